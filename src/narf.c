@@ -10,6 +10,10 @@
 #include "narf.h"
 #include "narf_io.h"
 
+#ifdef NARF_USE_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef __GNUC__
    #define PACKED __attribute__((packed))
 #else
@@ -17,7 +21,7 @@
 #endif
 
 #define SIGNATURE 0x4652414E // little endian 'NARF'
-#define VERSION 0x0000000A
+#define VERSION 0x00000011
 #define END INVALID_NAF
 #define NARF_MIN_FS_SECTORS 4
 
@@ -55,9 +59,38 @@ typedef struct PACKED {
    NarfSector   m_start;
    NarfSector   m_length;
    NarfByteSize m_bytes;
+   NarfSector   m_valid;
+   NarfSector   m_first;
+   NarfSector   m_tail;
+   NarfSector   m_tail_at;
+   NarfSector   m_slack;
+   uint8_t      m_codec;
+   NarfSector   m_index;
+   NarfSector   m_packed;
+   uint8_t      m_shared;
+   uint32_t     m_hash;
+   uint32_t     m_born;
    uint8_t      m_metadata[NARF_METADATA_SIZE];
 } DataPayload;
 
+// m_codec values.  A compressed key's extent holds independently compressed
+// chunks of CHUNK_SECTORS logical sectors, each starting on a sector, and an
+// index of ChunkEntry records at relative sector m_index.  m_packed counts the
+// index and chunk sectors the index still references.
+#define CODEC_PLAIN 0
+#define CODEC_LZ    1
+
+#define CHUNK_SECTORS 8
+#define CHUNK_BYTES (CHUNK_SECTORS * NARF_SECTOR_SIZE)
+
+typedef struct PACKED {
+   NarfSector m_sector;
+   uint16_t   m_stored;
+   uint16_t   m_logical;
+} ChunkEntry;
+
+#define CHUNK_ENTRIES (NARF_SECTOR_SIZE / sizeof(ChunkEntry))
+
 typedef struct PACKED {
    NarfSector m_start;
    NarfSector m_length;
@@ -65,6 +98,58 @@ typedef struct PACKED {
 
 #define INIT_DEFRAG_SEARCH ((FreePayload){ END, 0 })
 
+// Shared extents.  A data node with m_shared set references an extent that
+// other data nodes may reference too; the extent has one node in the shared
+// tree, keyed like the data tree by share_key() of its content hash and start
+// so that equal hashes sort together, and m_refs counts the data nodes that
+// point at it.  A shared payload is plain and dense: m_first is 0, there is no
+// tail copy, and m_valid and m_length both equal the sectors of m_bytes.
+typedef struct PACKED {
+   NarfSector   m_start;
+   NarfSector   m_length;
+   NarfByteSize m_bytes;
+   NarfSector   m_refs;
+   uint32_t     m_hash;
+   uint32_t     m_born;
+} SharePayload;
+
+// Eight hex digits of hash, then the start at full sector width, then NUL.
+#define SHARE_KEY_BYTES (9 + 2 * sizeof(NarfSector))
+
+// Pinned extents.  m_born is the root version that allocated a payload
+// extent, kept in DataPayload and SharePayload; a snapshot of root version v
+// reads every extent with m_born <= v.  An extent freed while some snapshot
+// still reads it goes to the pinned tree instead of the free tree, keyed by
+// pin_key() of its start, and m_died records the freeing root version.  The
+// snapshots that read it are exactly those with m_born <= v < m_died.
+typedef struct PACKED {
+   NarfSector   m_start;
+   NarfSector   m_length;
+   uint32_t     m_born;
+   uint32_t     m_died;
+} PinPayload;
+
+// The start at full sector width, then NUL.
+#define PIN_KEY_BYTES (1 + 2 * sizeof(NarfSector))
+
+typedef enum {
+   TREE_DATA,
+   TREE_FREE,
+   TREE_SHARED,
+   TREE_PINNED,
+} TreeKind;
+
+// One named snapshot: the three tree roots and key count of the committed
+// root version m_version.  A slot is free when m_name is empty.
+typedef struct PACKED {
+   char         m_name[NARF_SNAPSHOT_NAME_BYTES];
+   uint32_t     m_version;
+   NarfSector   m_data_root;
+   NarfSector   m_free_root;
+   NarfSector   m_shared_root;
+   NarfSector   m_count;
+} SnapshotSlot;
+
 #define ROOT_FIELDS                        \
    union {                                 \
       uint32_t m_signature;                \
@@ -75,12 +160,22 @@ typedef struct PACKED {
    NarfSector   m_total_sectors;           \
    NarfSector   m_data_root;               \
    NarfSector   m_free_root;               \
+   NarfSector   m_shared_root;             \
+   NarfSector   m_pinned_root;             \
                                            \
    NarfSector   m_count;                   \
    NarfSector   m_bottom;                  \
    NarfSector   m_top;                     \
    NarfSector   m_origin;                  \
-   uint32_t     m_root_version;
+   uint32_t     m_root_version;            \
+                                           \
+   NarfSector   m_spare_head;              \
+   NarfSector   m_spare_tail;              \
+   NarfSector   m_spare_count;             \
+   uint32_t     m_spare_generation;        \
+   uint32_t     m_spare_check;             \
+   uint32_t     m_clean_generation;        \
+   SnapshotSlot m_snapshots[NARF_SNAPSHOT_SLOTS];
 
 typedef struct {
    ROOT_FIELDS
@@ -94,6 +189,15 @@ typedef struct {
 // is a RAM-only cache rebuilt by scanning that catalog-node region; its
 // links are stored in the spare sectors themselves but are never durable
 // filesystem truth.
+//
+// narf_checkpoint() may commit the list's ends, length, and CRC in the root.
+// Mount adopts the on-disk chain only when m_spare_generation equals the
+// root's own m_root_version and a walk of the chain reproduces the summary.
+// Any later commit writes these fields as zero.
+//
+// narf_unmount() commits the same checkpoint with m_clean_generation also set
+// to the root's version.  Mount trusts such a root after spot checks instead of
+// walking both trees.  The first later commit writes the field as zero again.
 
 // Bytes occupied by Root fields other than m_reserved. Keep this next to Root.
 #define ROOT_PREFIX_BYTES (sizeof(RootState))
@@ -119,6 +223,8 @@ static_assert(sizeof(Root) == NARF_SECTOR_SIZE, "Root wrong size");
    union {                      \
       DataPayload  m_data;      \
       FreePayload  m_free;      \
+      SharePayload m_share;     \
+      PinPayload   m_pin;       \
    };                           \
 
 typedef struct PACKED {
@@ -131,6 +237,8 @@ typedef struct PACKED {
    uint32_t     m_checksum;
 } Node;
 static_assert(sizeof(Node) == NARF_SECTOR_SIZE, "Node wrong size");
+static_assert(CHUNK_BYTES <= 0xFFFFu, "ChunkEntry byte counts are 16 bits");
+static_assert(NARF_SECTOR_SIZE % sizeof(ChunkEntry) == 0, "ChunkEntry wrong size");
 
 #define BYTES2SECTORS(x) \
    (((x) / NARF_SECTOR_SIZE) + (((x) % NARF_SECTOR_SIZE) != 0))
@@ -156,10 +264,13 @@ static RootState root;
 static RootSnapshot saved_root;
 static Node node_work0;
 static Node node_work1;
-#define SPARE_FRAME_SECTORS ((NarfSector) (NARF_SECTOR_SIZE * 8u))
-static uint8_t spare_work[NARF_SECTOR_SIZE];
-static_assert(sizeof(spare_work) * 8u == SPARE_FRAME_SECTORS,
-              "spare bitmap frame size mismatch");
+static_assert(NARF_SPARE_WORK_BYTES >= 1 &&
+              NARF_SPARE_WORK_BYTES <= ((NarfSector) -1) / 8u,
+              "NARF_SPARE_WORK_BYTES out of range");
+static uint8_t spare_work_builtin[NARF_SPARE_WORK_BYTES];
+static uint8_t *spare_work = spare_work_builtin;
+static NarfSector spare_frame_sectors =
+   (NarfSector) (sizeof(spare_work_builtin) * 8u);
 static int root_copy = 0;
 static char dir_key[KEYSIZE];
 static char key_work[KEYSIZE];
@@ -173,35 +284,300 @@ static NarfSector retired_nodes[RETIRED_MAX];
 static unsigned retired_node_count = 0;
 static bool retired_node_overflow = false;
 
+// Incremental spare rebuild state.  Frames are processed from high to low, one
+// frame per step, each ending where the previous one began.  Everything in
+// [rebuild_low, m_total_sectors) has been scanned; rebuild_pending is the lowest
+// spare found so far and its record is written only once the next lower spare
+// is known.
+static bool spare_rebuilding = false;
+static NarfSector rebuild_low = END;
+static NarfSector rebuild_pending = END;
+static NarfSector rebuild_pending_right = END;
+static NarfSector rebuild_highest = END;
+
+#ifdef NARF_USE_DEFRAG
+// Phase the next narf_defrag_step() resumes at, and the sectors copied by the
+// running step against its limit.  None of it is persisted; any phase is a
+// safe place to resume.
+static NarfDefragPhase defrag_phase = NARF_DEFRAG_CARVE;
+static NarfSector defrag_moved = 0;
+static NarfSector defrag_move_limit = 0;
+#endif
+
+#ifdef NARF_USE_DISCARD
+// Payload ranges freed by the open transaction and not claimed again.  They
+// are discarded once the transaction commits.
+static NarfSector discard_start[NARF_DISCARD_RANGES];
+static NarfSector discard_length[NARF_DISCARD_RANGES];
+static unsigned discard_count = 0;
+#endif
+
+#ifdef NARF_USE_SNAPSHOTS
+// While a snapshot is mounted for reading, root carries its trees and
+// snapshot_live keeps the live ones.  snapshot_node is a private buffer for
+// the version checks made while retiring nodes.  No snapshot reaches the
+// pinned tree, so snapshot_pin_edit lets its rewrites retire old nodes.
+// snapshot_reap_pending says the pinned tree may hold extents no snapshot
+// reads any more, left for snapshot_reap_once() to free.
+static bool snapshot_viewing = false;
+static bool snapshot_pin_edit = false;
+static bool snapshot_reap_pending = false;
+static SnapshotSlot snapshot_live;
+static Node snapshot_node;
+
+static bool snapshot_detach(const char *key);
+static bool snapshot_reap_once(bool *more);
+#endif
+
 static bool initialize_spare(void);
+static bool read_node_any(NarfSector sector, Node *out);
+
+static bool spare_rebuild_advance(unsigned frames);
+static NarfSector metadata_reserve(void);
 static void transaction_rollback(void);
+#ifdef NARF_USE_SNAPSHOTS
+static void snapshot_unview(void);
+#endif
+static bool write_with_metadata(const char *key, const void *data, NarfByteSize size,
+                                NarfByteSize offset, const char *metadata);
 
 //! @brief Discard the disposable RAM spare-list cache.
 static void invalidate_spare_cache(void) {
    spare_head = END;
    spare_tail = END;
    spare_initialized = false;
+   spare_rebuilding = false;
+}
+
+#ifdef NARF_USE_DISCARD
+//! @brief Remember a range freed by the open transaction.
+static void discard_note(NarfSector start, NarfSector length) {
+   if (!transaction_open || length == 0) return;
+
+   for (unsigned i = 0; i < discard_count; i++) {
+      if (start + length == discard_start[i]) {
+         discard_start[i] = start;
+         discard_length[i] += length;
+         return;
+      }
+      if (discard_start[i] + discard_length[i] == start) {
+         discard_length[i] += length;
+         return;
+      }
+   }
+
+   if (discard_count < NARF_DISCARD_RANGES) {
+      discard_start[discard_count] = start;
+      discard_length[discard_count] = length;
+      discard_count++;
+   }
+}
+
+//! @brief Forget any part of the pending ranges that is being allocated again.
+static void discard_claim(NarfSector start, NarfSector length) {
+   NarfSector end = start + length;
+   unsigned i = 0;
+
+   while (i < discard_count) {
+      NarfSector s = discard_start[i];
+      NarfSector e = s + discard_length[i];
+
+      if (e <= start || end <= s) {
+         i++;
+         continue;
+      }
+
+      if (start > s && end < e && discard_count < NARF_DISCARD_RANGES) {
+         discard_start[discard_count] = end;
+         discard_length[discard_count] = e - end;
+         discard_count++;
+         discard_length[i] = start - s;
+         i++;
+      }
+      else if (start > s && end >= e) {
+         discard_length[i] = start - s;
+         i++;
+      }
+      else if (start <= s && end < e) {
+         discard_start[i] = end;
+         discard_length[i] = e - end;
+         i++;
+      }
+      else {
+         // Fully claimed, or a split with no free slot: drop the range.
+         discard_count--;
+         discard_start[i] = discard_start[discard_count];
+         discard_length[i] = discard_length[discard_count];
+      }
+   }
+}
+
+//! @brief Issue the discards collected by a committed transaction.
+static void discard_flush(void) {
+   for (unsigned i = 0; i < discard_count; i++) {
+      (void) narf_io_discard(root.m_origin + discard_start[i],
+                             discard_length[i]);
+   }
+   discard_count = 0;
+}
+#else
+#define discard_note(start, length) ((void) 0)
+#define discard_claim(start, length) ((void) 0)
+#define discard_flush() ((void) 0)
+#endif
+
+#ifndef NARF_USE_PERF_TRACE
+#define perf_call_begin(op) ((void) 0)
+#define perf_io_start() ((void) 0)
+#define perf_io_done(kind, sector) ((void) 0)
+#endif
+
+#ifdef NARF_USE_PERF_STATS
+// Counters per public operation.  Each public call names the operation its
+// work is charged to on entry; calls one public function makes on behalf of
+// another go through internal helpers so they keep the outer operation.
+static NarfPerfStats perf_stats[NARF_PERF_OPS];
+static NarfPerfOp perf_op = NARF_PERF_MOUNT;
+
+#define perf_count(field) ((void) perf_stats[perf_op].field++)
+
+#ifdef NARF_USE_PERF_TRACE
+// Latency histograms and the sector trace.  A call is open from perf_begin()
+// until the next one, and its latency runs to the end of its last transfer,
+// so no return path has to stop a timer.
+static NarfPerfLatency perf_latency[NARF_PERF_OPS];
+static NarfPerfClock perf_clock = NULL;
+static NarfTraceRecord *perf_trace = NULL;
+static size_t perf_trace_entries = 0;
+static uint64_t perf_trace_total = 0;
+static uint64_t perf_call_start = 0;
+static uint64_t perf_call_end = 0;
+static NarfPerfOp perf_call_op = NARF_PERF_MOUNT;
+static bool perf_call_open = false;
+static uint64_t perf_io_started = 0;
+
+//! @brief Bin the open call, if any, into its operation's histogram.
+static void perf_call_close(void) {
+   NarfPerfLatency *l = &perf_latency[perf_call_op];
+   uint64_t micros;
+   unsigned bucket = 0;
+
+   if (!perf_call_open) return;
+   perf_call_open = false;
+   micros = perf_call_end - perf_call_start;
+   while (bucket < NARF_PERF_BUCKETS - 1 && (micros >> bucket) != 0) bucket++;
+   l->buckets[bucket]++;
+   l->count++;
+   if (micros > l->max) l->max = micros;
+}
+
+//! @brief Close the previous call and start timing one of op.
+static void perf_call_begin(NarfPerfOp op) {
+   perf_call_close();
+   if (perf_clock == NULL) return;
+   perf_call_op = op;
+   perf_call_start = perf_clock();
+   perf_call_end = perf_call_start;
+   perf_call_open = true;
+}
+
+//! @brief Note the clock before a sector transfer.
+static void perf_io_start(void) {
+   perf_io_started = perf_clock != NULL ? perf_clock() : 0;
+}
+
+//! @brief Extend the open call and trace a finished sector transfer.
+static void perf_io_done(NarfTraceKind kind, NarfSector sector) {
+   uint64_t now = perf_clock != NULL ? perf_clock() : 0;
+
+   if (perf_call_open) perf_call_end = now;
+   if (perf_trace != NULL) {
+      NarfTraceRecord *r = &perf_trace[perf_trace_total % perf_trace_entries];
+
+      r->start = perf_io_started;
+      r->micros = (uint32_t) (now - perf_io_started);
+      r->sector = sector;
+      r->kind = (uint8_t) kind;
+      r->op = (uint8_t) perf_op;
+      perf_trace_total++;
+   }
+}
+#endif
+
+//! @brief Charge the following work to a public operation.
+static void perf_begin(NarfPerfOp op) {
+   perf_call_begin(op);
+   perf_op = op;
+   perf_stats[op].calls++;
+}
+
+//! @brief Record the height of a catalog node that was read.
+static void perf_depth(uint8_t height) {
+   if (height > perf_stats[perf_op].max_depth) perf_stats[perf_op].max_depth = height;
+}
+#else
+#define perf_count(field) ((void) 0)
+#define perf_begin(op) ((void) 0)
+#define perf_depth(height) ((void) 0)
+#endif
+
+#ifdef NARF_USE_RECORDER
+// Recorder the host set with narf_set_recorder(), told about each public
+// call that reads or changes payload as it begins.
+static NarfRecorder recorder = NULL;
+static void *recorder_context = NULL;
+
+//! @brief Pass one public call to the recorder, if one is set.
+static void record(NarfRecordOp op, const char *key, const char *newkey,
+                   NarfByteSize offset, NarfByteSize size, const void *data) {
+   NarfRecord r;
+
+   if (recorder == NULL) return;
+   r.op = op;
+   r.key = key;
+   r.newkey = newkey;
+   r.offset = offset;
+   r.size = size;
+   r.data = data;
+   recorder(recorder_context, &r);
 }
+#else
+#define record(op, key, newkey, offset, size, data) ((void) 0)
+#endif
 
 //! @brief Clear all state that could make the core appear mounted.
 static void invalidate_mount_state(void) {
    memset(&root, 0, sizeof(root));
    root.m_data_root = END;
    root.m_free_root = END;
+   root.m_shared_root = END;
+   root.m_pinned_root = END;
 
    memset(&saved_root, 0, sizeof(saved_root));
    root_copy = 0;
    transaction_may_use_reserve = false;
    transaction_open = false;
    spare_initialized = false;
+   spare_rebuilding = false;
    spare_head = END;
    spare_tail = END;
    rollback_head = END;
    retired_node_count = 0;
    retired_node_overflow = false;
+#ifdef NARF_USE_DEFRAG
+   defrag_phase = NARF_DEFRAG_CARVE;
+#endif
+#ifdef NARF_USE_DISCARD
+   discard_count = 0;
+#endif
+#ifdef NARF_USE_SNAPSHOTS
+   snapshot_viewing = false;
+   snapshot_reap_pending = false;
+#endif
 }
 
 //! @brief Compute a CRC-32 compatible with zlib/crc32().
+
 static uint32_t crc32(uint32_t crc, const void *data, size_t length) {
    const uint8_t *p = data;
 
@@ -233,10 +609,56 @@ static uint32_t transaction_root_version(void) {
    return v;
 }
 
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief Return whether any snapshot slot is in use.
+static bool snapshot_any(void) {
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+      if (root.m_snapshots[i].m_name[0] != 0) return true;
+   }
+   return false;
+}
+
+//! @brief Return whether some snapshot can reach something written at born.
+//!
+//! Catalog nodes carry the version that wrote them and payload extents the
+//! version that allocated them.  Snapshot v sees exactly the ones with
+//! born <= v that were still live at v.
+static bool snapshot_pins(uint32_t born) {
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+      const SnapshotSlot *slot = &root.m_snapshots[i];
+
+      if (slot->m_name[0] == 0) continue;
+      if (!version_after(born, slot->m_version)) return true;
+   }
+   return false;
+}
+
+//! @brief Return whether some snapshot reads an extent live in [born, died).
+static bool snapshot_covers(uint32_t born, uint32_t died) {
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+      const SnapshotSlot *slot = &root.m_snapshots[i];
+
+      if (slot->m_name[0] == 0) continue;
+      if (!version_after(born, slot->m_version) &&
+          version_after(died, slot->m_version)) {
+         return true;
+      }
+   }
+   return false;
+}
+#endif
+
 //! @brief Save the current mutable root state before starting a public transaction.
 static void transaction_begin(void) {
-   if (!spare_initialized && !initialize_spare()) {
-      invalidate_spare_cache();
+   if (!spare_initialized) {
+      // A deferred rebuild is paid for a few frames at a time.  Finish it
+      // once the virgin gap is too small to carry the transaction alone.
+      if (root.m_top - root.m_bottom <= metadata_reserve() + RETIRED_MAX) {
+         initialize_spare();
+      }
+      else {
+         spare_rebuild_advance(NARF_SPARE_REBUILD_FRAMES);
+      }
    }
 
    saved_root.m_root = root;
@@ -245,6 +667,9 @@ static void transaction_begin(void) {
    retired_node_count = 0;
    retired_node_overflow = false;
    transaction_open = true;
+#ifdef NARF_USE_DISCARD
+   discard_count = 0;
+#endif
 }
 
 //! @brief Validate that the mounted root looks like a current NARF root.
@@ -254,6 +679,17 @@ static bool verify(void) {
    return true;
 }
 
+//! @brief Validate the mounted root for an operation that changes the volume.
+//!
+//! A mounted snapshot is read-only.
+static bool verify_live(void) {
+   if (!verify()) return false;
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_viewing) return false;
+#endif
+   return true;
+}
+
 //! @brief Validate a public key string.
 static bool valid_key(const char *key) {
    if (key == NULL) return false;
@@ -298,24 +734,130 @@ static bool node_key_terminated(const Node *node) {
    return node != NULL && memchr(node->m_key, 0, sizeof(node->m_key)) != NULL;
 }
 
+#ifdef NARF_USE_COMPRESSION
+//! @brief Return how many chunks a compressed payload of bytes spans.
+static NarfSector chunk_count(NarfByteSize bytes) {
+   return (NarfSector) (bytes / CHUNK_BYTES + (bytes % CHUNK_BYTES != 0));
+}
+
+//! @brief Return how many index sectors a compressed payload of bytes needs.
+static NarfSector chunk_index_sectors(NarfByteSize bytes) {
+   NarfSector chunks = chunk_count(bytes);
+
+   return chunks / CHUNK_ENTRIES + (chunks % CHUNK_ENTRIES != 0);
+}
+
+//! @brief Validate a compressed data payload without reading its index.
+//!
+//! The chunk stream is the written prefix, m_first is 0, and there is never a
+//! tail copy.  The extent may run m_slack sectors past the stream.
+static bool valid_chunk_payload(const DataPayload *payload) {
+   NarfSector index_sectors;
+
+   if (payload->m_codec != CODEC_LZ) return false;
+   if (payload->m_first != 0 || payload->m_tail != END || payload->m_tail_at != 0) {
+      return false;
+   }
+   if (payload->m_shared != 0 || payload->m_hash != 0) return false;
+
+   if (payload->m_length == 0) {
+      return payload->m_start == END && payload->m_valid == 0 &&
+             payload->m_bytes == 0 && payload->m_index == 0 &&
+             payload->m_packed == 0;
+   }
+
+   index_sectors = chunk_index_sectors(payload->m_bytes);
+   if (payload->m_start == END || payload->m_start < 2) return false;
+   if (payload->m_start >= root.m_bottom) return false;
+   if (payload->m_length > root.m_bottom - payload->m_start) return false;
+   if (payload->m_valid > payload->m_length) return false;
+   if (payload->m_length - payload->m_valid > payload->m_slack) return false;
+   if (payload->m_index > payload->m_valid) return false;
+   if (index_sectors > payload->m_valid - payload->m_index) return false;
+   return payload->m_packed >= index_sectors && payload->m_packed <= payload->m_valid;
+}
+#endif
+
 //! @brief Validate one data payload without scanning other extents.
 static bool valid_data_payload(const DataPayload *payload) {
    NarfSector needed;
 
    if (payload == NULL) return false;
 
+   if (payload->m_codec != CODEC_PLAIN) {
+#ifdef NARF_USE_COMPRESSION
+      return valid_chunk_payload(payload);
+#else
+      return false;
+#endif
+   }
+   if (payload->m_index != 0 || payload->m_packed != 0) return false;
+   if (payload->m_shared > 1) return false;
+   if (!payload->m_shared && payload->m_hash != 0) return false;
+
    if (payload->m_length == 0) {
-      return payload->m_start == END && payload->m_bytes == 0;
+      return payload->m_start == END && payload->m_valid == 0 &&
+             payload->m_first == 0 && payload->m_tail == END &&
+             payload->m_tail_at == 0 && !payload->m_shared;
    }
 
    needed = BYTES2SECTORS(payload->m_bytes);
+   if (payload->m_shared &&
+       (payload->m_first != 0 || payload->m_tail != END || payload->m_tail_at != 0 ||
+        payload->m_length != needed || payload->m_valid != needed)) {
+      return false;
+   }
    if (payload->m_start == END || payload->m_start < 2) return false;
    if (payload->m_start >= root.m_bottom) return false;
    if (payload->m_length > root.m_bottom - payload->m_start) return false;
-   if (needed != payload->m_length) return false;
+   if (payload->m_first > needed) return false;
+   if (payload->m_length > needed - payload->m_first &&
+       payload->m_length - (needed - payload->m_first) > payload->m_slack) {
+      return false;
+   }
+   if (payload->m_valid > payload->m_length) return false;
+   if (payload->m_valid > needed - payload->m_first) return false;
+   if (payload->m_tail == END) return payload->m_tail_at == 0;
+   if (payload->m_tail < 2 || payload->m_tail >= root.m_bottom) return false;
+   if (payload->m_tail >= payload->m_start &&
+       payload->m_tail - payload->m_start < payload->m_length) {
+      return false;
+   }
+   if (payload->m_tail_at < payload->m_first) return false;
+   if (payload->m_tail_at - payload->m_first >= payload->m_valid) return false;
    return true;
 }
 
+//! @brief Return how far an extent may grow past length under its slack hint.
+//!
+//! An extent may reach m_slack sectors past the last sector of its byte size.
+static NarfSector payload_slack_room(NarfByteSize bytes, NarfSector first,
+                                     NarfSector length, NarfSector slack) {
+   NarfSector limit = BYTES2SECTORS(bytes);
+
+   if (first > limit) return 0;
+   limit -= first;
+   limit = slack > ((NarfSector) -1) - limit ? (NarfSector) -1 : limit + slack;
+   return limit > length ? limit - length : 0;
+}
+
+//! @brief Return the extent length a payload may keep with slack sectors of room.
+//!
+//! That is the sectors its byte size spans past m_first, or the written chunk
+//! stream of a compressed key, plus slack.
+static NarfSector payload_limit(const DataPayload *payload, NarfSector slack) {
+   if (payload->m_codec != CODEC_PLAIN) {
+      return slack > ((NarfSector) -1) - payload->m_valid ?
+             (NarfSector) -1 : payload->m_valid + slack;
+   }
+   return payload_slack_room(payload->m_bytes, payload->m_first, 0, slack);
+}
+
+//! @brief Return how many payload sectors a key holds, counting its tail copy.
+static NarfSector payload_held(const DataPayload *payload) {
+   return payload->m_length + (payload->m_tail != END);
+}
+
 //! @brief Validate one free payload without scanning other extents.
 static bool valid_free_payload(const FreePayload *payload) {
    if (payload == NULL) return false;
@@ -325,6 +867,61 @@ static bool valid_free_payload(const FreePayload *payload) {
    return true;
 }
 
+//! @brief Format the shared-tree key of an extent with a content hash.
+static void share_key(char out[SHARE_KEY_BYTES], uint32_t hash, NarfSector start) {
+   static const char digits[] = "0123456789abcdef";
+   unsigned start_digits = 2 * sizeof(NarfSector);
+
+   for (unsigned i = 0; i < 8; i++) {
+      out[i] = digits[(hash >> (28 - 4 * i)) & 15u];
+   }
+   for (unsigned i = 0; i < start_digits; i++) {
+      out[8 + i] = digits[(start >> (4 * (start_digits - 1 - i))) & 15u];
+   }
+   out[8 + start_digits] = 0;
+}
+
+//! @brief Validate one shared-tree node without scanning the data tree.
+static bool valid_share_node(const Node *node) {
+   const SharePayload *payload = &node->m_share;
+   char key[SHARE_KEY_BYTES];
+
+   if (!node_key_terminated(node)) return false;
+   if (payload->m_refs == 0 || payload->m_bytes == 0) return false;
+   if (payload->m_length != BYTES2SECTORS(payload->m_bytes)) return false;
+   if (payload->m_start == END || payload->m_start < 2) return false;
+   if (payload->m_start >= root.m_bottom) return false;
+   if (payload->m_length > root.m_bottom - payload->m_start) return false;
+   share_key(key, payload->m_hash, payload->m_start);
+   return strcmp(key, node->m_key) == 0;
+}
+
+//! @brief Format the pinned-tree key of an extent.
+static void pin_key(char out[PIN_KEY_BYTES], NarfSector start) {
+   static const char digits[] = "0123456789abcdef";
+   unsigned start_digits = 2 * sizeof(NarfSector);
+
+   for (unsigned i = 0; i < start_digits; i++) {
+      out[i] = digits[(start >> (4 * (start_digits - 1 - i))) & 15u];
+   }
+   out[start_digits] = 0;
+}
+
+//! @brief Validate one pinned-tree node without scanning other trees.
+static bool valid_pin_node(const Node *node) {
+   const PinPayload *payload = &node->m_pin;
+   char key[PIN_KEY_BYTES];
+
+   if (!node_key_terminated(node)) return false;
+   if (payload->m_length == 0) return false;
+   if (payload->m_start == END || payload->m_start < 2) return false;
+   if (payload->m_start >= root.m_bottom) return false;
+   if (payload->m_length > root.m_bottom - payload->m_start) return false;
+   if (!version_after(payload->m_died, payload->m_born)) return false;
+   pin_key(key, payload->m_start);
+   return strcmp(key, node->m_key) == 0;
+}
+
 //! @brief Compute the checksum for a root block.
 static uint32_t root_checksum(Root *r) {
    uint32_t old = r->m_checksum;
@@ -344,11 +941,20 @@ static void root_to_disk(Root *out) {
    out->m_total_sectors = root.m_total_sectors;
    out->m_data_root = root.m_data_root;
    out->m_free_root = root.m_free_root;
+   out->m_shared_root = root.m_shared_root;
+   out->m_pinned_root = root.m_pinned_root;
    out->m_count = root.m_count;
    out->m_bottom = root.m_bottom;
    out->m_top = root.m_top;
    out->m_origin = root.m_origin;
    out->m_root_version = root.m_root_version;
+   out->m_spare_head = root.m_spare_head;
+   out->m_spare_tail = root.m_spare_tail;
+   out->m_spare_count = root.m_spare_count;
+   out->m_spare_generation = root.m_spare_generation;
+   out->m_spare_check = root.m_spare_check;
+   out->m_clean_generation = root.m_clean_generation;
+   memcpy(out->m_snapshots, root.m_snapshots, sizeof(out->m_snapshots));
 }
 
 //! @brief Load the compact in-memory root state from a validated on-disk sector.
@@ -359,11 +965,20 @@ static void root_from_disk(const Root *in) {
    root.m_total_sectors = in->m_total_sectors;
    root.m_data_root = in->m_data_root;
    root.m_free_root = in->m_free_root;
+   root.m_shared_root = in->m_shared_root;
+   root.m_pinned_root = in->m_pinned_root;
    root.m_count = in->m_count;
    root.m_bottom = in->m_bottom;
    root.m_top = in->m_top;
    root.m_origin = in->m_origin;
    root.m_root_version = in->m_root_version;
+   root.m_spare_head = in->m_spare_head;
+   root.m_spare_tail = in->m_spare_tail;
+   root.m_spare_count = in->m_spare_count;
+   root.m_spare_generation = in->m_spare_generation;
+   root.m_spare_check = in->m_spare_check;
+   root.m_clean_generation = in->m_clean_generation;
+   memcpy(root.m_snapshots, in->m_snapshots, sizeof(root.m_snapshots));
 }
 
 //! @brief Read and validate one of the two root copies.
@@ -387,11 +1002,17 @@ static bool read_root_copy_version(NarfSector origin, int which, uint32_t *versi
 //! @brief Commit the current in-memory root as the newest root copy.
 static bool commit_root(void) {
    int dest = 1 - root_copy;
+   bool ok;
+
    root.m_root_version = transaction_root_version();
    root_to_disk(&root_tmp);
    root_tmp.m_checksum = 0;
    root_tmp.m_checksum = crc32(0, &root_tmp, NARF_SECTOR_SIZE - sizeof(uint32_t));
-   if (!narf_io_write(root.m_origin + (NarfSector) dest, &root_tmp)) return false;
+   perf_io_start();
+   ok = narf_io_write(root.m_origin + (NarfSector) dest, &root_tmp);
+   perf_io_done(NARF_TRACE_ROOT_WRITE, root.m_origin + (NarfSector) dest);
+   if (!ok) return false;
+   perf_count(root_commits);
    root_copy = dest;
    transaction_may_use_reserve = false;
    transaction_open = false;
@@ -407,7 +1028,10 @@ static bool init_root(NarfSector origin, NarfSector size) {
    root.m_total_sectors = size;
    root.m_data_root = END;
    root.m_free_root = END;
+   root.m_shared_root = END;
+   root.m_pinned_root = END;
    root.m_count = 0;
+
    root.m_bottom = 2;
    root.m_top = size;
    root.m_origin = origin;
@@ -452,27 +1076,82 @@ static void retire_node(NarfSector sector) {
       if (retired_nodes[i] == sector) return;
    }
 
+#ifdef NARF_USE_SNAPSHOTS
+   // A node written no later than some snapshot is still part of it.  It
+   // stays put until that snapshot is deleted, whose spare rebuild finds it.
+   if (snapshot_any() && !snapshot_pin_edit) {
+      if (!read_node_any(sector, &snapshot_node)) {
+         perf_count(retired_overflows);
+         retired_node_overflow = true;
+         return;
+      }
+      if (snapshot_pins(snapshot_node.m_root_version)) return;
+   }
+#endif
+
    if (retired_node_count < RETIRED_MAX) {
       retired_nodes[retired_node_count++] = sector;
    }
    else {
+      perf_count(retired_overflows);
       retired_node_overflow = true;
    }
 }
 
 static bool alloc_node_sector(NarfSector *sector, NarfSector *rollback_next);
+
 static bool alloc_spare_node_sector(NarfSector *sector,
                                     NarfSector *rollback_next);
 
 //! @brief Read a raw single-sector node when its checksum is valid.
 static bool read_node_any(NarfSector sector, Node *out) {
+   bool ok;
+
    if (out == NULL) return false;
    if (!valid_node_sector(sector)) return false;
-   if (!narf_io_read(root.m_origin + sector, out)) return false;
+   perf_io_start();
+   ok = narf_io_read(root.m_origin + sector, out);
+   perf_io_done(NARF_TRACE_NODE_READ, root.m_origin + sector);
+   if (!ok) return false;
+   perf_count(node_reads);
    if (out->m_checksum != node_checksum(out)) return false;
+   perf_depth(out->m_height);
    return true;
 }
 
+//! @brief Write one catalog sector, relative to the filesystem origin.
+static bool write_node_sector(NarfSector sector, void *data) {
+   bool ok;
+
+   perf_count(node_writes);
+   perf_io_start();
+   ok = narf_io_write(root.m_origin + sector, data);
+   perf_io_done(NARF_TRACE_NODE_WRITE, root.m_origin + sector);
+   return ok;
+}
+
+//! @brief Read one payload sector, relative to the filesystem origin.
+static bool payload_read(NarfSector sector, void *data) {
+   bool ok;
+
+   perf_count(payload_reads);
+   perf_io_start();
+   ok = narf_io_read(root.m_origin + sector, data);
+   perf_io_done(NARF_TRACE_PAYLOAD_READ, root.m_origin + sector);
+   return ok;
+}
+
+//! @brief Write one payload sector, relative to the filesystem origin.
+static bool payload_write(NarfSector sector, void *data) {
+   bool ok;
+
+   perf_count(payload_writes);
+   perf_io_start();
+   ok = narf_io_write(root.m_origin + sector, data);
+   perf_io_done(NARF_TRACE_PAYLOAD_WRITE, root.m_origin + sector);
+   return ok;
+}
+
 //! @brief Read a catalog node by sector number.
 static bool read_node(NarfSector sector, Node *out) {
    if (sector == END) return false;
@@ -512,7 +1191,7 @@ static bool write_node(NarfSector old_sector, Node *n, NarfSector *new_sector) {
    n->m_checksum = 0;
    n->m_checksum = crc32(0, n, NARF_SECTOR_SIZE - sizeof(uint32_t));
 
-   if (!narf_io_write(root.m_origin + sector, n)) {
+   if (!write_node_sector(sector, n)) {
       return false;
    }
 
@@ -542,7 +1221,7 @@ static bool write_node_from_spare(NarfSector old_sector, Node *n,
    n->m_checksum = 0;
    n->m_checksum = crc32(0, n, NARF_SECTOR_SIZE - sizeof(uint32_t));
 
-   if (!narf_io_write(root.m_origin + sector, n)) return false;
+   if (!write_node_sector(sector, n)) return false;
 
    *new_sector = sector;
    return true;
@@ -570,7 +1249,7 @@ static bool write_node_to_virgin(NarfSector old_sector, NarfSector sector,
    n->m_checksum = 0;
    n->m_checksum = crc32(0, n, NARF_SECTOR_SIZE - sizeof(uint32_t));
 
-   if (!narf_io_write(root.m_origin + sector, n)) return false;
+   if (!write_node_sector(sector, n)) return false;
 
    rollback_head = sector;
    retire_node(old_sector);
@@ -606,7 +1285,7 @@ static bool write_spare_record_with_work(NarfSector sector,
    spare->m_checksum = 0;
    spare->m_checksum = crc32(0, spare, NARF_SECTOR_SIZE - sizeof(uint32_t));
 
-   return narf_io_write(root.m_origin + sector, spare);
+   return write_node_sector(sector, spare);
 }
 
 //! @brief Write one spare-list record using the general node scratch buffer.
@@ -760,6 +1439,7 @@ static bool pop_spare(NarfSector *result) {
    if (!read_spare_record(sector, &node_tmp)) return false;
    if (node_tmp.m_right != END) return false;
    previous = node_tmp.m_left;
+   perf_count(spare_hits);
 
    if (previous == END) {
       if (spare_head != sector) return false;
@@ -791,13 +1471,16 @@ static bool plan_catalog_contraction(NarfSector *new_top,
                                      NarfSector *surviving_head) {
    NarfSector candidate;
    NarfSector cursor;
+   NarfSector limit;
 
    if (new_top == NULL || surviving_head == NULL) return false;
 
    candidate = root.m_top;
    cursor = spare_initialized ? spare_head : END;
+   // A deferred rebuild owns everything below its scanned region.
+   limit = spare_rebuilding ? rebuild_low : root.m_total_sectors;
 
-   while (candidate < root.m_total_sectors) {
+   while (candidate < limit) {
       if (cursor != END && cursor < candidate) return false;
 
       if (cursor == candidate) {
@@ -861,6 +1544,72 @@ static bool reclaim_spare_prefix_in_memory(void) {
    return detach_spare_head_after_contraction(spare_head);
 }
 
+//! @brief Walk the on-disk spare chain and summarize it for a checkpoint.
+//!
+//! Every record must link back to its predecessor and lie above m_top in
+//! ascending order, so a damaged chain is rejected rather than summarized.
+static bool spare_chain_summary(NarfSector head, uint32_t generation,
+                                NarfSector *tail, NarfSector *count,
+                                uint32_t *check) {
+   NarfSector previous = END;
+   NarfSector sector = head;
+   NarfSector n = 0;
+   uint32_t crc = crc32(0, &generation, sizeof(generation));
+
+   while (sector != END) {
+      if (n >= root.m_total_sectors - root.m_top) return false;
+      if (!read_spare_record(sector, &node_tmp)) return false;
+      if (node_tmp.m_left != previous) return false;
+      crc = crc32(crc, &sector, sizeof(sector));
+      previous = sector;
+      sector = node_tmp.m_right;
+      n++;
+   }
+
+   *tail = previous;
+   *count = n;
+   *check = crc;
+   return true;
+}
+
+//! @brief Forget the checkpoint fields so later commits do not repeat them.
+static void clear_spare_checkpoint(void) {
+   root.m_spare_head = 0;
+   root.m_spare_tail = 0;
+   root.m_spare_count = 0;
+   root.m_spare_generation = 0;
+   root.m_spare_check = 0;
+}
+
+//! @brief Adopt the spare chain checkpointed with the mounted root, if still intact.
+//!
+//! A transaction interrupted by power loss may have popped spares or written
+//! nodes into them.  Such a chain no longer reproduces the committed tail,
+//! count, and CRC, and mount falls back to the framed rebuild.
+static bool load_spare_checkpoint(void) {
+   NarfSector head = root.m_spare_head;
+   NarfSector tail;
+   NarfSector count;
+   uint32_t check;
+   bool ok;
+
+   ok = root.m_spare_generation == root.m_root_version &&
+        (head == END) == (root.m_spare_tail == END) &&
+        spare_chain_summary(head, root.m_spare_generation,
+                            &tail, &count, &check) &&
+        tail == root.m_spare_tail &&
+        count == root.m_spare_count &&
+        check == root.m_spare_check;
+
+   clear_spare_checkpoint();
+   if (!ok) return false;
+
+   spare_head = head;
+   spare_tail = tail;
+   spare_initialized = true;
+   return true;
+}
+
 //! @brief Mark an allocated catalog sector as transaction-private and link it for rollback.
 static bool prepare_allocated_node_sector(NarfSector sector, NarfSector *rollback_next) {
    Node *node = &node_tmp;
@@ -879,7 +1628,7 @@ static bool prepare_allocated_node_sector(NarfSector sector, NarfSector *rollbac
    node->m_checksum = 0;
    node->m_checksum = crc32(0, node, NARF_SECTOR_SIZE - sizeof(uint32_t));
 
-   if (!narf_io_write(root.m_origin + sector, node)) return false;
+   if (!write_node_sector(sector, node)) return false;
 
    rollback_head = sector;
    if (rollback_next != NULL) *rollback_next = next;
@@ -898,6 +1647,7 @@ static void transaction_rollback(void) {
    NarfSector guard = 0;
    bool spare_restore_ok = true;
 
+   perf_count(rollbacks);
    root = saved_root.m_root;
    transaction_may_use_reserve = false;
 
@@ -929,6 +1679,9 @@ static void transaction_rollback(void) {
    retired_node_count = 0;
    retired_node_overflow = false;
    transaction_open = false;
+#ifdef NARF_USE_DISCARD
+   discard_count = 0;
+#endif
 }
 
 //! @brief Mark one sector as reachable in the current spare-rebuild frame.
@@ -973,86 +1726,76 @@ static bool mark_spare_frame_tree_rec(NarfSector sector,
    return mark_spare_frame_tree_rec(right, frame_begin, frame_end, depth + 1);
 }
 
-//! @brief Rebuild the RAM spare list with a framed reachability bitmap.
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief Mark the in-frame nodes of the pinned tree and every snapshot.
 //!
-//! spare_work is a 512-byte bitmap representing 4096 catalog sectors. For each
-//! frame, both live trees are walked once and their in-frame nodes are marked;
-//! every unmarked catalog sector in the frame is unreachable and becomes spare.
-static bool initialize_spare(void) {
-   NarfSector frame_begin;
-   NarfSector pending = END;
-   NarfSector pending_right = END;
-   NarfSector highest = END;
-
-   spare_head = END;
-   spare_tail = END;
-   spare_initialized = false;
-
-   if (root.m_top >= root.m_total_sectors) {
-      spare_initialized = true;
-      return true;
+//! While a snapshot is mounted, root holds its trees and the live ones are
+//! marked from snapshot_live instead.
+static bool mark_spare_frame_snapshots(NarfSector frame_begin,
+                                       NarfSector frame_end) {
+   if (!mark_spare_frame_tree_rec(root.m_pinned_root,
+                                  frame_begin, frame_end, 0)) {
+      return false;
+   }
+   if (snapshot_viewing &&
+       (!mark_spare_frame_tree_rec(snapshot_live.m_data_root,
+                                   frame_begin, frame_end, 0) ||
+        !mark_spare_frame_tree_rec(snapshot_live.m_free_root,
+                                   frame_begin, frame_end, 0) ||
+        !mark_spare_frame_tree_rec(snapshot_live.m_shared_root,
+                                   frame_begin, frame_end, 0))) {
+      return false;
    }
 
-   frame_begin = ((root.m_total_sectors - 1) / SPARE_FRAME_SECTORS) *
-                 SPARE_FRAME_SECTORS;
-
-   for (;;) {
-      NarfSector frame_end;
-      NarfSector scan_begin;
-      NarfSector sector;
-
-      if (root.m_total_sectors - frame_begin < SPARE_FRAME_SECTORS) {
-         frame_end = root.m_total_sectors;
-      }
-      else {
-         frame_end = frame_begin + SPARE_FRAME_SECTORS;
-      }
-
-      memset(spare_work, 0, sizeof(spare_work));
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+      const SnapshotSlot *slot = &root.m_snapshots[i];
 
-      if (!mark_spare_frame_tree_rec(root.m_data_root,
-                                     frame_begin, frame_end, 0)) {
-         return false;
-      }
-      if (!mark_spare_frame_tree_rec(root.m_free_root,
+      if (slot->m_name[0] == 0) continue;
+      if (!mark_spare_frame_tree_rec(slot->m_data_root,
+                                     frame_begin, frame_end, 0) ||
+          !mark_spare_frame_tree_rec(slot->m_free_root,
+                                     frame_begin, frame_end, 0) ||
+          !mark_spare_frame_tree_rec(slot->m_shared_root,
                                      frame_begin, frame_end, 0)) {
          return false;
       }
+   }
+   return true;
+}
+#endif
 
-      scan_begin = frame_begin < root.m_top ? root.m_top : frame_begin;
+//! @brief Forget a partially rebuilt spare list and restart from the top frame.
+static void spare_rebuild_start(void) {
+   spare_head = END;
+   spare_tail = END;
+   spare_initialized = false;
 
-      /*
-       * Discover spares from high to low.  A node is written only after the
-       * next lower spare is known, so every rebuilt doubly linked record is
-       * written exactly once.
-       */
-      for (sector = frame_end; sector > scan_begin;) {
-         sector--;
-         if (!spare_frame_sector_marked(frame_begin, sector)) {
-            if (pending == END) {
-               highest = sector;
-            }
-            else if (!write_spare_record_with_work(pending, sector,
-                                                    pending_right,
-                                                    &node_work1)) {
-               return false;
-            }
-            pending_right = pending;
-            pending = sector;
-         }
-      }
+   rebuild_low = root.m_total_sectors;
+   rebuild_pending = END;
+   rebuild_pending_right = END;
+   rebuild_highest = END;
 
-      if (frame_begin <= root.m_top) break;
-      frame_begin -= SPARE_FRAME_SECTORS;
+   if (root.m_top >= root.m_total_sectors) {
+      spare_rebuilding = false;
+      spare_initialized = true;
+      return;
    }
 
-   if (pending != END) {
-      if (!write_spare_record_with_work(pending, END, pending_right,
-                                        &node_work1)) {
+   perf_count(spare_rebuilds);
+   spare_rebuilding = true;
+}
+
+//! @brief Link the rebuilt spare list into the RAM cache.
+static bool spare_rebuild_finish(void) {
+   spare_rebuilding = false;
+
+   if (rebuild_pending != END) {
+      if (!write_spare_record_with_work(rebuild_pending, END,
+                                        rebuild_pending_right, &node_work1)) {
          return false;
       }
-      spare_head = pending;
-      spare_tail = highest;
+      spare_head = rebuild_pending;
+      spare_tail = rebuild_highest;
    }
 
    spare_initialized = true;
@@ -1063,12 +1806,158 @@ static bool initialize_spare(void) {
    return true;
 }
 
-//! @brief Return the AVL height for a node sector.
-static bool node_height(NarfSector sector, int *result) {
-   if (result == NULL) return false;
-   if (sector == END) {
-      *result = 0;
-      return true;
+//! @brief Scan one frame of the incremental spare rebuild.
+//!
+//! spare_work is a bitmap with one bit per catalog sector of the frame; the
+//! built-in one is NARF_SPARE_WORK_BYTES long, and narf_set_work_memory() may
+//! lend a larger one.  Both live trees are walked once and their in-frame
+//! nodes are marked; every unmarked catalog sector in the frame is unreachable
+//! and becomes spare.  Must not run inside a transaction, because it trusts
+//! the current roots.
+static bool spare_rebuild_step(void) {
+   NarfSector frame_begin;
+   NarfSector frame_end;
+   NarfSector sector;
+
+   if (!spare_rebuilding || transaction_open) return false;
+   if (rebuild_low < root.m_top) return false;
+
+   frame_end = rebuild_low;
+   if (frame_end - root.m_top <= spare_frame_sectors) {
+      frame_begin = root.m_top;
+   }
+   else {
+      frame_begin = frame_end - spare_frame_sectors;
+   }
+
+   memset(spare_work, 0, ((size_t) (frame_end - frame_begin) + 7u) / 8u);
+
+   if (!mark_spare_frame_tree_rec(root.m_data_root,
+                                  frame_begin, frame_end, 0) ||
+       !mark_spare_frame_tree_rec(root.m_free_root,
+                                  frame_begin, frame_end, 0) ||
+       !mark_spare_frame_tree_rec(root.m_shared_root,
+                                  frame_begin, frame_end, 0)) {
+      spare_rebuilding = false;
+      return false;
+   }
+#ifdef NARF_USE_SNAPSHOTS
+   if (!mark_spare_frame_snapshots(frame_begin, frame_end)) {
+      spare_rebuilding = false;
+      return false;
+   }
+#endif
+
+   /*
+    * Discover spares from high to low.  A node is written only after the
+    * next lower spare is known, so every rebuilt doubly linked record is
+    * written exactly once.
+    */
+   for (sector = frame_end; sector > frame_begin;) {
+      sector--;
+      if (!spare_frame_sector_marked(frame_begin, sector)) {
+         if (rebuild_pending == END) {
+            rebuild_highest = sector;
+         }
+         else if (!write_spare_record_with_work(rebuild_pending, sector,
+                                                 rebuild_pending_right,
+                                                 &node_work1)) {
+            spare_rebuilding = false;
+            return false;
+         }
+         rebuild_pending_right = rebuild_pending;
+         rebuild_pending = sector;
+      }
+   }
+
+   rebuild_low = frame_begin;
+   if (frame_begin <= root.m_top) return spare_rebuild_finish();
+   return true;
+}
+
+//! @brief Add a sector retired during the rebuild to the already scanned part.
+//!
+//! Sectors below rebuild_low are found by later frames.  A sector above it was
+//! live when its frame was scanned, so it is linked in here.
+static bool spare_rebuild_note_retired(NarfSector sector) {
+   NarfSector lower;
+   NarfSector higher;
+
+   if (sector < rebuild_low || sector < root.m_top) return true;
+
+   if (rebuild_pending == END) {
+      rebuild_pending = sector;
+      rebuild_pending_right = END;
+      rebuild_highest = sector;
+      return true;
+   }
+
+   if (sector < rebuild_pending) {
+      if (!write_spare_record(rebuild_pending, sector, rebuild_pending_right)) {
+         return false;
+      }
+      rebuild_pending_right = rebuild_pending;
+      rebuild_pending = sector;
+      return true;
+   }
+
+   lower = rebuild_pending;
+   higher = rebuild_pending_right;
+   while (higher != END && higher < sector) {
+      if (!read_spare_record(higher, &node_tmp)) return false;
+      lower = higher;
+      higher = node_tmp.m_right;
+   }
+   if (higher == sector || lower == sector) return true;
+
+   if (!write_spare_record(sector, lower, higher)) return false;
+   if (higher == END) {
+      rebuild_highest = sector;
+   }
+   else if (!set_spare_previous(higher, sector)) {
+      return false;
+   }
+
+   if (lower == rebuild_pending) {
+      rebuild_pending_right = sector;
+      return true;
+   }
+   return set_spare_next(lower, sector);
+}
+
+//! @brief Advance a deferred spare rebuild by at most a number of frames.
+static bool spare_rebuild_advance(unsigned frames) {
+   if (spare_initialized) return true;
+   if (!spare_rebuilding) spare_rebuild_start();
+
+   while (spare_rebuilding && frames-- > 0) {
+      if (!spare_rebuild_step()) {
+         invalidate_spare_cache();
+         return false;
+      }
+   }
+   return true;
+}
+
+//! @brief Rebuild the RAM spare list, finishing any deferred rebuild now.
+static bool initialize_spare(void) {
+   if (!spare_rebuilding) spare_rebuild_start();
+
+   while (spare_rebuilding) {
+      if (!spare_rebuild_step()) {
+         invalidate_spare_cache();
+         return false;
+      }
+   }
+   return spare_initialized;
+}
+
+//! @brief Return the AVL height for a node sector.
+static bool node_height(NarfSector sector, int *result) {
+   if (result == NULL) return false;
+   if (sector == END) {
+      *result = 0;
+      return true;
    }
    if (!read_node(sector, &node_tmp)) return false;
    *result = node_tmp.m_height;
@@ -1561,6 +2450,82 @@ static bool free_sector_count_rec(NarfSector sector, NarfSector *sectors) {
    return free_sector_count_rec(right, sectors);
 }
 
+//! @brief Add one counter to a statistic, failing on overflow.
+static bool stat_add(NarfSector *total, NarfSector sectors) {
+   if (*total > ((NarfSector) -1) - sectors) return false;
+   *total += sectors;
+   return true;
+}
+
+//! @brief Add the payload, logical, and slack sectors of every key.
+//!
+//! Slack is what an extent holds past its byte size, or past the chunk stream
+//! of a compressed key.
+static bool data_usage_rec(NarfSector sector, NarfUsage *usage) {
+   NarfSector left;
+   NarfSector right;
+   NarfSector used;
+   NarfSector length;
+   NarfSector held;
+   NarfSector logical;
+
+   if (usage == NULL) return false;
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   used = payload_limit(&node_work0.m_data, 0);
+   length = node_work0.m_data.m_length;
+   held = payload_held(&node_work0.m_data);
+   logical = BYTES2SECTORS(node_work0.m_data.m_bytes);
+   // A shared extent is held once; share_usage_rec() counts it.
+   if (node_work0.m_data.m_shared) held = 0;
+
+   if (!data_usage_rec(left, usage)) return false;
+
+   if (length > used && !stat_add(&usage->slack_sectors, length - used)) return false;
+   if (!stat_add(&usage->payload_sectors, held)) return false;
+   if (!stat_add(&usage->logical_sectors, logical)) return false;
+
+   return data_usage_rec(right, usage);
+}
+
+//! @brief Add the sectors of every shared extent to usage statistics.
+static bool share_usage_rec(NarfSector sector, NarfUsage *usage) {
+   NarfSector left;
+   NarfSector right;
+   NarfSector length;
+
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   length = node_work0.m_share.m_length;
+
+   if (!stat_add(&usage->payload_sectors, length)) return false;
+   if (!stat_add(&usage->shared_sectors, length)) return false;
+   return share_usage_rec(left, usage) && share_usage_rec(right, usage);
+}
+
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief Count the extents held only for snapshots.
+static bool pin_usage_rec(NarfSector sector, NarfUsage *usage) {
+   NarfSector left;
+   NarfSector right;
+
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+
+   if (!stat_add(&usage->snapshot_sectors, node_work0.m_pin.m_length)) return false;
+   return pin_usage_rec(left, usage) && pin_usage_rec(right, usage);
+}
+#endif
+
 //! @brief Return the configured metadata reserve, clipped for tiny images.
 static NarfSector metadata_reserve(void) {
    NarfSector r = NARF_METADATA_RESERVE_SECTORS;
@@ -1575,6 +2540,129 @@ static NarfSector metadata_reserve(void) {
    return r;
 }
 
+#ifdef NARF_USE_ALLOC_POLICIES
+static NarfAllocPolicy alloc_policy = NARF_ALLOC_BEST_FIT;
+static NarfSector alloc_cursor = 0;
+
+//! @brief Find the fitting free extent with the lowest start at or after floor.
+//!
+//! The free tree is ordered by length first, so a node too short for need
+//! rules out its whole left subtree.
+static bool free_low_fit_rec(NarfSector sector, NarfSector need, NarfSector floor,
+                             NarfSector *best_sector, Node *bestnode, bool *found) {
+   NarfSector left;
+   NarfSector right;
+   FreePayload fp;
+
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   fp = node_work0.m_free;
+
+   if (fp.m_length >= need) {
+      if (fp.m_start >= floor && (!*found || fp.m_start < bestnode->m_free.m_start)) {
+         *best_sector = sector;
+         *bestnode = node_work0;
+         *found = true;
+      }
+      if (!free_low_fit_rec(left, need, floor, best_sector, bestnode, found)) return false;
+   }
+   return free_low_fit_rec(right, need, floor, best_sector, bestnode, found);
+}
+
+//! @brief Find the fitting free extent with the highest start.
+static bool free_high_fit_rec(NarfSector sector, NarfSector need,
+                              NarfSector *best_sector, Node *bestnode, bool *found) {
+   NarfSector left;
+   NarfSector right;
+   FreePayload fp;
+
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   fp = node_work0.m_free;
+
+   if (fp.m_length >= need) {
+      if (!*found || fp.m_start > bestnode->m_free.m_start) {
+         *best_sector = sector;
+         *bestnode = node_work0;
+         *found = true;
+      }
+      if (!free_high_fit_rec(left, need, best_sector, bestnode, found)) return false;
+   }
+   return free_high_fit_rec(right, need, best_sector, bestnode, found);
+}
+
+//! @brief Select the data allocation policy.
+bool narf_set_alloc_policy(NarfAllocPolicy policy) {
+   if (policy < NARF_ALLOC_BEST_FIT || policy > NARF_ALLOC_FRONTIER) return false;
+   alloc_policy = policy;
+   alloc_cursor = 0;
+   return true;
+}
+
+//! @brief Return the selected data allocation policy.
+NarfAllocPolicy narf_alloc_policy(void) {
+   return alloc_policy;
+}
+#endif
+
+//! @brief Return whether the open gap can take length sectors plus extra.
+//!
+//! extra is the catalog sectors the caller also needs from the gap.
+static bool frontier_fits(NarfSector length, NarfSector extra) {
+   NarfSector gap;
+
+   if (root.m_top < root.m_bottom) return false;
+   gap = root.m_top - root.m_bottom;
+   if (length > gap || gap - length < extra) return false;
+   if (!transaction_may_use_reserve && gap - length - extra < metadata_reserve()) return false;
+   return true;
+}
+
+//! @brief Choose the free extent a payload allocation should carve from.
+//!
+//! Without NARF_USE_ALLOC_POLICIES this is best fit.
+//! @return false when the request should come from the open gap instead.
+static bool free_choose(NarfSector need, NarfSector extra,
+                        NarfSector *free_sector, Node *node) {
+#ifdef NARF_USE_ALLOC_POLICIES
+   bool found = false;
+
+   switch (alloc_policy) {
+      case NARF_ALLOC_FIRST_FIT:
+         return free_low_fit_rec(root.m_free_root, need, 0, free_sector, node, &found) && found;
+      case NARF_ALLOC_NEXT_FIT:
+         if (!free_low_fit_rec(root.m_free_root, need, alloc_cursor, free_sector, node, &found)) {
+            return false;
+         }
+         if (!found && !free_low_fit_rec(root.m_free_root, need, 0, free_sector, node, &found)) {
+            return false;
+         }
+         if (found) alloc_cursor = node->m_free.m_start + need;
+         return found;
+      case NARF_ALLOC_SEGREGATED:
+         // Small requests pack the lowest holes, large ones the highest.
+         if (need < NARF_ALLOC_SMALL_SECTORS) {
+            return free_low_fit_rec(root.m_free_root, need, 0, free_sector, node, &found) && found;
+         }
+         return free_high_fit_rec(root.m_free_root, need, free_sector, node, &found) && found;
+      case NARF_ALLOC_FRONTIER:
+         if (need >= NARF_ALLOC_LARGE_SECTORS && frontier_fits(need, extra)) return false;
+         break;
+      case NARF_ALLOC_BEST_FIT:
+         break;
+   }
+#else
+   (void) extra;
+#endif
+   return free_best_rec(root.m_free_root, need, free_sector, node);
+}
+
 //! @brief Allocate a single-sector catalog node from spare or high-end space.
 static bool alloc_node_sector(NarfSector *sector, NarfSector *rollback_next) {
    NarfSector reserve;
@@ -1582,13 +2670,10 @@ static bool alloc_node_sector(NarfSector *sector, NarfSector *rollback_next) {
    if (sector == NULL) return false;
    if (rollback_next != NULL) *rollback_next = END;
 
-   if (!spare_initialized) {
-      if (transaction_open) {
-         invalidate_spare_cache();
-      }
-      else if (!initialize_spare()) {
-         return false;
-      }
+   // Inside a transaction an uninitialized cache is empty, so allocation falls
+   // through to the virgin gap and any deferred rebuild keeps its progress.
+   if (!spare_initialized && !transaction_open && !initialize_spare()) {
+      return false;
    }
 
    if (!pop_spare(sector)) return false;
@@ -1604,6 +2689,8 @@ static bool alloc_node_sector(NarfSector *sector, NarfSector *rollback_next) {
    if (root.m_top > root.m_bottom + reserve) {
       root.m_top--;
       *sector = root.m_top;
+      // The gap may still hold payload freed earlier in this transaction.
+      discard_claim(*sector, 1);
       return prepare_allocated_node_sector(*sector, rollback_next);
    }
 
@@ -1645,6 +2732,8 @@ static bool insert_free_extent_with_seed_sector(NarfSector sector, NarfSector st
    if (start == END) return false;
    if (length > ((NarfSector) -1) - start) return false;
 
+   discard_note(start, length);
+
    /*
     * The free tree is ordered by length for best-fit allocation, not by
     * address.  That makes adjacency lookup a linear tree walk, but free-space
@@ -1658,6 +2747,7 @@ static bool insert_free_extent_with_seed_sector(NarfSector sector, NarfSector st
       FreePayload adj;
 
       changed = false;
+      perf_count(coalesce_walks);
 
       if (length <= ((NarfSector) -1) - start &&
           free_find_start_rec(root.m_free_root, start + length, &adj_sector, &adj)) {
@@ -1715,6 +2805,44 @@ static bool insert_free_extent(NarfSector start, NarfSector length) {
    return insert_free_extent_with_seed_sector(END, start, length);
 }
 
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief Record an extent that the open transaction frees while a snapshot reads it.
+static bool snapshot_pin_extent(NarfSector start, NarfSector length, uint32_t born) {
+   char key[PIN_KEY_BYTES];
+   NarfSector written;
+   NarfSector newroot;
+   bool ok;
+
+   if (length == 0) return true;
+   if (start == END) return false;
+
+   pin_key(key, start);
+   memset(&node_work1, 0, sizeof(node_work1));
+   node_work1.m_left = END;
+   node_work1.m_right = END;
+   node_work1.m_height = 1;
+   node_work1.m_pin.m_start = start;
+   node_work1.m_pin.m_length = length;
+   node_work1.m_pin.m_born = born;
+   node_work1.m_pin.m_died = transaction_root_version();
+   strcpy(node_work1.m_key, key);
+
+   if (!write_node(END, &node_work1, &written)) return false;
+   snapshot_pin_edit = true;
+   ok = data_insert_rec(root.m_pinned_root, written, key, &newroot);
+   snapshot_pin_edit = false;
+   if (!ok) return false;
+   root.m_pinned_root = newroot;
+   return true;
+}
+
+//! @brief Free an extent allocated at born, or pin it if a snapshot reads it.
+static bool snapshot_release(NarfSector start, NarfSector length, uint32_t born) {
+   if (snapshot_pins(born)) return snapshot_pin_extent(start, length, born);
+   return insert_free_extent(start, length);
+}
+#endif
+
 //! @brief Write zeroes to every sector in an extent.
 static bool zero_extent(NarfSector start, NarfSector length) {
    NarfSector i;
@@ -1722,10 +2850,14 @@ static bool zero_extent(NarfSector start, NarfSector length) {
    if (length == 0) return true;
    if (start == END) return false;
 
+#ifdef NARF_USE_DISCARD
+   if (narf_io_write_zeroes(root.m_origin + start, length)) return true;
+#endif
+
    memset(buffer, 0, sizeof(buffer));
 
    for (i = 0; i < length; i++) {
-      if (!narf_io_write(root.m_origin + start + i, buffer)) {
+      if (!payload_write(start + i, buffer)) {
          return false;
       }
    }
@@ -1741,6 +2873,7 @@ static bool allocate_data_extent(NarfSector length, NarfSector *start) {
    FreePayload removed_free;
    NarfSector free_start;
    NarfSector free_length;
+   bool found;
 
    if (start == NULL) return false;
 
@@ -1749,7 +2882,14 @@ static bool allocate_data_extent(NarfSector length, NarfSector *start) {
       return true;
    }
 
-   if (free_best_rec(root.m_free_root, length, &free_sector, &node_work1)) {
+   found = free_choose(length, 0, &free_sector, &node_work1);
+   if (!found && !frontier_fits(length, 0)) {
+      // A frontier-first policy may still find room in the free tree.
+      if (!free_best_rec(root.m_free_root, length, &free_sector, &node_work1)) return false;
+      found = true;
+   }
+
+   if (found) {
       free_start = node_work1.m_free.m_start;
       free_length = node_work1.m_free.m_length;
 
@@ -1760,6 +2900,7 @@ static bool allocate_data_extent(NarfSector length, NarfSector *start) {
 
       root.m_free_root = newroot;
       *start = removed_free.m_start;
+      discard_claim(*start, length);
 
       (void) removed_sector;
 
@@ -1771,13 +2912,9 @@ static bool allocate_data_extent(NarfSector length, NarfSector *start) {
       return true;
    }
 
-   if (root.m_top < root.m_bottom) return false;
-   if (length > root.m_top - root.m_bottom) return false;
-   if (!transaction_may_use_reserve &&
-       root.m_top - root.m_bottom - length < metadata_reserve()) return false;
-
    *start = root.m_bottom;
    root.m_bottom += length;
+   discard_claim(*start, length);
    return true;
 }
 
@@ -1798,6 +2935,7 @@ static bool allocate_tail_extent(NarfSector start, NarfSector length) {
       if (!transaction_may_use_reserve &&
           root.m_top - root.m_bottom - length < metadata_reserve()) return false;
       root.m_bottom += length;
+      discard_claim(start, length);
       return true;
    }
 
@@ -1814,6 +2952,7 @@ static bool allocate_tail_extent(NarfSector start, NarfSector length) {
 
    root.m_free_root = newroot;
    (void) removed_sector;
+   discard_claim(start, length);
 
    if (free_node.m_length > length) {
       if (!insert_free_extent(start + length, free_node.m_length - length)) {
@@ -1824,75 +2963,206 @@ static bool allocate_tail_extent(NarfSector start, NarfSector length) {
    return true;
 }
 
-//! @brief Try the safe append-at-EOF fast path without copying old payload sectors.
-static bool write_append_fast(const char *key, const uint8_t *src,
-                              NarfByteSize size, NarfByteSize old_bytes,
-                              NarfSector old_start, NarfSector old_length,
-                              NarfByteSize new_bytes) {
-   NarfSector new_length;
-   NarfSector extra;
-   NarfSector write_start;
-   NarfSector i;
-   NarfSector newroot;
+//! @brief Allocate a payload extent, adding up to room sectors of growth slack.
+//!
+//! The slack is dropped rather than failing the allocation.
+static bool allocate_slack_extent(NarfSector length, NarfSector room,
+                                  NarfSector *start, NarfSector *allocated) {
+   if (room != 0 && room <= ((NarfSector) -1) - length &&
+       allocate_data_extent(length + room, start)) {
+      *allocated = length + room;
+      return true;
+   }
+   if (!allocate_data_extent(length, start)) return false;
+   *allocated = length;
+   return true;
+}
+
+//! @brief Grow an extent in place, adding up to room sectors of growth slack.
+static bool allocate_slack_tail(NarfSector start, NarfSector length,
+                                NarfSector room, NarfSector *allocated) {
+   if (room != 0 && room <= ((NarfSector) -1) - length &&
+       allocate_tail_extent(start, length + room)) {
+      *allocated = length + room;
+      return true;
+   }
+   if (!allocate_tail_extent(start, length)) return false;
+   *allocated = length;
+   return true;
+}
 
-   if (old_bytes % NARF_SECTOR_SIZE != 0) return false;
+//! @brief Return whether growing past old_bytes would expose stale tail bytes.
+//!
+//! Bytes past m_bytes in the last written sector are not cleared by a shrink,
+//! so a size increase must rewrite that sector before they become visible.
+static bool payload_stale_tail(const DataPayload *payload, NarfByteSize new_bytes) {
+   NarfSector tail;
 
-   new_length = BYTES2SECTORS(new_bytes);
-   if (new_length < old_length) return false;
-   extra = new_length - old_length;
-   if (extra == 0) return false;
+   if (new_bytes <= payload->m_bytes) return false;
+   if (payload->m_bytes % NARF_SECTOR_SIZE == 0) return false;
+   tail = (NarfSector) (payload->m_bytes / NARF_SECTOR_SIZE);
+   return tail >= payload->m_first && tail - payload->m_first < payload->m_valid;
+}
 
-   if (old_length == 0) {
-      if (!allocate_data_extent(new_length, &write_start)) return false;
-      extra = new_length;
-   }
-   else {
-      if (old_start == END) return false;
-      if (old_length > ((NarfSector) -1) - old_start) return false;
-      write_start = old_start + old_length;
-      if (!allocate_tail_extent(write_start, extra)) return false;
+//! @brief Return the relative sector holding a written logical payload sector.
+//!
+//! A tail copy in m_tail overrides its extent slot at logical sector m_tail_at.
+static NarfSector payload_sector(const DataPayload *payload, NarfSector logical) {
+   if (payload->m_tail != END && payload->m_tail_at == logical) {
+      return payload->m_tail;
    }
+   return payload->m_start + (logical - payload->m_first);
+}
 
-   for (i = 0; i < extra; i++) {
-      NarfByteSize base;
-      NarfByteSize copied = 0;
+//! @brief Try to write without copying more than one committed payload sector.
+//!
+//! Succeeds when the write touches only holes and unwritten sectors: a NULL
+//! source that misses the written prefix only changes m_bytes, a first write
+//! into an empty key allocates just the written sectors, and a write at or past
+//! the written prefix lands in place, growing the extent into following free
+//! space if needed.  Unwritten sectors it skips over are zeroed first.
+//!
+//! A write past an unaligned EOF must also rewrite the partial last sector.
+//! The committed root still reads that sector, so its new content goes to a
+//! one-sector tail copy instead; if the tail copy already covers it, the
+//! extent slot is unreferenced and takes the new content back.
+static bool write_unwritten_fast(const char *key, const uint8_t *src,
+                                 NarfByteSize size, NarfByteSize offset,
+                                 const DataPayload *old, NarfByteSize new_bytes,
+                                 const char *metadata) {
+   NarfByteSize write_end = offset + size;
+   NarfByteSize rest = offset;
+   NarfSector first;
+   NarfSector last = BYTES2SECTORS(write_end);
+   NarfSector start = old->m_start;
+   NarfSector logical = old->m_first;
+   NarfSector length = old->m_length;
+   NarfSector valid = old->m_valid;
+   NarfSector tail = old->m_tail;
+   NarfSector tail_at = old->m_tail_at;
+   NarfSector partial = END;
+   NarfSector release = END;
+   NarfSector newroot;
+   NarfSector i;
+   bool has_rest;
+
+   if (payload_stale_tail(old, new_bytes)) {
+      // Only writes past EOF leave the rest of the partial sector alone.
+      if (offset < old->m_bytes) return false;
+      partial = (NarfSector) (old->m_bytes / NARF_SECTOR_SIZE);
+      if (rest < (NarfByteSize) (partial + 1) * NARF_SECTOR_SIZE) {
+         rest = (NarfByteSize) (partial + 1) * NARF_SECTOR_SIZE;
+      }
+   }
+   first = (NarfSector) (rest / NARF_SECTOR_SIZE);
+   has_rest = src != NULL && rest < write_end;
 
-      if (i > ((NarfByteSize) -1) / NARF_SECTOR_SIZE) {
+   if (!has_rest) {
+      // Zeroes over holes and unwritten sectors are already there.
+      if (partial == END && valid != 0 &&
+          offset < (NarfByteSize) (logical + valid) * NARF_SECTOR_SIZE &&
+          write_end > (NarfByteSize) logical * NARF_SECTOR_SIZE) {
+         return false;
+      }
+   }
+   else if (length == 0) {
+      if (!allocate_slack_extent(last - first,
+                                 payload_slack_room(new_bytes, first, last - first, old->m_slack),
+                                 &start, &length)) {
          return false;
       }
+      logical = first;
+      valid = 0;
+   }
+   else {
+      if (first < logical + valid) return false;
+      if (last > logical + length) {
+         NarfSector grown;
+
+         if (length > ((NarfSector) -1) - start) return false;
+         if (!allocate_slack_tail(start + length, last - logical - length,
+                                  payload_slack_room(new_bytes, logical, last - logical, old->m_slack),
+                                  &grown)) {
+            return false;
+         }
+         length += grown;
+      }
+   }
 
-      base = ((NarfByteSize) i) * NARF_SECTOR_SIZE;
-      memset(buffer, 0, sizeof(buffer));
+   if (partial != END) {
+      NarfSector target = start + (partial - logical);
+      size_t within = (size_t) (old->m_bytes % NARF_SECTOR_SIZE);
 
-      if (base < size) {
-         copied = size - base;
-         if (copied > sizeof(buffer)) copied = sizeof(buffer);
-         if (src != NULL) {
-            memcpy(buffer, src + base, copied);
+      if (tail != END && tail_at == partial) {
+         release = tail;
+         tail = END;
+         tail_at = 0;
+      }
+      else {
+         if (!allocate_data_extent(1, &target)) return false;
+         if (tail != END) {
+            // The older tail copy folds back into its now unreferenced slot.
+            if (!payload_read(tail, buffer) ||
+                !payload_write(start + (tail_at - logical), buffer)) {
+               return false;
+            }
+            release = tail;
          }
+         tail = target;
+         tail_at = partial;
       }
 
-      if (src == NULL && copied != 0) {
-         memset(buffer, 0, copied);
+      if (!payload_read(payload_sector(old, partial), buffer)) {
+         return false;
       }
+      memset(buffer + within, 0, NARF_SECTOR_SIZE - within);
+      if (src != NULL && offset < (NarfByteSize) (partial + 1) * NARF_SECTOR_SIZE) {
+         NarfByteSize base = (NarfByteSize) partial * NARF_SECTOR_SIZE;
+         NarfByteSize end = base + NARF_SECTOR_SIZE;
 
-      if (!narf_io_write(root.m_origin + write_start + i, buffer)) {
-         return false;
+         if (end > write_end) end = write_end;
+         memcpy(buffer + (offset - base), src, end - offset);
       }
+      if (!payload_write(target, buffer)) return false;
    }
 
-   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
-      return false;
-   }
+   if (has_rest) {
+      if (!zero_extent(start + valid, first - logical - valid)) return false;
 
-   if (old_length == 0) {
-      node_work1.m_data.m_start = new_length ? write_start : END;
-   }
-   else {
-      node_work1.m_data.m_start = old_start;
-   }
-   node_work1.m_data.m_length = new_length;
+      for (i = first; i < last; i++) {
+         NarfByteSize base = (NarfByteSize) i * NARF_SECTOR_SIZE;
+         NarfByteSize begin = offset > base ? offset : base;
+         NarfByteSize end = base + NARF_SECTOR_SIZE;
+
+         if (end > write_end) end = write_end;
+         memset(buffer, 0, sizeof(buffer));
+         memcpy(buffer + (begin - base), src + (begin - offset), end - begin);
+
+         if (!payload_write(start + (i - logical), buffer)) {
+            return false;
+         }
+      }
+      valid = last - logical;
+   }
+
+   if (release != END && !insert_free_extent(release, 1)) return false;
+
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      return false;
+   }
+   node_work1.m_data.m_start = start;
+   node_work1.m_data.m_first = logical;
+   node_work1.m_data.m_length = length;
    node_work1.m_data.m_bytes = new_bytes;
+   node_work1.m_data.m_valid = valid;
+   node_work1.m_data.m_tail = tail;
+   node_work1.m_data.m_tail_at = tail_at;
+
+   if (metadata) {
+      memset(node_work1.m_data.m_metadata, 0, sizeof(node_work1.m_data.m_metadata));
+      strncpy((char *) node_work1.m_data.m_metadata, metadata,
+            sizeof(node_work1.m_data.m_metadata) - 1);
+   }
 
    if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) {
       return false;
@@ -1902,6 +3172,512 @@ static bool write_append_fast(const char *key, const uint8_t *src,
    return true;
 }
 
+#ifdef NARF_USE_COMPRESSION
+// Compressed payloads.
+//
+// The codec is a byte-oriented LZ77 using the LZ4 block layout: each sequence
+// is a token whose high nibble counts literals and low nibble counts match
+// bytes past the 4-byte minimum, 255-run extensions of either count, the
+// literals, and a 16-bit little-endian match distance.  The last sequence is
+// literals only.  Chunks are small, so the hash table holds 16-bit positions
+// and is cleared per chunk; every chunk decodes on its own.
+
+#define LZ_MIN_MATCH 4
+#define LZ_TAIL_LITERALS 5
+
+static uint16_t lz_table[1u << NARF_LZ_HASH_BITS];
+static uint8_t chunk_plain[CHUNK_BYTES];
+static uint8_t chunk_coded[CHUNK_BYTES];
+static ChunkEntry chunk_index[CHUNK_ENTRIES];
+static_assert(sizeof(chunk_index) == NARF_SECTOR_SIZE, "chunk index sector size");
+
+//! @brief Load four bytes little-endian.
+static uint32_t lz_load32(const uint8_t *p) {
+   return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+          ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+//! @brief Hash four bytes into the match table.
+static unsigned lz_hash(uint32_t v) {
+   return (unsigned) ((v * 2654435761u) >> (32 - NARF_LZ_HASH_BITS));
+}
+
+//! @brief Emit the 255-run extension of a literal or match count.
+static bool lz_put_length(uint8_t *dst, size_t cap, size_t *op, size_t rest) {
+   while (rest >= 255) {
+      if (*op >= cap) return false;
+      dst[(*op)++] = 255;
+      rest -= 255;
+   }
+   if (*op >= cap) return false;
+   dst[(*op)++] = (uint8_t) rest;
+   return true;
+}
+
+//! @brief Emit one sequence; match is 0 for the final literal-only sequence.
+static bool lz_emit(uint8_t *dst, size_t cap, size_t *op, const uint8_t *literals,
+                    size_t nliterals, size_t distance, size_t match) {
+   size_t extra = match ? match - LZ_MIN_MATCH : 0;
+
+   if (*op >= cap) return false;
+   dst[(*op)++] = (uint8_t) (((nliterals < 15 ? nliterals : 15) << 4) |
+                             (extra < 15 ? extra : 15));
+   if (nliterals >= 15 && !lz_put_length(dst, cap, op, nliterals - 15)) return false;
+   if (nliterals > cap - *op) return false;
+   memcpy(dst + *op, literals, nliterals);
+   *op += nliterals;
+   if (match == 0) return true;
+
+   if (cap - *op < 2) return false;
+   dst[(*op)++] = (uint8_t) distance;
+   dst[(*op)++] = (uint8_t) (distance >> 8);
+   return extra < 15 || lz_put_length(dst, cap, op, extra - 15);
+}
+
+//! @brief Compress n bytes into at most cap bytes.
+//! @return Compressed length, or 0 when it does not fit.
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+   size_t ip = 0;
+   size_t anchor = 0;
+   size_t op = 0;
+
+   // Positions are stored plus one, so zero is an empty slot.
+   memset(lz_table, 0, sizeof(lz_table));
+
+   while (n >= LZ_MIN_MATCH + LZ_TAIL_LITERALS &&
+          ip <= n - LZ_MIN_MATCH - LZ_TAIL_LITERALS) {
+      uint32_t v = lz_load32(src + ip);
+      unsigned h = lz_hash(v);
+      size_t ref = lz_table[h];
+      size_t len = LZ_MIN_MATCH;
+
+      lz_table[h] = (uint16_t) (ip + 1);
+      if (ref == 0 || lz_load32(src + ref - 1) != v) {
+         ip++;
+         continue;
+      }
+      ref--;
+
+      while (ip + len < n - LZ_TAIL_LITERALS && src[ref + len] == src[ip + len]) len++;
+      if (!lz_emit(dst, cap, &op, src + anchor, ip - anchor, ip - ref, len)) return 0;
+      ip += len;
+      anchor = ip;
+   }
+
+   if (!lz_emit(dst, cap, &op, src + anchor, n - anchor, 0, 0)) return 0;
+   return op;
+}
+
+//! @brief Decode n compressed bytes into exactly out bytes.
+static bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out) {
+   size_t ip = 0;
+   size_t op = 0;
+
+   while (ip < n) {
+      unsigned token = src[ip++];
+      size_t nliterals = token >> 4;
+      size_t match = token & 15u;
+      size_t distance;
+      uint8_t more;
+
+      if (nliterals == 15) {
+         do {
+            if (ip >= n) return false;
+            more = src[ip++];
+            nliterals += more;
+         } while (more == 255);
+      }
+      if (nliterals > n - ip || nliterals > out - op) return false;
+      memcpy(dst + op, src + ip, nliterals);
+      ip += nliterals;
+      op += nliterals;
+      if (ip == n) break;
+
+      if (n - ip < 2) return false;
+      distance = (size_t) src[ip] | ((size_t) src[ip + 1] << 8);
+      ip += 2;
+      if (distance == 0 || distance > op) return false;
+      if (match == 15) {
+         do {
+            if (ip >= n) return false;
+            more = src[ip++];
+            match += more;
+         } while (more == 255);
+      }
+      match += LZ_MIN_MATCH;
+      if (match > out - op) return false;
+
+      // Byte by byte: a match may overlap the bytes it produces.
+      for (; match != 0; match--, op++) dst[op] = dst[op - distance];
+   }
+
+   return op == out;
+}
+
+//! @brief Return the logical bytes of chunk c in a payload of bytes.
+static size_t chunk_bytes(NarfByteSize bytes, NarfSector c) {
+   NarfByteSize base = (NarfByteSize) c * CHUNK_BYTES;
+
+   return bytes - base < CHUNK_BYTES ? (size_t) (bytes - base) : CHUNK_BYTES;
+}
+
+//! @brief Read index sector s of a compressed payload into chunk_index.
+static bool chunk_read_index(const DataPayload *payload, NarfSector s) {
+   if (s >= chunk_index_sectors(payload->m_bytes)) return false;
+   return payload_read(payload->m_start + payload->m_index + s,
+                       chunk_index);
+}
+
+//! @brief Check one index entry of chunk c against its payload.
+//!
+//! A hole is all zero.  A stored chunk lies in the written stream clear of the
+//! index, and is raw exactly when its stored and logical sizes match.
+static bool chunk_entry_ok(const DataPayload *payload, const ChunkEntry *entry,
+                           NarfSector c) {
+   NarfSector sectors;
+
+   if (entry->m_stored == 0) return entry->m_logical == 0 && entry->m_sector == 0;
+   if (entry->m_stored > entry->m_logical) return false;
+   if (entry->m_logical > chunk_bytes(payload->m_bytes, c)) return false;
+
+   sectors = BYTES2SECTORS(entry->m_stored);
+   if (entry->m_sector > payload->m_valid) return false;
+   if (sectors > payload->m_valid - entry->m_sector) return false;
+   return entry->m_sector >= payload->m_index + chunk_index_sectors(payload->m_bytes) ||
+          entry->m_sector + sectors <= payload->m_index;
+}
+
+//! @brief Decode a checked chunk into chunk_plain, zero-filled to CHUNK_BYTES.
+static bool chunk_load(const DataPayload *payload, const ChunkEntry *entry) {
+   NarfSector sectors = BYTES2SECTORS(entry->m_stored);
+   NarfSector i;
+
+   memset(chunk_plain, 0, sizeof(chunk_plain));
+   if (entry->m_stored == 0) return true;
+
+   for (i = 0; i < sectors; i++) {
+      if (!payload_read(payload->m_start + entry->m_sector + i,
+                        chunk_coded + (size_t) i * NARF_SECTOR_SIZE)) {
+         return false;
+      }
+   }
+   if (entry->m_stored == entry->m_logical) {
+      memcpy(chunk_plain, chunk_coded, entry->m_logical);
+      return true;
+   }
+   return lz_decompress(chunk_coded, entry->m_stored, chunk_plain, entry->m_logical);
+}
+
+//! @brief Load chunk c of a plain payload into chunk_plain.
+static bool chunk_load_plain(const DataPayload *payload, NarfSector c) {
+   NarfByteSize base = (NarfByteSize) c * CHUNK_BYTES;
+   NarfSector i;
+
+   memset(chunk_plain, 0, sizeof(chunk_plain));
+   for (i = 0; i < CHUNK_SECTORS; i++) {
+      NarfSector logical = c * CHUNK_SECTORS + i;
+
+      if (logical < payload->m_first || logical - payload->m_first >= payload->m_valid) {
+         continue;
+      }
+      if (!payload_read(payload_sector(payload, logical),
+                        chunk_plain + (size_t) i * NARF_SECTOR_SIZE)) {
+         return false;
+      }
+   }
+
+   // The last written sector may hold stale bytes past the size.
+   if (payload->m_bytes - base < CHUNK_BYTES) {
+      memset(chunk_plain + (payload->m_bytes - base), 0,
+             CHUNK_BYTES - (size_t) (payload->m_bytes - base));
+   }
+   return true;
+}
+
+//! @brief Return whether chunk c of a plain payload overlaps its written prefix.
+static bool chunk_plain_written(const DataPayload *payload, NarfSector c) {
+   NarfSector lo = c * CHUNK_SECTORS;
+
+   if (payload->m_valid == 0 || lo + CHUNK_SECTORS <= payload->m_first) return false;
+   return lo < payload->m_first || lo - payload->m_first < payload->m_valid;
+}
+
+//! @brief Store the first logical bytes of chunk_plain at relative sector dst.
+//!
+//! An all-zero chunk becomes a hole and takes no sectors.  The compressed form
+//! is kept only when it saves a sector.  Fills entry apart from m_sector and
+//! sets *sectors to the sectors written.
+static bool chunk_store(NarfSector dst, size_t logical, ChunkEntry *entry,
+                        NarfSector *sectors) {
+   const uint8_t *data = chunk_coded;
+   size_t stored = 0;
+   size_t i;
+
+   memset(entry, 0, sizeof(*entry));
+   *sectors = 0;
+   for (i = 0; i < logical && chunk_plain[i] == 0; i++) {
+   }
+   if (i == logical) return true;
+
+   if (logical > NARF_SECTOR_SIZE) {
+      stored = lz_compress(chunk_plain, logical, chunk_coded,
+                           (BYTES2SECTORS(logical) - 1) * NARF_SECTOR_SIZE);
+   }
+   if (stored == 0) {
+      data = chunk_plain;
+      stored = logical;
+   }
+
+   entry->m_stored = (uint16_t) stored;
+   entry->m_logical = (uint16_t) logical;
+   *sectors = BYTES2SECTORS(stored);
+   for (i = 0; i < *sectors; i++) {
+      size_t n = stored - i * NARF_SECTOR_SIZE;
+
+      if (n > NARF_SECTOR_SIZE) n = NARF_SECTOR_SIZE;
+      memset(buffer, 0, sizeof(buffer));
+      memcpy(buffer, data + i * NARF_SECTOR_SIZE, n);
+      if (!payload_write(dst + i, buffer)) return false;
+   }
+   return true;
+}
+
+//! @brief Rewrite a compressed key's index and the chunks a change touches.
+//!
+//! Without copy, the new index and chunks are appended to the key's written
+//! stream, growing the extent in place, so the committed payload stays intact
+//! and superseded chunks linger as garbage.  With copy, or for a plain key
+//! being converted, the live chunks move to a new extent without being
+//! recompressed and the old extent is released.  Chunks overlapping
+//! [offset, offset + size) take src, or zeroes when src is NULL, and a shrink
+//! re-encodes the new last chunk so growing again reads zeroes.
+static bool chunk_rewrite(const char *key, const DataPayload *old,
+                          const uint8_t *src, NarfByteSize size,
+                          NarfByteSize offset, NarfByteSize new_bytes,
+                          const char *metadata, bool copy) {
+   NarfByteSize write_end = offset + size;
+   NarfSector chunks = chunk_count(new_bytes);
+   NarfSector index_sectors = chunk_index_sectors(new_bytes);
+   NarfSector old_chunks = 0;
+   NarfSector touch_first = 0;
+   NarfSector touch_end = 0;
+   NarfSector trim = END;
+   NarfSector start = END;
+   NarfSector length = 0;
+   NarfSector pos = 0;
+   NarfSector cursor;
+   NarfSector live;
+   NarfSector limit;
+   NarfSector s;
+   NarfSector newroot;
+   uint64_t need = 0;
+   bool plain = old->m_codec == CODEC_PLAIN;
+
+   if (!plain) old_chunks = chunk_count(old->m_bytes);
+   if (size != 0) {
+      touch_first = (NarfSector) (offset / CHUNK_BYTES);
+      touch_end = chunk_count(write_end);
+   }
+   if (new_bytes < old->m_bytes && new_bytes % CHUNK_BYTES != 0) {
+      trim = (NarfSector) (new_bytes / CHUNK_BYTES);
+   }
+   if (!copy && (plain || chunks == 0 || old->m_length == 0)) return false;
+
+   // Room for the index and every chunk that may be stored, at most one
+   // whole chunk each; zeroes over whole chunks only leave holes.
+   if (chunks != 0) {
+      need = index_sectors;
+      if (src != NULL) need += (uint64_t) (touch_end - touch_first) * CHUNK_SECTORS;
+      else if (size != 0) need += 2 * CHUNK_SECTORS;
+      if (trim != END) need += CHUNK_SECTORS;
+      if (plain) need += (uint64_t) old->m_valid + 2 * CHUNK_SECTORS;
+      else if (copy) need += old->m_packed - chunk_index_sectors(old->m_bytes);
+   }
+   if (need > root.m_total_sectors) return false;
+
+   if (!copy) {
+      // Compact instead once garbage outweighs the live stream.
+      if (old->m_valid - old->m_packed > old->m_packed) return false;
+      start = old->m_start;
+      length = old->m_length;
+      pos = old->m_valid;
+      if (need > length - pos) {
+         NarfSector grown;
+
+         if (length > ((NarfSector) -1) - start) return false;
+         if (!allocate_slack_tail(start + length, (NarfSector) need - (length - pos), 0, &grown)) {
+            return false;
+         }
+         length += grown;
+      }
+   }
+   else if (need != 0 &&
+            !allocate_slack_extent((NarfSector) need, old->m_slack, &start, &length)) {
+      return false;
+   }
+
+   cursor = pos + index_sectors;
+   live = index_sectors;
+   for (s = 0; s < index_sectors; s++) {
+      NarfSector base = s * (NarfSector) CHUNK_ENTRIES;
+      unsigned k;
+
+      memset(chunk_index, 0, sizeof(chunk_index));
+      if (base < old_chunks && !chunk_read_index(old, s)) return false;
+
+      for (k = 0; k < CHUNK_ENTRIES; k++) {
+         ChunkEntry *entry = &chunk_index[k];
+         NarfSector c = base + k;
+         NarfByteSize chunk_base = (NarfByteSize) c * CHUNK_BYTES;
+         size_t logical;
+         NarfSector sectors;
+
+         if (c >= chunks || c >= old_chunks) memset(entry, 0, sizeof(*entry));
+         if (c >= chunks) continue;
+         if (!plain && !chunk_entry_ok(old, entry, c)) return false;
+         logical = chunk_bytes(new_bytes, c);
+
+         if (src == NULL && offset <= chunk_base && write_end >= chunk_base + logical &&
+             c >= touch_first && c < touch_end) {
+            // Zeroes over the whole chunk.
+            memset(entry, 0, sizeof(*entry));
+         }
+         else if ((plain && chunk_plain_written(old, c)) ||
+                  (c >= touch_first && c < touch_end) || c == trim) {
+            if (plain ? !chunk_load_plain(old, c) : !chunk_load(old, entry)) return false;
+            memset(chunk_plain + logical, 0, CHUNK_BYTES - logical);
+
+            if (write_end > chunk_base && offset < chunk_base + logical) {
+               NarfByteSize begin = offset > chunk_base ? offset : chunk_base;
+               NarfByteSize end = write_end < chunk_base + logical ? write_end : chunk_base + logical;
+
+               if (src != NULL) {
+                  memcpy(chunk_plain + (begin - chunk_base), src + (begin - offset), end - begin);
+               }
+               else {
+                  memset(chunk_plain + (begin - chunk_base), 0, end - begin);
+               }
+            }
+
+            if (CHUNK_SECTORS > length - cursor) return false;
+            if (!chunk_store(start + cursor, logical, entry, &sectors)) return false;
+            if (sectors != 0) entry->m_sector = cursor;
+            cursor += sectors;
+            live += sectors;
+         }
+         else if (entry->m_stored != 0) {
+            sectors = BYTES2SECTORS(entry->m_stored);
+            if (copy) {
+               NarfSector i;
+
+               if (sectors > length - cursor) return false;
+               for (i = 0; i < sectors; i++) {
+                  if (!payload_read(old->m_start + entry->m_sector + i, buffer) ||
+                      !payload_write(start + cursor + i, buffer)) {
+                     return false;
+                  }
+               }
+               entry->m_sector = cursor;
+               cursor += sectors;
+            }
+            live += sectors;
+         }
+      }
+
+      if (!payload_write(start + pos + s, chunk_index)) return false;
+   }
+
+   // Keep only the stream and its growth slack.
+   limit = old->m_slack > ((NarfSector) -1) - cursor ? (NarfSector) -1 : cursor + old->m_slack;
+   if (length > limit) {
+      if (!insert_free_extent(start + limit, length - limit)) return false;
+      length = limit;
+   }
+   if (copy) {
+      if (old->m_length != 0 && !insert_free_extent(old->m_start, old->m_length)) return false;
+      if (old->m_tail != END && !insert_free_extent(old->m_tail, 1)) return false;
+   }
+
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   node_work1.m_data.m_start = length ? start : END;
+   node_work1.m_data.m_length = length;
+   node_work1.m_data.m_first = 0;
+   node_work1.m_data.m_valid = length ? cursor : 0;
+   node_work1.m_data.m_bytes = new_bytes;
+   node_work1.m_data.m_tail = END;
+   node_work1.m_data.m_tail_at = 0;
+   node_work1.m_data.m_codec = CODEC_LZ;
+   node_work1.m_data.m_index = length ? pos : 0;
+   node_work1.m_data.m_packed = length ? live : 0;
+
+   if (metadata) {
+      memset(node_work1.m_data.m_metadata, 0, sizeof(node_work1.m_data.m_metadata));
+      strncpy((char *) node_work1.m_data.m_metadata, metadata,
+            sizeof(node_work1.m_data.m_metadata) - 1);
+   }
+
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) return false;
+   root.m_data_root = newroot;
+   return true;
+}
+
+//! @brief Read bytes from a compressed payload, decoding each chunk they touch.
+static bool chunk_read(const DataPayload *payload, uint8_t *dst,
+                       NarfByteSize size, NarfByteSize offset) {
+   NarfSector loaded = END;
+
+   while (size) {
+      NarfSector c = (NarfSector) (offset / CHUNK_BYTES);
+      const ChunkEntry *entry = &chunk_index[c % CHUNK_ENTRIES];
+      size_t within = (size_t) (offset % CHUNK_BYTES);
+      size_t n = CHUNK_BYTES - within;
+
+      if (n > size) n = size;
+      if (c / CHUNK_ENTRIES != loaded) {
+         if (!chunk_read_index(payload, c / CHUNK_ENTRIES)) return false;
+         loaded = c / CHUNK_ENTRIES;
+      }
+      if (!chunk_entry_ok(payload, entry, c)) return false;
+      if (entry->m_stored == 0) {
+         memset(dst, 0, n);
+      }
+      else {
+         if (!chunk_load(payload, entry)) return false;
+         memcpy(dst, chunk_plain + within, n);
+      }
+      dst += n;
+      offset += n;
+      size -= n;
+   }
+   return true;
+}
+
+//! @brief Find the next stored chunk or hole of a compressed payload.
+static bool chunk_seek(const DataPayload *payload, NarfByteSize offset, bool hole,
+                       NarfByteSize *result) {
+   NarfSector chunks = chunk_count(payload->m_bytes);
+   NarfSector loaded = END;
+   NarfSector c;
+
+   for (c = (NarfSector) (offset / CHUNK_BYTES); c < chunks; c++) {
+      NarfByteSize base = (NarfByteSize) c * CHUNK_BYTES;
+
+      if (c / CHUNK_ENTRIES != loaded) {
+         if (!chunk_read_index(payload, c / CHUNK_ENTRIES)) return false;
+         loaded = c / CHUNK_ENTRIES;
+      }
+      if ((chunk_index[c % CHUNK_ENTRIES].m_stored == 0) == hole) {
+         *result = base > offset ? base : offset;
+         return true;
+      }
+   }
+
+   if (!hole) return false;
+   *result = payload->m_bytes;
+   return true;
+}
+#endif
+
 //! @brief Allocate a catalog node and optional payload storage for a new entry.
 static bool allocate_storage(NarfSector length, NarfSector *meta_sector, NarfSector *start) {
    NarfSector free_sector;
@@ -1910,8 +3686,16 @@ static bool allocate_storage(NarfSector length, NarfSector *meta_sector, NarfSec
    FreePayload removed_free;
    NarfSector free_start;
    NarfSector free_length;
+   bool found = false;
+
+   if (length > 0) {
+      found = free_choose(length, 1, &free_sector, &node_work1);
+      if (!found && !frontier_fits(length, 1)) {
+         found = free_best_rec(root.m_free_root, length, &free_sector, &node_work1);
+      }
+   }
 
-   if (length > 0 && free_best_rec(root.m_free_root, length, &free_sector, &node_work1)) {
+   if (found) {
       free_start = node_work1.m_free.m_start;
       free_length = node_work1.m_free.m_length;
       if (!free_delete_rec(root.m_free_root, free_length, free_start, free_sector,
@@ -1920,6 +3704,7 @@ static bool allocate_storage(NarfSector length, NarfSector *meta_sector, NarfSec
       (void) removed_sector;
       if (!alloc_node_sector(meta_sector, NULL)) return false;
       *start = removed_free.m_start;
+      discard_claim(*start, length);
       if (removed_free.m_length > length) {
          if (!insert_free_extent(removed_free.m_start + length,
                                  removed_free.m_length - length)) return false;
@@ -1927,14 +3712,11 @@ static bool allocate_storage(NarfSector length, NarfSector *meta_sector, NarfSec
       return true;
    }
 
-   if (root.m_top < root.m_bottom) return false;
-   if (length > root.m_top - root.m_bottom) return false;
-   if (root.m_top - root.m_bottom - length < 1) return false;
-   if (!transaction_may_use_reserve &&
-       root.m_top - root.m_bottom - length <= metadata_reserve()) return false;
+   if (!frontier_fits(length, 1)) return false;
    if (!alloc_node_sector(meta_sector, NULL)) return false;
    *start = root.m_bottom;
    root.m_bottom += length;
+   discard_claim(*start, length);
    return true;
 }
 
@@ -1947,7 +3729,7 @@ typedef struct {
 } MountTreeContext;
 
 //! @brief Validate AVL shape and cheap per-node invariants during mount.
-static bool validate_tree_shape_rec(NarfSector sector, bool free_tree,
+static bool validate_tree_shape_rec(NarfSector sector, TreeKind kind,
                                     unsigned depth, NarfSector *path,
                                     NarfSector *count, int *height) {
    NarfSector left;
@@ -1978,17 +3760,23 @@ static bool validate_tree_shape_rec(NarfSector sector, bool free_tree,
    if (!valid_catalog_child(left) || !valid_catalog_child(right)) return false;
    if (left != END && left == right) return false;
 
-   if (free_tree) {
+   if (kind == TREE_FREE) {
       if (!valid_free_payload(&node_work0.m_free)) return false;
    }
+   else if (kind == TREE_SHARED) {
+      if (!valid_share_node(&node_work0)) return false;
+   }
+   else if (kind == TREE_PINNED) {
+      if (!valid_pin_node(&node_work0)) return false;
+   }
    else {
       if (!node_key_terminated(&node_work0)) return false;
       if (!valid_data_payload(&node_work0.m_data)) return false;
    }
 
-   if (!validate_tree_shape_rec(left, free_tree, depth + 1, path,
+   if (!validate_tree_shape_rec(left, kind, depth + 1, path,
                                 count, &left_height)) return false;
-   if (!validate_tree_shape_rec(right, free_tree, depth + 1, path,
+   if (!validate_tree_shape_rec(right, kind, depth + 1, path,
                                 count, &right_height)) return false;
 
    expected_height = (left_height > right_height ? left_height : right_height) + 1;
@@ -2051,7 +3839,7 @@ static bool validate_free_order_rec(NarfSector sector, unsigned depth,
 }
 
 //! @brief Validate one authoritative metadata tree during mount.
-static bool validate_tree(NarfSector sector, bool free_tree, NarfSector *count) {
+static bool validate_tree(NarfSector sector, TreeKind kind, NarfSector *count) {
    MountTreeContext ctx;
    NarfSector path[NARF_MAX_AVL_DEPTH + 1];
    int height;
@@ -2060,20 +3848,109 @@ static bool validate_tree(NarfSector sector, bool free_tree, NarfSector *count)
    *count = 0;
    memset(&ctx, 0, sizeof(ctx));
 
-   if (!validate_tree_shape_rec(sector, free_tree, 0, path, count, &height)) {
+   if (!validate_tree_shape_rec(sector, kind, 0, path, count, &height)) {
       return false;
    }
-   if (free_tree) {
+   if (kind == TREE_FREE) {
       return validate_free_order_rec(sector, 0, &ctx);
    }
    return validate_data_order_rec(sector, 0, &ctx);
 }
 
+//! @brief Spot-check one tree along its leftmost and rightmost paths.
+//!
+//! Each node on the two spines gets the per-node mount checks, its stored
+//! height must fit its parent's, and the spine must be strictly ordered.  This
+//! reads at most two root-to-leaf paths.  A snapshot's free extents may lie
+//! past the live m_bottom, so for a snapshot tree they only need to fit the
+//! volume.
+static bool validate_tree_spines(NarfSector top, TreeKind kind, bool snapshot) {
+   char parent_key[KEYSIZE];
+   FreePayload parent_free;
+   NarfSector parent_sector;
+   NarfSector sector;
+   uint8_t parent_height;
+   int cmp;
+
+   memset(&parent_free, 0, sizeof(parent_free));
+   parent_key[0] = 0;
+
+   for (int side = 0; side < 2; side++) {
+      sector = top;
+      parent_sector = END;
+      parent_height = 0;
+
+      for (unsigned depth = 0; sector != END; depth++) {
+         if (depth > NARF_MAX_AVL_DEPTH) return false;
+         if (!valid_catalog_node_sector(sector)) return false;
+         if (!read_node(sector, &node_work0)) return false;
+         if (!valid_catalog_child(node_work0.m_left) ||
+             !valid_catalog_child(node_work0.m_right)) {
+            return false;
+         }
+         if (node_work0.m_left != END &&
+             node_work0.m_left == node_work0.m_right) {
+            return false;
+         }
+         if (node_work0.m_height == 0) return false;
+         if (parent_sector == END) {
+            if (node_work0.m_height > NARF_MAX_AVL_DEPTH + 1) return false;
+         }
+         else if (node_work0.m_height >= parent_height ||
+                  node_work0.m_height + 2 < parent_height) {
+            return false;
+         }
+
+         if (kind == TREE_FREE) {
+            if (snapshot) {
+               if (node_work0.m_free.m_length == 0 ||
+                   node_work0.m_free.m_start < 2 ||
+                   node_work0.m_free.m_start >= root.m_total_sectors ||
+                   node_work0.m_free.m_length >
+                   root.m_total_sectors - node_work0.m_free.m_start) {
+                  return false;
+               }
+            }
+            else if (!valid_free_payload(&node_work0.m_free)) {
+               return false;
+            }
+            if (parent_sector != END) {
+               cmp = free_cmp_values(parent_free.m_length, parent_free.m_start,
+                                     parent_sector, &node_work0, sector);
+               if (side == 0 ? cmp <= 0 : cmp >= 0) return false;
+            }
+            parent_free = node_work0.m_free;
+         }
+         else {
+            if (!node_key_terminated(&node_work0)) return false;
+            if (kind == TREE_SHARED ? !valid_share_node(&node_work0) :
+                kind == TREE_PINNED ? !valid_pin_node(&node_work0) :
+                !valid_data_payload(&node_work0.m_data)) {
+               return false;
+            }
+            if (parent_sector != END) {
+               cmp = strcmp(parent_key, node_work0.m_key);
+               if (side == 0 ? cmp <= 0 : cmp >= 0) return false;
+            }
+            strcpy(parent_key, node_work0.m_key);
+         }
+
+         parent_sector = sector;
+         parent_height = node_work0.m_height;
+         sector = side == 0 ? node_work0.m_left : node_work0.m_right;
+      }
+
+      if (parent_sector != END && parent_height > 2) return false;
+   }
+
+   return true;
+}
+
 //! @brief Validate the mounted root and its authoritative metadata trees.
 static bool validate_mounted_root(NarfSector expected_origin,
                                   NarfSector available_sectors) {
-   NarfSector data_count;
-   NarfSector free_count;
+   NarfSector nodes;
+   bool snapshots = false;
 
    if (!verify()) return false;
    if (root.m_origin != expected_origin) return false;
@@ -2084,13 +3961,64 @@ static bool validate_mounted_root(NarfSector expected_origin,
    if (root.m_bottom > root.m_top) return false;
    if (root.m_count > root.m_total_sectors - root.m_top) return false;
    if (root.m_data_root != END && root.m_data_root == root.m_free_root) return false;
+   if (root.m_shared_root != END &&
+       (root.m_shared_root == root.m_data_root ||
+        root.m_shared_root == root.m_free_root)) {
+      return false;
+   }
+#ifndef NARF_USE_DEDUP
+   // Writing a shared extent in place would change every key sharing it.
+   if (root.m_shared_root != END) return false;
+#endif
+   if (root.m_pinned_root != END &&
+       (root.m_pinned_root == root.m_data_root ||
+        root.m_pinned_root == root.m_free_root ||
+        root.m_pinned_root == root.m_shared_root)) {
+      return false;
+   }
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+      const SnapshotSlot *slot = &root.m_snapshots[i];
 
-   if (!validate_tree(root.m_data_root, false, &data_count)) return false;
-   if (!validate_tree(root.m_free_root, true, &free_count)) return false;
-   if (data_count != root.m_count) return false;
-   (void) free_count;
+      if (slot->m_name[0] == 0) continue;
+      if (slot->m_name[sizeof(slot->m_name) - 1] != 0) return false;
+      if (version_after(slot->m_version, root.m_root_version)) return false;
+      if (!valid_catalog_child(slot->m_data_root) ||
+          !valid_catalog_child(slot->m_free_root) ||
+          !valid_catalog_child(slot->m_shared_root)) {
+         return false;
+      }
+      // Its nodes are never reused, so the spines catch a slot pointing at a
+      // torn or overwritten tree.
+      if (!validate_tree_spines(slot->m_data_root, TREE_DATA, true) ||
+          !validate_tree_spines(slot->m_free_root, TREE_FREE, true) ||
+          !validate_tree_spines(slot->m_shared_root, TREE_SHARED, true)) {
+         return false;
+      }
+      snapshots = true;
+   }
+   // With no snapshot left, nothing may stay pinned.
+   if (!snapshots && root.m_pinned_root != END) return false;
+#ifndef NARF_USE_SNAPSHOTS
+   // Catalog nodes and extents that snapshots read would be reused.
+   if (snapshots) return false;
+#endif
 
-   return true;
+   // A cleanly unmounted root was fully trusted when it was written, and no
+   // later commit has happened.  Check only the spines here and leave complete
+   // validation to narf_fsck().
+   if (root.m_clean_generation == root.m_root_version) {
+      if (root.m_data_root == END && root.m_count != 0) return false;
+      if (!validate_tree_spines(root.m_data_root, TREE_DATA, false)) return false;
+      if (!validate_tree_spines(root.m_shared_root, TREE_SHARED, false)) return false;
+      if (!validate_tree_spines(root.m_pinned_root, TREE_PINNED, false)) return false;
+      return validate_tree_spines(root.m_free_root, TREE_FREE, false);
+   }
+
+   if (!validate_tree(root.m_free_root, TREE_FREE, &nodes)) return false;
+   if (!validate_tree(root.m_shared_root, TREE_SHARED, &nodes)) return false;
+   if (!validate_tree(root.m_pinned_root, TREE_PINNED, &nodes)) return false;
+   if (!validate_tree(root.m_data_root, TREE_DATA, &nodes)) return false;
+   return nodes == root.m_count;
 }
 
 //! @brief Try to mount one root copy and reject roots pointing at torn authoritative nodes.
@@ -2108,11 +4036,15 @@ static bool mount_root_copy(NarfSector start, NarfSector available_sectors,
    }
 
    root_copy = which;
+   root.m_clean_generation = 0;
+#ifdef NARF_USE_SNAPSHOTS
+   // A snapshot deletion may have stopped between its commits.
+   snapshot_reap_pending = root.m_pinned_root != END;
+#endif
 
-   if (!initialize_spare()) {
-      invalidate_mount_state();
-      return false;
-   }
+   // Without a checkpoint the spare list is rebuilt lazily by later
+   // transactions and narf_maintenance_step().
+   if (!load_spare_checkpoint()) spare_rebuild_start();
 
    return true;
 }
@@ -2125,9 +4057,26 @@ static void recycle_retired_after_commit(void) {
    retired_node_count = 0;
    retired_node_overflow = false;
 
-   if (overflow || !spare_initialized) {
-      // The fixed-size list is incomplete, or the disposable cache was damaged.
-      // Rebuild from the newly committed trees rather than leaking sectors.
+   if (!spare_initialized) {
+      // Frames not yet scanned will find these sectors unreachable.  Only the
+      // scanned region needs them linked in, and an incomplete list means the
+      // rebuild must start over from the newly committed trees.
+      if (overflow || !spare_rebuilding) {
+         spare_rebuild_start();
+         return;
+      }
+      for (unsigned i = 0; i < count; i++) {
+         if (!spare_rebuild_note_retired(retired_nodes[i])) {
+            invalidate_spare_cache();
+            return;
+         }
+      }
+      return;
+   }
+
+   if (overflow) {
+      // The fixed-size list is incomplete.  Rebuild from the newly committed
+      // trees rather than leaking sectors.
       if (!initialize_spare()) invalidate_spare_cache();
       return;
    }
@@ -2157,6 +4106,13 @@ static bool commit_user_transaction(void) {
    }
 
    rollback_head = END;
+#ifdef NARF_USE_DISCARD
+   if (root.m_top > original_top) {
+      (void) narf_io_discard(root.m_origin + original_top,
+                             root.m_top - original_top);
+   }
+#endif
+   discard_flush();
 
    if (!contraction_ok) {
       invalidate_spare_cache();
@@ -2302,6 +4258,7 @@ bool narf_mount(int partition) {
    NarfSector size;
    NarfSector device_sectors;
 
+   perf_begin(NARF_PERF_MOUNT);
    invalidate_mount_state();
    if (!narf_io_open()) return false;
    if (partition < 1 || partition > 4) return false;
@@ -2323,6 +4280,7 @@ bool narf_mount(int partition) {
 
 //! @brief Format a NARF filesystem at a sector origin.
 bool narf_mkfs(NarfSector start, NarfSector size) {
+   perf_begin(NARF_PERF_MOUNT);
    if (!narf_io_open()) return false;
    if (size < NARF_MIN_FS_SECTORS) return false;
    if (start > narf_io_sectors()) return false;
@@ -2334,6 +4292,7 @@ bool narf_mkfs(NarfSector start, NarfSector size) {
 bool narf_init(NarfSector start) {
    NarfSector device_sectors;
 
+   perf_begin(NARF_PERF_MOUNT);
    invalidate_mount_state();
    if (!narf_io_open()) return false;
 
@@ -2343,31 +4302,355 @@ bool narf_init(NarfSector start) {
    return mount_range(start, device_sectors - start);
 }
 
-//! @brief Return basic filesystem capacity and key-count statistics.
-bool narf_stat(NarfStat *stats) {
-   NarfSector free_sectors;
+//! @brief Commit a root carrying the spare-list checkpoint and, optionally, the clean mark.
+static bool commit_checkpoint(bool clean) {
+   RootState before;
+   NarfSector tail;
+   NarfSector count;
+   uint32_t check;
+   uint32_t generation;
 
-   if (stats == NULL) return false;
-   if (!verify()) return false;
-   if (root.m_bottom > root.m_top) return false;
+   if (!verify_live()) return false;
+   if (!spare_initialized && !initialize_spare()) return false;
 
-   memset(stats, 0, sizeof(*stats));
+   generation = transaction_root_version();
+   if (!spare_chain_summary(spare_head, generation, &tail, &count, &check) ||
+       tail != spare_tail) {
+      invalidate_spare_cache();
+      return false;
+   }
 
-   free_sectors = root.m_top - root.m_bottom;
-   if (!free_sector_count_rec(root.m_free_root, &free_sectors)) return false;
-   if (free_sectors > root.m_total_sectors) return false;
+   before = root;
+   root.m_spare_head = spare_head;
+   root.m_spare_tail = spare_tail;
+   root.m_spare_count = count;
+   root.m_spare_generation = generation;
+   root.m_spare_check = check;
+   if (clean) root.m_clean_generation = generation;
 
-   stats->total_sectors = root.m_total_sectors;
-   stats->free_sectors = free_sectors;
-   stats->used_sectors = root.m_total_sectors - free_sectors;
-   stats->file_count = root.m_count;
-   stats->max_key_bytes = KEYSIZE - 1;
+   if (!commit_root()) {
+      root = before;
+      return false;
+   }
 
+   clear_spare_checkpoint();
+   root.m_clean_generation = 0;
    return true;
 }
 
+//! @brief Commit a root that lets the next mount skip the spare-list rebuild.
+bool narf_checkpoint(void) {
+   perf_begin(NARF_PERF_MOUNT);
+   return commit_checkpoint(false);
+}
 
-typedef struct {
+//! @brief Checkpoint, mark the root clean, and forget the mounted filesystem.
+bool narf_unmount(void) {
+   perf_begin(NARF_PERF_MOUNT);
+#ifdef NARF_USE_SNAPSHOTS
+   snapshot_unview();
+#endif
+
+   if (!commit_checkpoint(true)) return false;
+   invalidate_mount_state();
+   return true;
+}
+
+//! @brief Perform one bounded slice of deferred background work.
+bool narf_maintenance_step(bool *pending) {
+   perf_begin(NARF_PERF_MAINTENANCE);
+   if (pending == NULL) return false;
+   *pending = false;
+   if (!verify()) return false;
+
+   if (!spare_rebuild_advance(1)) return false;
+   *pending = !spare_initialized;
+
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_reap_pending && !snapshot_viewing) {
+      bool more;
+
+      if (!snapshot_reap_once(&more)) return false;
+      *pending = *pending || more;
+   }
+#endif
+   return true;
+}
+
+//! @brief Select the bitmap used by spare rebuilds and deep fsck.
+bool narf_set_work_memory(void *memory, size_t bytes) {
+   if (memory == NULL || bytes <= sizeof(spare_work_builtin)) {
+      memory = spare_work_builtin;
+      bytes = sizeof(spare_work_builtin);
+   }
+   if (bytes > ((NarfSector) -1) / 8u) bytes = ((NarfSector) -1) / 8u;
+
+   // Frames start where the previous one ended, so a pending rebuild simply
+   // continues with the new frame size.
+   spare_work = memory;
+   spare_frame_sectors = (NarfSector) (bytes * 8u);
+   return true;
+}
+
+//! @brief Return basic filesystem capacity and key-count statistics.
+bool narf_stat(NarfStat *stats) {
+   NarfSector free_root = root.m_free_root;
+   NarfSector free_sectors;
+   NarfSector sector;
+
+   perf_begin(NARF_PERF_STAT);
+   if (stats == NULL) return false;
+   if (!verify()) return false;
+   if (root.m_bottom > root.m_top) return false;
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_viewing) free_root = snapshot_live.m_free_root;
+#endif
+
+   memset(stats, 0, sizeof(*stats));
+
+   free_sectors = root.m_top - root.m_bottom;
+   if (!free_sector_count_rec(free_root, &free_sectors)) return false;
+   if (free_sectors > root.m_total_sectors) return false;
+
+   stats->total_sectors = root.m_total_sectors;
+   stats->free_sectors = free_sectors;
+   stats->used_sectors = root.m_total_sectors - free_sectors;
+   stats->file_count = root.m_count;
+   stats->max_key_bytes = KEYSIZE - 1;
+
+   // The free tree is ordered by length, so its rightmost node is the largest.
+   stats->largest_free = root.m_top - root.m_bottom;
+   for (sector = free_root; sector != END; sector = node_work0.m_right) {
+      if (!read_node(sector, &node_work0)) return false;
+      if (node_work0.m_free.m_length > stats->largest_free) {
+         stats->largest_free = node_work0.m_free.m_length;
+      }
+   }
+
+   return true;
+}
+
+//! @brief Return how the sectors used by keys are held.
+bool narf_usage(NarfUsage *usage) {
+   perf_begin(NARF_PERF_STAT);
+   if (usage == NULL) return false;
+   if (!verify()) return false;
+
+   memset(usage, 0, sizeof(*usage));
+   if (!data_usage_rec(root.m_data_root, usage)) return false;
+   if (!share_usage_rec(root.m_shared_root, usage)) return false;
+#ifdef NARF_USE_SNAPSHOTS
+   if (!pin_usage_rec(root.m_pinned_root, usage)) return false;
+#endif
+   return true;
+}
+
+//! @brief Report the payload sectors one tree's records keep readable.
+//!
+//! A data key needs its valid prefix and tail copy; a shared key is skipped
+//! because its extent is reported once from the shared tree.  Shared and
+//! pinned extents are reported whole.
+static bool live_payload_rec(NarfSector sector, TreeKind kind, unsigned depth,
+                             NarfLiveNext next, void *context) {
+   NarfSector left;
+   NarfSector right;
+   NarfSector start = END;
+   NarfSector count = 0;
+   NarfSector tail = END;
+
+   if (sector == END) return true;
+   if (depth > NARF_MAX_AVL_DEPTH) return false;
+   if (!read_node(sector, &node_work0)) return false;
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+
+   if (kind == TREE_DATA) {
+      if (!node_work0.m_data.m_shared) {
+         start = node_work0.m_data.m_start;
+         count = node_work0.m_data.m_valid;
+         tail = node_work0.m_data.m_tail;
+      }
+   }
+   else if (kind == TREE_SHARED) {
+      start = node_work0.m_share.m_start;
+      count = node_work0.m_share.m_length;
+   }
+   else {
+      start = node_work0.m_pin.m_start;
+      count = node_work0.m_pin.m_length;
+   }
+
+   if (count != 0 && !next(context, NARF_LIVE_PAYLOAD, root.m_origin + start, count)) {
+      return false;
+   }
+   if (tail != END && !next(context, NARF_LIVE_PAYLOAD, root.m_origin + tail, 1)) {
+      return false;
+   }
+   return live_payload_rec(left, kind, depth + 1, next, context) &&
+          live_payload_rec(right, kind, depth + 1, next, context);
+}
+
+//! @brief Report every sector the committed filesystem still reads.
+bool narf_live_extents(NarfLiveNext next, void *context) {
+   NarfSector begin;
+
+   perf_begin(NARF_PERF_STAT);
+   if (next == NULL) return false;
+   if (!verify_live()) return false;
+   if (!spare_initialized && !initialize_spare()) return false;
+
+   if (!next(context, NARF_LIVE_ROOT, root.m_origin, 2)) return false;
+
+   // Deep fsck holds every catalog sector to be reachable from some tree or
+   // on the spare list, which is sorted, so the runs between spares are live.
+   begin = root.m_top;
+   for (NarfSector sector = spare_head; sector != END; sector = node_work0.m_right) {
+      if (!read_spare_record(sector, &node_work0)) return false;
+      if (sector > begin &&
+          !next(context, NARF_LIVE_CATALOG, root.m_origin + begin, sector - begin)) {
+         return false;
+      }
+      begin = sector + 1;
+   }
+   if (begin < root.m_total_sectors &&
+       !next(context, NARF_LIVE_CATALOG, root.m_origin + begin,
+             root.m_total_sectors - begin)) {
+      return false;
+   }
+
+   return live_payload_rec(root.m_data_root, TREE_DATA, 0, next, context) &&
+          live_payload_rec(root.m_shared_root, TREE_SHARED, 0, next, context) &&
+          live_payload_rec(root.m_pinned_root, TREE_PINNED, 0, next, context);
+}
+
+#ifdef NARF_USE_RECORDER
+//! @brief Set the function told about each public call, or NULL for none.
+void narf_set_recorder(NarfRecorder fn, void *context) {
+   recorder = fn;
+   recorder_context = context;
+}
+#endif
+
+#ifdef NARF_USE_PERF_STATS
+static const char *const perf_op_names[NARF_PERF_OPS] = {
+   "mount", "find", "list", "read", "alloc", "realloc", "write", "punch", "free",
+   "rename", "metadata", "compress", "dedup", "snapshot", "stat", "fsck",
+   "defrag", "maintenance",
+};
+
+//! @brief Return the performance counters charged to an operation, or to all.
+bool narf_perf_stats(NarfPerfOp op, NarfPerfStats *stats) {
+   if (stats == NULL || (unsigned) op > NARF_PERF_OPS) return false;
+   if (op != NARF_PERF_OPS) {
+      *stats = perf_stats[op];
+      return true;
+   }
+
+   memset(stats, 0, sizeof(*stats));
+   for (unsigned i = 0; i < NARF_PERF_OPS; i++) {
+      const NarfPerfStats *s = &perf_stats[i];
+
+      stats->calls += s->calls;
+      stats->node_reads += s->node_reads;
+      stats->node_writes += s->node_writes;
+      stats->payload_reads += s->payload_reads;
+      stats->payload_writes += s->payload_writes;
+      stats->root_commits += s->root_commits;
+      stats->rollbacks += s->rollbacks;
+      stats->spare_rebuilds += s->spare_rebuilds;
+      stats->retired_overflows += s->retired_overflows;
+      stats->coalesce_walks += s->coalesce_walks;
+      stats->spare_hits += s->spare_hits;
+      if (s->max_depth > stats->max_depth) stats->max_depth = s->max_depth;
+   }
+   return true;
+}
+
+//! @brief Return a short name for a performance-counter operation.
+const char *narf_perf_op_name(NarfPerfOp op) {
+   if ((unsigned) op >= NARF_PERF_OPS) return NULL;
+   return perf_op_names[op];
+}
+
+//! @brief Zero every performance counter, latency histogram, and trace count.
+void narf_perf_reset(void) {
+   memset(perf_stats, 0, sizeof(perf_stats));
+#ifdef NARF_USE_PERF_TRACE
+   memset(perf_latency, 0, sizeof(perf_latency));
+   perf_call_open = false;
+   perf_trace_total = 0;
+#endif
+}
+
+#ifdef NARF_USE_PERF_TRACE
+//! @brief Set the clock that times calls and sector transfers.
+void narf_perf_set_clock(NarfPerfClock clock) {
+   perf_call_open = false;
+   perf_clock = clock;
+}
+
+//! @brief Return the upper bound of the bucket holding a given rank.
+static uint64_t perf_percentile(const NarfPerfLatency *l, uint32_t permille) {
+   uint64_t rank = ((uint64_t) l->count * permille + 999) / 1000;
+   uint64_t seen = 0;
+
+   if (rank == 0) return 0;
+   for (unsigned b = 0; b < NARF_PERF_BUCKETS; b++) {
+      seen += l->buckets[b];
+      if (seen >= rank) {
+         uint64_t bound = (uint64_t) 1 << b;
+
+         if (b == NARF_PERF_BUCKETS - 1 || bound > l->max) return l->max;
+         return bound;
+      }
+   }
+   return l->max;
+}
+
+//! @brief Return the latency histogram of an operation, or of all of them.
+bool narf_perf_latency(NarfPerfOp op, NarfPerfLatency *latency) {
+   if (latency == NULL || (unsigned) op > NARF_PERF_OPS) return false;
+   perf_call_close();
+   if (op != NARF_PERF_OPS) {
+      *latency = perf_latency[op];
+   }
+   else {
+      memset(latency, 0, sizeof(*latency));
+      for (unsigned i = 0; i < NARF_PERF_OPS; i++) {
+         const NarfPerfLatency *l = &perf_latency[i];
+
+         latency->count += l->count;
+         for (unsigned b = 0; b < NARF_PERF_BUCKETS; b++) {
+            latency->buckets[b] += l->buckets[b];
+         }
+         if (l->max > latency->max) latency->max = l->max;
+      }
+   }
+   latency->p50 = perf_percentile(latency, 500);
+   latency->p99 = perf_percentile(latency, 990);
+   latency->p999 = perf_percentile(latency, 999);
+   return true;
+}
+
+//! @brief Lend the core a ring for the sector trace.
+void narf_perf_set_trace(NarfTraceRecord *ring, size_t entries) {
+   if (ring == NULL || entries == 0) {
+      ring = NULL;
+      entries = 0;
+   }
+   perf_trace = ring;
+   perf_trace_entries = entries;
+   perf_trace_total = 0;
+}
+
+//! @brief Return the number of records traced since the ring was lent.
+uint64_t narf_perf_trace_count(void) {
+   return perf_trace_total;
+}
+#endif
+#endif
+
+typedef struct {
    NarfFsckReport m_report;
    char m_prev_key[KEYSIZE];
    bool m_have_prev_key;
@@ -2375,18 +4658,13 @@ typedef struct {
    NarfSector m_prev_free_sector;
    bool m_have_prev_free;
    uint8_t *m_catalog_marks;
-   size_t m_catalog_mark_count;
+   bool m_catalog_marks_allocated;
+   NarfSector m_catalog_mark_count;
 } FsckContext;
 
 static FsckContext fsck_ctx;
 static bool fsck_deep_checks = false;
 
-enum {
-   FSCK_CATALOG_DATA = 1,
-   FSCK_CATALOG_FREE = 2,
-   FSCK_CATALOG_SPARE = 3
-};
-
 //! @brief Record one fsck error without aborting the whole scan.
 static void fsck_error(void) {
    if (fsck_ctx.m_report.errors != (NarfSector) -1) {
@@ -2411,7 +4689,7 @@ static bool extents_overlap(NarfSector a_start, NarfSector a_len,
 }
 
 //! @brief Validate AVL shape, stored heights, and cheap node invariants.
-static int fsck_tree_shape_rec(NarfSector sector, bool free_tree, unsigned depth,
+static int fsck_tree_shape_rec(NarfSector sector, TreeKind kind, unsigned depth,
                                NarfSector *path) {
    NarfSector left;
    NarfSector right;
@@ -2457,20 +4735,26 @@ static int fsck_tree_shape_rec(NarfSector sector, bool free_tree, unsigned depth
       fsck_error();
       return 0;
    }
-   if (!free_tree && !node_key_terminated(&node_work0)) {
+   if (kind != TREE_FREE && !node_key_terminated(&node_work0)) {
       fsck_error();
       return 0;
    }
 
-   if (free_tree) {
+   if (kind == TREE_FREE) {
       fsck_ctx.m_report.free_nodes++;
    }
+   else if (kind == TREE_SHARED) {
+      fsck_ctx.m_report.shared_nodes++;
+   }
+   else if (kind == TREE_PINNED) {
+      fsck_ctx.m_report.pinned_nodes++;
+   }
    else {
       fsck_ctx.m_report.data_nodes++;
    }
 
-   lh = fsck_tree_shape_rec(left, free_tree, depth + 1, path);
-   rh = fsck_tree_shape_rec(right, free_tree, depth + 1, path);
+   lh = fsck_tree_shape_rec(left, kind, depth + 1, path);
+   rh = fsck_tree_shape_rec(right, kind, depth + 1, path);
    expected = (lh > rh ? lh : rh) + 1;
 
    if (stored_height != (uint8_t) expected) {
@@ -2615,8 +4899,10 @@ static void fsck_scan_data_overlap_rec(NarfSector sector, NarfSector self,
    right = node_work0.m_right;
    dp = node_work0.m_data;
 
-   if (sector != self &&
-       extents_overlap(start, length, dp.m_start, dp.m_length)) {
+   // A shared node's extent is checked once, through its shared-tree node.
+   if (sector != self && !dp.m_shared &&
+       (extents_overlap(start, length, dp.m_start, dp.m_length) ||
+        (dp.m_tail != END && extents_overlap(start, length, dp.m_tail, 1)))) {
       fsck_error();
    }
 
@@ -2624,6 +4910,56 @@ static void fsck_scan_data_overlap_rec(NarfSector sector, NarfSector self,
    fsck_scan_data_overlap_rec(right, self, start, length);
 }
 
+//! @brief Check whether one shared extent overlaps a given payload extent.
+static void fsck_scan_share_overlap_rec(NarfSector sector, NarfSector self,
+                                        NarfSector start, NarfSector length) {
+   NarfSector left;
+   NarfSector right;
+   SharePayload sp;
+
+   if (sector == END) return;
+   if (!read_node(sector, &node_work0)) {
+      fsck_error();
+      return;
+   }
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   sp = node_work0.m_share;
+
+   if (sector != self && extents_overlap(start, length, sp.m_start, sp.m_length)) {
+      fsck_error();
+   }
+
+   fsck_scan_share_overlap_rec(left, self, start, length);
+   fsck_scan_share_overlap_rec(right, self, start, length);
+}
+
+//! @brief Check whether one pinned extent overlaps a given payload extent.
+static void fsck_scan_pin_overlap_rec(NarfSector sector, NarfSector self,
+                                      NarfSector start, NarfSector length) {
+   NarfSector left;
+   NarfSector right;
+   PinPayload pp;
+
+   if (sector == END) return;
+   if (!read_node(sector, &node_work0)) {
+      fsck_error();
+      return;
+   }
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   pp = node_work0.m_pin;
+
+   if (sector != self && extents_overlap(start, length, pp.m_start, pp.m_length)) {
+      fsck_error();
+   }
+
+   fsck_scan_pin_overlap_rec(left, self, start, length);
+   fsck_scan_pin_overlap_rec(right, self, start, length);
+}
+
 //! @brief Check whether one free extent overlaps another free extent.
 static void fsck_scan_free_free_overlap_rec(NarfSector sector, NarfSector self,
                                             NarfSector start, NarfSector length) {
@@ -2650,6 +4986,59 @@ static void fsck_scan_free_free_overlap_rec(NarfSector sector, NarfSector self,
    fsck_scan_free_free_overlap_rec(right, self, start, length);
 }
 
+#ifdef NARF_USE_COMPRESSION
+//! @brief Check every entry of a compressed payload's chunk index.
+//!
+//! The live index and chunk sectors must add up to the recorded m_packed.
+static void fsck_chunk_index(const DataPayload *payload) {
+   NarfSector chunks = chunk_count(payload->m_bytes);
+   NarfSector live = chunk_index_sectors(payload->m_bytes);
+   NarfSector c;
+
+   for (c = 0; c < chunks; c++) {
+      const ChunkEntry *entry = &chunk_index[c % CHUNK_ENTRIES];
+
+      if (c % CHUNK_ENTRIES == 0 && !chunk_read_index(payload, c / CHUNK_ENTRIES)) {
+         fsck_error();
+         return;
+      }
+      if (!chunk_entry_ok(payload, entry, c)) {
+         fsck_error();
+         return;
+      }
+      live += BYTES2SECTORS(entry->m_stored);
+   }
+
+   if (live != payload->m_packed) {
+      fsck_error();
+   }
+}
+
+//! @brief Check the chunk index of every compressed key.
+static void fsck_chunk_indexes_rec(NarfSector sector) {
+   NarfSector left;
+   NarfSector right;
+   DataPayload dp;
+
+   if (sector == END) return;
+   if (!read_node(sector, &node_work0)) {
+      fsck_error();
+      return;
+   }
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   dp = node_work0.m_data;
+
+   if (dp.m_codec == CODEC_LZ && dp.m_length != 0 && valid_data_payload(&dp)) {
+      fsck_chunk_index(&dp);
+   }
+
+   fsck_chunk_indexes_rec(left);
+   fsck_chunk_indexes_rec(right);
+}
+#endif
+
 //! @brief Validate data payload ranges and cross-tree extent overlaps.
 static void fsck_data_extents_rec(NarfSector sector) {
    NarfSector left;
@@ -2669,9 +5058,19 @@ static void fsck_data_extents_rec(NarfSector sector) {
    if (!valid_data_payload(&dp)) {
       fsck_error();
    }
+   else if (dp.m_shared) {
+      char key[SHARE_KEY_BYTES];
+
+      // The extent is counted and scanned with its shared-tree node.
+      share_key(key, dp.m_hash, dp.m_start);
+      if (!data_find_sector_rec(root.m_shared_root, key, NULL, &node_work0) ||
+          node_work0.m_share.m_bytes != dp.m_bytes) {
+         fsck_error();
+      }
+   }
    else if (dp.m_length != 0) {
-      if (fsck_ctx.m_report.payload_sectors <= ((NarfSector) -1) - dp.m_length) {
-         fsck_ctx.m_report.payload_sectors += dp.m_length;
+      if (fsck_ctx.m_report.payload_sectors <= ((NarfSector) -1) - payload_held(&dp)) {
+         fsck_ctx.m_report.payload_sectors += payload_held(&dp);
       }
       else {
          fsck_error();
@@ -2679,6 +5078,14 @@ static void fsck_data_extents_rec(NarfSector sector) {
       if (fsck_deep_checks) {
          fsck_scan_free_overlap_rec(root.m_free_root, dp.m_start, dp.m_length);
          fsck_scan_data_overlap_rec(root.m_data_root, sector, dp.m_start, dp.m_length);
+         fsck_scan_share_overlap_rec(root.m_shared_root, END, dp.m_start, dp.m_length);
+         fsck_scan_pin_overlap_rec(root.m_pinned_root, END, dp.m_start, dp.m_length);
+         if (dp.m_tail != END) {
+            fsck_scan_free_overlap_rec(root.m_free_root, dp.m_tail, 1);
+            fsck_scan_data_overlap_rec(root.m_data_root, sector, dp.m_tail, 1);
+            fsck_scan_share_overlap_rec(root.m_shared_root, END, dp.m_tail, 1);
+            fsck_scan_pin_overlap_rec(root.m_pinned_root, END, dp.m_tail, 1);
+         }
       }
    }
 
@@ -2686,11 +5093,11 @@ static void fsck_data_extents_rec(NarfSector sector) {
    fsck_data_extents_rec(right);
 }
 
-//! @brief Validate free extent ranges and free-free overlaps.
-static void fsck_free_extents_rec(NarfSector sector) {
+//! @brief Validate shared extents and their overlaps with every other extent.
+static void fsck_shared_extents_rec(NarfSector sector) {
    NarfSector left;
    NarfSector right;
-   FreePayload fp;
+   SharePayload sp;
 
    if (sector == END) return;
    if (!read_node(sector, &node_work0)) {
@@ -2700,52 +5107,178 @@ static void fsck_free_extents_rec(NarfSector sector) {
 
    left = node_work0.m_left;
    right = node_work0.m_right;
-   fp = node_work0.m_free;
+   sp = node_work0.m_share;
 
-   if (!valid_free_payload(&fp)) {
+   if (!valid_share_node(&node_work0)) {
       fsck_error();
    }
    else {
+      if (fsck_ctx.m_report.payload_sectors <= ((NarfSector) -1) - sp.m_length) {
+         fsck_ctx.m_report.payload_sectors += sp.m_length;
+      }
+      else {
+         fsck_error();
+      }
       if (fsck_deep_checks) {
-         fsck_scan_free_free_overlap_rec(root.m_free_root, sector, fp.m_start, fp.m_length);
+         fsck_scan_free_overlap_rec(root.m_free_root, sp.m_start, sp.m_length);
+         fsck_scan_data_overlap_rec(root.m_data_root, END, sp.m_start, sp.m_length);
+         fsck_scan_share_overlap_rec(root.m_shared_root, sector, sp.m_start, sp.m_length);
+         fsck_scan_pin_overlap_rec(root.m_pinned_root, END, sp.m_start, sp.m_length);
       }
    }
 
-   fsck_free_extents_rec(left);
-   fsck_free_extents_rec(right);
+   fsck_shared_extents_rec(left);
+   fsck_shared_extents_rec(right);
 }
 
-//! @brief Count and lightly validate the RAM spare-list cache.
-static void fsck_spare_list(void) {
-   NarfSector sector = spare_head;
-   NarfSector previous = END;
-   NarfSector guard = 0;
+//! @brief Validate pinned extents and their overlaps with every other extent.
+//!
+//! One that no snapshot reads any more is still in use until a later commit
+//! of the snapshot deletion frees it.
+static void fsck_pinned_extents_rec(NarfSector sector) {
+   NarfSector left;
+   NarfSector right;
+   PinPayload pp;
 
-   if ((spare_head == END) != (spare_tail == END)) {
+   if (sector == END) return;
+   if (!read_node(sector, &node_work0)) {
       fsck_error();
       return;
    }
 
-   while (sector != END) {
-      fsck_ctx.m_report.spare_nodes++;
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   pp = node_work0.m_pin;
 
-      if (!valid_node_sector(sector) || sector < root.m_top ||
-          sector >= root.m_total_sectors) {
-         fsck_error();
-         return;
+   if (!valid_pin_node(&node_work0)) {
+      fsck_error();
+   }
+   else {
+      if (fsck_ctx.m_report.payload_sectors <= ((NarfSector) -1) - pp.m_length) {
+         fsck_ctx.m_report.payload_sectors += pp.m_length;
       }
-
-      if (!read_spare_record(sector, &node_work0)) {
+      else {
          fsck_error();
-         return;
       }
-      if (node_work0.m_left != previous) {
-         fsck_error();
-         return;
+      if (fsck_deep_checks) {
+         fsck_scan_free_overlap_rec(root.m_free_root, pp.m_start, pp.m_length);
+         fsck_scan_data_overlap_rec(root.m_data_root, END, pp.m_start, pp.m_length);
+         fsck_scan_share_overlap_rec(root.m_shared_root, END, pp.m_start, pp.m_length);
+         fsck_scan_pin_overlap_rec(root.m_pinned_root, sector, pp.m_start, pp.m_length);
       }
-      if (node_work0.m_right != END && node_work0.m_right <= sector) {
-         fsck_error();
-         return;
+   }
+
+   fsck_pinned_extents_rec(left);
+   fsck_pinned_extents_rec(right);
+}
+
+//! @brief Count the data nodes that reference one shared extent.
+static void fsck_count_sharers_rec(NarfSector sector, const SharePayload *sp,
+                                   NarfSector *refs) {
+   NarfSector left;
+   NarfSector right;
+
+   if (sector == END) return;
+   if (!read_node(sector, &node_work0)) {
+      fsck_error();
+      return;
+   }
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   if (node_work0.m_data.m_shared && node_work0.m_data.m_start == sp->m_start &&
+       node_work0.m_data.m_hash == sp->m_hash) {
+      (*refs)++;
+   }
+
+   fsck_count_sharers_rec(left, sp, refs);
+   fsck_count_sharers_rec(right, sp, refs);
+}
+
+//! @brief Require every shared extent's reference count to be exact.
+static void fsck_shared_refs_rec(NarfSector sector) {
+   NarfSector left;
+   NarfSector right;
+   NarfSector refs = 0;
+   SharePayload sp;
+
+   if (sector == END) return;
+   if (!read_node(sector, &node_work0)) {
+      fsck_error();
+      return;
+   }
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   sp = node_work0.m_share;
+
+   fsck_count_sharers_rec(root.m_data_root, &sp, &refs);
+   if (refs != sp.m_refs) fsck_error();
+
+   fsck_shared_refs_rec(left);
+   fsck_shared_refs_rec(right);
+}
+
+//! @brief Validate free extent ranges and free-free overlaps.
+static void fsck_free_extents_rec(NarfSector sector) {
+   NarfSector left;
+   NarfSector right;
+   FreePayload fp;
+
+   if (sector == END) return;
+   if (!read_node(sector, &node_work0)) {
+      fsck_error();
+      return;
+   }
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   fp = node_work0.m_free;
+
+   if (!valid_free_payload(&fp)) {
+      fsck_error();
+   }
+   else {
+      if (fsck_deep_checks) {
+         fsck_scan_free_free_overlap_rec(root.m_free_root, sector, fp.m_start, fp.m_length);
+      }
+   }
+
+   fsck_free_extents_rec(left);
+   fsck_free_extents_rec(right);
+}
+
+//! @brief Count and lightly validate the RAM spare-list cache.
+static void fsck_spare_list(void) {
+   NarfSector sector = spare_head;
+   NarfSector previous = END;
+   NarfSector guard = 0;
+
+   if ((spare_head == END) != (spare_tail == END)) {
+      fsck_error();
+      return;
+   }
+
+   while (sector != END) {
+      fsck_ctx.m_report.spare_nodes++;
+
+      if (!valid_node_sector(sector) || sector < root.m_top ||
+          sector >= root.m_total_sectors) {
+         fsck_error();
+         return;
+      }
+
+      if (!read_spare_record(sector, &node_work0)) {
+         fsck_error();
+         return;
+      }
+      if (node_work0.m_left != previous) {
+         fsck_error();
+         return;
+      }
+      if (node_work0.m_right != END && node_work0.m_right <= sector) {
+         fsck_error();
+         return;
       }
 
       previous = sector;
@@ -2760,28 +5293,33 @@ static void fsck_spare_list(void) {
    if (previous != spare_tail) fsck_error();
 }
 
+//! @brief Mark one catalog sector in the deep-fsck map.
+//! @return false when the sector is outside the catalog or already marked.
+static bool fsck_deep_mark_catalog(NarfSector sector) {
+   NarfSector index;
+   uint8_t bit;
+
+   if (!valid_catalog_node_sector(sector)) return false;
+   index = sector - root.m_top;
+   if (index >= fsck_ctx.m_catalog_mark_count) return false;
+
+   bit = (uint8_t) (1u << (index & 7u));
+   if ((fsck_ctx.m_catalog_marks[index >> 3] & bit) != 0) return false;
+   fsck_ctx.m_catalog_marks[index >> 3] |= bit;
+   return true;
+}
+
+#ifndef NARF_USE_THREADS
 //! @brief Mark one authoritative tree and detect duplicate catalog references.
-static void fsck_deep_mark_tree_rec(NarfSector sector, uint8_t kind) {
+static void fsck_deep_mark_tree_rec(NarfSector sector) {
    NarfSector left;
    NarfSector right;
-   size_t index;
 
    if (sector == END) return;
-   if (!valid_catalog_node_sector(sector)) {
-      fsck_error();
-      return;
-   }
-
-   index = (size_t) (sector - root.m_top);
-   if (index >= fsck_ctx.m_catalog_mark_count) {
-      fsck_error();
-      return;
-   }
-   if (fsck_ctx.m_catalog_marks[index] != 0) {
+   if (!fsck_deep_mark_catalog(sector)) {
       fsck_error();
       return;
    }
-   fsck_ctx.m_catalog_marks[index] = kind;
 
    if (!read_node(sector, &node_work0)) {
       fsck_error();
@@ -2789,10 +5327,12 @@ static void fsck_deep_mark_tree_rec(NarfSector sector, uint8_t kind) {
    }
    left = node_work0.m_left;
    right = node_work0.m_right;
-   fsck_deep_mark_tree_rec(left, kind);
-   fsck_deep_mark_tree_rec(right, kind);
+   fsck_deep_mark_tree_rec(left);
+   fsck_deep_mark_tree_rec(right);
 }
 
+#endif
+
 //! @brief Mark the spare chain and detect cycles or overlap with live trees.
 static void fsck_deep_mark_spares(void) {
    NarfSector sector = spare_head;
@@ -2800,22 +5340,10 @@ static void fsck_deep_mark_spares(void) {
    NarfSector guard = 0;
 
    while (sector != END) {
-      size_t index;
-
-      if (!valid_catalog_node_sector(sector)) {
+      if (!fsck_deep_mark_catalog(sector)) {
          fsck_error();
          return;
       }
-      index = (size_t) (sector - root.m_top);
-      if (index >= fsck_ctx.m_catalog_mark_count) {
-         fsck_error();
-         return;
-      }
-      if (fsck_ctx.m_catalog_marks[index] != 0) {
-         fsck_error();
-         return;
-      }
-      fsck_ctx.m_catalog_marks[index] = FSCK_CATALOG_SPARE;
 
       if (!read_spare_record(sector, &node_work0)) {
          fsck_error();
@@ -2837,33 +5365,132 @@ static void fsck_deep_mark_spares(void) {
    if (previous != spare_tail) fsck_error();
 }
 
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief Mark the catalog nodes only one snapshot tree still reaches.
+//!
+//! A node the live trees or an earlier snapshot share is already marked and
+//! ends the walk.  Payload of the newly marked nodes must not be free.
+static void fsck_deep_mark_snapshot_rec(NarfSector sector, TreeKind kind,
+                                        unsigned depth) {
+   NarfSector left;
+   NarfSector right;
+   NarfSector start = END;
+   NarfSector length = 0;
+   NarfSector tail = END;
+
+   if (sector == END) return;
+   if (depth > NARF_MAX_AVL_DEPTH || !valid_catalog_node_sector(sector)) {
+      fsck_error();
+      return;
+   }
+   if (!fsck_deep_mark_catalog(sector)) return;
+   fsck_ctx.m_report.snapshot_nodes++;
+
+   if (!read_node(sector, &node_work0)) {
+      fsck_error();
+      return;
+   }
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+
+   if (kind == TREE_DATA) {
+      if (!node_key_terminated(&node_work0) ||
+          !valid_data_payload(&node_work0.m_data)) {
+         fsck_error();
+      }
+      else {
+         start = node_work0.m_data.m_start;
+         length = node_work0.m_data.m_length;
+         tail = node_work0.m_data.m_tail;
+      }
+   }
+   else if (kind == TREE_SHARED) {
+      if (!valid_share_node(&node_work0)) {
+         fsck_error();
+      }
+      else {
+         start = node_work0.m_share.m_start;
+         length = node_work0.m_share.m_length;
+      }
+   }
+   else if (node_work0.m_free.m_length == 0 ||
+            node_work0.m_free.m_start < 2 ||
+            node_work0.m_free.m_start >= root.m_total_sectors ||
+            node_work0.m_free.m_length >
+               root.m_total_sectors - node_work0.m_free.m_start) {
+      // A snapshot's free tree is stale: the live volume may have pulled
+      // m_bottom back over its extents since, so only the disk bounds it.
+      fsck_error();
+   }
+
+   if (length != 0) fsck_scan_free_overlap_rec(root.m_free_root, start, length);
+
+   if (tail != END) fsck_scan_free_overlap_rec(root.m_free_root, tail, 1);
+
+   fsck_deep_mark_snapshot_rec(left, kind, depth + 1);
+   fsck_deep_mark_snapshot_rec(right, kind, depth + 1);
+}
+
+//! @brief Mark the trees of every snapshot after the live ones.
+static void fsck_deep_mark_snapshots(void) {
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+      const SnapshotSlot *slot = &root.m_snapshots[i];
+
+      if (slot->m_name[0] == 0) continue;
+      fsck_deep_mark_snapshot_rec(slot->m_data_root, TREE_DATA, 0);
+      fsck_deep_mark_snapshot_rec(slot->m_free_root, TREE_FREE, 0);
+      fsck_deep_mark_snapshot_rec(slot->m_shared_root, TREE_SHARED, 0);
+   }
+}
+#endif
+
+static void fsck_deep_catalog_coverage(void);
+
+#ifndef NARF_USE_THREADS
 //! @brief Perform whole-catalog reference and coverage checks for deep fsck.
 static void fsck_deep_catalog_map(void) {
    NarfSector catalog_sectors;
-   NarfSector accounted;
-   bool missing = false;
+   size_t map_bytes;
 
    catalog_sectors = root.m_total_sectors - root.m_top;
-   fsck_ctx.m_catalog_mark_count = (size_t) catalog_sectors;
-   if ((NarfSector) fsck_ctx.m_catalog_mark_count != catalog_sectors) {
-      fsck_error();
-      return;
-   }
+   map_bytes = ((size_t) catalog_sectors + 7u) / 8u;
+   fsck_ctx.m_catalog_mark_count = catalog_sectors;
 
-   if (fsck_ctx.m_catalog_mark_count != 0) {
-      fsck_ctx.m_catalog_marks = calloc(fsck_ctx.m_catalog_mark_count, 1);
+   // The spare-rebuild bitmap is idle between transactions; use it when it
+   // covers the whole catalog and fall back to the heap otherwise.
+   if (catalog_sectors <= spare_frame_sectors) {
+      fsck_ctx.m_catalog_marks = spare_work;
+      memset(spare_work, 0, map_bytes);
+   }
+   else {
+      fsck_ctx.m_catalog_marks = calloc(map_bytes, 1);
       if (fsck_ctx.m_catalog_marks == NULL) {
          fsck_error();
          return;
       }
+      fsck_ctx.m_catalog_marks_allocated = true;
    }
 
-   fsck_deep_mark_tree_rec(root.m_data_root, FSCK_CATALOG_DATA);
-   fsck_deep_mark_tree_rec(root.m_free_root, FSCK_CATALOG_FREE);
+   fsck_deep_mark_tree_rec(root.m_data_root);
+   fsck_deep_mark_tree_rec(root.m_free_root);
+   fsck_deep_mark_tree_rec(root.m_shared_root);
+   fsck_deep_mark_tree_rec(root.m_pinned_root);
+#ifdef NARF_USE_SNAPSHOTS
+   fsck_deep_mark_snapshots();
+#endif
    fsck_deep_mark_spares();
+   fsck_deep_catalog_coverage();
+}
+#endif
 
-   for (size_t i = 0; i < fsck_ctx.m_catalog_mark_count; i++) {
-      if (fsck_ctx.m_catalog_marks[i] == 0) {
+//! @brief Require every catalog sector to be marked exactly once.
+static void fsck_deep_catalog_coverage(void) {
+   NarfSector catalog_sectors = fsck_ctx.m_catalog_mark_count;
+   NarfSector accounted;
+   bool missing = false;
+
+   for (NarfSector i = 0; i < catalog_sectors; i++) {
+      if ((fsck_ctx.m_catalog_marks[i >> 3] & (uint8_t) (1u << (i & 7u))) == 0) {
          missing = true;
          break;
       }
@@ -2875,6 +5502,21 @@ static void fsck_deep_catalog_map(void) {
       return;
    }
    accounted = fsck_ctx.m_report.data_nodes + fsck_ctx.m_report.free_nodes;
+   if (accounted > ((NarfSector) -1) - fsck_ctx.m_report.shared_nodes) {
+      fsck_error();
+      return;
+   }
+   accounted += fsck_ctx.m_report.shared_nodes;
+   if (accounted > ((NarfSector) -1) - fsck_ctx.m_report.pinned_nodes) {
+      fsck_error();
+      return;
+   }
+   accounted += fsck_ctx.m_report.pinned_nodes;
+   if (accounted > ((NarfSector) -1) - fsck_ctx.m_report.snapshot_nodes) {
+      fsck_error();
+      return;
+   }
+   accounted += fsck_ctx.m_report.snapshot_nodes;
    if (accounted > ((NarfSector) -1) - fsck_ctx.m_report.spare_nodes) {
       fsck_error();
       return;
@@ -2883,7 +5525,8 @@ static void fsck_deep_catalog_map(void) {
    if (accounted != catalog_sectors) fsck_error();
 }
 
-//! @brief Ensure the payload region is covered exactly by data and free extents.
+//! @brief Ensure the payload region is covered exactly by data, shared,
+//! pinned and free extents.
 static void fsck_deep_payload_accounting(void) {
    NarfSector gap;
    NarfSector explicit_free;
@@ -2905,389 +5548,2417 @@ static void fsck_deep_payload_accounting(void) {
    if (accounted != payload_span) fsck_error();
 }
 
-//! @brief Validate the mounted filesystem and return a small consistency report.
-static bool narf_fsck_impl(NarfFsckReport *report, bool deep_checks) {
-   NarfSector data_path[NARF_MAX_AVL_DEPTH + 1];
-   NarfSector free_path[NARF_MAX_AVL_DEPTH + 1];
-
-   memset(&fsck_ctx, 0, sizeof(fsck_ctx));
-   fsck_deep_checks = deep_checks;
-
-   if (!verify()) {
-      fsck_error();
-   }
-   else {
-      if (root.m_total_sectors < NARF_MIN_FS_SECTORS) fsck_error();
-      if (root.m_bottom < 2) fsck_error();
-      if (root.m_top > root.m_total_sectors) fsck_error();
-      if (root.m_bottom > root.m_top) fsck_error();
-      if (root.m_top <= root.m_total_sectors &&
-          root.m_count > root.m_total_sectors - root.m_top) fsck_error();
-      if (root.m_data_root != END && root.m_data_root == root.m_free_root) fsck_error();
-      if (root.m_bottom <= root.m_top) {
-         fsck_ctx.m_report.free_sectors = root.m_top - root.m_bottom;
-      }
-
-      NarfSector shape_errors = fsck_ctx.m_report.errors;
+#ifdef NARF_USE_THREADS
+// Host deep fsck.  The live trees are frozen while narf_fsck_deep() runs, so
+// they are cut into subtrees near the roots and NARF_FSCK_THREADS workers walk
+// them with private node buffers.  Workers mark catalog sectors in the packed
+// bitmap with atomic ORs and collect payload extents; the extents are then
+// sorted by start and swept once, replacing the per-extent tree scans.
 
-      (void) fsck_tree_shape_rec(root.m_data_root, false, 0, data_path);
-      (void) fsck_tree_shape_rec(root.m_free_root, true, 0, free_path);
+#define FSCK_MAX_TASKS (NARF_FSCK_THREADS * 16)
 
-      if (fsck_ctx.m_report.errors == shape_errors) {
-         fsck_ctx.m_have_prev_key = false;
-         fsck_data_order_rec(root.m_data_root);
+typedef struct {
+   NarfSector m_start;
+   NarfSector m_length;
+   bool m_free;
+} FsckExtent;
 
-         fsck_ctx.m_have_prev_free = false;
-         fsck_free_order_rec(root.m_free_root);
+typedef struct {
+   NarfSector m_sector;
+   unsigned m_depth;
+   TreeKind m_kind;
+} FsckTask;
 
-         fsck_data_extents_rec(root.m_data_root);
-         fsck_free_extents_rec(root.m_free_root);
+typedef struct {
+   Node m_node;
+   FsckExtent *m_extents;
+   size_t m_extent_count;
+   size_t m_extent_capacity;
+   NarfSector m_map_errors;
+   NarfSector m_errors;
+   uint32_t m_node_reads;
+   uint8_t m_max_depth;
+} FsckWorker;
 
-         if (deep_checks && !spare_initialized && !initialize_spare()) {
-            fsck_error();
-         }
-         if (spare_initialized) {
-            fsck_spare_list();
-         }
+typedef struct {
+   pthread_mutex_t m_lock;
+   FsckTask m_tasks[FSCK_MAX_TASKS];
+   unsigned m_task_count;
+   unsigned m_next_task;
+} FsckQueue;
 
-         if (deep_checks && fsck_ctx.m_report.errors == shape_errors) {
-            fsck_deep_catalog_map();
-            fsck_deep_payload_accounting();
-         }
-      }
+static FsckQueue fsck_queue;
 
-      fsck_ctx.m_report.file_count = root.m_count;
-      if (root.m_count != fsck_ctx.m_report.data_nodes) {
-         fsck_error();
-      }
+//! @brief Add a worker's error tally to the shared report.
+static void fsck_add_errors(NarfSector errors) {
+   if (errors > ((NarfSector) -1) - fsck_ctx.m_report.errors) {
+      fsck_ctx.m_report.errors = (NarfSector) -1;
    }
-
-   if (report != NULL) {
-      *report = fsck_ctx.m_report;
+   else {
+      fsck_ctx.m_report.errors += errors;
    }
-
-   free(fsck_ctx.m_catalog_marks);
-   fsck_ctx.m_catalog_marks = NULL;
-   fsck_ctx.m_catalog_mark_count = 0;
-   fsck_deep_checks = false;
-   return fsck_ctx.m_report.errors == 0;
 }
 
-//! @brief Validate the mounted filesystem without quadratic overlap scans.
-bool narf_fsck(NarfFsckReport *report) {
-   return narf_fsck_impl(report, false);
+//! @brief Count one error against a worker.
+static void fsck_worker_error(NarfSector *errors) {
+   if (*errors != (NarfSector) -1) (*errors)++;
 }
 
-//! @brief Validate the mounted filesystem with full overlap scans.
-bool narf_fsck_deep(NarfFsckReport *report) {
-   return narf_fsck_impl(report, true);
-}
+//! @brief Append one payload extent to a worker's list.
+static void fsck_worker_extent(FsckWorker *w, NarfSector start,
+                               NarfSector length, bool free_extent) {
+   if (w->m_extent_count == w->m_extent_capacity) {
+      size_t capacity = w->m_extent_capacity ? w->m_extent_capacity * 2 : 256;
+      FsckExtent *grown = realloc(w->m_extents, capacity * sizeof(*grown));
 
-//! @brief Return whether a key exists in the data tree.
-bool narf_find(const char *key) {
-   return valid_key(key) && verify() && data_find_sector_rec(root.m_data_root, key, NULL, NULL);
+      if (grown == NULL) {
+         fsck_worker_error(&w->m_errors);
+         return;
+      }
+      w->m_extents = grown;
+      w->m_extent_capacity = capacity;
+   }
+
+   w->m_extents[w->m_extent_count].m_start = start;
+   w->m_extents[w->m_extent_count].m_length = length;
+   w->m_extents[w->m_extent_count].m_free = free_extent;
+   w->m_extent_count++;
 }
 
-//! @brief Return the directory prefix after an optional leading separator.
-static const char *dir_prefix(const char *dirname, const char *sep) {
-   size_t sep_len = strlen(sep);
+//! @brief Mark and read one node, collecting its extent and children.
+//! @return false when the walk must not descend below this node.
+static bool fsck_worker_visit(FsckWorker *w, NarfSector sector, TreeKind kind,
+                              unsigned depth, NarfSector *left,
+                              NarfSector *right) {
+   NarfSector index;
+   uint8_t bit;
 
-   if (sep_len != 0 && !strncmp(dirname, sep, sep_len)) {
+   if (depth > NARF_MAX_AVL_DEPTH || !valid_catalog_node_sector(sector)) {
+      fsck_worker_error(&w->m_map_errors);
+      return false;
+   }
+   index = sector - root.m_top;
+   if (index >= fsck_ctx.m_catalog_mark_count) {
+      fsck_worker_error(&w->m_map_errors);
+      return false;
+   }
+   bit = (uint8_t) (1u << (index & 7u));
+   if ((__atomic_fetch_or(&fsck_ctx.m_catalog_marks[index >> 3], bit,
+                          __ATOMIC_RELAXED) & bit) != 0) {
+      fsck_worker_error(&w->m_map_errors);
+      return false;
+   }
+
+   // The perf counters and trace are not shared between threads, so the
+   // worker counts its own reads for the caller to add after the join.
+   if (!narf_io_read(root.m_origin + sector, &w->m_node)) {
+      fsck_worker_error(&w->m_map_errors);
+      return false;
+   }
+   w->m_node_reads++;
+   if (w->m_node.m_checksum != node_checksum(&w->m_node)) {
+      fsck_worker_error(&w->m_map_errors);
+      return false;
+   }
+   if (w->m_node.m_height > w->m_max_depth) w->m_max_depth = w->m_node.m_height;
+   *left = w->m_node.m_left;
+   *right = w->m_node.m_right;
+
+   if (kind == TREE_FREE) {
+      if (valid_free_payload(&w->m_node.m_free)) {
+         fsck_worker_extent(w, w->m_node.m_free.m_start,
+                            w->m_node.m_free.m_length, true);
+      }
+   }
+   else if (kind == TREE_SHARED) {
+      if (valid_share_node(&w->m_node)) {
+         fsck_worker_extent(w, w->m_node.m_share.m_start,
+                            w->m_node.m_share.m_length, false);
+      }
+   }
+   else if (kind == TREE_PINNED) {
+      if (valid_pin_node(&w->m_node)) {
+         fsck_worker_extent(w, w->m_node.m_pin.m_start,
+                            w->m_node.m_pin.m_length, false);
+      }
+   }
+   else if (valid_data_payload(&w->m_node.m_data) &&
+            w->m_node.m_data.m_length != 0 && !w->m_node.m_data.m_shared) {
+      fsck_worker_extent(w, w->m_node.m_data.m_start,
+                         w->m_node.m_data.m_length, false);
+      if (w->m_node.m_data.m_tail != END) {
+         fsck_worker_extent(w, w->m_node.m_data.m_tail, 1, false);
+      }
+   }
+   return true;
+}
+
+//! @brief Walk one subtree for a worker.
+static void fsck_worker_walk_rec(FsckWorker *w, NarfSector sector,
+                                 TreeKind kind, unsigned depth) {
+   NarfSector left;
+   NarfSector right;
+
+   if (sector == END) return;
+   if (!fsck_worker_visit(w, sector, kind, depth, &left, &right)) return;
+
+   fsck_worker_walk_rec(w, left, kind, depth + 1);
+   fsck_worker_walk_rec(w, right, kind, depth + 1);
+}
+
+//! @brief Worker thread body: walk queued subtrees until none remain.
+static void *fsck_worker_main(void *context) {
+   FsckWorker *w = context;
+
+   for (;;) {
+      FsckTask task;
+
+      pthread_mutex_lock(&fsck_queue.m_lock);
+      if (fsck_queue.m_next_task == fsck_queue.m_task_count) {
+         pthread_mutex_unlock(&fsck_queue.m_lock);
+         return NULL;
+      }
+      task = fsck_queue.m_tasks[fsck_queue.m_next_task++];
+      pthread_mutex_unlock(&fsck_queue.m_lock);
+
+      fsck_worker_walk_rec(w, task.m_sector, task.m_kind, task.m_depth);
+   }
+}
+
+//! @brief Split the trees into independent subtrees for the workers.
+//!
+//! Nodes above the cut are visited here, breadth first, by the first worker.
+static void fsck_split_trees(FsckWorker *w) {
+   NarfSector left;
+   NarfSector right;
+   unsigned head = 0;
+
+   fsck_queue.m_task_count = 0;
+   if (root.m_data_root != END) {
+      fsck_queue.m_tasks[fsck_queue.m_task_count++] =
+         (FsckTask) { root.m_data_root, 0, TREE_DATA };
+   }
+   if (root.m_free_root != END) {
+      fsck_queue.m_tasks[fsck_queue.m_task_count++] =
+         (FsckTask) { root.m_free_root, 0, TREE_FREE };
+   }
+   if (root.m_shared_root != END) {
+      fsck_queue.m_tasks[fsck_queue.m_task_count++] =
+         (FsckTask) { root.m_shared_root, 0, TREE_SHARED };
+   }
+   if (root.m_pinned_root != END) {
+      fsck_queue.m_tasks[fsck_queue.m_task_count++] =
+         (FsckTask) { root.m_pinned_root, 0, TREE_PINNED };
+   }
+
+   while (head < fsck_queue.m_task_count &&
+          fsck_queue.m_task_count - head < NARF_FSCK_THREADS * 4 &&
+          fsck_queue.m_task_count + 2 <= FSCK_MAX_TASKS) {
+      FsckTask task = fsck_queue.m_tasks[head++];
+
+      if (!fsck_worker_visit(w, task.m_sector, task.m_kind, task.m_depth,
+                             &left, &right)) {
+         continue;
+      }
+      if (left != END) {
+         fsck_queue.m_tasks[fsck_queue.m_task_count++] =
+            (FsckTask) { left, task.m_depth + 1, task.m_kind };
+      }
+      if (right != END) {
+         fsck_queue.m_tasks[fsck_queue.m_task_count++] =
+            (FsckTask) { right, task.m_depth + 1, task.m_kind };
+      }
+   }
+   fsck_queue.m_next_task = head;
+}
+
+//! @brief Order extents by start sector for the overlap sweep.
+static int fsck_extent_cmp(const void *a, const void *b) {
+   const FsckExtent *x = a;
+   const FsckExtent *y = b;
+
+   if (x->m_start < y->m_start) return -1;
+   if (x->m_start > y->m_start) return 1;
+   return 0;
+}
+
+//! @brief Count overlapping extent pairs with one sort and sweep.
+//!
+//! Matches the tree scans: a pair of data or of free extents is found from
+//! both sides and counts twice, a data/free pair counts once.
+static void fsck_sweep_overlaps(FsckExtent *extents, size_t count) {
+   size_t *active;
+   size_t active_count = 0;
+
+   if (count < 2) return;
+   qsort(extents, count, sizeof(*extents), fsck_extent_cmp);
+
+   active = malloc(count * sizeof(*active));
+   if (active == NULL) {
+      fsck_error();
+      return;
+   }
+
+   for (size_t i = 0; i < count; i++) {
+      uint64_t start = extents[i].m_start;
+      size_t kept = 0;
+
+      for (size_t j = 0; j < active_count; j++) {
+         const FsckExtent *other = &extents[active[j]];
+
+         if ((uint64_t) other->m_start + other->m_length <= start) continue;
+         active[kept++] = active[j];
+         fsck_error();
+         if (other->m_free == extents[i].m_free) fsck_error();
+      }
+      active_count = kept;
+      active[active_count++] = i;
+   }
+
+   free(active);
+}
+
+//! @brief Run the deep catalog-map and overlap checks with worker threads.
+//!
+//! @param shape_errors Error count after the tree shape checks; the catalog
+//! map is judged only if nothing has been found since.
+static void fsck_deep_threaded(NarfSector shape_errors) {
+   FsckWorker *workers;
+   pthread_t threads[NARF_FSCK_THREADS - 1];
+   bool started[NARF_FSCK_THREADS - 1];
+   NarfSector catalog_sectors;
+   NarfSector map_errors = 0;
+   size_t map_bytes;
+   size_t extent_count = 0;
+   FsckExtent *extents = NULL;
+
+   workers = calloc(NARF_FSCK_THREADS, sizeof(*workers));
+   if (workers == NULL) {
+      fsck_error();
+      return;
+   }
+
+   catalog_sectors = root.m_total_sectors - root.m_top;
+   map_bytes = ((size_t) catalog_sectors + 7u) / 8u;
+   fsck_ctx.m_catalog_mark_count = catalog_sectors;
+   if (catalog_sectors <= spare_frame_sectors) {
+      fsck_ctx.m_catalog_marks = spare_work;
+      memset(spare_work, 0, map_bytes);
+   }
+   else {
+      fsck_ctx.m_catalog_marks = calloc(map_bytes, 1);
+      if (fsck_ctx.m_catalog_marks == NULL) {
+         free(workers);
+         fsck_error();
+         return;
+      }
+      fsck_ctx.m_catalog_marks_allocated = true;
+   }
+
+   pthread_mutex_init(&fsck_queue.m_lock, NULL);
+   fsck_split_trees(&workers[0]);
+
+   // The calling thread is the first worker; if no thread can be started it
+   // simply walks every subtree itself.
+   for (unsigned i = 0; i < NARF_FSCK_THREADS - 1; i++) {
+      started[i] = pthread_create(&threads[i], NULL, fsck_worker_main,
+                                  &workers[i + 1]) == 0;
+   }
+   fsck_worker_main(&workers[0]);
+   for (unsigned i = 0; i < NARF_FSCK_THREADS - 1; i++) {
+      if (started[i]) pthread_join(threads[i], NULL);
+   }
+   pthread_mutex_destroy(&fsck_queue.m_lock);
+
+   for (unsigned i = 0; i < NARF_FSCK_THREADS; i++) {
+      FsckWorker *w = &workers[i];
+
+      fsck_add_errors(w->m_errors);
+      if (map_errors <= ((NarfSector) -1) - w->m_map_errors) {
+         map_errors += w->m_map_errors;
+      }
+#ifdef NARF_USE_PERF_STATS
+      perf_stats[perf_op].node_reads += w->m_node_reads;
+#endif
+      perf_depth(w->m_max_depth);
+      if (w->m_extent_count == 0) continue;
+      if (extents == NULL) {
+         extents = w->m_extents;
+         extent_count = w->m_extent_count;
+         w->m_extents = NULL;
+         continue;
+      }
+      FsckExtent *grown = realloc(extents, (extent_count + w->m_extent_count) *
+                                           sizeof(*extents));
+      if (grown == NULL) {
+         fsck_error();
+         continue;
+      }
+      extents = grown;
+      memcpy(extents + extent_count, w->m_extents,
+             w->m_extent_count * sizeof(*extents));
+      extent_count += w->m_extent_count;
+   }
+
+   fsck_sweep_overlaps(extents, extent_count);
+   free(extents);
+   for (unsigned i = 0; i < NARF_FSCK_THREADS; i++) free(workers[i].m_extents);
+   free(workers);
+
+   // The catalog map is judged only once everything else, overlaps included,
+   // is clean, as in the single-threaded check.
+   if (fsck_ctx.m_report.errors == shape_errors) {
+      fsck_add_errors(map_errors);
+#ifdef NARF_USE_SNAPSHOTS
+      // Snapshot trees share subtrees with the live ones, so they are marked
+      // here, after the workers, rather than split among them.
+      fsck_deep_mark_snapshots();
+#endif
+      fsck_deep_mark_spares();
+      fsck_deep_catalog_coverage();
+      fsck_deep_payload_accounting();
+   }
+}
+#endif
+
+//! @brief Validate the mounted filesystem and return a small consistency report.
+static bool narf_fsck_impl(NarfFsckReport *report, bool deep_checks) {
+   NarfSector data_path[NARF_MAX_AVL_DEPTH + 1];
+   NarfSector free_path[NARF_MAX_AVL_DEPTH + 1];
+   NarfSector shared_path[NARF_MAX_AVL_DEPTH + 1];
+   NarfSector pinned_path[NARF_MAX_AVL_DEPTH + 1];
+
+   perf_begin(NARF_PERF_FSCK);
+   memset(&fsck_ctx, 0, sizeof(fsck_ctx));
+#ifdef NARF_USE_THREADS
+   // fsck_deep_threaded() replaces the per-extent overlap scans.
+   fsck_deep_checks = false;
+#else
+   fsck_deep_checks = deep_checks;
+#endif
+
+   if (!verify_live()) {
+      fsck_error();
+   }
+   else {
+      // Finishing a pending spare rebuild may raise m_top over spares at the
+      // catalog frontier, so it runs before anything reads the root.
+      if (deep_checks && !spare_initialized && !initialize_spare()) {
+         fsck_error();
+      }
+      if (root.m_total_sectors < NARF_MIN_FS_SECTORS) fsck_error();
+      if (root.m_bottom < 2) fsck_error();
+      if (root.m_top > root.m_total_sectors) fsck_error();
+      if (root.m_bottom > root.m_top) fsck_error();
+      if (root.m_top <= root.m_total_sectors &&
+          root.m_count > root.m_total_sectors - root.m_top) fsck_error();
+      if (root.m_data_root != END && root.m_data_root == root.m_free_root) fsck_error();
+      if (root.m_shared_root != END &&
+          (root.m_shared_root == root.m_data_root ||
+           root.m_shared_root == root.m_free_root)) {
+         fsck_error();
+      }
+      if (root.m_pinned_root != END &&
+          (root.m_pinned_root == root.m_data_root ||
+           root.m_pinned_root == root.m_free_root ||
+           root.m_pinned_root == root.m_shared_root)) {
+         fsck_error();
+      }
+      if (root.m_bottom <= root.m_top) {
+         fsck_ctx.m_report.free_sectors = root.m_top - root.m_bottom;
+      }
+
+      NarfSector shape_errors = fsck_ctx.m_report.errors;
+
+      (void) fsck_tree_shape_rec(root.m_data_root, TREE_DATA, 0, data_path);
+      (void) fsck_tree_shape_rec(root.m_free_root, TREE_FREE, 0, free_path);
+      (void) fsck_tree_shape_rec(root.m_shared_root, TREE_SHARED, 0, shared_path);
+      (void) fsck_tree_shape_rec(root.m_pinned_root, TREE_PINNED, 0, pinned_path);
+
+      if (fsck_ctx.m_report.errors == shape_errors) {
+         fsck_ctx.m_have_prev_key = false;
+         fsck_data_order_rec(root.m_data_root);
+
+         fsck_ctx.m_have_prev_key = false;
+         fsck_data_order_rec(root.m_shared_root);
+
+         fsck_ctx.m_have_prev_key = false;
+         fsck_data_order_rec(root.m_pinned_root);
+
+         fsck_ctx.m_have_prev_free = false;
+         fsck_free_order_rec(root.m_free_root);
+
+         fsck_data_extents_rec(root.m_data_root);
+         fsck_free_extents_rec(root.m_free_root);
+         fsck_shared_extents_rec(root.m_shared_root);
+         fsck_pinned_extents_rec(root.m_pinned_root);
+
+         if (spare_initialized) {
+            fsck_spare_list();
+         }
+
+#ifdef NARF_USE_COMPRESSION
+         if (deep_checks) {
+            fsck_chunk_indexes_rec(root.m_data_root);
+         }
+#endif
+         if (deep_checks) {
+            fsck_shared_refs_rec(root.m_shared_root);
+         }
+
+#ifdef NARF_USE_THREADS
+         // The overlap sweep runs whatever was found so far, as the
+         // per-extent scans do in the single-threaded build.
+         if (deep_checks) {
+            fsck_deep_threaded(shape_errors);
+         }
+#else
+         if (deep_checks && fsck_ctx.m_report.errors == shape_errors) {
+            fsck_deep_catalog_map();
+            fsck_deep_payload_accounting();
+         }
+#endif
+      }
+
+      fsck_ctx.m_report.file_count = root.m_count;
+      if (root.m_count != fsck_ctx.m_report.data_nodes) {
+         fsck_error();
+      }
+   }
+
+   if (report != NULL) {
+      *report = fsck_ctx.m_report;
+   }
+
+   if (fsck_ctx.m_catalog_marks_allocated) free(fsck_ctx.m_catalog_marks);
+   fsck_ctx.m_catalog_marks = NULL;
+   fsck_ctx.m_catalog_marks_allocated = false;
+   fsck_ctx.m_catalog_mark_count = 0;
+   fsck_deep_checks = false;
+   return fsck_ctx.m_report.errors == 0;
+}
+
+//! @brief Validate the mounted filesystem without quadratic overlap scans.
+bool narf_fsck(NarfFsckReport *report) {
+   return narf_fsck_impl(report, false);
+}
+
+//! @brief Validate the mounted filesystem with full overlap scans.
+bool narf_fsck_deep(NarfFsckReport *report) {
+   return narf_fsck_impl(report, true);
+}
+
+// Online fsck.  One tree node is entered or left per loop iteration, with an
+// explicit stack instead of recursion, so a step stops after any number of
+// sector reads.  The walk is pinned to the root version it started from and
+// starts over whenever a commit has replaced that root.
+//
+// A node is read once, on entry, and its payload is accounted then.  Only its
+// in-order position has to wait for its left subtree; free-tree nodes keep
+// what that check needs in their frame, and a key node is read again for its
+// key only when it has a left subtree, since a frame cannot hold a key.
+typedef struct {
+   NarfSector m_sector;
+   NarfSector m_right;
+   FreePayload m_free;
+   uint8_t m_stage;
+   uint8_t m_height;
+   uint8_t m_left_height;
+} FsckFrame;
+
+typedef struct {
+   NarfFsckReport m_report;
+   FsckFrame m_stack[NARF_MAX_AVL_DEPTH + 1];
+   unsigned m_depth;
+   uint8_t m_child_height;
+   TreeKind m_kind;
+   bool m_active;
+   bool m_done;
+   uint32_t m_version;
+   NarfSector m_data_root;
+   NarfSector m_free_root;
+   NarfSector m_shared_root;
+   NarfSector m_pinned_root;
+   char m_prev_key[KEYSIZE];
+   bool m_have_prev_key;
+   FreePayload m_prev_free;
+   NarfSector m_prev_free_sector;
+   bool m_have_prev_free;
+} FsckOnline;
+
+static FsckOnline fsck_online;
+
+//! @brief Record one online-fsck error.
+static void fsck_online_error(void) {
+   if (fsck_online.m_report.errors != (NarfSector) -1) {
+      fsck_online.m_report.errors++;
+   }
+}
+
+//! @brief Start the online walk over from the current committed root.
+static void fsck_online_restart(void) {
+   memset(&fsck_online.m_report, 0, sizeof(fsck_online.m_report));
+   fsck_online.m_depth = 0;
+   fsck_online.m_child_height = 0;
+   fsck_online.m_kind = TREE_DATA;
+   fsck_online.m_done = false;
+   fsck_online.m_version = root.m_root_version;
+   fsck_online.m_data_root = root.m_data_root;
+   fsck_online.m_free_root = root.m_free_root;
+   fsck_online.m_shared_root = root.m_shared_root;
+   fsck_online.m_pinned_root = root.m_pinned_root;
+   fsck_online.m_have_prev_key = false;
+   fsck_online.m_have_prev_free = false;
+
+   if (root.m_total_sectors < NARF_MIN_FS_SECTORS) fsck_online_error();
+   if (root.m_bottom < 2) fsck_online_error();
+   if (root.m_top > root.m_total_sectors) fsck_online_error();
+   if (root.m_bottom > root.m_top) fsck_online_error();
+   if (root.m_top <= root.m_total_sectors &&
+       root.m_count > root.m_total_sectors - root.m_top) fsck_online_error();
+   if (root.m_data_root != END && root.m_data_root == root.m_free_root) {
+      fsck_online_error();
+   }
+   if (root.m_shared_root != END &&
+       (root.m_shared_root == root.m_data_root ||
+        root.m_shared_root == root.m_free_root)) {
+      fsck_online_error();
+   }
+   if (root.m_pinned_root != END &&
+       (root.m_pinned_root == root.m_data_root ||
+        root.m_pinned_root == root.m_free_root ||
+        root.m_pinned_root == root.m_shared_root)) {
+      fsck_online_error();
+   }
+   if (root.m_bottom <= root.m_top) {
+      fsck_online.m_report.free_sectors = root.m_top - root.m_bottom;
+   }
+}
+
+//! @brief Push a child frame, or report an empty subtree's height.
+static void fsck_online_push(NarfSector sector) {
+   FsckFrame *frame;
+
+   fsck_online.m_child_height = 0;
+   if (sector == END) return;
+
+   if (fsck_online.m_depth > NARF_MAX_AVL_DEPTH ||
+       !valid_catalog_node_sector(sector)) {
+      fsck_online_error();
+      return;
+   }
+   for (unsigned i = 0; i < fsck_online.m_depth; i++) {
+      if (fsck_online.m_stack[i].m_sector == sector) {
+         fsck_online_error();
+         return;
+      }
+   }
+
+   frame = &fsck_online.m_stack[fsck_online.m_depth++];
+   frame->m_sector = sector;
+   frame->m_stage = 0;
+}
+
+//! @brief Account a node's payload, which does not depend on its position.
+static void fsck_online_payload(const Node *node) {
+   if (fsck_online.m_kind == TREE_FREE) {
+      FreePayload fp = node->m_free;
+
+      if (!valid_free_payload(&fp)) {
+         fsck_online_error();
+      }
+      else {
+         fsck_online.m_report.free_extents++;
+         if (fsck_online.m_report.free_sectors <= ((NarfSector) -1) - fp.m_length) {
+            fsck_online.m_report.free_sectors += fp.m_length;
+         }
+         else {
+            fsck_online_error();
+         }
+      }
+   }
+   else {
+      const DataPayload *dp = &node->m_data;
+      NarfSector held;
+
+      // A shared extent is counted once, at its shared-tree node.
+      if (fsck_online.m_kind == TREE_SHARED) {
+         held = valid_share_node(node) ? node->m_share.m_length : 0;
+         if (held == 0) fsck_online_error();
+      }
+      else if (fsck_online.m_kind == TREE_PINNED) {
+         held = valid_pin_node(node) ? node->m_pin.m_length : 0;
+         if (held == 0) fsck_online_error();
+      }
+      else if (!valid_data_payload(dp)) {
+         held = 0;
+         fsck_online_error();
+      }
+      else {
+         held = dp->m_shared ? 0 : payload_held(dp);
+      }
+      if (fsck_online.m_report.payload_sectors <= ((NarfSector) -1) - held) {
+         fsck_online.m_report.payload_sectors += held;
+      }
+      else {
+         fsck_online_error();
+      }
+   }
+}
+
+//! @brief Check that a node follows the previous one in its tree's order.
+//!
+//! @param frame The node's frame.
+//! @param key The node's key; ignored for free-tree nodes.
+static void fsck_online_order(const FsckFrame *frame, const char *key) {
+   if (fsck_online.m_kind == TREE_FREE) {
+      const FreePayload *prev = &fsck_online.m_prev_free;
+      const FreePayload *fp = &frame->m_free;
+
+      if (fsck_online.m_have_prev_free &&
+          (prev->m_length > fp->m_length ||
+           (prev->m_length == fp->m_length &&
+            (prev->m_start > fp->m_start ||
+             (prev->m_start == fp->m_start &&
+              fsck_online.m_prev_free_sector >= frame->m_sector))))) {
+         fsck_online_error();
+      }
+      fsck_online.m_prev_free = *fp;
+      fsck_online.m_prev_free_sector = frame->m_sector;
+      fsck_online.m_have_prev_free = true;
+   }
+   else {
+      if (fsck_online.m_have_prev_key && strcmp(fsck_online.m_prev_key, key) >= 0) {
+         fsck_online_error();
+      }
+      strcpy(fsck_online.m_prev_key, key);
+      fsck_online.m_have_prev_key = true;
+   }
+}
+
+//! @brief Read a node on first entry, check it, and account its payload.
+//!
+//! A node without a left subtree is visited at once.
+static void fsck_online_enter(FsckFrame *frame) {
+   if (!read_node(frame->m_sector, &node_work0) ||
+       !valid_catalog_child(node_work0.m_left) ||
+       !valid_catalog_child(node_work0.m_right) ||
+       (node_work0.m_left != END && node_work0.m_left == node_work0.m_right) ||
+       (fsck_online.m_kind != TREE_FREE && !node_key_terminated(&node_work0))) {
+      fsck_online_error();
+      fsck_online.m_depth--;
+      fsck_online.m_child_height = 0;
+      return;
+   }
+
+   if (fsck_online.m_kind == TREE_FREE) {
+      fsck_online.m_report.free_nodes++;
+   }
+   else if (fsck_online.m_kind == TREE_SHARED) {
+      fsck_online.m_report.shared_nodes++;
+   }
+   else if (fsck_online.m_kind == TREE_PINNED) {
+      fsck_online.m_report.pinned_nodes++;
+   }
+   else {
+      fsck_online.m_report.data_nodes++;
+   }
+   fsck_online_payload(&node_work0);
+
+   frame->m_right = node_work0.m_right;
+   frame->m_free = node_work0.m_free;
+   frame->m_height = node_work0.m_height;
+   if (node_work0.m_left == END) {
+      frame->m_left_height = 0;
+      frame->m_stage = 2;
+      fsck_online_order(frame, node_work0.m_key);
+      fsck_online_push(frame->m_right);
+      return;
+   }
+   frame->m_stage = 1;
+   fsck_online_push(node_work0.m_left);
+}
+
+//! @brief Check a node's in-order position once its left subtree is done.
+//!
+//! @return true when the node was read again for its key.
+static bool fsck_online_visit(FsckFrame *frame) {
+   bool reread = fsck_online.m_kind != TREE_FREE;
+
+   frame->m_left_height = fsck_online.m_child_height;
+   frame->m_stage = 2;
+
+   if (!reread) {
+      fsck_online_order(frame, "");
+   }
+   else if (!read_node(frame->m_sector, &node_work0) ||
+            !node_key_terminated(&node_work0)) {
+      fsck_online_error();
+   }
+   else {
+      fsck_online_order(frame, node_work0.m_key);
+   }
+
+   fsck_online_push(frame->m_right);
+   return reread;
+}
+
+//! @brief Check a node's stored height once both subtrees are done.
+static void fsck_online_leave(FsckFrame *frame) {
+   int lh = frame->m_left_height;
+   int rh = fsck_online.m_child_height;
+   int expected = (lh > rh ? lh : rh) + 1;
+
+   if (frame->m_height != (uint8_t) expected) fsck_online_error();
+   if (lh - rh > 1 || rh - lh > 1) fsck_online_error();
+
+   fsck_online.m_depth--;
+   fsck_online.m_child_height = (uint8_t) expected;
+}
+
+//! @brief Start an incremental fsck of the mounted filesystem.
+bool narf_fsck_begin(void) {
+   perf_begin(NARF_PERF_FSCK);
+   if (!verify_live()) return false;
+
+   fsck_online.m_active = true;
+   fsck_online_restart();
+   fsck_online_push(fsck_online.m_data_root);
+   return true;
+}
+
+//! @brief Advance an incremental fsck by at most a number of sector reads.
+bool narf_fsck_step(unsigned budget, bool *done) {
+   perf_begin(NARF_PERF_FSCK);
+   if (done == NULL) return false;
+   *done = false;
+   if (!fsck_online.m_active || !verify_live()) return false;
+
+   if (fsck_online.m_version != root.m_root_version ||
+       fsck_online.m_data_root != root.m_data_root ||
+       fsck_online.m_free_root != root.m_free_root ||
+       fsck_online.m_shared_root != root.m_shared_root ||
+       fsck_online.m_pinned_root != root.m_pinned_root) {
+      fsck_online_restart();
+      fsck_online_push(fsck_online.m_data_root);
+   }
+
+   while (!fsck_online.m_done && budget > 0) {
+      FsckFrame *frame;
+
+      if (fsck_online.m_depth == 0) {
+         if (fsck_online.m_kind == TREE_SHARED) {
+            fsck_online.m_kind = TREE_PINNED;
+            fsck_online.m_have_prev_key = false;
+            fsck_online_push(fsck_online.m_pinned_root);
+            continue;
+         }
+         if (fsck_online.m_kind == TREE_PINNED) {
+            fsck_online.m_report.file_count = root.m_count;
+
+            if (root.m_count != fsck_online.m_report.data_nodes) {
+               fsck_online_error();
+            }
+            fsck_online.m_done = true;
+            break;
+         }
+         if (fsck_online.m_kind == TREE_FREE) {
+            fsck_online.m_kind = TREE_SHARED;
+            fsck_online.m_have_prev_key = false;
+            fsck_online_push(fsck_online.m_shared_root);
+            continue;
+         }
+         fsck_online.m_kind = TREE_FREE;
+         fsck_online_push(fsck_online.m_free_root);
+         continue;
+      }
+
+      frame = &fsck_online.m_stack[fsck_online.m_depth - 1];
+      if (frame->m_stage == 0) {
+         fsck_online_enter(frame);
+         budget--;
+      }
+      else if (frame->m_stage == 1) {
+         if (fsck_online_visit(frame)) budget--;
+      }
+      else {
+         fsck_online_leave(frame);
+      }
+   }
+
+   *done = fsck_online.m_done;
+   return true;
+}
+
+//! @brief Finish an incremental fsck and return its report.
+bool narf_fsck_end(NarfFsckReport *report) {
+   bool ok = fsck_online.m_active && fsck_online.m_done &&
+             fsck_online.m_report.errors == 0;
+
+   perf_begin(NARF_PERF_FSCK);
+
+   if (report != NULL) *report = fsck_online.m_report;
+   fsck_online.m_active = false;
+   return ok;
+}
+
+//! @brief Return whether a key exists in the data tree.
+bool narf_find(const char *key) {
+   perf_begin(NARF_PERF_FIND);
+   return valid_key(key) && verify() && data_find_sector_rec(root.m_data_root, key, NULL, NULL);
+}
+
+//! @brief Return the directory prefix after an optional leading separator.
+static const char *dir_prefix(const char *dirname, const char *sep) {
+   size_t sep_len = strlen(sep);
+
+   if (sep_len != 0 && !strncmp(dirname, sep, sep_len)) {
       return dirname + sep_len;
    }
 
-   return dirname;
+   return dirname;
+}
+
+//! @brief Return whether a key is an immediate entry of a directory.
+static bool dir_match(const char *key, const char *dirname, const char *sep) {
+   const char *prefix = dir_prefix(dirname, sep);
+   size_t prefix_len = strlen(prefix);
+   size_t sep_len = strlen(sep);
+   const char *p;
+
+   if (strncmp(prefix, key, prefix_len)) return false;
+   p = strstr(key + prefix_len, sep);
+   return p == NULL || p[sep_len] == 0;
+}
+
+//! @brief Build the exclusive lexicographic upper bound for a prefix.
+static bool prefix_upper_bound(const char *prefix, char *out, size_t out_size) {
+   size_t len;
+
+   if (prefix == NULL || out == NULL || out_size == 0) return false;
+
+   len = strlen(prefix);
+   if (len == 0 || len >= out_size) return false;
+
+   memcpy(out, prefix, len + 1);
+
+   while (len > 0) {
+      unsigned char c = (unsigned char) out[len - 1];
+
+      if (c != 0xff) {
+         out[len - 1] = (char)(c + 1);
+         out[len] = 0;
+         return true;
+      }
+
+      len--;
+   }
+
+   return false;
+}
+
+//! @brief Scan the data tree for the next directory entry after a key.
+static bool dir_scan_rec(NarfSector sector, const char *dirname, const char *sep,
+                         const char *prefix, const char *prefix_high,
+                         const char *after, const char **best) {
+   int cmp;
+
+   if (best == NULL) return false;
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   if (after != NULL && strcmp(node_work0.m_key, after) <= 0) {
+      return dir_scan_rec(node_work0.m_right, dirname, sep, prefix, prefix_high,
+                          after, best);
+   }
+
+   cmp = strcmp(node_work0.m_key, prefix);
+   if (cmp < 0) {
+      return dir_scan_rec(node_work0.m_right, dirname, sep, prefix, prefix_high,
+                          after, best);
+   }
+
+   if (prefix_high != NULL && strcmp(node_work0.m_key, prefix_high) >= 0) {
+      return dir_scan_rec(node_work0.m_left, dirname, sep, prefix, prefix_high,
+                          after, best);
+   }
+
+   if (!dir_scan_rec(node_work0.m_left, dirname, sep, prefix, prefix_high,
+                     after, best)) {
+      return false;
+   }
+
+   if (!read_node(sector, &node_work0)) return false;
+
+   if ((*best == NULL || strcmp(node_work0.m_key, *best) < 0) &&
+       dir_match(node_work0.m_key, dirname, sep)) {
+      strncpy(dir_key, node_work0.m_key, sizeof(dir_key));
+      dir_key[sizeof(dir_key) - 1] = 0;
+      *best = dir_key;
+   }
+
+   if (*best != NULL && strcmp(*best, node_work0.m_key) <= 0) {
+      return true;
+   }
+
+   return dir_scan_rec(node_work0.m_right, dirname, sep, prefix, prefix_high,
+                       after, best);
+}
+
+//! @brief Return the next directory entry after an optional previous key.
+static const char *dir_scan_next(const char *dirname, const char *sep, const char *after) {
+   const char *best = NULL;
+   const char *prefix = dir_prefix(dirname, sep);
+   const char *prefix_high = NULL;
+
+   if (prefix_upper_bound(prefix, key_work, sizeof(key_work))) {
+      prefix_high = key_work;
+   }
+
+   if (!dir_scan_rec(root.m_data_root, dirname, sep, prefix, prefix_high, after, &best)) {
+      return NULL;
+   }
+
+   return best;
+}
+
+//! @brief Return the first immediate key in a directory.
+const char *narf_dirfirst(const char *dirname, const char *sep) {
+   perf_begin(NARF_PERF_LIST);
+   if (!verify()) return NULL;
+   if (!valid_dir_args(dirname, sep)) return NULL;
+   return dir_scan_next(dirname, sep, NULL);
+}
+
+//! @brief Return the immediate directory key after a previous key.
+const char *narf_dirnext(const char *dirname, const char *sep, const char *previous_key) {
+   perf_begin(NARF_PERF_LIST);
+   if (!verify()) return NULL;
+   if (!valid_dir_args(dirname, sep)) return NULL;
+   if (!valid_key(previous_key)) return NULL;
+   return dir_scan_next(dirname, sep, previous_key);
+}
+
+//! @brief Scan the data tree for the next key beginning with a prefix.
+static bool prefix_scan_rec(NarfSector sector, const char *prefix,
+                            const char *prefix_high, const char *after,
+                            const char **best) {
+   int cmp;
+
+   if (best == NULL) return false;
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   if (after != NULL && strcmp(node_work0.m_key, after) <= 0) {
+      return prefix_scan_rec(node_work0.m_right, prefix, prefix_high, after, best);
+   }
+
+   cmp = strcmp(node_work0.m_key, prefix);
+   if (cmp < 0) {
+      return prefix_scan_rec(node_work0.m_right, prefix, prefix_high, after, best);
+   }
+
+   if (prefix_high != NULL && strcmp(node_work0.m_key, prefix_high) >= 0) {
+      return prefix_scan_rec(node_work0.m_left, prefix, prefix_high, after, best);
+   }
+
+   if (!prefix_scan_rec(node_work0.m_left, prefix, prefix_high, after, best)) {
+      return false;
+   }
+
+   if (*best != NULL) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   if (!strncmp(node_work0.m_key, prefix, strlen(prefix))) {
+      strncpy(dir_key, node_work0.m_key, sizeof(dir_key));
+      dir_key[sizeof(dir_key) - 1] = 0;
+      *best = dir_key;
+      return true;
+   }
+
+   return prefix_scan_rec(node_work0.m_right, prefix, prefix_high, after, best);
+}
+
+//! @brief Return the next key beginning with a prefix after an optional key.
+static const char *prefix_scan_next(const char *prefix, const char *after) {
+   const char *best = NULL;
+   const char *prefix_high = NULL;
+
+   if (prefix_upper_bound(prefix, key_work, sizeof(key_work))) {
+      prefix_high = key_work;
+   }
+
+   if (!prefix_scan_rec(root.m_data_root, prefix, prefix_high, after, &best)) {
+      return NULL;
+   }
+
+   return best;
+}
+
+//! @brief Return the first key beginning with a prefix.
+const char *narf_prefixfirst(const char *prefix) {
+   perf_begin(NARF_PERF_LIST);
+   if (!verify()) return NULL;
+   if (!valid_key(prefix)) return NULL;
+   return prefix_scan_next(prefix, NULL);
+}
+
+//! @brief Return the next key beginning with a prefix after a previous key.
+const char *narf_prefixnext(const char *prefix, const char *previous_key) {
+   perf_begin(NARF_PERF_LIST);
+   if (!verify()) return NULL;
+   if (!valid_key(prefix)) return NULL;
+   if (!valid_key(previous_key)) return NULL;
+   return prefix_scan_next(prefix, previous_key);
+}
+
+//! @brief Create one data node with unwritten payload inside the open transaction.
+//!
+//! The extent is not zeroed; m_valid starts at 0, so it reads as zeroes until
+//! written.
+static bool insert_new_key(const char *key, NarfByteSize bytes, const char *metadata) {
+   NarfSector length;
+   NarfSector start = END;
+   NarfSector meta_sector;
+   NarfSector written = END;
+   NarfSector newroot;
+
+   length = BYTES2SECTORS(bytes);
+   if (!allocate_storage(length, &meta_sector, &start)) return false;
+
+   memset(&node_work1, 0, sizeof(node_work1));
+   node_work1.m_left = END;
+   node_work1.m_right = END;
+   node_work1.m_data.m_start = length ? start : END;
+   node_work1.m_data.m_length = length;
+   node_work1.m_data.m_tail = END;
+   node_work1.m_data.m_bytes = bytes;
+   node_work1.m_data.m_born = transaction_root_version();
+   node_work1.m_height = 1;
+   strcpy(node_work1.m_key, key);
+
+   if (metadata) {
+      strncpy((char *) node_work1.m_data.m_metadata, metadata,
+            sizeof(node_work1.m_data.m_metadata) - 1);
+   }
+
+   if (!write_node(meta_sector, &node_work1, &written) ||
+       !data_insert_rec(root.m_data_root, written, key, &newroot)) {
+      return false;
+   }
+
+   root.m_data_root = newroot;
+   root.m_count++;
+   return true;
+}
+
+//! @brief Create a key with unwritten payload storage and optional metadata.
+static bool alloc_with_metadata(const char *key, NarfByteSize bytes, const char *metadata) {
+   if (!verify_live()) return false;
+   if (!valid_key(key)) return false;
+   if (data_find_sector_rec(root.m_data_root, key, NULL, NULL)) return false;
+
+   transaction_begin();
+   if (!insert_new_key(key, bytes, metadata)) {
+      transaction_rollback();
+      return false;
+   }
+
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   return true;
+}
+
+//! @brief Create a key whose payload reads as zeroes.
+bool narf_alloc(const char *key, NarfByteSize bytes) {
+   perf_begin(NARF_PERF_ALLOC);
+   record(NARF_RECORD_ALLOC, key, NULL, 0, bytes, NULL);
+   return alloc_with_metadata(key, bytes, NULL);
+}
+
+// Sorted bulk insert.
+//
+// A stream of m new keys already in key order can be merged with the n
+// existing keys and rebuilt as one perfectly balanced tree with O(n + m)
+// node writes, instead of m independent root-to-leaf COW inserts.  The merge
+// walks the committed tree in order with an explicit stack while new nodes
+// are written.  Committed nodes are never modified in place and retired
+// sectors are not recycled until commit, so the old tree stays readable for
+// the whole rebuild.  The rebuild therefore needs a fresh catalog sector for
+// every key at once; when that much is not free, or the batch is small
+// against a large tree, ordinary inserts run instead, in the same single
+// transaction.
+//
+// Each node is written once.  A subtree's parent is written as soon as its
+// own item is taken, so the sector of its right subtree root is allocated
+// first and that root is later written into it.
+
+typedef struct {
+   NarfBulkNext m_next;
+   void *m_context;
+   NarfSector m_remaining;
+   NarfBulkItem m_item;
+   bool m_have_item;
+   bool m_have_last;
+   NarfSector m_stack[NARF_MAX_AVL_DEPTH + 1];
+   unsigned m_depth;
+} BulkCursor;
+
+static BulkCursor bulk;
+
+//! @brief Fetch the next stream item and check it is strictly ascending.
+static bool bulk_fetch(void) {
+   if (bulk.m_have_item || bulk.m_remaining == 0) return true;
+
+   memset(&bulk.m_item, 0, sizeof(bulk.m_item));
+   if (!bulk.m_next(bulk.m_context, &bulk.m_item)) return false;
+   if (!valid_key(bulk.m_item.key)) return false;
+   if (bulk.m_have_last && strcmp(bulk.m_item.key, key_work) <= 0) return false;
+
+   record(NARF_RECORD_ALLOC, bulk.m_item.key, NULL, 0, bulk.m_item.bytes, NULL);
+   strcpy(key_work, bulk.m_item.key);
+   bulk.m_have_last = true;
+   bulk.m_have_item = true;
+   bulk.m_remaining--;
+   return true;
+}
+
+//! @brief Push a committed node and its left spine onto the merge stack.
+static bool bulk_push_left(NarfSector sector) {
+   while (sector != END) {
+      if (bulk.m_depth > NARF_MAX_AVL_DEPTH) return false;
+      if (!read_node(sector, &node_work0)) return false;
+      bulk.m_stack[bulk.m_depth++] = sector;
+      sector = node_work0.m_left;
+   }
+   return true;
+}
+
+//! @brief Fill node_work1 with a new node with unwritten payload for the fetched item.
+static bool bulk_new_node(void) {
+   NarfSector length;
+   NarfSector start = END;
+
+   length = BYTES2SECTORS(bulk.m_item.bytes);
+   if (!allocate_data_extent(length, &start)) return false;
+
+   memset(&node_work1, 0, sizeof(node_work1));
+   node_work1.m_left = END;
+   node_work1.m_right = END;
+   node_work1.m_data.m_start = length ? start : END;
+   node_work1.m_data.m_length = length;
+   node_work1.m_data.m_tail = END;
+   node_work1.m_data.m_bytes = bulk.m_item.bytes;
+   node_work1.m_data.m_born = transaction_root_version();
+   node_work1.m_height = 1;
+   strcpy(node_work1.m_key, bulk.m_item.key);
+
+   if (bulk.m_item.metadata) {
+      strncpy((char *) node_work1.m_data.m_metadata, bulk.m_item.metadata,
+            sizeof(node_work1.m_data.m_metadata) - 1);
+   }
+
+   bulk.m_have_item = false;
+   return true;
+}
+
+//! @brief Take the next node of the merged in-order sequence into node_work1.
+//!
+//! Existing nodes also report their committed sector, which the caller
+//! retires.  New items are copied at once, so the caller's key and metadata
+//! pointers are never needed after the next callback.
+static bool bulk_take(NarfSector *existing_sector) {
+   NarfSector existing;
+   int cmp = 1;
+
+   if (!bulk_fetch()) return false;
+
+   existing = bulk.m_depth ? bulk.m_stack[bulk.m_depth - 1] : END;
+
+   if (existing != END) {
+      if (!read_node(existing, &node_work1)) return false;
+      if (bulk.m_have_item) {
+         cmp = strcmp(bulk.m_item.key, node_work1.m_key);
+         if (cmp == 0) return false;
+      }
+   }
+
+   if (existing != END && (!bulk.m_have_item || cmp > 0)) {
+      bulk.m_depth--;
+      if (!bulk_push_left(node_work1.m_right)) return false;
+      *existing_sector = existing;
+      return true;
+   }
+
+   if (!bulk.m_have_item) return false;
+   *existing_sector = END;
+   return bulk_new_node();
+}
+
+//! @brief Return the height of the balanced subtree bulk_build_rec() makes of count nodes.
+static uint8_t bulk_height(NarfSector count) {
+   uint8_t height = 0;
+
+   while (count != 0) {
+      height++;
+      count /= 2;
+   }
+   return height;
+}
+
+//! @brief Build a balanced subtree from the next count merged nodes.
+//!
+//! @param count Nodes in the subtree.
+//! @param target Sector allocated in this transaction for the subtree root,
+//! or END to allocate one.
+//! @param out Destination for the subtree root sector.
+static bool bulk_build_rec(NarfSector count, NarfSector target, NarfSector *out) {
+   NarfSector left_count;
+   NarfSector right_count;
+   NarfSector left;
+   NarfSector right = END;
+   NarfSector existing;
+
+   if (count == 0) {
+      *out = END;
+      return true;
+   }
+
+   left_count = count / 2;
+   right_count = count - 1 - left_count;
+   if (!bulk_build_rec(left_count, END, &left)) return false;
+   if (right_count != 0 && !alloc_node_sector(&right, NULL)) return false;
+   if (!bulk_take(&existing)) return false;
+
+   node_work1.m_left = left;
+   node_work1.m_right = right;
+   node_work1.m_height = bulk_height(count);
+   if (target != END) {
+      if (existing != END) retire_node(existing);
+      if (!write_node(target, &node_work1, out)) return false;
+   }
+   else if (!write_node(existing, &node_work1, out)) {
+      return false;
+   }
+
+   return bulk_build_rec(right_count, right, &right);
+}
+
+//! @brief Count free-tree nodes, stopping once limit is reached.
+static bool bulk_free_nodes_rec(NarfSector sector, NarfSector limit, NarfSector *count) {
+   NarfSector right;
+
+   if (sector == END || *count >= limit) return true;
+   if (!read_node(sector, &node_work0)) return false;
+   (*count)++;
+   right = node_work0.m_right;
+   if (!bulk_free_nodes_rec(node_work0.m_left, limit, count)) return false;
+   return bulk_free_nodes_rec(right, limit, count);
+}
+
+//! @brief Return whether need fresh catalog sectors can be allocated at once.
+//!
+//! Counts the open gap above the metadata reserve, then walks the spare list
+//! from its tail only as far as needed.  An unbuilt spare list counts as empty,
+//! as it does for allocations inside a transaction.
+static bool bulk_catalog_fits(NarfSector need) {
+   NarfSector reserve = metadata_reserve();
+   NarfSector have = 0;
+   NarfSector sector = spare_tail;
+
+   if (root.m_top > root.m_bottom + reserve) have = root.m_top - root.m_bottom - reserve;
+   if (!spare_initialized) return have >= need;
+
+   while (have < need && sector != END) {
+      if (!read_spare_record(sector, &node_tmp)) return false;
+      have++;
+      sector = node_tmp.m_left;
+   }
+   return have >= need;
+}
+
+//! @brief Insert a sorted stream of new keys in one transaction.
+bool narf_bulk_insert(NarfSector count, NarfBulkNext next, void *context) {
+   NarfSector total;
+   NarfSector newroot;
+   int height = 0;
+   bool use_rebuild = true;
+   bool ok = true;
+
+   perf_begin(NARF_PERF_ALLOC);
+   if (!verify_live()) return false;
+   if (next == NULL) return false;
+   if (count == 0) return true;
+   if (count > ((NarfSector) -1) - root.m_count) return false;
+   total = root.m_count + count;
+
+   if (!node_height(root.m_data_root, &height)) return false;
+
+   memset(&bulk, 0, sizeof(bulk));
+   bulk.m_next = next;
+   bulk.m_context = context;
+   bulk.m_remaining = count;
+
+   if ((uint64_t) count * (uint64_t) (height + 1) < (uint64_t) total) {
+      use_rebuild = false;
+   }
+   else {
+      // Besides a node per key, carving the new keys' payload can replace a
+      // free-tree node with a fresh one per key, at most one per free node,
+      // and copies the free-tree path above it once.
+      NarfSector free_nodes = 0;
+      int free_height = 0;
+
+      if (!node_height(root.m_free_root, &free_height)) return false;
+      if (!bulk_free_nodes_rec(root.m_free_root, count, &free_nodes)) return false;
+      if ((uint64_t) total + free_nodes + (NarfSector) free_height + 1 > (NarfSector) -1 ||
+          !bulk_catalog_fits(total + free_nodes + (NarfSector) free_height + 1)) {
+         use_rebuild = false;
+      }
+   }
+
+   transaction_begin();
+
+   if (!use_rebuild) {
+      // Few keys into a big tree, or too little catalog space for a rebuild:
+      // ordinary inserts touch fewer nodes.
+      while (ok && (bulk.m_remaining != 0 || bulk.m_have_item)) {
+         ok = bulk_fetch() &&
+              !data_find_sector_rec(root.m_data_root, bulk.m_item.key,
+                                    NULL, &node_work0) &&
+              insert_new_key(bulk.m_item.key, bulk.m_item.bytes,
+                             bulk.m_item.metadata);
+         bulk.m_have_item = false;
+      }
+   }
+   else {
+      ok = bulk_push_left(root.m_data_root) &&
+           bulk_build_rec(total, END, &newroot) &&
+           bulk.m_depth == 0 && !bulk.m_have_item && bulk.m_remaining == 0;
+      if (ok) {
+         root.m_data_root = newroot;
+         root.m_count = total;
+      }
+   }
+
+   if (!ok || !commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+
+   return true;
 }
 
-//! @brief Return whether a key is an immediate entry of a directory.
-static bool dir_match(const char *key, const char *dirname, const char *sep) {
-   const char *prefix = dir_prefix(dirname, sep);
-   size_t prefix_len = strlen(prefix);
-   size_t sep_len = strlen(sep);
-   const char *p;
+#ifdef NARF_USE_COMPRESSION
+//! @brief Apply a write or resize to a compressed key, or compress a plain key, in one commit.
+//!
+//! Appends to the chunk stream in place when it can, and otherwise compacts
+//! the stream into a new extent.
+static bool chunk_write(const char *key, const DataPayload *old,
+                        const uint8_t *src, NarfByteSize size,
+                        NarfByteSize offset, NarfByteSize new_bytes,
+                        const char *metadata) {
+   transaction_begin();
+   if (chunk_rewrite(key, old, src, size, offset, new_bytes, metadata, false)) {
+      if (!commit_user_transaction()) {
+         transaction_rollback();
+         return false;
+      }
+      return true;
+   }
 
-   if (strncmp(prefix, key, prefix_len)) return false;
-   p = strstr(key + prefix_len, sep);
-   return p == NULL || p[sep_len] == 0;
+   transaction_rollback();
+   transaction_begin();
+   if (!chunk_rewrite(key, old, src, size, offset, new_bytes, metadata, true)) {
+      transaction_rollback();
+      return false;
+   }
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   return true;
 }
 
-//! @brief Build the exclusive lexicographic upper bound for a prefix.
-static bool prefix_upper_bound(const char *prefix, char *out, size_t out_size) {
-   size_t len;
+//! @brief Decode a compressed key into a new plain extent in one commit.
+//!
+//! Chunks up to the last stored one become written sectors; holes after it
+//! stay unwritten.
+static bool chunk_unpack(const char *key, const DataPayload *old) {
+   NarfSector chunks = chunk_count(old->m_bytes);
+   NarfSector last = 0;
+   NarfSector valid;
+   NarfSector start = END;
+   NarfSector length = 0;
+   NarfSector newroot;
+   NarfSector c;
 
-   if (prefix == NULL || out == NULL || out_size == 0) return false;
+   for (c = 0; c < chunks; c++) {
+      if (c % CHUNK_ENTRIES == 0 && !chunk_read_index(old, c / CHUNK_ENTRIES)) return false;
+      if (chunk_index[c % CHUNK_ENTRIES].m_stored != 0) last = c + 1;
+   }
+   valid = last * CHUNK_SECTORS;
+   if (valid > BYTES2SECTORS(old->m_bytes)) valid = BYTES2SECTORS(old->m_bytes);
 
-   len = strlen(prefix);
-   if (len == 0 || len >= out_size) return false;
+   transaction_begin();
+   if (valid != 0 &&
+       !allocate_slack_extent(valid, payload_slack_room(old->m_bytes, 0, valid, old->m_slack),
+                              &start, &length)) {
+      transaction_rollback();
+      return false;
+   }
+
+   for (c = 0; c < last; c++) {
+      const ChunkEntry *entry = &chunk_index[c % CHUNK_ENTRIES];
+      NarfSector i;
+
+      if (c % CHUNK_ENTRIES == 0 && !chunk_read_index(old, c / CHUNK_ENTRIES)) {
+         transaction_rollback();
+         return false;
+      }
+      if (!chunk_entry_ok(old, entry, c) || !chunk_load(old, entry)) {
+         transaction_rollback();
+         return false;
+      }
+      for (i = 0; i < CHUNK_SECTORS && c * CHUNK_SECTORS + i < valid; i++) {
+         if (!payload_write(start + c * CHUNK_SECTORS + i,
+                            chunk_plain + (size_t) i * NARF_SECTOR_SIZE)) {
+            transaction_rollback();
+            return false;
+         }
+      }
+   }
+
+   if (old->m_length != 0 && !insert_free_extent(old->m_start, old->m_length)) {
+      transaction_rollback();
+      return false;
+   }
+
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
+   }
+   node_work1.m_data.m_start = length ? start : END;
+   node_work1.m_data.m_length = length;
+   node_work1.m_data.m_first = 0;
+   node_work1.m_data.m_valid = valid;
+   node_work1.m_data.m_codec = CODEC_PLAIN;
+   node_work1.m_data.m_index = 0;
+   node_work1.m_data.m_packed = 0;
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) {
+      transaction_rollback();
+      return false;
+   }
+   root.m_data_root = newroot;
+
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   return true;
+}
+
+#endif
+
+#ifdef NARF_USE_DEDUP
+// Deduplication.  narf_dedup() hashes a dense plain payload and looks for a
+// shared extent of equal hash and size.  A byte-for-byte match turns the key
+// into one more reference and frees its own extent; otherwise the key's
+// extent becomes shared.  Every later change to a shared key first gives it a
+// private extent in its own commit (share_detach), so a shared extent is never
+// written in place and a power loss leaves either the old or the new state.
+
+static uint8_t share_sector[NARF_SECTOR_SIZE];
+static char share_work[KEYSIZE];
+
+static bool fold_tail(const char *key, bool may_use_reserve);
+
+//! @brief Hash the bytes of a dense plain payload.
+static bool share_hash(const DataPayload *payload, uint32_t *hash) {
+   NarfByteSize left = payload->m_bytes;
+   uint32_t crc = 0;
+
+   for (NarfSector i = 0; left != 0; i++) {
+      size_t count = left < NARF_SECTOR_SIZE ? (size_t) left : NARF_SECTOR_SIZE;
+
+      if (!payload_read(payload->m_start + i, buffer)) return false;
+      crc = crc32(crc, buffer, count);
+      left -= count;
+   }
+   *hash = crc;
+   return true;
+}
+
+//! @brief Compare two extents sector by sector.
+//!
+//! Whole sectors are compared, so a match also agrees past the last byte.
+static bool share_same_content(NarfSector a, NarfSector b, NarfSector length,
+                               bool *same) {
+   *same = false;
+   for (NarfSector i = 0; i < length; i++) {
+      if (!payload_read(a + i, buffer)) return false;
+      if (!payload_read(b + i, share_sector)) return false;
+      if (memcmp(buffer, share_sector, NARF_SECTOR_SIZE) != 0) return true;
+   }
+   *same = true;
+   return true;
+}
+
+//! @brief Find a shared extent holding the same bytes as a payload extent.
+//!
+//! Shared keys sort by hash first, so only subtrees that can hold the hash
+//! prefix are walked.
+static bool share_find_rec(NarfSector sector, const char *prefix,
+                           NarfByteSize bytes, NarfSector start,
+                           NarfSector *match) {
+   NarfSector left;
+   NarfSector right;
+   SharePayload sp;
+   bool same;
+   int cmp;
+
+   if (sector == END || *match != END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   sp = node_work0.m_share;
+   cmp = strncmp(prefix, node_work0.m_key, 8);
+
+   if (cmp < 0) return share_find_rec(left, prefix, bytes, start, match);
+   if (cmp > 0) return share_find_rec(right, prefix, bytes, start, match);
+
+   if (sp.m_bytes == bytes && sp.m_start != start) {
+      if (!share_same_content(start, sp.m_start, sp.m_length, &same)) return false;
+      if (same) {
+         *match = sp.m_start;
+         return true;
+      }
+   }
+   return share_find_rec(left, prefix, bytes, start, match) &&
+          share_find_rec(right, prefix, bytes, start, match);
+}
+
+//! @brief Find a data node that references a shared extent.
+static bool share_find_sharer_rec(NarfSector sector, uint32_t hash,
+                                  NarfSector start, bool *found) {
+   NarfSector left;
+   NarfSector right;
+
+   if (sector == END || *found) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   if (node_work0.m_data.m_shared && node_work0.m_data.m_hash == hash &&
+       node_work0.m_data.m_start == start) {
+      strcpy(share_work, node_work0.m_key);
+      *found = true;
+      return true;
+   }
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   return share_find_sharer_rec(left, hash, start, found) &&
+          share_find_sharer_rec(right, hash, start, found);
+}
+
+//! @brief Drop one reference to a shared extent inside the open transaction.
+//!
+//! @param keep_extent When the last reference goes, hand the extent to the
+//!                    caller instead of freeing it.
+static bool share_unref(uint32_t hash, NarfSector start, bool keep_extent,
+                        bool *last) {
+   char share[SHARE_KEY_BYTES];
+   NarfSector newroot;
+   NarfSector removed_sector;
+   SharePayload sp;
+
+   share_key(share, hash, start);
+   if (!data_find_sector_rec(root.m_shared_root, share, NULL, &node_work1)) return false;
+   sp = node_work1.m_share;
+   *last = sp.m_refs == 1;
+
+   if (!*last) {
+      node_work1.m_share.m_refs--;
+      if (!data_update_rec(root.m_shared_root, share, &node_work1, &newroot)) return false;
+      root.m_shared_root = newroot;
+      return true;
+   }
+
+   if (!data_delete_rec(root.m_shared_root, share, &newroot, &removed_sector, NULL)) {
+      return false;
+   }
+   root.m_shared_root = newroot;
+   if (keep_extent) return true;
+#ifdef NARF_USE_SNAPSHOTS
+   return snapshot_release(sp.m_start, sp.m_length, sp.m_born);
+#else
+   return insert_free_extent(sp.m_start, sp.m_length);
+#endif
+}
+
+//! @brief Give a shared key its own extent before it changes.
+//!
+//! Runs as its own commit.  The last reference simply takes the extent over;
+//! otherwise the bytes are copied to a new extent.  On success node_work1
+//! holds the key's node.
+static bool share_detach(const char *key) {
+   DataPayload dp;
+   NarfSector start;
+   NarfSector newroot;
+   bool last;
+
+   transaction_begin();
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
+   }
+   dp = node_work1.m_data;
+   start = dp.m_start;
+
+   if (!share_unref(dp.m_hash, dp.m_start, true, &last)) {
+      transaction_rollback();
+      return false;
+   }
+   if (!last) {
+      if (!allocate_data_extent(dp.m_length, &start)) {
+         transaction_rollback();
+         return false;
+      }
+      for (NarfSector i = 0; i < dp.m_length; i++) {
+         if (!payload_read(dp.m_start + i, buffer) ||
+             !payload_write(start + i, buffer)) {
+            transaction_rollback();
+            return false;
+         }
+      }
+   }
+
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
+   }
+   node_work1.m_data.m_start = start;
+   node_work1.m_data.m_shared = 0;
+   node_work1.m_data.m_hash = 0;
+   if (!last) node_work1.m_data.m_born = transaction_root_version();
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) {
+      transaction_rollback();
+      return false;
+   }
+   root.m_data_root = newroot;
+
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   return true;
+}
+
+//! @brief Follow a shared extent that defrag moved, inside the open transaction.
+//!
+//! The shared node is re-keyed for the new start and every other key that
+//! references the extent is pointed at it.
+static bool share_move(uint32_t hash, NarfSector old_start, NarfSector new_start) {
+   char share[SHARE_KEY_BYTES];
+   NarfSector newroot;
+   NarfSector removed_sector;
+   NarfSector written;
+   SharePayload sp;
+   bool found;
+
+   share_key(share, hash, old_start);
+   if (!data_find_sector_rec(root.m_shared_root, share, NULL, &node_work1)) return false;
+   sp = node_work1.m_share;
+   if (!data_delete_rec(root.m_shared_root, share, &newroot, &removed_sector, NULL)) {
+      return false;
+   }
+   root.m_shared_root = newroot;
+
+   sp.m_start = new_start;
+   share_key(share, hash, new_start);
+   memset(&node_work1, 0, sizeof(node_work1));
+   node_work1.m_left = END;
+   node_work1.m_right = END;
+   node_work1.m_height = 1;
+   node_work1.m_share = sp;
+   strcpy(node_work1.m_key, share);
+   if (!write_node(END, &node_work1, &written)) return false;
+   if (!data_insert_rec(root.m_shared_root, written, share, &newroot)) return false;
+   root.m_shared_root = newroot;
+
+   for (;;) {
+      found = false;
+      if (!share_find_sharer_rec(root.m_data_root, hash, old_start, &found)) return false;
+      if (!found) return true;
+      if (!data_find_sector_rec(root.m_data_root, share_work, NULL, &node_work1)) return false;
+      node_work1.m_data.m_start = new_start;
+      if (!data_update_rec(root.m_data_root, share_work, &node_work1, &newroot)) return false;
+      root.m_data_root = newroot;
+   }
+}
+
+//! @brief Share a key's payload extent with every key holding the same bytes.
+bool narf_dedup(const char *key) {
+   DataPayload dp;
+   NarfSector needed;
+   NarfSector start;
+   NarfSector match = END;
+   NarfSector newroot;
+   NarfSector written;
+   char share[SHARE_KEY_BYTES];
+   uint32_t hash;
+   uint32_t born;
+
+   perf_begin(NARF_PERF_DEDUP);
+   if (!verify_live()) return false;
+   if (!valid_key(key)) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   if (!valid_data_payload(&node_work1.m_data)) return false;
+
+   dp = node_work1.m_data;
+   if (dp.m_shared) return true;
+   if (dp.m_codec != CODEC_PLAIN || dp.m_length == 0) return false;
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_pins(dp.m_born)) {
+      if (!snapshot_detach(key)) return false;
+      dp = node_work1.m_data;
+   }
+#endif
+   if (dp.m_tail != END) {
+      if (!fold_tail(key, false)) return false;
+      if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+      dp = node_work1.m_data;
+   }
+   needed = BYTES2SECTORS(dp.m_bytes);
+   if (dp.m_first != 0 || dp.m_valid != needed || dp.m_tail != END) return false;
+
+   if (!share_hash(&dp, &hash)) return false;
+   share_key(share, hash, 0);
+   if (!share_find_rec(root.m_shared_root, share, dp.m_bytes, dp.m_start, &match)) {
+      return false;
+   }
+
+   transaction_begin();
+
+   if (match != END) {
+      share_key(share, hash, match);
+      if (!data_find_sector_rec(root.m_shared_root, share, NULL, &node_work1) ||
+          node_work1.m_share.m_refs == (NarfSector) -1) {
+         transaction_rollback();
+         return false;
+      }
+      node_work1.m_share.m_refs++;
+      born = node_work1.m_share.m_born;
+      if (!data_update_rec(root.m_shared_root, share, &node_work1, &newroot)) {
+         transaction_rollback();
+         return false;
+      }
+      root.m_shared_root = newroot;
+      if (!insert_free_extent(dp.m_start, dp.m_length)) {
+         transaction_rollback();
+         return false;
+      }
+      start = match;
+   }
+   else {
+      // Growth slack would be overwritten by the next sharer's copy anyway.
+      if (dp.m_length > needed &&
+          !insert_free_extent(dp.m_start + needed, dp.m_length - needed)) {
+         transaction_rollback();
+         return false;
+      }
+      start = dp.m_start;
+      born = dp.m_born;
+      share_key(share, hash, start);
+      memset(&node_work1, 0, sizeof(node_work1));
+      node_work1.m_left = END;
+      node_work1.m_right = END;
+      node_work1.m_height = 1;
+      node_work1.m_share.m_start = start;
+      node_work1.m_share.m_length = needed;
+      node_work1.m_share.m_bytes = dp.m_bytes;
+      node_work1.m_share.m_refs = 1;
+      node_work1.m_share.m_hash = hash;
+      node_work1.m_share.m_born = born;
+      strcpy(node_work1.m_key, share);
+      if (!write_node(END, &node_work1, &written) ||
+          !data_insert_rec(root.m_shared_root, written, share, &newroot)) {
+         transaction_rollback();
+         return false;
+      }
+      root.m_shared_root = newroot;
+   }
+
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
+   }
+   node_work1.m_data.m_start = start;
+   node_work1.m_data.m_length = needed;
+   node_work1.m_data.m_shared = 1;
+   node_work1.m_data.m_hash = hash;
+   node_work1.m_data.m_born = born;
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) {
+      transaction_rollback();
+      return false;
+   }
+   root.m_data_root = newroot;
 
-   memcpy(out, prefix, len + 1);
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   return true;
+}
 
-   while (len > 0) {
-      unsigned char c = (unsigned char) out[len - 1];
+//! @brief Return whether a key references a shared extent.
+bool narf_deduped(const char *key) {
+   perf_begin(NARF_PERF_FIND);
+   if (!verify()) return false;
+   if (!valid_key(key)) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   return node_work1.m_data.m_shared != 0;
+}
+#endif
 
-      if (c != 0xff) {
-         out[len - 1] = (char)(c + 1);
-         out[len] = 0;
-         return true;
+#ifdef NARF_USE_SNAPSHOTS
+// Snapshots.  A snapshot is a slot in the root holding the tree roots of an
+// earlier committed root version v.  Nodes are COW, so its trees stay intact
+// as long as no node written at or before v is reused, and retire_node()
+// keeps those.  Payload is written in place, so the first change to a key
+// whose extent was allocated at or before v gives the key a private copy in
+// its own commit (snapshot_detach), and storage such a snapshot reads goes to
+// the pinned tree when freed.  Deleting a snapshot frees the pinned extents
+// no remaining snapshot reads and lets a spare rebuild find its nodes.
+
+//! @brief Return the slot holding a snapshot name, or NARF_SNAPSHOT_SLOTS.
+static unsigned snapshot_find(const char *name) {
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+      const SnapshotSlot *slot = &root.m_snapshots[i];
+
+      if (slot->m_name[0] != 0 &&
+          strncmp(slot->m_name, name, sizeof(slot->m_name)) == 0) {
+         return i;
       }
-
-      len--;
    }
-
-   return false;
+   return NARF_SNAPSHOT_SLOTS;
 }
 
-//! @brief Scan the data tree for the next directory entry after a key.
-static bool dir_scan_rec(NarfSector sector, const char *dirname, const char *sep,
-                         const char *prefix, const char *prefix_high,
-                         const char *after, const char **best) {
-   int cmp;
+//! @brief Validate a public snapshot name.
+static bool valid_snapshot_name(const char *name) {
+   if (name == NULL || name[0] == 0) return false;
+   return strlen(name) < NARF_SNAPSHOT_NAME_BYTES;
+}
 
-   if (best == NULL) return false;
-   if (sector == END) return true;
-   if (!read_node(sector, &node_work0)) return false;
+//! @brief Give a key that a snapshot reads its own extent before it changes.
+//!
+//! Runs as its own commit, like share_detach().  The valid sectors are copied
+//! with any tail copy folded in, and the old storage is released.  On success
+//! node_work1 holds the key's node.
+static bool snapshot_detach(const char *key) {
+   DataPayload dp;
+   NarfSector start = END;
+   NarfSector newroot;
 
-   if (after != NULL && strcmp(node_work0.m_key, after) <= 0) {
-      return dir_scan_rec(node_work0.m_right, dirname, sep, prefix, prefix_high,
-                          after, best);
+   transaction_begin();
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
    }
+   dp = node_work1.m_data;
 
-   cmp = strcmp(node_work0.m_key, prefix);
-   if (cmp < 0) {
-      return dir_scan_rec(node_work0.m_right, dirname, sep, prefix, prefix_high,
-                          after, best);
+   if (dp.m_length != 0) {
+      if (!allocate_data_extent(dp.m_length, &start)) {
+         transaction_rollback();
+         return false;
+      }
+      for (NarfSector i = 0; i < dp.m_valid; i++) {
+         NarfSector from = dp.m_start + i;
+
+         if (dp.m_tail != END && i == dp.m_tail_at - dp.m_first) from = dp.m_tail;
+         if (!payload_read(from, buffer) ||
+             !payload_write(start + i, buffer)) {
+            transaction_rollback();
+            return false;
+         }
+      }
+#ifdef NARF_USE_DEDUP
+      if (dp.m_shared) {
+         bool last;
+
+         if (!share_unref(dp.m_hash, dp.m_start, false, &last)) {
+            transaction_rollback();
+            return false;
+         }
+      }
+      else
+#endif
+      if (!snapshot_release(dp.m_start, dp.m_length, dp.m_born) ||
+          (dp.m_tail != END && !snapshot_release(dp.m_tail, 1, dp.m_born))) {
+         transaction_rollback();
+         return false;
+      }
+
+      if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+         transaction_rollback();
+         return false;
+      }
    }
 
-   if (prefix_high != NULL && strcmp(node_work0.m_key, prefix_high) >= 0) {
-      return dir_scan_rec(node_work0.m_left, dirname, sep, prefix, prefix_high,
-                          after, best);
+   node_work1.m_data.m_start = start;
+   node_work1.m_data.m_tail = END;
+   node_work1.m_data.m_tail_at = 0;
+   node_work1.m_data.m_shared = 0;
+   node_work1.m_data.m_hash = 0;
+   node_work1.m_data.m_born = transaction_root_version();
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) {
+      transaction_rollback();
+      return false;
    }
+   root.m_data_root = newroot;
 
-   if (!dir_scan_rec(node_work0.m_left, dirname, sep, prefix, prefix_high,
-                     after, best)) {
+   if (!commit_user_transaction()) {
+      transaction_rollback();
       return false;
    }
+   return true;
+}
 
-   if (!read_node(sector, &node_work0)) return false;
+//! @brief Find a pinned extent that no snapshot reads any more.
+static bool snapshot_find_dead_rec(NarfSector sector, unsigned depth,
+                                   PinPayload *dead, bool *found) {
+   NarfSector left;
+   NarfSector right;
 
-   if ((*best == NULL || strcmp(node_work0.m_key, *best) < 0) &&
-       dir_match(node_work0.m_key, dirname, sep)) {
-      strncpy(dir_key, node_work0.m_key, sizeof(dir_key));
-      dir_key[sizeof(dir_key) - 1] = 0;
-      *best = dir_key;
-   }
+   if (sector == END || *found) return true;
+   if (depth > NARF_MAX_AVL_DEPTH) return false;
+   if (!read_node(sector, &node_work0)) return false;
 
-   if (*best != NULL && strcmp(*best, node_work0.m_key) <= 0) {
+   if (!snapshot_covers(node_work0.m_pin.m_born, node_work0.m_pin.m_died)) {
+      *dead = node_work0.m_pin;
+      *found = true;
       return true;
    }
-
-   return dir_scan_rec(node_work0.m_right, dirname, sep, prefix, prefix_high,
-                       after, best);
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   return snapshot_find_dead_rec(left, depth + 1, dead, found) &&
+          snapshot_find_dead_rec(right, depth + 1, dead, found);
 }
 
-//! @brief Return the next directory entry after an optional previous key.
-static const char *dir_scan_next(const char *dirname, const char *sep, const char *after) {
-   const char *best = NULL;
-   const char *prefix = dir_prefix(dirname, sep);
-   const char *prefix_high = NULL;
+//! @brief Keep the committed state of the filesystem under a name.
+bool narf_snapshot_create(const char *name) {
+   SnapshotSlot *slot = NULL;
 
-   if (prefix_upper_bound(prefix, key_work, sizeof(key_work))) {
-      prefix_high = key_work;
-   }
+   perf_begin(NARF_PERF_SNAPSHOT);
+   if (!verify_live()) return false;
+   if (!valid_snapshot_name(name)) return false;
+   if (snapshot_find(name) != NARF_SNAPSHOT_SLOTS) return false;
 
-   if (!dir_scan_rec(root.m_data_root, dirname, sep, prefix, prefix_high, after, &best)) {
-      return NULL;
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS && slot == NULL; i++) {
+      if (root.m_snapshots[i].m_name[0] == 0) slot = &root.m_snapshots[i];
    }
+   if (slot == NULL) return false;
 
-   return best;
-}
+   transaction_begin();
+   memset(slot, 0, sizeof(*slot));
+   strcpy(slot->m_name, name);
+   slot->m_version = root.m_root_version;
+   slot->m_data_root = root.m_data_root;
+   slot->m_free_root = root.m_free_root;
+   slot->m_shared_root = root.m_shared_root;
+   slot->m_count = root.m_count;
 
-//! @brief Return the first immediate key in a directory.
-const char *narf_dirfirst(const char *dirname, const char *sep) {
-   if (!verify()) return NULL;
-   if (!valid_dir_args(dirname, sep)) return NULL;
-   return dir_scan_next(dirname, sep, NULL);
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   return true;
 }
 
-//! @brief Return the immediate directory key after a previous key.
-const char *narf_dirnext(const char *dirname, const char *sep, const char *previous_key) {
-   if (!verify()) return NULL;
-   if (!valid_dir_args(dirname, sep)) return NULL;
-   if (!valid_key(previous_key)) return NULL;
-   return dir_scan_next(dirname, sep, previous_key);
-}
+//! @brief Free a batch of pinned extents no snapshot reads in one commit.
+//!
+//! Sectors retired by the batch are only reusable after it commits, so the
+//! batch stops early once the gap nears the reserve.  more is set while
+//! extents may remain.
+static bool snapshot_reap_once(bool *more) {
+   PinPayload dead;
+   NarfSector newroot;
+   NarfSector removed_sector;
+   char key[PIN_KEY_BYTES];
+   unsigned applied = 0;
+   bool found;
+   bool ok;
 
-//! @brief Scan the data tree for the next key beginning with a prefix.
-static bool prefix_scan_rec(NarfSector sector, const char *prefix,
-                            const char *prefix_high, const char *after,
-                            const char **best) {
-   int cmp;
+   *more = false;
+   transaction_begin();
+   transaction_may_use_reserve = true;
 
-   if (best == NULL) return false;
-   if (sector == END) return true;
-   if (!read_node(sector, &node_work0)) return false;
+   // One walk per freed extent keeps RAM constant.
+   for (;;) {
+      if (applied != 0 &&
+          (retired_node_count >= RETIRED_MAX / 2 ||
+           root.m_top - root.m_bottom <= metadata_reserve() + RETIRED_MAX)) {
+         *more = true;
+         break;
+      }
 
-   if (after != NULL && strcmp(node_work0.m_key, after) <= 0) {
-      return prefix_scan_rec(node_work0.m_right, prefix, prefix_high, after, best);
-   }
+      found = false;
+      if (!snapshot_find_dead_rec(root.m_pinned_root, 0, &dead, &found)) {
+         transaction_rollback();
+         return false;
+      }
+      if (!found) break;
 
-   cmp = strcmp(node_work0.m_key, prefix);
-   if (cmp < 0) {
-      return prefix_scan_rec(node_work0.m_right, prefix, prefix_high, after, best);
+      pin_key(key, dead.m_start);
+      snapshot_pin_edit = true;
+      ok = data_delete_rec(root.m_pinned_root, key, &newroot, &removed_sector, NULL);
+      snapshot_pin_edit = false;
+      if (!ok) {
+         transaction_rollback();
+         return false;
+      }
+
+      root.m_pinned_root = newroot;
+      if (!insert_free_extent(dead.m_start, dead.m_length)) {
+         transaction_rollback();
+         return false;
+      }
+      applied++;
    }
 
-   if (prefix_high != NULL && strcmp(node_work0.m_key, prefix_high) >= 0) {
-      return prefix_scan_rec(node_work0.m_left, prefix, prefix_high, after, best);
+   if (applied == 0) {
+      transaction_rollback();
+      snapshot_reap_pending = false;
+      return true;
    }
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   snapshot_reap_pending = *more;
+   return true;
+}
 
-   if (!prefix_scan_rec(node_work0.m_left, prefix, prefix_high, after, best)) {
+//! @brief Delete a snapshot and free the storage only it kept.
+//!
+//! The cleared slot commits first, so a full device can always delete a
+//! snapshot.  The pinned extents it kept are then freed in bounded batches;
+//! whatever an error leaves behind is freed by narf_maintenance_step().
+bool narf_snapshot_delete(const char *name) {
+   unsigned index;
+   bool more = true;
+
+   perf_begin(NARF_PERF_SNAPSHOT);
+   if (!verify_live()) return false;
+   if (!valid_snapshot_name(name)) return false;
+   index = snapshot_find(name);
+   if (index == NARF_SNAPSHOT_SLOTS) return false;
+
+   transaction_begin();
+   transaction_may_use_reserve = true;
+   memset(&root.m_snapshots[index], 0, sizeof(root.m_snapshots[index]));
+
+   if (!commit_user_transaction()) {
+      transaction_rollback();
       return false;
    }
+   snapshot_reap_pending = true;
 
-   if (*best != NULL) return true;
-   if (!read_node(sector, &node_work0)) return false;
+   // Nodes only the deleted snapshot reached were never retired.
+   spare_rebuild_start();
 
-   if (!strncmp(node_work0.m_key, prefix, strlen(prefix))) {
-      strncpy(dir_key, node_work0.m_key, sizeof(dir_key));
-      dir_key[sizeof(dir_key) - 1] = 0;
-      *best = dir_key;
-      return true;
+   while (more) {
+      if (!snapshot_reap_once(&more)) break;
    }
+   return true;
+}
 
-   return prefix_scan_rec(node_work0.m_right, prefix, prefix_high, after, best);
+//! @brief Return to the live filesystem if a snapshot is shown.
+static void snapshot_unview(void) {
+   if (!snapshot_viewing) return;
+   root.m_data_root = snapshot_live.m_data_root;
+   root.m_free_root = snapshot_live.m_free_root;
+   root.m_shared_root = snapshot_live.m_shared_root;
+   root.m_count = snapshot_live.m_count;
+   snapshot_viewing = false;
 }
 
-//! @brief Return the next key beginning with a prefix after an optional key.
-static const char *prefix_scan_next(const char *prefix, const char *after) {
-   const char *best = NULL;
-   const char *prefix_high = NULL;
+//! @brief Show a snapshot read-only in place of the live filesystem.
+bool narf_snapshot_mount(const char *name) {
+   const SnapshotSlot *slot;
+   unsigned index;
 
-   if (prefix_upper_bound(prefix, key_work, sizeof(key_work))) {
-      prefix_high = key_work;
-   }
+   perf_begin(NARF_PERF_SNAPSHOT);
+   if (!verify()) return false;
 
-   if (!prefix_scan_rec(root.m_data_root, prefix, prefix_high, after, &best)) {
-      return NULL;
+   if (name == NULL) {
+      snapshot_unview();
+      return true;
    }
 
-   return best;
-}
+   if (!valid_snapshot_name(name)) return false;
+   index = snapshot_find(name);
+   if (index == NARF_SNAPSHOT_SLOTS) return false;
+   slot = &root.m_snapshots[index];
 
-//! @brief Return the first key beginning with a prefix.
-const char *narf_prefixfirst(const char *prefix) {
-   if (!verify()) return NULL;
-   if (!valid_key(prefix)) return NULL;
-   return prefix_scan_next(prefix, NULL);
+   if (!snapshot_viewing) {
+      snapshot_live.m_data_root = root.m_data_root;
+      snapshot_live.m_free_root = root.m_free_root;
+      snapshot_live.m_shared_root = root.m_shared_root;
+      snapshot_live.m_count = root.m_count;
+      snapshot_viewing = true;
+   }
+   root.m_data_root = slot->m_data_root;
+   root.m_free_root = slot->m_free_root;
+   root.m_shared_root = slot->m_shared_root;
+   root.m_count = slot->m_count;
+   return true;
 }
 
-//! @brief Return the next key beginning with a prefix after a previous key.
-const char *narf_prefixnext(const char *prefix, const char *previous_key) {
+//! @brief Return the name of the snapshot in a slot.
+const char *narf_snapshot_name(unsigned slot) {
    if (!verify()) return NULL;
-   if (!valid_key(prefix)) return NULL;
-   if (!valid_key(previous_key)) return NULL;
-   return prefix_scan_next(prefix, previous_key);
+   if (slot >= NARF_SNAPSHOT_SLOTS) return NULL;
+   if (root.m_snapshots[slot].m_name[0] == 0) return NULL;
+   return root.m_snapshots[slot].m_name;
 }
 
-//! @brief Create a key with zero-filled payload storage and optional metadata.
-static bool alloc_with_metadata(const char *key, NarfByteSize bytes, const char *metadata) {
-   NarfSector length;
-   NarfSector start = END;
-   NarfSector meta_sector;
-   NarfSector written;
-   NarfSector newroot;
-
-   if (!verify()) return false;
-   if (!valid_key(key)) return false;
-   if (narf_find(key)) return false;
-
-   transaction_begin();
-   length = BYTES2SECTORS(bytes);
-   if (!allocate_storage(length, &meta_sector, &start)) {
-      transaction_rollback();
-      return false;
-   }
+// Change walks.  A snapshot's data tree and the live one share every subtree
+// no commit since has touched, so both are walked in key order at once and
+// a subtree that is next in both is skipped without reading it.  Each walk is
+// a stack of pending subtrees, deepest last, with the node itself entered at
+// height 0 once its left subtree is pushed above it.  Expanding the taller of
+// two different subtrees first brings a shared one to the top of both stacks,
+// so the nodes read are those on paths to changed keys.
 
-   if (!zero_extent(start, length)) {
-      transaction_rollback();
-      return false;
-   }
+// One right subtree and one node per level, plus the subtree being expanded.
+#define CHANGE_STACK (2 * NARF_MAX_AVL_DEPTH + 3)
 
-   memset(&node_work1, 0, sizeof(node_work1));
-   node_work1.m_left = END;
-   node_work1.m_right = END;
-   node_work1.m_data.m_start = length ? start : END;
-   node_work1.m_data.m_length = length;
-   node_work1.m_data.m_bytes = bytes;
-   node_work1.m_height = 1;
-   strcpy(node_work1.m_key, key);
+typedef struct {
+   NarfSector m_sector[CHANGE_STACK];
+   uint8_t    m_height[CHANGE_STACK];
+   unsigned   m_depth;
+   NarfSector m_loaded;
+} ChangeWalk;
 
-   if (metadata) {
-      strncpy((char *) node_work1.m_data.m_metadata, metadata,
-            sizeof(node_work1.m_data.m_metadata) - 1);
-   }
+static ChangeWalk change_before;
+static ChangeWalk change_after;
 
-   if (!write_node(meta_sector, &node_work1, &written) ||
-       !data_insert_rec(root.m_data_root, written, key, &newroot)) {
-      transaction_rollback();
+//! @brief Push a subtree onto a change walk.
+static bool change_push(ChangeWalk *walk, NarfSector sector) {
+   if (sector == END) return true;
+   if (walk->m_depth == CHANGE_STACK) return false;
+   if (!read_node(sector, &snapshot_node) || snapshot_node.m_height == 0) {
       return false;
    }
+   walk->m_sector[walk->m_depth] = sector;
+   walk->m_height[walk->m_depth] = snapshot_node.m_height;
+   walk->m_depth++;
+   return true;
+}
+
+//! @brief Replace the subtree on top of a change walk by its left subtree,
+//! its node, and its right subtree.
+static bool change_expand(ChangeWalk *walk) {
+   NarfSector sector = walk->m_sector[--walk->m_depth];
+   NarfSector left;
+   NarfSector right;
 
-   root.m_data_root = newroot;
-   root.m_count++;
-   if (!commit_user_transaction()) {
-      transaction_rollback();
-      return false;
+   if (!read_node(sector, &snapshot_node)) return false;
+   left = snapshot_node.m_left;
+   right = snapshot_node.m_right;
+   if (!change_push(walk, right)) return false;
+   walk->m_sector[walk->m_depth] = sector;
+   walk->m_height[walk->m_depth] = 0;
+   walk->m_depth++;
+   return change_push(walk, left);
+}
+
+//! @brief Expand a change walk until a node is on top, or it is empty.
+static bool change_settle(ChangeWalk *walk) {
+   while (walk->m_depth != 0 && walk->m_height[walk->m_depth - 1] != 0) {
+      if (!change_expand(walk)) return false;
    }
    return true;
 }
 
-//! @brief Create a key with zero-filled payload storage.
-bool narf_alloc(const char *key, NarfByteSize bytes) {
-   return alloc_with_metadata(key, bytes, NULL);
+//! @brief Read the node on top of a change walk unless it is already loaded.
+static bool change_load(ChangeWalk *walk, Node *node) {
+   NarfSector sector = walk->m_sector[walk->m_depth - 1];
+
+   if (walk->m_loaded == sector) return true;
+   if (!read_node(sector, node) || !node_key_terminated(node)) return false;
+   walk->m_loaded = sector;
+   return true;
+}
+
+//! @brief Report how a key differs between a snapshot and the live filesystem.
+bool narf_changes_since(const char *name, NarfChangeNext next, void *context) {
+   ChangeWalk *before = &change_before;
+   ChangeWalk *after = &change_after;
+   unsigned index;
+   NarfChange change;
+   int order;
+
+   perf_begin(NARF_PERF_SNAPSHOT);
+   if (!verify_live()) return false;
+   if (next == NULL || !valid_snapshot_name(name)) return false;
+   index = snapshot_find(name);
+   if (index == NARF_SNAPSHOT_SLOTS) return false;
+
+   before->m_depth = 0;
+   before->m_loaded = END;
+   after->m_depth = 0;
+   after->m_loaded = END;
+   if (!change_push(before, root.m_snapshots[index].m_data_root) ||
+       !change_push(after, root.m_data_root)) {
+      return false;
+   }
+
+   for (;;) {
+      // Skip shared subtrees until both walks have a node on top.
+      while (before->m_depth != 0 && after->m_depth != 0) {
+         uint8_t b = before->m_height[before->m_depth - 1];
+         uint8_t a = after->m_height[after->m_depth - 1];
+
+         if (a == 0 && b == 0) break;
+         if (a != 0 && b != 0 &&
+             before->m_sector[before->m_depth - 1] ==
+                after->m_sector[after->m_depth - 1]) {
+
+            before->m_depth--;
+            after->m_depth--;
+            continue;
+         }
+         if (!change_expand(b > a ? before : after)) return false;
+      }
+      if (!change_settle(before) || !change_settle(after)) return false;
+      if (before->m_depth == 0 && after->m_depth == 0) return true;
+
+      if (before->m_depth == 0) {
+         order = 1;
+      }
+      else if (after->m_depth == 0) {
+         order = -1;
+      }
+      else {
+         if (!change_load(before, &node_work0) ||
+             !change_load(after, &node_work1)) {
+            return false;
+         }
+         order = strcmp(node_work0.m_key, node_work1.m_key);
+      }
+
+      memset(&change, 0, sizeof(change));
+      if (order < 0) {
+         if (!change_load(before, &node_work0)) return false;
+         change.kind = NARF_CHANGE_DELETED;
+         change.key = node_work0.m_key;
+         change.old_bytes = node_work0.m_data.m_bytes;
+         before->m_depth--;
+      }
+      else if (order > 0) {
+         if (!change_load(after, &node_work1)) return false;
+         change.kind = NARF_CHANGE_CREATED;
+         change.key = node_work1.m_key;
+         change.new_bytes = node_work1.m_data.m_bytes;
+         change.metadata = true;
+         after->m_depth--;
+      }
+      else {
+         const DataPayload *old = &node_work0.m_data;
+         const DataPayload *now = &node_work1.m_data;
+
+         before->m_depth--;
+         after->m_depth--;
+         if (memcmp(old, now, sizeof(*old)) == 0) continue;
+
+         change.kind = NARF_CHANGE_MODIFIED;
+         change.key = node_work1.m_key;
+         change.old_bytes = old->m_bytes;
+         change.new_bytes = now->m_bytes;
+         change.metadata = memcmp(old->m_metadata, now->m_metadata,
+                                  sizeof(old->m_metadata)) != 0;
+         // A key keeps the extent it had at the snapshot only until its
+         // payload first changes, so the same extent means the same bytes.
+         if (old->m_born == now->m_born && old->m_start == now->m_start) {
+            change.first = old->m_bytes < now->m_bytes ? old->m_bytes : now->m_bytes;
+         }
+      }
+      if (!next(context, &change)) return false;
+   }
 }
+#endif
 
 //! @brief Resize a key, creating it if absent, and optionally replace metadata.
 bool narf_realloc_with_metadata(const char *key, NarfByteSize bytes, const char *metadata) {
    NarfSector newroot;
    NarfSector old_start;
    NarfSector old_length;
+   NarfSector old_first;
+   NarfSector drop_tail;
+   NarfSector new_valid;
    NarfByteSize old_bytes;
    NarfSector new_length;
    NarfSector free_start;
    NarfSector free_length;
 
-   if (!verify()) return false;
+   perf_begin(NARF_PERF_REALLOC);
+   record(NARF_RECORD_REALLOC, key, NULL, 0, bytes, NULL);
+   if (!verify_live()) return false;
    if (!valid_key(key)) return false;
 
    if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
       return alloc_with_metadata(key, bytes, metadata);
    }
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_pins(node_work1.m_data.m_born) && !snapshot_detach(key)) return false;
+#endif
+#ifdef NARF_USE_DEDUP
+   if (node_work1.m_data.m_shared && !share_detach(key)) return false;
+#endif
 
    old_bytes = node_work1.m_data.m_bytes;
    if (bytes > old_bytes) {
-      return narf_write_with_metadata(key, NULL, bytes - old_bytes, old_bytes, metadata);
+      return write_with_metadata(key, NULL, bytes - old_bytes, old_bytes, metadata);
+   }
+#ifdef NARF_USE_COMPRESSION
+   if (node_work1.m_data.m_codec != CODEC_PLAIN) {
+      DataPayload old = node_work1.m_data;
+
+      if (!valid_data_payload(&old)) return false;
+      return chunk_write(key, &old, NULL, 0, bytes, bytes, metadata);
    }
+#endif
 
    old_start = node_work1.m_data.m_start;
    old_length = node_work1.m_data.m_length;
-   new_length = BYTES2SECTORS(bytes);
+   old_first = node_work1.m_data.m_first;
+   drop_tail = node_work1.m_data.m_tail;
+   new_length = old_length;
+
+   // Keep the part of the extent below the new size, plus its growth slack.
+   new_valid = 0;
+   if (BYTES2SECTORS(bytes) > old_first) {
+      new_valid = BYTES2SECTORS(bytes) - old_first;
+      if (old_length != 0 &&
+          payload_slack_room(bytes, old_first, 0, node_work1.m_data.m_slack) < new_length) {
+         new_length = payload_slack_room(bytes, old_first, 0, node_work1.m_data.m_slack);
+      }
+   }
+   else {
+      new_length = 0;
+   }
+   if (new_valid > node_work1.m_data.m_valid) new_valid = node_work1.m_data.m_valid;
+   if (new_valid > new_length) new_valid = new_length;
+   if (drop_tail != END && node_work1.m_data.m_tail_at - old_first < new_valid) {
+      drop_tail = END;
+   }
 
    transaction_begin();
 
-   if (bytes == 0) {
-      if (old_length != 0) {
-         if (old_start == END) {
-            transaction_rollback();
-            return false;
-         }
-
-         if (!insert_free_extent(old_start, old_length)) {
-            transaction_rollback();
-            return false;
-         }
-      }
-   }
-   else if (new_length < old_length) {
+   if (new_length < old_length) {
       if (old_start == END) {
          transaction_rollback();
          return false;
@@ -3307,6 +7978,11 @@ bool narf_realloc_with_metadata(const char *key, NarfByteSize bytes, const char
       }
    }
 
+   if (drop_tail != END && !insert_free_extent(drop_tail, 1)) {
+      transaction_rollback();
+      return false;
+   }
+
    /* Free-tree COW updates may have changed the data-tree root.  Re-read the
     * current data node only after those updates, then apply both the new size
     * and metadata to that current copy. */
@@ -3315,13 +7991,19 @@ bool narf_realloc_with_metadata(const char *key, NarfByteSize bytes, const char
       return false;
    }
 
-   if (bytes == 0) {
+   if (new_length == 0) {
       node_work1.m_data.m_start = END;
+      node_work1.m_data.m_first = 0;
       node_work1.m_data.m_length = 0;
    }
    else if (new_length < old_length) {
       node_work1.m_data.m_length = new_length;
    }
+   node_work1.m_data.m_valid = new_valid;
+   if (drop_tail != END) {
+      node_work1.m_data.m_tail = END;
+      node_work1.m_data.m_tail_at = 0;
+   }
    node_work1.m_data.m_bytes = bytes;
 
    if (metadata) {
@@ -3358,7 +8040,9 @@ bool narf_free(const char *key) {
    NarfSector removed_start;
    NarfSector removed_length;
 
-   if (!verify()) return false;
+   perf_begin(NARF_PERF_FREE);
+   record(NARF_RECORD_FREE, key, NULL, 0, 0, NULL);
+   if (!verify_live()) return false;
    if (!valid_key(key)) return false;
    transaction_begin();
    transaction_may_use_reserve = true;
@@ -3369,10 +8053,39 @@ bool narf_free(const char *key) {
    root.m_data_root = newroot;
    removed_start = removed_data.m_start;
    removed_length = removed_data.m_length;
+#ifdef NARF_USE_DEDUP
+   if (removed_data.m_shared) {
+      bool last;
+
+      // A shared extent is freed with its last reference.
+      if (!share_unref(removed_data.m_hash, removed_start, false, &last)) {
+         transaction_rollback();
+         return false;
+      }
+      removed_length = 0;
+   }
+#endif
+#ifdef NARF_USE_SNAPSHOTS
+   if (!removed_data.m_shared && snapshot_pins(removed_data.m_born)) {
+      // Snapshots still read the payload, so it goes to the pinned tree.
+      if (!snapshot_pin_extent(removed_start, removed_length, removed_data.m_born) ||
+          (removed_data.m_tail != END &&
+           !snapshot_pin_extent(removed_data.m_tail, 1, removed_data.m_born))) {
+         transaction_rollback();
+         return false;
+      }
+      removed_length = 0;
+      removed_data.m_tail = END;
+   }
+#endif
    if (!insert_free_extent_with_seed_sector(removed_sector, removed_start, removed_length)) {
       transaction_rollback();
       return false;
    }
+   if (removed_data.m_tail != END && !insert_free_extent(removed_data.m_tail, 1)) {
+      transaction_rollback();
+      return false;
+   }
    if (root.m_count) root.m_count--;
    if (!commit_user_transaction()) {
       transaction_rollback();
@@ -3388,10 +8101,12 @@ bool narf_rename_key(const char *key, const char *newkey) {
    NarfSector written;
    DataPayload renamed_data;
 
-   if (!verify()) return false;
+   perf_begin(NARF_PERF_RENAME);
+   record(NARF_RECORD_RENAME, key, newkey, 0, 0, NULL);
+   if (!verify_live()) return false;
    if (!valid_key(key) || !valid_key(newkey)) return false;
-   if (strcmp(key, newkey) == 0) return narf_find(key);
-   if (narf_find(newkey)) return false;
+   if (strcmp(key, newkey) == 0) return data_find_sector_rec(root.m_data_root, key, NULL, NULL);
+   if (data_find_sector_rec(root.m_data_root, newkey, NULL, NULL)) return false;
    transaction_begin();
    transaction_may_use_reserve = true;
    if (!data_delete_rec(root.m_data_root, key, &newroot, &removed_sector, &renamed_data)) {
@@ -3419,8 +8134,9 @@ bool narf_rename_key(const char *key, const char *newkey) {
    return true;
 }
 
-//! @brief Return the physical sector of a key payload.
+//! @brief Return the physical sector of the first allocated payload sector.
 NarfSector narf_sector(const char *key) {
+   perf_begin(NARF_PERF_FIND);
    if (!verify()) return END;
    if (!valid_key(key)) return END;
    if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return END;
@@ -3430,17 +8146,410 @@ NarfSector narf_sector(const char *key) {
    return root.m_origin + node_work1.m_data.m_start;
 }
 
-//! @brief Return the byte size of a key payload.
-NarfByteSize narf_size(const char *key) {
-   if (!verify()) return 0;
-   if (!valid_key(key)) return 0;
-   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return 0;
-   return node_work1.m_data.m_bytes;
+//! @brief Return the byte size of a key payload.
+NarfByteSize narf_size(const char *key) {
+   perf_begin(NARF_PERF_FIND);
+   if (!verify()) return 0;
+   if (!valid_key(key)) return 0;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return 0;
+   return node_work1.m_data.m_bytes;
+}
+
+//! @brief Read bytes at an offset in a key payload; holes and unwritten sectors read as zeroes.
+bool narf_read(const char *key, void *data, NarfByteSize size, NarfByteSize offset) {
+   uint8_t *dst = data;
+   DataPayload payload;
+   NarfSector first;
+   NarfSector valid;
+   NarfSector sector;
+   NarfByteSize within;
+   NarfByteSize chunk;
+
+   perf_begin(NARF_PERF_READ);
+   record(NARF_RECORD_READ, key, NULL, offset, size, NULL);
+   if (!verify()) return false;
+   if (!valid_key(key)) return false;
+   if (data == NULL && size != 0) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   if (offset > node_work1.m_data.m_bytes) return false;
+   if (size > node_work1.m_data.m_bytes - offset) return false;
+   if (size == 0) return true;
+   if (!valid_data_payload(&node_work1.m_data)) return false;
+
+   payload = node_work1.m_data;
+#ifdef NARF_USE_COMPRESSION
+   if (payload.m_codec != CODEC_PLAIN) return chunk_read(&payload, dst, size, offset);
+#endif
+   first = payload.m_first;
+   valid = payload.m_valid;
+
+   while (size) {
+      sector = (NarfSector) (offset / NARF_SECTOR_SIZE);
+      within = offset % NARF_SECTOR_SIZE;
+      chunk = NARF_SECTOR_SIZE - within;
+      if (chunk > size) chunk = size;
+      if (sector < first || sector - first >= valid) {
+         memset(dst, 0, chunk);
+      }
+      else {
+         if (!payload_read(payload_sector(&payload, sector), buffer)) return false;
+         memcpy(dst, buffer + within, chunk);
+      }
+      dst += chunk;
+      offset += chunk;
+      size -= chunk;
+   }
+   return true;
+}
+
+//! @brief Return the number of payload sectors allocated to a key.
+NarfSector narf_allocated(const char *key) {
+   perf_begin(NARF_PERF_FIND);
+   if (!verify()) return 0;
+   if (!valid_key(key)) return 0;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return 0;
+   return payload_held(&node_work1.m_data);
+}
+
+//! @brief Find the next data or hole byte at or after an offset.
+bool narf_seek(const char *key, NarfByteSize offset, bool hole, NarfByteSize *result) {
+   NarfByteSize data_start;
+   NarfByteSize data_end;
+
+   perf_begin(NARF_PERF_FIND);
+   if (!verify()) return false;
+   if (!valid_key(key)) return false;
+   if (result == NULL) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   if (!valid_data_payload(&node_work1.m_data)) return false;
+   if (offset >= node_work1.m_data.m_bytes) return false;
+#ifdef NARF_USE_COMPRESSION
+   if (node_work1.m_data.m_codec != CODEC_PLAIN) {
+      DataPayload payload = node_work1.m_data;
+
+      return chunk_seek(&payload, offset, hole, result);
+   }
+#endif
+
+   // The written prefix of the extent is the only data; the rest is hole.
+   data_start = (NarfByteSize) node_work1.m_data.m_first * NARF_SECTOR_SIZE;
+   data_end = data_start + (NarfByteSize) node_work1.m_data.m_valid * NARF_SECTOR_SIZE;
+   if (data_end > node_work1.m_data.m_bytes) data_end = node_work1.m_data.m_bytes;
+
+   if (hole) {
+      *result = (offset >= data_start && offset < data_end) ? data_end : offset;
+      return true;
+   }
+
+   if (offset >= data_end) return false;
+   *result = offset < data_start ? data_start : offset;
+   return true;
+}
+
+//! @brief Copy a payload's written sectors from first to valid_end, zeroing a byte range.
+//!
+//! Bytes past m_bytes in the last sector are zeroed as well.
+static bool punch_copy(const DataPayload *old, NarfSector first, NarfSector valid_end,
+                       NarfByteSize offset, NarfByteSize end, NarfSector start) {
+   NarfSector sector;
+
+   for (sector = first; sector < valid_end; sector++) {
+      NarfByteSize base;
+      NarfByteSize sector_end;
+
+      if (sector > ((NarfByteSize) -1) / NARF_SECTOR_SIZE) return false;
+      base = (NarfByteSize) sector * NARF_SECTOR_SIZE;
+      sector_end = base + NARF_SECTOR_SIZE;
+
+      if (!payload_read(payload_sector(old, sector), buffer)) return false;
+      if (old->m_bytes < sector_end) {
+         NarfByteSize keep = old->m_bytes > base ? old->m_bytes - base : 0;
+
+         memset(buffer + keep, 0, sizeof(buffer) - keep);
+      }
+      if (base < end && offset < sector_end) {
+         NarfByteSize begin = offset > base ? offset : base;
+         NarfByteSize stop = end < sector_end ? end : sector_end;
+
+         memset(buffer + (begin - base), 0, stop - begin);
+      }
+
+      if (!payload_write(start + (sector - first), buffer)) return false;
+   }
+   return true;
+}
+
+//! @brief Zero a byte range of a key payload, releasing sectors at the ends of its extent.
+bool narf_punch(const char *key, NarfByteSize offset, NarfByteSize size) {
+   DataPayload old;
+   NarfByteSize end;
+   NarfSector lo;
+   NarfSector hi;
+   NarfSector old_end;
+   NarfSector valid_end;
+   NarfSector new_first;
+   NarfSector new_end;
+   NarfSector drop_tail;
+   NarfSector new_start;
+   NarfSector new_length;
+   NarfSector newroot;
+   bool copy;
+
+   perf_begin(NARF_PERF_PUNCH);
+   record(NARF_RECORD_PUNCH, key, NULL, offset, size, NULL);
+   if (!verify_live()) return false;
+   if (!valid_key(key)) return false;
+   if (size > ((NarfByteSize) -1) - offset) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   if (!valid_data_payload(&node_work1.m_data)) return false;
+
+   old = node_work1.m_data;
+   if (size == 0 || offset >= old.m_bytes || old.m_length == 0) return true;
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_pins(old.m_born)) {
+      if (!snapshot_detach(key)) return false;
+      old = node_work1.m_data;
+   }
+#endif
+#ifdef NARF_USE_DEDUP
+   if (old.m_shared) {
+      if (!share_detach(key)) return false;
+      old = node_work1.m_data;
+   }
+#endif
+
+   end = offset + size;
+   if (end > old.m_bytes) end = old.m_bytes;
+#ifdef NARF_USE_COMPRESSION
+   if (old.m_codec != CODEC_PLAIN) {
+      // Chunks the range covers become holes; partial ones are re-encoded.
+      return chunk_write(key, &old, NULL, end - offset, offset, old.m_bytes, NULL);
+   }
+#endif
+
+   // Whole sectors inside the range; past EOF the last sector counts whole.
+   lo = BYTES2SECTORS(offset);
+   hi = end == old.m_bytes ? BYTES2SECTORS(end) : (NarfSector) (end / NARF_SECTOR_SIZE);
+
+   old_end = old.m_first + old.m_length;
+   valid_end = old.m_first + old.m_valid;
+   new_first = old.m_first;
+   new_end = old_end;
+
+   if (lo < hi) {
+      if (lo <= old.m_first && hi >= old_end) {
+         new_first = new_end = old_end;
+      }
+      else if (lo <= old.m_first && hi > old.m_first) {
+         new_first = hi;
+      }
+      else if (hi >= old_end && lo < old_end) {
+         new_end = lo;
+      }
+      else if (lo < valid_end && hi >= valid_end) {
+         // Interior range covering the end of the written prefix: unwrite it.
+         valid_end = lo;
+      }
+   }
+
+   if (valid_end > new_end) valid_end = new_end;
+   if (valid_end < new_first) valid_end = new_first;
+   drop_tail = old.m_tail;
+   if (drop_tail != END && old.m_tail_at >= new_first && old.m_tail_at < valid_end) {
+      drop_tail = END;
+   }
+
+   // Partial edge sectors and interior written data are zeroed by copying.
+   copy = new_end > new_first && valid_end > new_first &&
+          offset < (NarfByteSize) valid_end * NARF_SECTOR_SIZE &&
+          end > (NarfByteSize) new_first * NARF_SECTOR_SIZE;
+   if (!copy && new_first == old.m_first && new_end == old_end &&
+       valid_end == old.m_first + old.m_valid) {
+      return true;
+   }
+
+   transaction_begin();
+
+   if (copy) {
+      if (!allocate_slack_extent(new_end - new_first,
+                                 payload_slack_room(old.m_bytes, new_first,
+                                                    new_end - new_first, old.m_slack),
+                                 &new_start, &new_length) ||
+          !punch_copy(&old, new_first, valid_end, offset, end, new_start) ||
+          !insert_free_extent(old.m_start, old.m_length) ||
+          (old.m_tail != END && !insert_free_extent(old.m_tail, 1))) {
+         transaction_rollback();
+         return false;
+      }
+   }
+   else {
+      new_start = old.m_start + (new_first - old.m_first);
+      new_length = new_end - new_first;
+
+      if (new_first > old.m_first &&
+          !insert_free_extent(old.m_start, new_first - old.m_first)) {
+         transaction_rollback();
+         return false;
+      }
+
+      if (new_end < old_end && new_end > new_first &&
+          !insert_free_extent(old.m_start + (new_end - old.m_first), old_end - new_end)) {
+         transaction_rollback();
+         return false;
+      }
+
+      if (drop_tail != END && !insert_free_extent(drop_tail, 1)) {
+         transaction_rollback();
+         return false;
+      }
+   }
+
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
+   }
+
+   if (new_end == new_first) {
+      node_work1.m_data.m_start = END;
+      node_work1.m_data.m_first = 0;
+      node_work1.m_data.m_length = 0;
+      node_work1.m_data.m_valid = 0;
+   }
+   else {
+      node_work1.m_data.m_start = new_start;
+      node_work1.m_data.m_first = new_first;
+      node_work1.m_data.m_length = new_length;
+      node_work1.m_data.m_valid = valid_end - new_first;
+   }
+   if (copy || drop_tail != END) {
+      node_work1.m_data.m_tail = END;
+      node_work1.m_data.m_tail_at = 0;
+   }
+
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) {
+      transaction_rollback();
+      return false;
+   }
+   root.m_data_root = newroot;
+
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+
+   return true;
+}
+
+//! @brief Set a key's growth slack hint and grow or trim its extent to match.
+bool narf_reserve(const char *key, NarfSector sectors) {
+   DataPayload old;
+   NarfSector target;
+   NarfSector grown;
+   NarfSector newroot;
+
+   perf_begin(NARF_PERF_REALLOC);
+   record(NARF_RECORD_RESERVE, key, NULL, 0, sectors, NULL);
+   if (!verify_live()) return false;
+   if (!valid_key(key)) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   if (!valid_data_payload(&node_work1.m_data)) return false;
+
+   old = node_work1.m_data;
+   if (old.m_slack == sectors) return true;
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_pins(old.m_born)) {
+      if (!snapshot_detach(key)) return false;
+      old = node_work1.m_data;
+   }
+#endif
+#ifdef NARF_USE_DEDUP
+   if (old.m_shared) {
+      if (!share_detach(key)) return false;
+      old = node_work1.m_data;
+   }
+#endif
+
+   transaction_begin();
+
+   target = payload_limit(&old, sectors);
+   grown = old.m_length;
+   if (old.m_length != 0 && target > old.m_length) {
+      // Slack that cannot be claimed in place now comes with the next copy.
+      if (old.m_length <= ((NarfSector) -1) - old.m_start &&
+          allocate_tail_extent(old.m_start + old.m_length, target - old.m_length)) {
+         grown = target;
+      }
+   }
+   else if (old.m_length != 0 && target < old.m_length) {
+      if (!insert_free_extent(old.m_start + target, old.m_length - target)) {
+         transaction_rollback();
+         return false;
+      }
+      grown = target;
+   }
+
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
+   }
+   node_work1.m_data.m_length = grown;
+   node_work1.m_data.m_slack = sectors;
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) {
+      transaction_rollback();
+      return false;
+   }
+   root.m_data_root = newroot;
+
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   return true;
+}
+
+#ifdef NARF_USE_COMPRESSION
+//! @brief Convert a key between plain and compressed payload storage.
+bool narf_set_compressed(const char *key, bool compressed) {
+   DataPayload old;
+
+   perf_begin(NARF_PERF_COMPRESS);
+   if (!verify_live()) return false;
+   if (!valid_key(key)) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   if (!valid_data_payload(&node_work1.m_data)) return false;
+
+   old = node_work1.m_data;
+   if ((old.m_codec != CODEC_PLAIN) == compressed) return true;
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_pins(old.m_born)) {
+      if (!snapshot_detach(key)) return false;
+      old = node_work1.m_data;
+   }
+#endif
+#ifdef NARF_USE_DEDUP
+   if (old.m_shared) {
+      if (!share_detach(key)) return false;
+      old = node_work1.m_data;
+   }
+#endif
+   if (compressed) return chunk_write(key, &old, NULL, 0, 0, old.m_bytes, NULL);
+   return chunk_unpack(key, &old);
+}
+
+//! @brief Return whether a key's payload is stored compressed.
+bool narf_compressed(const char *key) {
+   perf_begin(NARF_PERF_FIND);
+   if (!verify()) return false;
+   if (!valid_key(key)) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   return node_work1.m_data.m_codec != CODEC_PLAIN;
 }
+#endif
 
 //! @brief Return a copy of a key metadata area.
 void *narf_metadata(const char *key) {
    static uint8_t metadata[NARF_METADATA_SIZE];
+   perf_begin(NARF_PERF_FIND);
    if (!verify()) return NULL;
    if (!valid_key(key)) return NULL;
    if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return NULL;
@@ -3452,7 +8561,8 @@ void *narf_metadata(const char *key) {
 bool narf_set_metadata(const char *key, void *data) {
    NarfSector newroot;
 
-   if (!verify()) return false;
+   perf_begin(NARF_PERF_METADATA);
+   if (!verify_live()) return false;
    if (!valid_key(key)) return false;
    if (data == NULL) return false;
    if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
@@ -3474,85 +8584,169 @@ bool narf_set_metadata(const char *key, void *data) {
    return true;
 }
 
-//! @brief Atomically write bytes at an offset in a key payload.
-bool narf_write_with_metadata(const char *key, const void *data, NarfByteSize size, NarfByteSize offset, const char *metadata) {
+//! @brief Copy a key's tail copy back into its extent slot and free it.
+//!
+//! Runs as its own commit: the slot is unreferenced while the tail copy is
+//! live, so it can be overwritten before the node stops pointing at the copy.
+static bool fold_tail(const char *key, bool may_use_reserve) {
+   NarfSector tail;
+   NarfSector newroot;
+
+   transaction_begin();
+   transaction_may_use_reserve = may_use_reserve;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
+   }
+   tail = node_work1.m_data.m_tail;
+   if (tail == END) {
+      transaction_rollback();
+      return true;
+   }
+   if (!payload_read(tail, buffer) ||
+       !payload_write(node_work1.m_data.m_start +
+                      (node_work1.m_data.m_tail_at - node_work1.m_data.m_first), buffer) ||
+       !insert_free_extent(tail, 1) ||
+       !data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
+      transaction_rollback();
+      return false;
+   }
+   node_work1.m_data.m_tail = END;
+   node_work1.m_data.m_tail_at = 0;
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) {
+      transaction_rollback();
+      return false;
+   }
+   root.m_data_root = newroot;
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+   return true;
+}
+
+//! @brief Write bytes at an offset in a key payload in one transaction.
+static bool write_with_metadata(const char *key, const void *data, NarfByteSize size,
+                                NarfByteSize offset, const char *metadata) {
    NarfSector newroot;
    NarfByteSize write_end;
    NarfByteSize new_bytes;
    NarfByteSize old_bytes;
-   NarfSector old_start;
-   NarfSector old_length;
+   DataPayload old;
+   NarfSector old_end;
+   NarfSector new_first;
+   NarfSector new_end;
    NarfSector new_length;
-   NarfSector new_start;
+   NarfSector new_start = END;
+   NarfSector new_valid;
    NarfSector i;
    const uint8_t *src = (const uint8_t *) data;
+   bool has_data;
 
-   if (!verify()) return false;
+   if (!verify_live()) return false;
    if (!valid_key(key)) return false;
    if (size > ((NarfByteSize) -1) - offset) return false;
    if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+   if (!valid_data_payload(&node_work1.m_data)) return false;
 
-   old_bytes = node_work1.m_data.m_bytes;
-   old_start = node_work1.m_data.m_start;
-   old_length = node_work1.m_data.m_length;
+   old = node_work1.m_data;
+   old_bytes = old.m_bytes;
    write_end = offset + size;
    new_bytes = old_bytes;
    if (write_end > new_bytes) new_bytes = write_end;
+   has_data = src != NULL && size != 0;
 
    if (size == 0 && new_bytes == old_bytes) {
       return true;
    }
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_pins(old.m_born)) {
+      if (!snapshot_detach(key)) return false;
+      old = node_work1.m_data;
+   }
+#endif
+#ifdef NARF_USE_DEDUP
+   if (old.m_shared) {
+      if (!share_detach(key)) return false;
+      old = node_work1.m_data;
+   }
+#endif
+#ifdef NARF_USE_COMPRESSION
+   if (old.m_codec != CODEC_PLAIN) {
+      return chunk_write(key, &old, src, size, offset, new_bytes, metadata);
+   }
+#endif
+
+   if (has_data && old.m_tail != END && old.m_tail == old.m_start + old.m_length &&
+       BYTES2SECTORS(write_end) > old.m_first + old.m_length) {
+      // The tail copy sits where the extent would grow into.
+      if (!fold_tail(key, false)) return false;
+      if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+      old = node_work1.m_data;
+   }
 
    transaction_begin();
 
-   if (!metadata && offset == old_bytes && new_bytes > old_bytes) {
-      if (write_append_fast(key, src, size, old_bytes, old_start, old_length, new_bytes)) {
-         if (!commit_user_transaction()) {
-            transaction_rollback();
-            return false;
-         }
-         return true;
+   if (write_unwritten_fast(key, src, size, offset, &old, new_bytes, metadata)) {
+      if (!commit_user_transaction()) {
+         transaction_rollback();
+         return false;
       }
-
-      transaction_rollback();
-      transaction_begin();
+      return true;
    }
 
-   new_length = BYTES2SECTORS(new_bytes);
+   transaction_rollback();
+   transaction_begin();
+
+   // The copy covers the old extent plus the written sectors; only the
+   // written prefix of it is filled, the rest stays unwritten.
+   old_end = old.m_first + old.m_length;
+   new_first = old.m_first;
+   new_end = old_end;
+   new_valid = old.m_first + old.m_valid;
+   if (old.m_length == 0) {
+      new_first = (NarfSector) (offset / NARF_SECTOR_SIZE);
+      new_end = new_first;
+      new_valid = new_first;
+   }
+   if (has_data) {
+      if ((NarfSector) (offset / NARF_SECTOR_SIZE) < new_first) {
+         new_first = (NarfSector) (offset / NARF_SECTOR_SIZE);
+      }
+      if (BYTES2SECTORS(write_end) > new_end) new_end = BYTES2SECTORS(write_end);
+      if (BYTES2SECTORS(write_end) > new_valid) new_valid = BYTES2SECTORS(write_end);
+   }
+   new_length = new_end - new_first;
+   new_valid -= new_first;
 
-   if (!allocate_data_extent(new_length, &new_start)) {
+   if (new_length != 0 &&
+       !allocate_slack_extent(new_length,
+                              payload_slack_room(new_bytes, new_first, new_length, old.m_slack),
+                              &new_start, &new_length)) {
       transaction_rollback();
       return false;
    }
 
-   for (i = 0; i < new_length; i++) {
+   for (i = 0; i < new_valid; i++) {
+      NarfSector sector = new_first + i;
       NarfByteSize base;
-      NarfByteSize sector_bytes = NARF_SECTOR_SIZE;
       NarfByteSize sector_end;
 
-      if (i > ((NarfByteSize) -1) / NARF_SECTOR_SIZE) {
+      if (sector > ((NarfByteSize) -1) / NARF_SECTOR_SIZE) {
          transaction_rollback();
          return false;
       }
 
-      base = (NarfByteSize) i * NARF_SECTOR_SIZE;
-
-      if (((NarfByteSize) -1) - base < sector_bytes) {
-         sector_bytes = ((NarfByteSize) -1) - base;
-      }
-
-      sector_end = base + sector_bytes;
+      base = (NarfByteSize) sector * NARF_SECTOR_SIZE;
+      sector_end = base + NARF_SECTOR_SIZE;
 
       memset(buffer, 0, sizeof(buffer));
 
-      if (base < old_bytes && old_start != END && i < old_length) {
+      if (base < old_bytes && old.m_length != 0 && sector >= old.m_first &&
+          sector - old.m_first < old.m_valid) {
          NarfByteSize old_n = old_bytes - base;
 
-         if (old_n > sector_bytes) {
-            old_n = sector_bytes;
-         }
-
-         if (!narf_io_read(root.m_origin + old_start + i, buffer)) {
+         if (!payload_read(payload_sector(&old, sector), buffer)) {
             transaction_rollback();
             return false;
          }
@@ -3576,18 +8770,22 @@ bool narf_write_with_metadata(const char *key, const void *data, NarfByteSize si
          }
       }
 
-      if (!narf_io_write(root.m_origin + new_start + i, buffer)) {
+      if (!payload_write(new_start + i, buffer)) {
          transaction_rollback();
          return false;
       }
    }
 
-   if (old_length > 0) {
-      if (!insert_free_extent(old_start, old_length)) {
+   if (old.m_length > 0) {
+      if (!insert_free_extent(old.m_start, old.m_length)) {
          transaction_rollback();
          return false;
       }
    }
+   if (old.m_tail != END && !insert_free_extent(old.m_tail, 1)) {
+      transaction_rollback();
+      return false;
+   }
 
    if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) {
       transaction_rollback();
@@ -3595,8 +8793,12 @@ bool narf_write_with_metadata(const char *key, const void *data, NarfByteSize si
    }
 
    node_work1.m_data.m_start = new_length ? new_start : END;
+   node_work1.m_data.m_first = new_length ? new_first : 0;
    node_work1.m_data.m_length = new_length;
    node_work1.m_data.m_bytes = new_bytes;
+   node_work1.m_data.m_valid = new_valid;
+   node_work1.m_data.m_tail = END;
+   node_work1.m_data.m_tail_at = 0;
 
    if (metadata) {
       memset(node_work1.m_data.m_metadata, 0, sizeof(node_work1.m_data.m_metadata));
@@ -3619,24 +8821,35 @@ bool narf_write_with_metadata(const char *key, const void *data, NarfByteSize si
    return true;
 }
 
+//! @brief Atomically write bytes at an offset in a key payload, overwriting existing metadata.
+bool narf_write_with_metadata(const char *key, const void *data, NarfByteSize size, NarfByteSize offset, const char *metadata) {
+   perf_begin(NARF_PERF_WRITE);
+   record(NARF_RECORD_WRITE, key, NULL, offset, size, data);
+   return write_with_metadata(key, data, size, offset, metadata);
+}
+
 //! @brief Atomically write bytes at an offset in a key payload.
 bool narf_write(const char *key, const void *data, NarfByteSize size, NarfByteSize offset) {
-   return narf_write_with_metadata(key, data, size, offset, NULL);
+   perf_begin(NARF_PERF_WRITE);
+   record(NARF_RECORD_WRITE, key, NULL, offset, size, data);
+   return write_with_metadata(key, data, size, offset, NULL);
 }
 
 //! @brief Append bytes to a key payload.
 bool narf_append(const char *key, const void *data, NarfByteSize size) {
    NarfByteSize old_size;
 
-   if (!verify()) return false;
+   perf_begin(NARF_PERF_WRITE);
+   record(NARF_RECORD_APPEND, key, NULL, 0, size, data);
+   if (!verify_live()) return false;
    if (!valid_key(key)) return false;
    if (data == NULL && size != 0) return false;
-   if (!data_find_sector_rec(root.m_data_root, key, NULL, NULL)) return false;
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
 
-   old_size = narf_size(key);
+   old_size = node_work1.m_data.m_bytes;
    if (size > ((NarfByteSize) -1) - old_size) return false;
 
-   return narf_write(key, data, size, old_size);
+   return write_with_metadata(key, data, size, old_size, NULL);
 }
 
 #ifdef NARF_USE_DEFRAG
@@ -3647,7 +8860,6 @@ static bool defrag_carve_rec(NarfSector sector, bool *changed) {
    NarfSector right;
    NarfSector data_start;
    NarfSector data_length;
-   NarfByteSize data_bytes;
    NarfSector needed;
    NarfSector free_start;
    NarfSector free_length;
@@ -3667,35 +8879,50 @@ static bool defrag_carve_rec(NarfSector sector, bool *changed) {
 
    data_start = node_work0.m_data.m_start;
    data_length = node_work0.m_data.m_length;
-   data_bytes = node_work0.m_data.m_bytes;
    strncpy(key_work, node_work0.m_key, sizeof(key_work));
    key_work[sizeof(key_work) - 1] = 0;
 
-   needed = BYTES2SECTORS(data_bytes);
+   if (node_work0.m_data.m_tail != END) {
+      // A tail copy would pin a stray sector below the payload frontier.
+      if (!fold_tail(key_work, true)) return false;
+      *changed = true;
+      return true;
+   }
+
+   // Growth slack survives unless the payload/catalog gap runs low.
+   needed = payload_limit(&node_work0.m_data,
+                          root.m_top - root.m_bottom < NARF_SLACK_TIGHT_SECTORS ?
+                          0 : node_work0.m_data.m_slack);
    if (needed < data_length) {
+      free_start = data_start + needed;
+      free_length = data_length - needed;
+
       transaction_begin();
       transaction_may_use_reserve = true;
 
+      // insert_free_extent() builds its node in node_work1, so the key is
+      // looked up only afterwards.
+      if (!insert_free_extent(free_start, free_length)) {
+         transaction_rollback();
+         return false;
+      }
+
       if (!data_find_sector_rec(root.m_data_root, key_work, NULL, &node_work1)) {
          transaction_rollback();
          return false;
       }
 
       if (needed == 0) {
-         free_start = data_start;
-         free_length = data_length;
          node_work1.m_data.m_start = END;
+         node_work1.m_data.m_first = 0;
          node_work1.m_data.m_length = 0;
+         node_work1.m_data.m_valid = 0;
       }
       else {
-         free_start = data_start + needed;
-         free_length = data_length - needed;
          node_work1.m_data.m_length = needed;
-      }
-
-      if (free_length != 0 && !insert_free_extent(free_start, free_length)) {
-         transaction_rollback();
-         return false;
+         if (node_work1.m_data.m_valid > needed) {
+            node_work1.m_data.m_valid = needed;
+         }
       }
 
       if (!data_update_rec(root.m_data_root, key_work, &node_work1, &newroot)) {
@@ -3704,7 +8931,6 @@ static bool defrag_carve_rec(NarfSector sector, bool *changed) {
       }
       root.m_data_root = newroot;
 
-
       if (!commit_user_transaction()) {
          transaction_rollback();
          return false;
@@ -3724,6 +8950,24 @@ static bool defrag_carve_once(bool *changed) {
    return defrag_carve_rec(root.m_data_root, changed);
 }
 
+//! @brief Point a moved payload extent's key at its new start.
+//!
+//! Runs inside the open transaction.  Every key sharing the extent follows.
+static bool defrag_retarget(const char *key, NarfSector start) {
+   NarfSector newroot;
+
+   if (!data_find_sector_rec(root.m_data_root, key, NULL, &node_work1)) return false;
+#ifdef NARF_USE_DEDUP
+   if (node_work1.m_data.m_shared) {
+      return share_move(node_work1.m_data.m_hash, node_work1.m_data.m_start, start);
+   }
+#endif
+   node_work1.m_data.m_start = start;
+   if (!data_update_rec(root.m_data_root, key, &node_work1, &newroot)) return false;
+   root.m_data_root = newroot;
+   return true;
+}
+
 //! @brief Helper function for defrag_squish_lowest_hole_after.
 static bool dslha_helper(NarfSector sector, NarfSector target, NarfSector *node, NarfSector *hole, NarfSector *size) {
    NarfSector left;
@@ -3824,6 +9068,7 @@ static bool defrag_squish_once(bool *changed) {
    NarfSector search;
    NarfSector old_start;
    NarfSector old_length;
+   NarfSector old_valid;
 
    if (!changed) return false;
    *changed = false;
@@ -3842,16 +9087,19 @@ static bool defrag_squish_once(bool *changed) {
                 node_work1.m_data.m_length != old_length) return false;
             strncpy(key_work, node_work1.m_key, sizeof(key_work));
             key_work[sizeof(key_work) - 1] = 0;
+            old_valid = node_work1.m_data.m_valid;
+            if (old_valid > old_length) return false;
 
             if (old_start == END || old_length == 0 || old_length > hole_length) return false;
             if (old_start < hole + hole_length) return false;
 
             if (old_start > root.m_total_sectors || old_length > root.m_total_sectors - old_start) return false;
             if (hole > root.m_total_sectors || old_length > root.m_total_sectors - hole) return false;
-            for (search = 0; search < old_length; search++) {
-               if (!narf_io_read(root.m_origin + old_start + search, buffer)) return false;
-               if (!narf_io_write(root.m_origin + hole + search, buffer)) return false;
+            for (search = 0; search < old_valid; search++) {
+               if (!payload_read(old_start + search, buffer)) return false;
+               if (!payload_write(hole + search, buffer)) return false;
             }
+            defrag_moved += old_valid;
 
             transaction_begin();
             transaction_may_use_reserve = true;
@@ -3863,16 +9111,10 @@ static bool defrag_squish_once(bool *changed) {
             }
             root.m_free_root = data_sector;
 
-            if (!data_find_sector_rec(root.m_data_root, key_work, NULL, &node_work1)) {
-               transaction_rollback();
-               return false;
-            }
-            node_work1.m_data.m_start = hole;
-            if (!data_update_rec(root.m_data_root, key_work, &node_work1, &data_sector)) {
+            if (!defrag_retarget(key_work, hole)) {
                transaction_rollback();
                return false;
             }
-            root.m_data_root = data_sector;
 
             if (old_start == hole + hole_length) {
                if (!insert_free_extent_with_seed_sector(free_sector,
@@ -4041,6 +9283,7 @@ static bool defrag_widen_once(bool *changed) {
    NarfSector hole;
    NarfSector hole_length;
    NarfSector data_length;
+   NarfSector valid;
 
    if (changed == NULL) return false;
    *changed = false;
@@ -4049,69 +9292,371 @@ static bool defrag_widen_once(bool *changed) {
                           &data_sector, &data_length)) {
       return false;
    }
-   if (free_sector == END) return true;
+   if (free_sector == END) return true;
+
+   if (hole == END || hole_length == 0 || hole > END - hole_length) return false;
+   if (data_length == 0 || root.m_bottom > root.m_top) return false;
+   if (data_length > END - hole_length) return false;
+   if (data_length > root.m_top - root.m_bottom) return false;
+   if (hole + hole_length > root.m_total_sectors ||
+       data_length > root.m_total_sectors - (hole + hole_length)) {
+      return false;
+   }
+   if (root.m_bottom > root.m_total_sectors ||
+       data_length > root.m_total_sectors - root.m_bottom) {
+      return false;
+   }
+
+   if (!read_node(data_sector, &node_work1)) return false;
+   if (node_work1.m_data.m_start != hole + hole_length ||
+       node_work1.m_data.m_length != data_length) {
+      return false;
+   }
+   strncpy(key_work, node_work1.m_key, sizeof(key_work));
+   key_work[sizeof(key_work) - 1] = 0;
+   if (node_work1.m_data.m_valid > data_length) return false;
+   valid = node_work1.m_data.m_valid;
+
+   for (data_sector = 0; data_sector < valid; data_sector++) {
+      if (!payload_read(hole + hole_length + data_sector,
+                        buffer)) {
+         return false;
+      }
+      if (!payload_write(root.m_bottom + data_sector,
+                         buffer)) {
+         return false;
+      }
+   }
+   defrag_moved += valid;
+
+   transaction_begin();
+   transaction_may_use_reserve = true;
+
+   if (!free_delete_rec(root.m_free_root, hole_length, hole, free_sector,
+                        &data_sector, &free_sector, NULL)) {
+      transaction_rollback();
+      return false;
+   }
+   root.m_free_root = data_sector;
+
+   data_sector = root.m_bottom;
+   root.m_bottom += data_length;
+   if (!defrag_retarget(key_work, data_sector)) {
+      transaction_rollback();
+      return false;
+   }
+
+   if (!insert_free_extent_with_seed_sector(free_sector, hole,
+                                            hole_length + data_length)) {
+      transaction_rollback();
+      return false;
+   }
+
+   if (!commit_user_transaction()) {
+      transaction_rollback();
+      return false;
+   }
+
+   *changed = true;
+   return true;
+}
+
+#ifdef NARF_USE_DEFRAG_PLAN
+//! @brief One data extent in a defrag plan snapshot.
+typedef struct {
+   NarfSector m_start;
+   NarfSector m_length;
+   NarfSector m_node;
+} DefragExtent;
+
+//! @brief Data extents of the committed tree, sorted by start sector.
+typedef struct {
+   DefragExtent *m_extents;
+   size_t m_count;
+   size_t m_capacity;
+} DefragPlan;
+
+//! @brief One planned payload move.
+typedef struct {
+   DefragExtent m_extent;
+   NarfSector m_destination;
+} DefragMove;
+
+//! @brief One hole below the compacted payload boundary.
+typedef struct {
+   NarfSector m_start;
+   NarfSector m_length;
+} DefragHole;
+
+//! @brief Append the data extents of a subtree to the plan.
+//!
+//! Only node sectors are kept; keys are re-read at execution time because
+//! committed catalog sectors stay valid until the next commit.
+static bool defrag_plan_collect_rec(DefragPlan *plan, NarfSector sector) {
+   NarfSector left;
+   NarfSector right;
+   NarfSector start;
+   NarfSector length;
+
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   start = node_work0.m_data.m_start;
+   length = node_work0.m_data.m_length;
+
+   if (start != END && length != 0) {
+      if (plan->m_count == plan->m_capacity) {
+         size_t capacity = plan->m_capacity ? plan->m_capacity * 2 : 256;
+         DefragExtent *grown = realloc(plan->m_extents,
+                                       capacity * sizeof(*grown));
+
+         if (grown == NULL) return false;
+         plan->m_extents = grown;
+         plan->m_capacity = capacity;
+      }
+      plan->m_extents[plan->m_count].m_start = start;
+      plan->m_extents[plan->m_count].m_length = length;
+      plan->m_extents[plan->m_count].m_node = sector;
+      plan->m_count++;
+   }
+
+   return defrag_plan_collect_rec(plan, left) &&
+          defrag_plan_collect_rec(plan, right);
+}
+
+//! @brief qsort() address order for planned extents.
+static int defrag_extent_cmp(const void *a, const void *b) {
+   const DefragExtent *x = a;
+   const DefragExtent *y = b;
+
+   if (x->m_start < y->m_start) return -1;
+   if (x->m_start > y->m_start) return 1;
+   return 0;
+}
+
+//! @brief qsort() order for movers: largest first, highest first on ties.
+static int defrag_mover_cmp(const void *a, const void *b) {
+   const DefragExtent *x = a;
+   const DefragExtent *y = b;
+
+   if (x->m_length != y->m_length) return x->m_length > y->m_length ? -1 : 1;
+   if (x->m_start != y->m_start) return x->m_start > y->m_start ? -1 : 1;
+   return 0;
+}
+
+//! @brief Choose the next batch of moves into holes below the final boundary.
+//!
+//! Fully compacted payload would end at 2 plus the sum of all extent lengths.
+//! Extents already below that boundary stay put; those reaching past it are
+//! assigned, largest first, to the smallest hole below it that fits.  Holes
+//! are free in the committed root and never overlap any source, so every
+//! move in a batch is independent and power-loss safe.  Extents that fit no
+//! hole are left for the greedy phases.
+static size_t defrag_plan_batch(DefragPlan *plan, DefragMove *moves) {
+   DefragHole *holes;
+   DefragExtent *movers;
+   NarfSector boundary = 2;
+   NarfSector cursor = 2;
+   NarfSector planned = 0;
+   size_t hole_count = 0;
+   size_t mover_count = 0;
+   size_t count = 0;
+
+   if (plan->m_count == 0) return 0;
+
+   for (size_t i = 0; i < plan->m_count; i++) {
+      boundary += plan->m_extents[i].m_length;
+   }
+
+   holes = malloc(plan->m_count * sizeof(*holes));
+   movers = malloc(plan->m_count * sizeof(*movers));
+   if (holes == NULL || movers == NULL) {
+      free(holes);
+      free(movers);
+      return 0;
+   }
+
+   for (size_t i = 0; i < plan->m_count; i++) {
+      const DefragExtent *e = &plan->m_extents[i];
+
+      if (e->m_start < cursor) {
+         mover_count = 0;
+         break;
+      }
+      if (e->m_start > cursor && cursor < boundary) {
+         holes[hole_count].m_start = cursor;
+         holes[hole_count].m_length = e->m_start - cursor;
+         hole_count++;
+      }
+      if (e->m_start + e->m_length > boundary) movers[mover_count++] = *e;
+      cursor = e->m_start + e->m_length;
+   }
+
+   qsort(movers, mover_count, sizeof(*movers), defrag_mover_cmp);
+
+   for (size_t i = 0; i < mover_count && count < NARF_DEFRAG_PLAN_BATCH; i++) {
+      const DefragExtent *e = &movers[i];
+      DefragHole *best = NULL;
+
+      if (defrag_move_limit != 0 &&
+          defrag_moved + planned >= defrag_move_limit) {
+         break;
+      }
+
+      for (size_t j = 0; j < hole_count; j++) {
+         if (holes[j].m_length >= e->m_length &&
+             holes[j].m_start < e->m_start &&
+             (best == NULL || holes[j].m_length < best->m_length)) {
+            best = &holes[j];
+         }
+      }
+      if (best == NULL) continue;
+
+      moves[count].m_extent = *e;
+      moves[count].m_destination = best->m_start;
+      best->m_start += e->m_length;
+      best->m_length -= e->m_length;
+      planned += e->m_length;
+      count++;
+   }
+
+   free(holes);
+   free(movers);
+   return count;
+}
+
+//! @brief Apply one planned move inside the open transaction.
+//!
+//! @param applied Set false without changing anything when the catalog no
+//!                longer matches the plan.
+static bool defrag_plan_apply(const DefragExtent *e, NarfSector destination,
+                              bool *applied) {
+   NarfSector free_sector;
+   NarfSector newroot;
+   NarfSector valid;
+   NarfSector i;
+   FreePayload hole;
+
+   *applied = false;
+
+   if (!read_node(e->m_node, &node_work1)) return false;
+   strncpy(key_work, node_work1.m_key, sizeof(key_work));
+   key_work[sizeof(key_work) - 1] = 0;
+
+   if (!data_find_sector_rec(root.m_data_root, key_work, NULL, &node_work1)) {
+      return false;
+   }
+   if (node_work1.m_data.m_start != e->m_start ||
+       node_work1.m_data.m_length != e->m_length ||
+       node_work1.m_data.m_valid > e->m_length) {
+      return true;
+   }
+   valid = node_work1.m_data.m_valid;
+   if (!free_find_start_rec(root.m_free_root, destination, &free_sector,
+                            &hole) ||
+       hole.m_length < e->m_length ||
+       destination + e->m_length > e->m_start) {
+      return true;
+   }
 
-   if (hole == END || hole_length == 0 || hole > END - hole_length) return false;
-   if (data_length == 0 || root.m_bottom > root.m_top) return false;
-   if (data_length > END - hole_length) return false;
-   if (data_length > root.m_top - root.m_bottom) return false;
-   if (hole + hole_length > root.m_total_sectors ||
-       data_length > root.m_total_sectors - (hole + hole_length)) {
-      return false;
+   discard_claim(destination, e->m_length);
+   for (i = 0; i < valid; i++) {
+      if (!payload_read(e->m_start + i, buffer)) return false;
+      if (!payload_write(destination + i, buffer)) return false;
    }
-   if (root.m_bottom > root.m_total_sectors ||
-       data_length > root.m_total_sectors - root.m_bottom) {
+   defrag_moved += valid;
+
+   if (!free_delete_rec(root.m_free_root, hole.m_length, hole.m_start,
+                        free_sector, &newroot, &free_sector, NULL)) {
       return false;
    }
+   root.m_free_root = newroot;
 
-   if (!read_node(data_sector, &node_work1)) return false;
-   if (node_work1.m_data.m_start != hole + hole_length ||
-       node_work1.m_data.m_length != data_length) {
+   if (!defrag_retarget(key_work, destination)) return false;
+
+   // No seed sector: the removed node may already belong to this
+   // transaction and is retired, so it must not be rewritten in place.
+   if (!insert_free_extent(destination + e->m_length,
+                           hole.m_length - e->m_length) ||
+       !insert_free_extent(e->m_start, e->m_length)) {
       return false;
    }
-   strncpy(key_work, node_work1.m_key, sizeof(key_work));
-   key_work[sizeof(key_work) - 1] = 0;
 
-   for (data_sector = 0; data_sector < data_length; data_sector++) {
-      if (!narf_io_read(root.m_origin + hole + hole_length + data_sector,
-                        buffer)) {
-         return false;
-      }
-      if (!narf_io_write(root.m_origin + root.m_bottom + data_sector,
-                         buffer)) {
-         return false;
+   *applied = true;
+   return true;
+}
+
+//! @brief Move a batch of data extents into lower holes in one commit.
+//!
+//! Heap memory holds a few entries per file.  Without it, or once no extent
+//! past the boundary fits a hole, the pass reports no change and the greedy
+//! phases finish the remaining holes.
+static bool defrag_plan_once(bool *changed) {
+   DefragPlan plan = { NULL, 0, 0 };
+   DefragMove moves[NARF_DEFRAG_PLAN_BATCH];
+   size_t count;
+   size_t applied = 0;
+   bool ok = true;
+
+   if (changed == NULL) return false;
+   *changed = false;
+
+   if (!defrag_plan_collect_rec(&plan, root.m_data_root)) {
+      free(plan.m_extents);
+      return true;
+   }
+
+   // Sort by start; keys sharing an extent collect it once each, so keep one
+   // copy.
+   if (plan.m_count > 1) {
+      size_t kept = 1;
+
+      qsort(plan.m_extents, plan.m_count, sizeof(*plan.m_extents),
+            defrag_extent_cmp);
+
+      for (size_t i = 1; i < plan.m_count; i++) {
+         if (plan.m_extents[i].m_start != plan.m_extents[kept - 1].m_start) {
+            plan.m_extents[kept++] = plan.m_extents[i];
+         }
       }
+      plan.m_count = kept;
    }
 
+   count = defrag_plan_batch(&plan, moves);
+   free(plan.m_extents);
+   if (count == 0) return true;
+
    transaction_begin();
    transaction_may_use_reserve = true;
 
-   if (!free_delete_rec(root.m_free_root, hole_length, hole, free_sector,
-                        &data_sector, &free_sector, NULL)) {
-      transaction_rollback();
-      return false;
-   }
-   root.m_free_root = data_sector;
+   for (size_t i = 0; i < count; i++) {
+      bool moved;
 
-   if (!data_find_sector_rec(root.m_data_root, key_work, NULL, &node_work1)) {
-      transaction_rollback();
-      return false;
+      // Leave room for the commit path once the gap nears the reserve.
+      if (applied != 0 &&
+          (retired_node_count >= RETIRED_MAX / 2 ||
+           root.m_top - root.m_bottom <= metadata_reserve() + RETIRED_MAX)) {
+         break;
+      }
+      if (!defrag_plan_apply(&moves[i].m_extent, moves[i].m_destination,
+                             &moved)) {
+         ok = false;
+         break;
+      }
+      if (!moved) break;
+      applied++;
    }
-   node_work1.m_data.m_start = root.m_bottom;
-   root.m_bottom += data_length;
 
-   if (!data_update_rec(root.m_data_root, key_work, &node_work1, &data_sector)) {
+   if (!ok) {
       transaction_rollback();
       return false;
    }
-   root.m_data_root = data_sector;
-
-   if (!insert_free_extent_with_seed_sector(free_sector, hole,
-                                            hole_length + data_length)) {
+   if (applied == 0) {
       transaction_rollback();
-      return false;
+      return true;
    }
-
    if (!commit_user_transaction()) {
       transaction_rollback();
       return false;
@@ -4120,6 +9665,7 @@ static bool defrag_widen_once(bool *changed) {
    *changed = true;
    return true;
 }
+#endif
 
 //! @brief Persist any reclaimable spare prefix at the catalog frontier.
 //!
@@ -4187,6 +9733,30 @@ static bool defrag_catalog_path_rec(NarfSector sector, NarfSector target,
                                   path_length, found);
 }
 
+//! @brief Find the live tree holding a catalog sector and the path to it.
+//!
+//! On success *tree points at the root field of the owning tree, or is NULL
+//! when no tree reaches the sector.
+static bool defrag_catalog_path(NarfSector target, NarfSector *path,
+                                unsigned *path_length, NarfSector **tree) {
+   NarfSector *roots[] = { &root.m_data_root, &root.m_free_root,
+                           &root.m_shared_root };
+   bool found = false;
+
+   *tree = NULL;
+   for (unsigned i = 0; i < sizeof(roots) / sizeof(roots[0]); i++) {
+      if (!defrag_catalog_path_rec(*roots[i], target, path, 0,
+                                   path_length, &found)) {
+         return false;
+      }
+      if (found) {
+         *tree = roots[i];
+         break;
+      }
+   }
+   return true;
+}
+
 //! @brief Count spare sectors up to a caller-supplied limit.
 //!
 //! Stopping at limit avoids a complete list walk when the caller only needs to
@@ -4238,8 +9808,7 @@ static bool defrag_relax_once(bool *changed) {
    NarfSector reserve;
    unsigned path_length = 0;
    unsigned spare_count;
-   bool found = false;
-   bool free_tree = false;
+   NarfSector *tree;
 
    if (changed == NULL) return false;
    *changed = false;
@@ -4248,18 +9817,8 @@ static bool defrag_relax_once(bool *changed) {
    if (root.m_top >= root.m_total_sectors) return true;
 
    target = root.m_top;
-   if (!defrag_catalog_path_rec(root.m_data_root, target, path, 0,
-                                &path_length, &found)) {
-      return false;
-   }
-   if (!found) {
-      if (!defrag_catalog_path_rec(root.m_free_root, target, path, 0,
-                                   &path_length, &found)) {
-         return false;
-      }
-      free_tree = found;
-   }
-   if (!found || path_length == 0) return false;
+   if (!defrag_catalog_path(target, path, &path_length, &tree)) return false;
+   if (tree == NULL || path_length == 0) return false;
 
    if (!defrag_count_spares_up_to(path_length, &spare_count)) return false;
    if (spare_count == 0 || spare_count >= path_length) return true;
@@ -4275,6 +9834,7 @@ static bool defrag_relax_once(bool *changed) {
 
    transaction_begin();
    root.m_top = new_top;
+   discard_claim(new_top, (NarfSector) path_length);
 
    for (unsigned i = path_length; i > 0; i--) {
       unsigned index = i - 1;
@@ -4309,12 +9869,8 @@ static bool defrag_relax_once(bool *changed) {
       }
    }
 
-   if (free_tree) {
-      root.m_free_root = replacement;
-   }
-   else {
-      root.m_data_root = replacement;
-   }
+   *tree = replacement;
+   defrag_moved += (NarfSector) path_length;
 
    if (!commit_user_transaction()) {
       transaction_rollback();
@@ -4337,8 +9893,7 @@ static bool defrag_squeeze_once(bool *changed) {
    NarfSector replacement = END;
    NarfSector target;
    unsigned path_length = 0;
-   bool found = false;
-   bool free_tree = false;
+   NarfSector *tree;
    bool enough;
 
    if (changed == NULL) return false;
@@ -4349,21 +9904,11 @@ static bool defrag_squeeze_once(bool *changed) {
 
    target = root.m_top;
 
-   if (!defrag_catalog_path_rec(root.m_data_root, target, path, 0,
-                                &path_length, &found)) {
-      return false;
-   }
-   if (!found) {
-      if (!defrag_catalog_path_rec(root.m_free_root, target, path, 0,
-                                   &path_length, &found)) {
-         return false;
-      }
-      free_tree = found;
-   }
+   if (!defrag_catalog_path(target, path, &path_length, &tree)) return false;
 
    // An initialized spare cache accounts for every unreachable catalog sector.
    // If m_top is neither spare nor reachable, the cache/tree state is invalid.
-   if (!found) return false;
+   if (tree == NULL) return false;
 
    if (!defrag_have_spares(path_length, &enough)) return false;
    if (!enough) return true;
@@ -4400,12 +9945,8 @@ static bool defrag_squeeze_once(bool *changed) {
       }
    }
 
-   if (free_tree) {
-      root.m_free_root = replacement;
-   }
-   else {
-      root.m_data_root = replacement;
-   }
+   *tree = replacement;
+   defrag_moved += (NarfSector) path_length;
 
    if (!commit_user_transaction()) {
       transaction_rollback();
@@ -4449,18 +9990,19 @@ static bool defrag_debug_status(int state, NarfSector start,
    double progress;
 
    switch (state) {
-      case 0: name = "carve"; break;
-      case 1: name = "squish"; break;
-      case 2: name = "widen"; break;
-      case 3: name = "reclaim"; break;
-      case 4: name = "relax"; break;
-      case 5: name = "squeeze"; break;
+      case NARF_DEFRAG_CARVE: name = "carve"; break;
+      case NARF_DEFRAG_PLAN: name = "plan"; break;
+      case NARF_DEFRAG_SQUISH: name = "squish"; break;
+      case NARF_DEFRAG_WIDEN: name = "widen"; break;
+      case NARF_DEFRAG_RECLAIM: name = "reclaim"; break;
+      case NARF_DEFRAG_RELAX: name = "relax"; break;
+      case NARF_DEFRAG_SQUEEZE: name = "squeeze"; break;
       default: name = "done"; break;
    }
 
    // Carve may create holes, so establish the fixed range only after
    // carve has completed.
-   if (state == 0 || !have_progress_range) {
+   if (state == NARF_DEFRAG_CARVE || !have_progress_range) {
       fprintf(stderr, "defrag state %d (%7s)\n", state, name);
       return true;
    }
@@ -4503,22 +10045,75 @@ static bool defrag_debug_status(int state, NarfSector start,
 }
 #endif
 
+//! @brief Run the current defrag phase once and select the next phase.
+static bool defrag_advance(bool *committed) {
+   bool changed = false;
+
+   if (committed == NULL) return false;
+
+   switch (defrag_phase) {
+      case NARF_DEFRAG_CARVE:
+         if (!defrag_carve_once(&changed)) return false;
+         if (!changed) defrag_phase = NARF_DEFRAG_PLAN;
+         break;
+      case NARF_DEFRAG_PLAN:
+#ifdef NARF_USE_DEFRAG_PLAN
+         if (!defrag_plan_once(&changed)) return false;
+#endif
+         if (!changed) defrag_phase = NARF_DEFRAG_SQUISH;
+         break;
+      case NARF_DEFRAG_SQUISH:
+         if (!defrag_squish_once(&changed)) return false;
+         if (!changed) defrag_phase = NARF_DEFRAG_WIDEN;
+         break;
+      case NARF_DEFRAG_WIDEN:
+         if (!defrag_widen_once(&changed)) return false;
+         if (!changed) defrag_phase = NARF_DEFRAG_RECLAIM;
+         else defrag_phase = NARF_DEFRAG_SQUISH;
+         break;
+      case NARF_DEFRAG_RECLAIM:
+         if (!defrag_reclaim_once(&changed)) return false;
+         if (!changed) defrag_phase = NARF_DEFRAG_RELAX;
+         break;
+      case NARF_DEFRAG_RELAX:
+         if (!defrag_relax_once(&changed)) return false;
+         defrag_phase = NARF_DEFRAG_SQUEEZE;
+         break;
+      case NARF_DEFRAG_SQUEEZE:
+         if (!defrag_squeeze_once(&changed)) return false;
+         if (!changed) defrag_phase = NARF_DEFRAG_DONE;
+         else defrag_phase = NARF_DEFRAG_RECLAIM;
+         break;
+      default:
+         defrag_phase = NARF_DEFRAG_DONE;
+         break;
+   }
+
+   *committed = changed;
+   return true;
+}
+
 //! @brief Defragment payload and catalog storage with bounded internal passes.
 bool narf_defrag(void) {
-   bool done = false;
-   bool changed;
-   int state = 0;
+   bool committed;
 #ifdef DEFRAG_DEBUG
    NarfSector progress_start = 0;
    NarfSector progress_finish = 0;
    bool have_progress_range = false;
 #endif
 
-   if (!verify()) return false;
+   perf_begin(NARF_PERF_DEFRAG);
+   if (!verify_live()) return false;
+#ifdef NARF_USE_SNAPSHOTS
+   // Defrag moves extents and catalog nodes that snapshots still reference.
+   if (snapshot_any()) return false;
+#endif
 
-   while (!done) {
+   defrag_phase = NARF_DEFRAG_CARVE;
+   defrag_move_limit = 0;
+   while (defrag_phase != NARF_DEFRAG_DONE) {
 #ifdef DEFRAG_DEBUG
-      if (state != 0 && !have_progress_range) {
+      if (defrag_phase != NARF_DEFRAG_CARVE && !have_progress_range) {
          NarfSector total_file_sectors = 0;
          NarfSector free_sector;
          NarfSector hole_length;
@@ -4540,41 +10135,12 @@ bool narf_defrag(void) {
          }
          have_progress_range = true;
       }
-      if (!defrag_debug_status(state, progress_start, progress_finish,
-                               have_progress_range)) {
+      if (!defrag_debug_status((int) defrag_phase, progress_start,
+                               progress_finish, have_progress_range)) {
          return false;
       }
 #endif
-      switch (state) {
-         case 0:
-            if (!defrag_carve_once(&changed)) return false;
-            if (!changed) state++;
-            break;
-         case 1:
-            if (!defrag_squish_once(&changed)) return false;
-            if (!changed) state++;
-            break;
-         case 2:
-            if (!defrag_widen_once(&changed)) return false;
-            if (!changed) state++;
-            else state--;
-            break;
-         case 3:
-            if (!defrag_reclaim_once(&changed)) return false;
-            if (!changed) state++;
-            break;
-         case 4:
-            if (!defrag_relax_once(&changed)) return false;
-            state++;
-            break;
-         case 5:
-            if (!defrag_squeeze_once(&changed)) return false;
-            if (!changed) state++;
-            else state = 3;
-            break;
-         default:
-            done = true;
-      }
+      if (!defrag_advance(&committed)) return false;
    }
 #ifdef DEFRAG_DEBUG
    fprintf(stderr, "\n");
@@ -4582,6 +10148,42 @@ bool narf_defrag(void) {
 
    return true;
 }
+
+//! @brief Run defrag phases until the pass completes or a budget is spent.
+bool narf_defrag_step(NarfSector max_sectors_moved, unsigned max_commits,
+                      NarfDefragProgress *progress) {
+   unsigned commits = 0;
+   bool committed;
+
+   perf_begin(NARF_PERF_DEFRAG);
+   if (progress != NULL) memset(progress, 0, sizeof(*progress));
+   if (!verify_live()) return false;
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_any()) return false;
+#endif
+
+   if (defrag_phase == NARF_DEFRAG_DONE) defrag_phase = NARF_DEFRAG_CARVE;
+   defrag_moved = 0;
+   defrag_move_limit = max_sectors_moved;
+
+   while (defrag_phase != NARF_DEFRAG_DONE &&
+          (max_commits == 0 || commits < max_commits) &&
+          (max_sectors_moved == 0 || defrag_moved < max_sectors_moved)) {
+      if (!defrag_advance(&committed)) return false;
+      if (committed) commits++;
+   }
+
+   if (progress != NULL) {
+      progress->phase = defrag_phase;
+      progress->sectors_moved = defrag_moved;
+      progress->commits = commits;
+      progress->bottom = root.m_bottom;
+      progress->top = root.m_top;
+      progress->done = defrag_phase == NARF_DEFRAG_DONE;
+   }
+
+   return true;
+}
 #endif
 
 #ifdef NARF_DEBUG
@@ -4658,10 +10260,32 @@ static void print_tree_node(NarfSector sector, const Node *n, const char *label)
              n->m_key, sector,
              n->m_free.m_start, (unsigned)n->m_free.m_length, n->m_height);
    }
+   else if (label[0] == 'S') {
+      printf("'%s' [%08x] S-> start:len=(%08x:%u) bytes=%u refs=%u h=%u",
+             n->m_key, sector,
+             n->m_share.m_start, (unsigned)n->m_share.m_length,
+             (unsigned)n->m_share.m_bytes, (unsigned)n->m_share.m_refs,
+             n->m_height);
+   }
+   else if (label[0] == 'P') {
+      printf("'%s' [%08x] P-> start:len=(%08x:%u) born=%u died=%u h=%u",
+             n->m_key, sector,
+             n->m_pin.m_start, (unsigned)n->m_pin.m_length,
+             (unsigned)n->m_pin.m_born, (unsigned)n->m_pin.m_died,
+             n->m_height);
+   }
    else {
-      printf("'%s' [%08x] %s-> start:len=(%08x:%u) bytes=%u h=%u",
+      printf("'%s' [%08x] %s-> start:len=(%08x:%u) first=%u valid=%u tail=%08x slack=%u bytes=%u h=%u",
              n->m_key, sector, label,
-             n->m_data.m_start, (unsigned)n->m_data.m_length, (unsigned)n->m_data.m_bytes, n->m_height);
+             n->m_data.m_start, (unsigned)n->m_data.m_length,
+             (unsigned)n->m_data.m_first, (unsigned)n->m_data.m_valid,
+             n->m_data.m_tail, (unsigned)n->m_data.m_slack,
+             (unsigned)n->m_data.m_bytes, n->m_height);
+      if (n->m_data.m_codec != CODEC_PLAIN) {
+         printf(" codec=%u index=%u packed=%u", (unsigned)n->m_data.m_codec,
+                (unsigned)n->m_data.m_index, (unsigned)n->m_data.m_packed);
+      }
+      if (n->m_data.m_shared) printf(" shared=%08x", n->m_data.m_hash);
       print_debug_metadata(n->m_data.m_metadata);
    }
 }
@@ -4744,7 +10368,7 @@ static bool debug_spare_sector_count(NarfSector *result) {
    return true;
 }
 
-//! @brief Find the data extent with the lowest start at or after target.
+//! @brief Find the data extent or tail copy with the lowest start at or after target.
 //! @param sector Current data-tree catalog sector.
 //! @param target Lowest payload start to consider.
 //! @param result_sector Catalog sector of the best match, or END if none.
@@ -4765,6 +10389,15 @@ static bool closest_payload_data(NarfSector sector, NarfSector target,
    start = node_work0.m_data.m_start;
 
    // Zero-length files have no payload extent and use END as their start.
+   // Shared extents are listed once, from the shared tree.
+   if (start != END && start >= target && !node_work0.m_data.m_shared &&
+       (*result_sector == END || start < *result_start)) {
+      *result_sector = sector;
+      *result_start = start;
+   }
+
+   // A tail copy is listed as its own one-sector extent.
+   start = node_work0.m_data.m_tail;
    if (start != END && start >= target &&
        (*result_sector == END || start < *result_start)) {
       *result_sector = sector;
@@ -4781,6 +10414,78 @@ static bool closest_payload_data(NarfSector sector, NarfSector target,
    return true;
 }
 
+//! @brief Find the shared extent with the lowest start at or after target.
+//! @param sector Current shared-tree catalog sector.
+//! @param target Lowest payload start to consider.
+//! @param result_sector Catalog sector of the best match, or END if none.
+//! @param result_start Payload start of the best match, or END if none.
+static bool closest_payload_shared(NarfSector sector, NarfSector target,
+                                   NarfSector *result_sector,
+                                   NarfSector *result_start) {
+   NarfSector left;
+   NarfSector right;
+   NarfSector start;
+
+   if (result_sector == NULL || result_start == NULL) return false;
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   start = node_work0.m_share.m_start;
+
+   if (start >= target &&
+       (*result_sector == END || start < *result_start)) {
+      *result_sector = sector;
+      *result_start = start;
+   }
+
+   if (!closest_payload_shared(left, target, result_sector, result_start)) {
+      return false;
+   }
+   if (!closest_payload_shared(right, target, result_sector, result_start)) {
+      return false;
+   }
+
+   return true;
+}
+
+//! @brief Find the pinned extent with the lowest start at or after target.
+//! @param sector Current pinned-tree catalog sector.
+//! @param target Lowest payload start to consider.
+//! @param result_sector Catalog sector of the best match, or END if none.
+//! @param result_start Payload start of the best match, or END if none.
+static bool closest_payload_pinned(NarfSector sector, NarfSector target,
+                                   NarfSector *result_sector,
+                                   NarfSector *result_start) {
+   NarfSector left;
+   NarfSector right;
+   NarfSector start;
+
+   if (result_sector == NULL || result_start == NULL) return false;
+   if (sector == END) return true;
+   if (!read_node(sector, &node_work0)) return false;
+
+   left = node_work0.m_left;
+   right = node_work0.m_right;
+   start = node_work0.m_pin.m_start;
+
+   if (start >= target &&
+       (*result_sector == END || start < *result_start)) {
+      *result_sector = sector;
+      *result_start = start;
+   }
+
+   if (!closest_payload_pinned(left, target, result_sector, result_start)) {
+      return false;
+   }
+   if (!closest_payload_pinned(right, target, result_sector, result_start)) {
+      return false;
+   }
+
+   return true;
+}
+
 //! @brief Find the free extent with the lowest start at or after target.
 //! @param sector Current free-tree catalog sector.
 //! @param target Lowest payload start to consider.
@@ -4827,6 +10532,9 @@ static void print_linear_data(const Node *node, bool overlap) {
    printf("\n");
 }
 
+// Each debug bitmap frame is one sector of bits.
+#define LINEAR_MAP_SECTORS ((NarfSector) (NARF_SECTOR_SIZE * 8u))
+
 //! @brief Mark one catalog sector in a debug bitmap frame.
 static void print_linear_catalog_mark(uint8_t map[NARF_SECTOR_SIZE],
                                       NarfSector frame_begin,
@@ -4912,18 +10620,51 @@ static void print_linear_catalog_data(NarfSector sector,
                                       const Node *node,
                                       bool free_overlap,
                                       bool spare_overlap) {
-   printf("[%08x] data node '%.*s' payload=[%08x:%u] bytes=%u "
-          "left=[%08x] right=[%08x] h=%u",
+   printf("[%08x] data node '%.*s' payload=[%08x:%u] first=%u valid=%u tail=%08x "
+          "bytes=%u left=[%08x] right=[%08x] h=%u",
           sector, (int) KEYSIZE, node->m_key,
           node->m_data.m_start, (unsigned) node->m_data.m_length,
+          (unsigned) node->m_data.m_first, (unsigned) node->m_data.m_valid,
+          node->m_data.m_tail,
           (unsigned) node->m_data.m_bytes,
           node->m_left, node->m_right, node->m_height);
+   if (node->m_data.m_codec != CODEC_PLAIN) {
+      printf(" codec=%u index=%u packed=%u", (unsigned) node->m_data.m_codec,
+             (unsigned) node->m_data.m_index, (unsigned) node->m_data.m_packed);
+   }
    print_debug_metadata(node->m_data.m_metadata);
    if (free_overlap) printf(" FREE-TREE OVERLAP");
    if (spare_overlap) printf(" SPARE OVERLAP");
    printf("\n");
 }
 
+//! @brief Print one live shared-tree catalog node.
+static void print_linear_catalog_shared(NarfSector sector,
+                                        const Node *node,
+                                        bool spare_overlap) {
+   printf("[%08x] shared node '%.*s' payload=[%08x:%u] bytes=%u refs=%u "
+          "left=[%08x] right=[%08x] h=%u",
+          sector, (int) KEYSIZE, node->m_key,
+          node->m_share.m_start, (unsigned) node->m_share.m_length,
+          (unsigned) node->m_share.m_bytes, (unsigned) node->m_share.m_refs,
+          node->m_left, node->m_right, node->m_height);
+   if (spare_overlap) printf(" SPARE OVERLAP");
+   printf("\n");
+}
+
+//! @brief Print one pinned-tree catalog node.
+static void print_linear_catalog_pinned(NarfSector sector,
+                                        const Node *node,
+                                        bool spare_overlap) {
+   printf("[%08x] pinned node payload=[%08x:%u] born=%u died=%u "
+          "left=[%08x] right=[%08x] h=%u",
+          sector, node->m_pin.m_start, (unsigned) node->m_pin.m_length,
+          (unsigned) node->m_pin.m_born, (unsigned) node->m_pin.m_died,
+          node->m_left, node->m_right, node->m_height);
+   if (spare_overlap) printf(" SPARE OVERLAP");
+   printf("\n");
+}
+
 //! @brief Print one live free-tree catalog node.
 static void print_linear_catalog_free(NarfSector sector,
                                       const Node *node,
@@ -4940,6 +10681,9 @@ static void print_linear_catalog_free(NarfSector sector,
 static void print_linear_catalog(void) {
    static uint8_t data_map[NARF_SECTOR_SIZE];
    static uint8_t free_map[NARF_SECTOR_SIZE];
+   static uint8_t shared_map[NARF_SECTOR_SIZE];
+   static uint8_t pinned_map[NARF_SECTOR_SIZE];
+   static uint8_t snapshot_map[NARF_SECTOR_SIZE];
    static uint8_t spare_map[NARF_SECTOR_SIZE];
    NarfSector frame_begin;
 
@@ -4954,15 +10698,18 @@ static void print_linear_catalog(void) {
       NarfSector sector;
       bool spare_map_valid;
 
-      if (root.m_total_sectors - frame_begin < SPARE_FRAME_SECTORS) {
+      if (root.m_total_sectors - frame_begin < LINEAR_MAP_SECTORS) {
          frame_end = root.m_total_sectors;
       }
       else {
-         frame_end = frame_begin + SPARE_FRAME_SECTORS;
+         frame_end = frame_begin + LINEAR_MAP_SECTORS;
       }
 
       memset(data_map, 0, sizeof(data_map));
       memset(free_map, 0, sizeof(free_map));
+      memset(shared_map, 0, sizeof(shared_map));
+      memset(pinned_map, 0, sizeof(pinned_map));
+      memset(snapshot_map, 0, sizeof(snapshot_map));
       memset(spare_map, 0, sizeof(spare_map));
 
       if (!print_linear_catalog_mark_tree_rec(root.m_data_root,
@@ -4977,6 +10724,35 @@ static void print_linear_catalog(void) {
          printf("(unable to map free-tree catalog sectors)\n");
          return;
       }
+      if (!print_linear_catalog_mark_tree_rec(root.m_shared_root,
+                                               frame_begin, frame_end,
+                                               shared_map, 0)) {
+         printf("(unable to map shared-tree catalog sectors)\n");
+         return;
+      }
+      if (!print_linear_catalog_mark_tree_rec(root.m_pinned_root,
+                                               frame_begin, frame_end,
+                                               pinned_map, 0)) {
+         printf("(unable to map pinned-tree catalog sectors)\n");
+         return;
+      }
+      for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+         const SnapshotSlot *slot = &root.m_snapshots[i];
+
+         if (slot->m_name[0] == 0) continue;
+         if (!print_linear_catalog_mark_tree_rec(slot->m_data_root,
+                                                  frame_begin, frame_end,
+                                                  snapshot_map, 0) ||
+             !print_linear_catalog_mark_tree_rec(slot->m_free_root,
+                                                  frame_begin, frame_end,
+                                                  snapshot_map, 0) ||
+             !print_linear_catalog_mark_tree_rec(slot->m_shared_root,
+                                                  frame_begin, frame_end,
+                                                  snapshot_map, 0)) {
+            printf("(unable to map snapshot catalog sectors)\n");
+            return;
+         }
+      }
 
       spare_map_valid = print_linear_catalog_mark_spares(frame_begin,
                                                           frame_end,
@@ -4993,6 +10769,12 @@ static void print_linear_catalog(void) {
                                                      frame_begin, sector);
          bool in_free = print_linear_catalog_marked(free_map,
                                                      frame_begin, sector);
+         bool in_shared = print_linear_catalog_marked(shared_map,
+                                                       frame_begin, sector);
+         bool in_pinned = print_linear_catalog_marked(pinned_map,
+                                                       frame_begin, sector);
+         bool in_snapshot = print_linear_catalog_marked(snapshot_map,
+                                                         frame_begin, sector);
          bool in_spare = spare_map_valid &&
                           print_linear_catalog_marked(spare_map,
                                                       frame_begin, sector);
@@ -5012,6 +10794,24 @@ static void print_linear_catalog(void) {
             }
             print_linear_catalog_free(sector, &node_work0, in_spare);
          }
+         else if (in_shared) {
+            if (!read_node(sector, &node_work0)) {
+               printf("[%08x] unreadable shared node\n", sector);
+               continue;
+            }
+            print_linear_catalog_shared(sector, &node_work0, in_spare);
+         }
+         else if (in_pinned) {
+            if (!read_node(sector, &node_work0)) {
+               printf("[%08x] unreadable pinned node\n", sector);
+               continue;
+            }
+            print_linear_catalog_pinned(sector, &node_work0, in_spare);
+         }
+         else if (in_snapshot) {
+            printf("[%08x] snapshot node%s\n", sector,
+                   in_spare ? " SPARE OVERLAP" : "");
+         }
          else if (in_spare) {
             if (!read_spare_record(sector, &node_work1)) {
                printf("[%08x] unreadable spare\n", sector);
@@ -5036,6 +10836,8 @@ static void print_linear_catalog(void) {
 //! @brief Print payload allocation in ascending sector order.
 static void print_linear(void) {
    NarfSector data_target = 2;
+   NarfSector shared_target = 2;
+   NarfSector pinned_target = 2;
    NarfSector free_target = 2;
    NarfSector covered_until = 2;
 
@@ -5044,13 +10846,19 @@ static void print_linear(void) {
 
    for (;;) {
       NarfSector data_sector = END;
+      NarfSector shared_sector = END;
+      NarfSector pinned_sector = END;
       NarfSector free_sector = END;
       NarfSector data_start = END;
+      NarfSector shared_start = END;
+      NarfSector pinned_start = END;
       NarfSector free_start = END;
       NarfSector extent_start;
       NarfSector extent_length;
       NarfSector extent_end;
       bool is_data;
+      bool is_shared;
+      bool is_pinned;
       bool overlap;
 
       if (!closest_payload_data(root.m_data_root, data_target,
@@ -5063,19 +10871,57 @@ static void print_linear(void) {
          printf("(unable to read free tree)\n");
          return;
       }
+      if (!closest_payload_shared(root.m_shared_root, shared_target,
+                                  &shared_sector, &shared_start)) {
+         printf("(unable to read shared tree)\n");
+         return;
+      }
+      if (!closest_payload_pinned(root.m_pinned_root, pinned_target,
+                                  &pinned_sector, &pinned_start)) {
+         printf("(unable to read pinned tree)\n");
+         return;
+      }
 
-      if (data_sector == END && free_sector == END) break;
+      if (data_sector == END && free_sector == END && shared_sector == END &&
+          pinned_sector == END) {
+         break;
+      }
 
-      // Process equal starts as data first.  The free extent remains pending
-      // and will be printed as an overlap on the next iteration.
-      is_data = data_start <= free_start;
-      if (is_data) {
+      // Process equal starts as data first, then shared, then pinned.  The
+      // free extent remains pending and will be printed as an overlap on the
+      // next iteration.
+      is_data = data_start <= free_start && data_start <= shared_start &&
+                data_start <= pinned_start;
+      is_shared = !is_data && shared_start <= free_start &&
+                  shared_start <= pinned_start;
+      is_pinned = !is_data && !is_shared && pinned_start <= free_start;
+      if (is_pinned) {
+         if (!read_node(pinned_sector, &node_work0)) {
+            printf("(unable to read pinned node [%08x])\n", pinned_sector);
+            return;
+         }
+         extent_start = node_work0.m_pin.m_start;
+         extent_length = node_work0.m_pin.m_length;
+      }
+      else if (is_shared) {
+         if (!read_node(shared_sector, &node_work0)) {
+            printf("(unable to read shared node [%08x])\n", shared_sector);
+            return;
+         }
+         extent_start = node_work0.m_share.m_start;
+         extent_length = node_work0.m_share.m_length;
+      }
+      else if (is_data) {
          if (!read_node(data_sector, &node_work0)) {
             printf("(unable to read data node [%08x])\n", data_sector);
             return;
          }
          extent_start = node_work0.m_data.m_start;
          extent_length = node_work0.m_data.m_length;
+         if (node_work0.m_data.m_tail != END && node_work0.m_data.m_tail == data_start) {
+            extent_start = data_start;
+            extent_length = 1;
+         }
       }
       else {
          if (!read_node(free_sector, &node_work0)) {
@@ -5090,7 +10936,8 @@ static void print_linear(void) {
           extent_start > END - extent_length) {
          printf("[%08x:%3u] invalid %s extent\n",
                 extent_start, (unsigned) extent_length,
-                is_data ? "data" : "free");
+                is_data ? "data" : is_shared ? "shared" :
+                is_pinned ? "pinned" : "free");
          return;
       }
       extent_end = extent_start + extent_length;
@@ -5101,7 +10948,27 @@ static void print_linear(void) {
       }
       overlap = extent_start < covered_until;
 
-      if (is_data) {
+      if (is_shared) {
+         printf("[%08x:%3u] shared %.8s (%6u bytes, %u refs)%s\n",
+                extent_start, (unsigned) extent_length, node_work0.m_key,
+                (unsigned) node_work0.m_share.m_bytes,
+                (unsigned) node_work0.m_share.m_refs, overlap ? " OVERLAP" : "");
+         shared_target = extent_start + 1;
+      }
+      else if (is_pinned) {
+         printf("[%08x:%3u] pinned (born %u, died %u)%s\n",
+                extent_start, (unsigned) extent_length,
+                (unsigned) node_work0.m_pin.m_born,
+                (unsigned) node_work0.m_pin.m_died, overlap ? " OVERLAP" : "");
+         pinned_target = extent_start + 1;
+      }
+      else if (is_data && extent_start == node_work0.m_data.m_tail) {
+         printf("[%08x:%3u] tail '%.*s' (sector %u)%s\n", extent_start, 1u,
+                (int) KEYSIZE, node_work0.m_key,
+                (unsigned) node_work0.m_data.m_tail_at, overlap ? " OVERLAP" : "");
+         data_target = extent_start + 1;
+      }
+      else if (is_data) {
          print_linear_data(&node_work0, overlap);
          data_target = extent_start + 1;
       }
@@ -5132,7 +10999,7 @@ static void print_linear(void) {
 
 //! @brief Print internal NARF root and tree state.
 void narf_debug(void) {
-   NarfSector spare_sectors;
+   NarfSector spare_sectors = 0;
    bool spare_count_valid = debug_spare_sector_count(&spare_sectors);
    printf("root.m_signature     = %08x '%.4s'\n", root.m_signature, root.m_sigbytes);
    printf("root.m_narf_version  = %08x\n", root.m_narf_version);
@@ -5140,6 +11007,25 @@ void narf_debug(void) {
    printf("root.m_total_sectors = %08x\n", root.m_total_sectors);
    printf("root.m_data_root     = [%08x]\n", root.m_data_root);
    printf("root.m_free_root     = [%08x]\n", root.m_free_root);
+   printf("root.m_shared_root   = [%08x]\n", root.m_shared_root);
+   printf("root.m_pinned_root   = [%08x]\n", root.m_pinned_root);
+   for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+      const SnapshotSlot *slot = &root.m_snapshots[i];
+
+      if (slot->m_name[0] == 0) continue;
+      printf("snapshot %u '%.*s' version=%u data=[%08x] free=[%08x] "
+             "shared=[%08x] count=%u\n",
+             i, (int) sizeof(slot->m_name), slot->m_name,
+             (unsigned) slot->m_version, slot->m_data_root,
+             slot->m_free_root, slot->m_shared_root, (unsigned) slot->m_count);
+   }
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_viewing) {
+      printf("viewing snapshot; live data=[%08x] free=[%08x] shared=[%08x]\n",
+             snapshot_live.m_data_root, snapshot_live.m_free_root,
+             snapshot_live.m_shared_root);
+   }
+#endif
    printf("spare_head           = [%08x]\n", spare_head);
    printf("spare_tail           = [%08x]\n", spare_tail);
    if (spare_count_valid)
@@ -5154,6 +11040,15 @@ void narf_debug(void) {
    print_tree(root.m_data_root, 0, 0, "D");
    printf("free tree:\n");
    print_tree(root.m_free_root, 0, 0, "F");
+   if (root.m_shared_root != END) {
+      printf("shared tree:\n");
+      print_tree(root.m_shared_root, 0, 0, "S");
+   }
+   if (root.m_pinned_root != END) {
+      printf("pinned tree:\n");
+      print_tree(root.m_pinned_root, 0, 0, "P");
+   }
+
    printf("memory map:\n");
    print_linear();
 }
@@ -5189,6 +11084,20 @@ bool narf_io_read(uint32_t sector, void *data) {
    return false;
 }
 
+//! @brief Stub I/O discard used when building the standalone layout-details tool.
+bool narf_io_discard(uint32_t sector, uint32_t count) {
+   (void) sector;
+   (void) count;
+   return false;
+}
+
+//! @brief Stub I/O write-zeroes used when building the standalone layout-details tool.
+bool narf_io_write_zeroes(uint32_t sector, uint32_t count) {
+   (void) sector;
+   (void) count;
+   return false;
+}
+
 //! @brief Print compile-time layout details for the standalone details build.
 int main(int argc, char **argv) {
    (void) argc;
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "narf_conf.h"
 
@@ -11,18 +12,35 @@ typedef NARF_SECTOR_ADDRESS_TYPE NarfByteSize;
 
 #define NARF_METADATA_SIZE 128
 
+// Snapshot slots kept in the root, and the size of a snapshot name including
+// its terminating NUL.  Both are part of the on-disk format.
+#define NARF_SNAPSHOT_SLOTS 4
+#define NARF_SNAPSHOT_NAME_BYTES 16
+
 typedef struct {
    NarfSector total_sectors;
    NarfSector free_sectors;
    NarfSector used_sectors;
    NarfSector file_count;
    NarfByteSize max_key_bytes;
+   NarfSector largest_free;
 } NarfStat;
 
+typedef struct {
+   NarfSector slack_sectors;
+   NarfSector payload_sectors;
+   NarfSector logical_sectors;
+   NarfSector shared_sectors;
+   NarfSector snapshot_sectors;
+} NarfUsage;
+
 typedef struct {
    NarfSector errors;
    NarfSector data_nodes;
    NarfSector free_nodes;
+   NarfSector shared_nodes;
+   NarfSector pinned_nodes;
+   NarfSector snapshot_nodes;
    NarfSector spare_nodes;
    NarfSector file_count;
    NarfSector free_extents;
@@ -30,6 +48,21 @@ typedef struct {
    NarfSector free_sectors;
 } NarfFsckReport;
 
+//! @brief One new key produced by a narf_bulk_insert() iterator.
+typedef struct {
+   const char *key;
+   NarfByteSize bytes;
+   const char *metadata;
+} NarfBulkItem;
+
+//! @brief Produce the next item for narf_bulk_insert().
+//!
+//! @param context Caller context passed to narf_bulk_insert().
+//! @param item Destination for the next item.  The key and metadata strings
+//! must stay valid until the next call.
+//! @return true when an item was produced.
+typedef bool (*NarfBulkNext)(void *context, NarfBulkItem *item);
+
 #define INVALID_NAF ((NarfSector) -1)
 
 #ifdef NARF_MBR_UTILS
@@ -76,12 +109,110 @@ bool narf_mkfs(NarfSector start, NarfSector size);
 //! @return true on success.
 bool narf_init(NarfSector start);
 
+//! @brief Persist the spare catalog-node list so the next mount can skip rebuilding it.
+//!
+//! Commits one root sector.  The checkpoint is trusted only while that root is
+//! the newest committed root, so call this after the last mutation, typically
+//! just before power-down or unmount.
+//!
+//! @return true on success.
+bool narf_checkpoint(void);
+
+//! @brief Cleanly unmount the filesystem.
+//!
+//! Commits one root carrying the spare-list checkpoint and a clean mark, then
+//! forgets the mounted state.  While that root is the newest committed root,
+//! the next mount spot-checks the spines of every tree, snapshots included,
+//! instead of walking every node; call narf_fsck() for full validation.
+//!
+//! @return true on success.  On failure the filesystem stays mounted.
+bool narf_unmount(void);
+
+//! @brief Perform one bounded slice of deferred background work.
+//!
+//! A mount without a valid checkpoint defers the spare-list rebuild.  Each
+//! mutation pays NARF_SPARE_REBUILD_FRAMES frames of it; idle callers may
+//! finish it sooner by calling this until *pending is false.  One call walks
+//! both catalog trees once for one bitmap frame, and with snapshots also
+//! frees one batch of storage left by an interrupted narf_snapshot_delete().
+//!
+//! @param pending Set to true while deferred work remains.
+//! @return true on success.
+bool narf_maintenance_step(bool *pending);
+
+//! @brief Lend the core a larger bitmap for spare rebuilds and deep fsck.
+//!
+//! Each byte covers eight catalog sectors of one spare-rebuild frame, and each
+//! frame walks both catalog trees once.  A bitmap of (catalog sectors + 7) / 8
+//! bytes rebuilds the spare list in a single walk and also backs
+//! narf_fsck_deep()'s catalog map, which otherwise comes from the heap.  The
+//! memory must stay valid until it is replaced.  NULL, or no more than
+//! NARF_SPARE_WORK_BYTES, restores the built-in bitmap.
+//!
+//! @param memory Caller-owned bitmap storage, or NULL.
+//! @param bytes Size of memory in bytes.
+//! @return true on success.
+bool narf_set_work_memory(void *memory, size_t bytes);
+
 //! @brief Return basic filesystem capacity and key-count statistics.
 //!
+//! Reads only the free tree, so it is cheap enough for statfs.  largest_free
+//! is the longest free extent or open gap, the largest payload that fits
+//! without defrag.
+//!
 //! @param stats Destination for statistics.
 //! @return true on success.
 bool narf_stat(NarfStat *stats);
 
+//! @brief Return how the sectors used by keys are held.
+//!
+//! Reads every node of the data, shared, and pinned trees.  slack_sectors
+//! counts the narf_reserve() growth slack held past the end of keys; it is
+//! part of narf_stat()'s used_sectors, not free_sectors.  payload_sectors
+//! counts the sectors key payloads hold, and logical_sectors the sectors
+//! their byte sizes span; compressed keys hold fewer than they span.  An
+//! extent shared by deduplicated keys is held once and also counted in
+//! shared_sectors.  snapshot_sectors counts payload sectors that no key holds
+//! any more but a snapshot still reads.
+//!
+//! @param usage Destination for the counters.
+//! @return true on success.
+bool narf_usage(NarfUsage *usage);
+
+typedef enum {
+   NARF_LIVE_ROOT,
+   NARF_LIVE_CATALOG,
+   NARF_LIVE_PAYLOAD,
+} NarfLiveKind;
+
+//! @brief Receive one run of sectors from narf_live_extents().
+//!
+//! The call must not call into NARF; reading the sectors through narf_io is
+//! fine.
+//!
+//! @param context Caller context passed to narf_live_extents().
+//! @param kind What the sectors hold.
+//! @param start First device sector, including the filesystem origin.
+//! @param count Number of sectors.
+//! @return true to continue, false to stop.
+typedef bool (*NarfLiveNext)(void *context, NarfLiveKind kind,
+                             NarfSector start, NarfSector count);
+
+//! @brief Report every sector the committed filesystem still reads.
+//!
+//! That is the two root copies, the catalog nodes any tree or snapshot
+//! reaches, and the written payload of each key, shared extent, and pinned
+//! extent.  Free extents, spare catalog sectors, slack, and the unused gap
+//! are left out, so copying just these sectors to an otherwise zeroed device
+//! of the same size yields a filesystem that mounts and reads the same.
+//! Catalog runs come first in address order; payload runs follow in tree
+//! order and do not overlap.  Finishes a pending spare rebuild first.
+//!
+//! @param next Callback for each run.
+//! @param context Caller context passed to next.
+//! @return true when every run was reported.
+bool narf_live_extents(NarfLiveNext next, void *context);
+
 //! @brief Validate the mounted filesystem with linear-time structural checks.
 //!
 //! @param report Optional destination for counters.
@@ -94,6 +225,32 @@ bool narf_fsck(NarfFsckReport *report);
 //! @return true when no structural errors are found.
 bool narf_fsck_deep(NarfFsckReport *report);
 
+//! @brief Start an incremental fsck that can be interleaved with other calls.
+//!
+//! The walk performs the narf_fsck() tree checks against the root committed
+//! when it starts, or restarts, and never holds the filesystem between steps.
+//! The disposable RAM spare list is not checked, so spare_nodes stays zero.
+//!
+//! @return true on success.
+bool narf_fsck_begin(void);
+
+//! @brief Advance an incremental fsck by at most budget sector reads.
+//!
+//! If a commit has replaced the pinned root since the previous step, the walk
+//! starts over from the new root.  Each read visits one node, so the pause is
+//! bounded by budget reads plus as many in-RAM stack pops.
+//!
+//! @param budget Maximum number of sector reads in this call.
+//! @param done Set to true once the whole walk has completed.
+//! @return true on success.
+bool narf_fsck_step(unsigned budget, bool *done);
+
+//! @brief Finish an incremental fsck.
+//!
+//! @param report Optional destination for the counters gathered so far.
+//! @return true when the walk completed without structural errors.
+bool narf_fsck_end(NarfFsckReport *report);
+
 //! @brief Check whether a key exists.
 //!
 //! @param key NUL-terminated key string.
@@ -136,8 +293,23 @@ const char *narf_prefixnext(const char *prefix, const char *previous_key);
 //! @return true on success.
 bool narf_alloc(const char *key, NarfByteSize bytes);
 
+//! @brief Create many new keys from a stream sorted by key, in one transaction.
+//!
+//! Large batches are merged with the existing keys and the data tree is
+//! rebuilt balanced, which needs temporary catalog space for every data node.
+//! Small batches fall back to ordinary inserts.  Payloads are zero-filled as
+//! with narf_alloc().
+//!
+//! @param count Number of items next() will produce.
+//! @param next Iterator yielding items in strictly ascending strcmp() order.
+//! @param context Caller context passed to next().
+//! @return true on success.  On failure no key is created.
+bool narf_bulk_insert(NarfSector count, NarfBulkNext next, void *context);
+
 //! @brief Resize a key, creating it if absent.
 //!
+//! Growing an existing key adds a hole; no payload sectors are allocated.
+//!
 //! @param key NUL-terminated key string.
 //! @param bytes New byte size.
 //! @return true on success.
@@ -145,6 +317,8 @@ bool narf_realloc(const char *key, NarfByteSize bytes);
 
 //! @brief Resize a key, creating it if absent.
 //!
+//! Growing an existing key adds a hole; no payload sectors are allocated.
+//!
 //! @param key NUL-terminated key string.
 //! @param bytes New byte size.
 //! @param metadata New metadata string, or NULL to preserve existing metadata.
@@ -164,15 +338,82 @@ bool narf_rename_key(const char *key, const char *newkey);
 //! @return true on success.
 bool narf_free(const char *key);
 
+#ifdef NARF_USE_ALLOC_POLICIES
+//! @brief Where payload allocations look for free space.
+typedef enum {
+   NARF_ALLOC_BEST_FIT,   //!< Smallest free extent that fits, else the open gap.
+   NARF_ALLOC_FIRST_FIT,  //!< Lowest-address free extent that fits.
+   NARF_ALLOC_NEXT_FIT,   //!< First fit starting after the previous allocation.
+   NARF_ALLOC_SEGREGATED, //!< Small requests low, large requests high.
+   NARF_ALLOC_FRONTIER,   //!< Large requests from the open gap first.
+} NarfAllocPolicy;
+
+//! @brief Select the payload allocation policy.
+//!
+//! The policy is kept in RAM only and defaults to NARF_ALLOC_BEST_FIT.  Every
+//! policy falls back to the open gap between the payload and catalog
+//! frontiers when no free extent fits, and NARF_ALLOC_FRONTIER falls back to
+//! best fit when the gap is short.  NARF_ALLOC_SMALL_SECTORS and
+//! NARF_ALLOC_LARGE_SECTORS set the size classes.
+//!
+//! @param policy Policy to use for later allocations.
+//! @return true on success.
+bool narf_set_alloc_policy(NarfAllocPolicy policy);
+
+//! @brief Return the selected payload allocation policy.
+NarfAllocPolicy narf_alloc_policy(void);
+#endif
+
 #ifdef NARF_USE_DEFRAG
+//! @brief Defrag phase that the next narf_defrag_step() resumes at.
+typedef enum {
+   NARF_DEFRAG_CARVE,
+   NARF_DEFRAG_PLAN,
+   NARF_DEFRAG_SQUISH,
+   NARF_DEFRAG_WIDEN,
+   NARF_DEFRAG_RECLAIM,
+   NARF_DEFRAG_RELAX,
+   NARF_DEFRAG_SQUEEZE,
+   NARF_DEFRAG_DONE,
+} NarfDefragPhase;
+
+//! @brief Progress reported by narf_defrag_step().
+typedef struct {
+   NarfDefragPhase phase;
+   NarfSector sectors_moved;
+   unsigned commits;
+   NarfSector bottom;
+   NarfSector top;
+   bool done;
+} NarfDefragProgress;
+
 //! @brief Defragment the filesystem when supported.
 //!
 //! @return true on success.
 bool narf_defrag(void);
+
+//! @brief Run a bounded slice of narf_defrag().
+//!
+//! Stops once max_sectors_moved payload or catalog sectors have been copied or
+//! max_commits transactions have committed; zero means no limit.  A single
+//! extent move is never split, so the sector count may overshoot by one
+//! extent.  The phase is kept in RAM only and the next call resumes there;
+//! a call after the pass completed starts a new pass.
+//!
+//! @param max_sectors_moved Sector budget, or 0.
+//! @param max_commits Commit budget, or 0.
+//! @param progress Optional phase, counters, and m_bottom/m_top after the step.
+//! @return true on success.
+bool narf_defrag_step(NarfSector max_sectors_moved, unsigned max_commits,
+                      NarfDefragProgress *progress);
 #endif
 
 //! @brief Return the physical sector for a key payload.
 //!
+//! For a sparse key this is the first allocated sector, which need not hold
+//! payload byte 0, and the last written sector may live in a separate tail
+//! copy; use narf_read() to read payload bytes.
+//!
 //! @param key Existing key.
 //! @return Physical sector, or INVALID_NAF when the key has no payload sector.
 NarfSector narf_sector(const char *key);
@@ -183,6 +424,197 @@ NarfSector narf_sector(const char *key);
 //! @return Byte size, or 0 on failure.
 NarfByteSize narf_size(const char *key);
 
+//! @brief Read bytes at an offset in a key payload.
+//!
+//! Sectors past the key's valid prefix were never written and read as zeroes.
+//!
+//! @param key Existing key.
+//! @param data Destination buffer.
+//! @param size Number of bytes to read; offset + size must not exceed the payload size.
+//! @param offset Byte offset in the payload.
+//! @return true on success.
+bool narf_read(const char *key, void *data, NarfByteSize size, NarfByteSize offset);
+
+//! @brief Return the number of payload sectors allocated to a key.
+//!
+//! A sparse key may hold fewer sectors than its byte size needs; a key
+//! with a tail copy holds one more.
+//!
+//! @param key Existing key.
+//! @return Allocated sector count, or 0 on failure.
+NarfSector narf_allocated(const char *key);
+
+//! @brief Find the next data or hole offset in a key payload, as for SEEK_DATA/SEEK_HOLE.
+//!
+//! Only the written prefix of the key's extent counts as data; the end of the
+//! payload is always a hole.
+//!
+//! @param key Existing key.
+//! @param offset Starting byte offset, below the payload size.
+//! @param hole true to find a hole, false to find data.
+//! @param result Receives the offset found.
+//! @return true on success, false on failure or when no data follows offset.
+bool narf_seek(const char *key, NarfByteSize offset, bool hole, NarfByteSize *result);
+
+//! @brief Zero a byte range of a key payload without changing its size.
+//!
+//! Whole sectors at the head or tail of the extent are released, and a range
+//! covering the end of the written prefix lowers the watermark.  Written data
+//! that cannot be dropped that way, such as partial edge sectors or the middle
+//! of the prefix, is zeroed in a copy of the trimmed extent.  Either way the
+//! punch is a single commit.
+//!
+//! @param key Existing key.
+//! @param offset Byte offset of the range.
+//! @param size Byte length of the range; bytes past the payload size are ignored.
+//! @return true on success.
+bool narf_punch(const char *key, NarfByteSize offset, NarfByteSize size);
+
+//! @brief Set how many sectors of growth slack a key keeps past its size.
+//!
+//! Writes that allocate or grow the key's extent claim up to this many extra
+//! sectors, so appends keep landing in place instead of copying the payload
+//! once another extent follows it.  The extent is grown in place now when
+//! the following sectors are free, or trimmed when the hint shrinks.
+//! Defrag keeps the slack unless the free gap falls below
+//! NARF_SLACK_TIGHT_SECTORS.
+//!
+//! @param key Existing key.
+//! @param sectors Growth slack in sectors; 0 removes it.
+//! @return true on success.
+bool narf_reserve(const char *key, NarfSector sectors);
+
+#ifdef NARF_USE_COMPRESSION
+//! @brief Convert a key between plain and compressed payload storage.
+//!
+//! A compressed key stores its payload as independently compressed chunks of
+//! 4 KiB, each starting on a sector, behind an index, so narf_read() at any
+//! offset decodes only the chunks it touches.  Chunks that do not compress
+//! by a whole sector are stored raw and all-zero chunks take no space.
+//! narf_size() is unchanged; narf_allocated() reports the sectors held.
+//! Later writes append the changed chunks and a new index past the stream
+//! and compact it into a new extent once superseded chunks outweigh live
+//! ones, so they stay atomic.  Keys start plain.
+//!
+//! @param key Existing key.
+//! @param compressed true to compress, false to store plain.
+//! @return true on success.
+bool narf_set_compressed(const char *key, bool compressed);
+
+//! @brief Return whether a key's payload is stored compressed.
+//!
+//! @param key Existing key.
+//! @return true when the key exists and is compressed.
+bool narf_compressed(const char *key);
+#endif
+
+#ifdef NARF_USE_DEDUP
+//! @brief Share a key's payload extent with every key holding the same bytes.
+//!
+//! The payload is hashed with CRC-32 and compared sector by sector against
+//! the shared extents of equal hash and size.  On a match the key references
+//! that extent and its own is freed; otherwise its extent becomes shared so
+//! later copies can find it.  A later change to a shared key first gives it
+//! a private copy, so keys never see each other's writes.  Sparse and
+//! compressed keys are not shared.
+//!
+//! @param key Existing key.
+//! @return true when the key is shared afterwards.
+bool narf_dedup(const char *key);
+
+//! @brief Return whether a key references a shared extent.
+//!
+//! @param key Existing key.
+//! @return true when the key exists and is shared.
+bool narf_deduped(const char *key);
+#endif
+
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief Keep the committed state of the filesystem under a name.
+//!
+//! Takes one root commit and copies nothing.  Until the snapshot is deleted,
+//! the catalog nodes and payload extents it reads are not reused: the first
+//! change to a key after the snapshot gives the key a private copy of its
+//! payload, and extents freed while a snapshot reads them are held instead.
+//! Defrag fails while any snapshot exists.
+//!
+//! @param name Name shorter than NARF_SNAPSHOT_NAME_BYTES.
+//! @return true on success; false when the name is taken or every one of the
+//! NARF_SNAPSHOT_SLOTS slots is in use.
+bool narf_snapshot_create(const char *name);
+
+//! @brief Delete a snapshot and free the storage only it kept.
+//!
+//! The slot is cleared in a commit of its own, then the storage is freed in
+//! bounded batches.  Batches an error interrupts are finished by
+//! narf_maintenance_step(), also after a remount.
+//!
+//! @param name Existing snapshot.
+//! @return true on success.
+bool narf_snapshot_delete(const char *name);
+
+//! @brief Show a snapshot read-only in place of the live filesystem.
+//!
+//! Lookups, reads, and listings then see the snapshot's keys, and every call
+//! that would change the filesystem fails, as does fsck.  narf_stat() counts
+//! the snapshot's keys against the free space of the volume.  Mounting another
+//! snapshot switches to it, NULL returns to the live filesystem, and
+//! narf_unmount() returns to it first.  Nothing is written either way.
+//!
+//! @param name Existing snapshot, or NULL.
+//! @return true on success.
+bool narf_snapshot_mount(const char *name);
+
+//! @brief Return the name of the snapshot in a slot.
+//!
+//! @param slot Slot index below NARF_SNAPSHOT_SLOTS.
+//! @return The name, or NULL when the slot is empty.
+const char *narf_snapshot_name(unsigned slot);
+
+typedef enum {
+   NARF_CHANGE_CREATED,
+   NARF_CHANGE_MODIFIED,
+   NARF_CHANGE_DELETED,
+} NarfChangeKind;
+
+//! @brief One key that differs between a snapshot and the live filesystem.
+//!
+//! Payload bytes from first up to new_bytes may differ from the snapshot's;
+//! bytes before first are unchanged.  first equals new_bytes when only the
+//! metadata changed.
+typedef struct {
+   NarfChangeKind kind;
+   const char *key;
+   NarfByteSize old_bytes;
+   NarfByteSize new_bytes;
+   NarfByteSize first;
+   bool metadata;
+} NarfChange;
+
+//! @brief Receive the next change from narf_changes_since().
+//!
+//! The change and its key are valid only during the call, which must not
+//! call into NARF.
+//!
+//! @param context Caller context passed to narf_changes_since().
+//! @param change Key that differs.
+//! @return true to continue, false to stop the walk.
+typedef bool (*NarfChangeNext)(void *context, const NarfChange *change);
+
+//! @brief Report the keys created, modified, or deleted since a snapshot.
+//!
+//! Changes arrive in key order.  Subtrees of the data tree that no commit
+//! has touched since the snapshot are skipped unread, so the work grows with
+//! the changes, not with the number of keys.  Keys whose node was rewritten
+//! without a change to their payload or metadata are not reported.
+//!
+//! @param name Existing snapshot.
+//! @param next Callback for each change.
+//! @param context Caller context passed to next.
+//! @return true when every change was reported.
+bool narf_changes_since(const char *name, NarfChangeNext next, void *context);
+#endif
+
 //! @brief Return a copy of the key metadata area.
 //!
 //! @param key Existing key.
@@ -223,6 +655,184 @@ bool narf_write_with_metadata(const char *key, const void *data, NarfByteSize si
 //! @return true on success.
 bool narf_append(const char *key, const void *data, NarfByteSize size);
 
+#ifdef NARF_USE_RECORDER
+//! @brief Public calls the recorder is told about.
+typedef enum {
+   NARF_RECORD_ALLOC,   //!< narf_alloc(), and each narf_bulk_insert() item.
+   NARF_RECORD_REALLOC, //!< narf_realloc(), narf_realloc_with_metadata().
+   NARF_RECORD_WRITE,   //!< narf_write(), narf_write_with_metadata().
+   NARF_RECORD_APPEND,  //!< narf_append().
+   NARF_RECORD_PUNCH,   //!< narf_punch().
+   NARF_RECORD_RESERVE, //!< narf_reserve().
+   NARF_RECORD_RENAME,  //!< narf_rename_key().
+   NARF_RECORD_FREE,    //!< narf_free().
+   NARF_RECORD_READ,    //!< narf_read().
+} NarfRecordOp;
+
+//! @brief One public call, as passed to the recorder.
+typedef struct {
+   NarfRecordOp op;     //!< Call made.
+   const char *key;     //!< Key argument, as passed.
+   const char *newkey;  //!< New key for a rename, else NULL.
+   NarfByteSize offset; //!< Byte offset for write, punch, and read, else 0.
+   NarfByteSize size;   //!< Bytes, or sectors for narf_reserve().
+   const void *data;    //!< Source bytes of a write or append, or NULL.
+} NarfRecord;
+
+//! @brief Receive one public call as it begins.
+//!
+//! Called before the arguments are checked, so calls that go on to fail
+//! are recorded too.  It must not call back into NARF.
+//!
+//! @param context Caller context passed to narf_set_recorder().
+//! @param record The call; its pointers are valid only during the call.
+typedef void (*NarfRecorder)(void *context, const NarfRecord *record);
+
+//! @brief Set the function told about each call that reads or changes payload.
+//!
+//! Work one public call does through another, such as the write behind
+//! narf_append(), is not recorded separately.
+//!
+//! @param fn Recorder, or NULL to stop recording.
+//! @param context Caller context passed to fn.
+void narf_set_recorder(NarfRecorder fn, void *context);
+#endif
+
+#ifdef NARF_USE_PERF_STATS
+//! @brief Public operations that performance counters are charged to.
+typedef enum {
+   NARF_PERF_MOUNT,       //!< narf_init(), narf_mount(), narf_mkfs(), narf_checkpoint(), narf_unmount().
+   NARF_PERF_FIND,        //!< narf_find(), narf_size(), narf_sector(), narf_allocated(), narf_seek(), narf_metadata(), narf_compressed(), narf_deduped().
+   NARF_PERF_LIST,        //!< narf_dirfirst(), narf_dirnext(), narf_prefixfirst(), narf_prefixnext().
+   NARF_PERF_READ,        //!< narf_read().
+   NARF_PERF_ALLOC,       //!< narf_alloc(), narf_bulk_insert().
+   NARF_PERF_REALLOC,     //!< narf_realloc(), narf_realloc_with_metadata(), narf_reserve().
+   NARF_PERF_WRITE,       //!< narf_write(), narf_write_with_metadata(), narf_append().
+   NARF_PERF_PUNCH,       //!< narf_punch().
+   NARF_PERF_FREE,        //!< narf_free().
+   NARF_PERF_RENAME,      //!< narf_rename_key().
+   NARF_PERF_METADATA,    //!< narf_set_metadata().
+   NARF_PERF_COMPRESS,    //!< narf_set_compressed().
+   NARF_PERF_DEDUP,       //!< narf_dedup().
+   NARF_PERF_SNAPSHOT,    //!< narf_snapshot_create(), narf_snapshot_delete(), narf_snapshot_mount(), narf_changes_since().
+   NARF_PERF_STAT,        //!< narf_stat(), narf_usage(), narf_live_extents().
+   NARF_PERF_FSCK,        //!< narf_fsck(), narf_fsck_deep(), narf_fsck_begin(), narf_fsck_step(), narf_fsck_end().
+   NARF_PERF_DEFRAG,      //!< narf_defrag(), narf_defrag_step().
+   NARF_PERF_MAINTENANCE, //!< narf_maintenance_step().
+   NARF_PERF_OPS,         //!< Number of operations; as an argument, all of them together.
+} NarfPerfOp;
+
+//! @brief Counters charged to one public operation.
+typedef struct {
+   uint32_t calls;             //!< Calls made.
+   uint32_t node_reads;        //!< Catalog node sectors read.
+   uint32_t node_writes;       //!< Catalog node and spare-record sectors written.
+   uint32_t payload_reads;     //!< Payload sectors read.
+   uint32_t payload_writes;    //!< Payload sectors written.
+   uint32_t root_commits;      //!< Root sectors written.
+   uint32_t rollbacks;         //!< Transactions rolled back.
+   uint32_t spare_rebuilds;    //!< Spare-list rebuilds started.
+   uint32_t retired_overflows; //!< Transactions whose retired-node list overflowed.
+   uint32_t coalesce_walks;    //!< Free-tree passes looking for adjacent extents.
+   uint32_t spare_hits;        //!< Catalog sectors reused from the RAM spare list.
+   uint32_t max_depth;         //!< Greatest AVL height among the catalog nodes read.
+} NarfPerfStats;
+
+//! @brief Return the performance counters charged to an operation.
+//!
+//! Counters live in RAM, start at zero, and survive mounts until
+//! narf_perf_reset().  Work a public call does on behalf of another, such
+//! as the write behind narf_append(), is charged to the outer call.  MBR
+//! sectors and narf_io_discard() or narf_io_write_zeroes() ranges are not
+//! counted.
+//!
+//! @param op Operation, or NARF_PERF_OPS for the sum over all of them.
+//! @param stats Destination for the counters.
+//! @return true on success.
+bool narf_perf_stats(NarfPerfOp op, NarfPerfStats *stats);
+
+//! @brief Return a short lower-case name for an operation, or NULL.
+const char *narf_perf_op_name(NarfPerfOp op);
+
+//! @brief Zero every performance counter, latency histogram, and trace count.
+void narf_perf_reset(void);
+
+#ifdef NARF_USE_PERF_TRACE
+//! @brief Number of log2 latency buckets kept per operation.
+#define NARF_PERF_BUCKETS 32
+
+//! @brief Monotonic host clock in microseconds from any fixed point.
+typedef uint64_t (*NarfPerfClock)(void);
+
+//! @brief Call latencies charged to one public operation.
+//!
+//! Bucket 0 holds calls under one microsecond; bucket b holds calls of at
+//! least 2^(b-1) and under 2^b microseconds; the last bucket also holds
+//! everything longer.  The percentiles are bucket upper bounds, so they are
+//! within a factor of two above the true value.
+typedef struct {
+   uint32_t count;                      //!< Calls timed.
+   uint32_t buckets[NARF_PERF_BUCKETS]; //!< Calls per latency bucket.
+   uint64_t p50;                        //!< Median, in microseconds.
+   uint64_t p99;                        //!< 99th percentile, in microseconds.
+   uint64_t p999;                       //!< 99.9th percentile, in microseconds.
+   uint64_t max;                        //!< Longest call, in microseconds.
+} NarfPerfLatency;
+
+//! @brief Kinds of sector transfer in the trace.
+typedef enum {
+   NARF_TRACE_NODE_READ,     //!< Catalog node read.
+   NARF_TRACE_NODE_WRITE,    //!< Catalog node or spare record written.
+   NARF_TRACE_PAYLOAD_READ,  //!< Payload sector read.
+   NARF_TRACE_PAYLOAD_WRITE, //!< Payload sector written.
+   NARF_TRACE_ROOT_WRITE,    //!< Root sector written by a commit.
+} NarfTraceKind;
+
+//! @brief One sector transfer in the trace.
+typedef struct {
+   uint64_t start;    //!< Clock reading before the transfer, or 0 without a clock.
+   uint32_t micros;   //!< Time the transfer took, or 0 without a clock.
+   NarfSector sector; //!< Absolute device sector, as passed to narf_io.
+   uint8_t kind;      //!< NarfTraceKind.
+   uint8_t op;        //!< NarfPerfOp the transfer was charged to.
+} NarfTraceRecord;
+
+//! @brief Set the clock that times calls and sector transfers.
+//!
+//! Without a clock, calls are not timed and trace records carry no times.
+//!
+//! @param clock Host clock, or NULL to stop timing.
+void narf_perf_set_clock(NarfPerfClock clock);
+
+//! @brief Return the latency histogram of an operation, or of all of them.
+//!
+//! A call is timed from its entry to the end of its last sector transfer,
+//! so work after the final transfer is not included.  Calls are binned when
+//! the next public call starts or a latency is asked for.
+//!
+//! @param op Operation, or NARF_PERF_OPS for all operations together.
+//! @param latency Destination for the histogram and percentiles.
+//! @return true on success.
+bool narf_perf_latency(NarfPerfOp op, NarfPerfLatency *latency);
+
+//! @brief Lend the core a ring for the sector trace.
+//!
+//! Every sector transfer the perf counters see is recorded; once the ring
+//! is full the oldest records are overwritten.  The memory must stay valid
+//! until it is replaced.  NULL or zero entries stops tracing.
+//!
+//! @param ring Caller-owned record storage, or NULL.
+//! @param entries Number of records ring holds.
+void narf_perf_set_trace(NarfTraceRecord *ring, size_t entries);
+
+//! @brief Return the number of records traced since the ring was lent.
+//!
+//! The newest record is at index (count - 1) % entries; once count exceeds
+//! entries, the oldest one still kept is at count % entries.
+uint64_t narf_perf_trace_count(void);
+#endif
+#endif
+
 #ifdef NARF_DEBUG
 //! @brief Print internal NARF root and tree state.
 void narf_debug(void);
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "narf_conf.h"
+#include "narf_io.h"
+#include "narf_io_ram.h"
+#include "narf.h"
+
+// narf_bench runs a fixed set of workloads against the simulated RAM device
+// and prints one line of key=value fields per workload, so results from
+// different releases can be compared by script.  Setup work is not measured.
+// The seconds are the core's CPU cost; the sector counts and the modelled
+// device time are what a real device would see, and repeat exactly.
+
+#define BENCH_KEY_BYTES 100
+#define BENCH_APPEND_BYTES 77
+#define BENCH_CHUNK_BYTES (64u * 1024u)
+#define BENCH_REWRITE_KEY_BYTES (1024u * 1024u)
+#define BENCH_REWRITE_BYTES 1000
+#define BENCH_MOUNTS 10
+
+//! @brief Device counters and clock at the start of a measurement.
+typedef struct {
+   struct timespec start;
+   NarfRamCounters device;
+} BenchMark;
+
+//! @brief One workload.
+typedef struct {
+   const char *name;
+   bool (*run)(void);
+} Bench;
+
+static uint32_t image_sectors = 0;
+static NarfRamModel device_model;
+static unsigned long bench_count = 1000;
+static uint32_t bench_seed = 1;
+static uint32_t rng_state = 1;
+static uint8_t *pattern = NULL;
+
+//! @brief Return the next value of the workload's pseudo-random sequence.
+static uint32_t rng_next(void) {
+   // xorshift32: the same seed gives the same workload on every host.
+   rng_state ^= rng_state << 13;
+   rng_state ^= rng_state >> 17;
+   rng_state ^= rng_state << 5;
+   return rng_state;
+}
+
+//! @brief Return a pseudo-random value below limit.
+static uint32_t rng_below(uint32_t limit) {
+   return limit != 0 ? rng_next() % limit : 0;
+}
+
+//! @brief Format an empty RAM image and reseed the workload sequence.
+static bool fresh_image(void) {
+   rng_state = bench_seed != 0 ? bench_seed : 1;
+   if (!narf_io_ram_setup(image_sectors, &device_model) ||
+       !narf_mkfs(0, image_sectors) || !narf_init(0)) {
+      fprintf(stderr, "cannot format the RAM image\n");
+      return false;
+   }
+   return true;
+}
+
+//! @brief Start measuring.
+static void mark_begin(BenchMark *mark) {
+   narf_io_ram_counters(&mark->device);
+   clock_gettime(CLOCK_MONOTONIC, &mark->start);
+}
+
+//! @brief Print one result line for the work since mark_begin().
+static void mark_end(const BenchMark *mark, const char *name, unsigned long ops,
+                     const char *extra) {
+   struct timespec end;
+   NarfRamCounters now;
+   double seconds;
+   double per_op = ops != 0 ? 1.0 / (double) ops : 0.0;
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   narf_io_ram_counters(&now);
+   seconds = (double) (end.tv_sec - mark->start.tv_sec) +
+             (double) (end.tv_nsec - mark->start.tv_nsec) / 1e9;
+
+   printf("bench=%s%s ops=%lu seconds=%.6f ops_per_sec=%.1f"
+          " reads_per_op=%.2f writes_per_op=%.2f syncs_per_op=%.2f"
+          " merges_per_op=%.2f device_us_per_op=%.1f\n",
+          name, extra != NULL ? extra : "", ops, seconds,
+          seconds > 0.0 ? (double) ops / seconds : 0.0,
+          (double) (now.reads - mark->device.reads) * per_op,
+          (double) (now.writes - mark->device.writes) * per_op,
+          (double) (now.syncs - mark->device.syncs) * per_op,
+          (double) (now.merges - mark->device.merges) * per_op,
+          (double) (now.micros - mark->device.micros) * per_op);
+}
+
+//! @brief Format a numbered key under a prefix.
+static const char *bench_key(char *key, size_t key_size, const char *prefix,
+                             unsigned long n) {
+   snprintf(key, key_size, "%s%08lu", prefix, n);
+   return key;
+}
+
+//! @brief Create count small keys named prefix00000000 upward.
+static bool create_keys(const char *prefix, unsigned long count) {
+   char key[64];
+
+   for (unsigned long i = 0; i < count; i++) {
+      bench_key(key, sizeof(key), prefix, i);
+      if (!narf_alloc(key, BENCH_KEY_BYTES) ||
+          !narf_write(key, pattern, BENCH_KEY_BYTES, 0)) {
+         fprintf(stderr, "cannot create %s\n", key);
+         return false;
+      }
+   }
+   return true;
+}
+
+//! @brief Small-key create: allocate and fill one short key per op.
+static bool bench_create(void) {
+   BenchMark mark;
+
+   if (!fresh_image()) return false;
+   mark_begin(&mark);
+   if (!create_keys("c/", bench_count)) return false;
+   mark_end(&mark, "create", bench_count, NULL);
+   return true;
+}
+
+//! @brief Random read: read one whole small key per op.
+static bool bench_read(void) {
+   BenchMark mark;
+   uint8_t data[BENCH_KEY_BYTES];
+   char key[64];
+
+   if (!fresh_image() || !create_keys("c/", bench_count)) return false;
+   mark_begin(&mark);
+   for (unsigned long i = 0; i < bench_count; i++) {
+      bench_key(key, sizeof(key), "c/", rng_below((uint32_t) bench_count));
+      if (!narf_read(key, data, sizeof(data), 0)) {
+         fprintf(stderr, "cannot read %s\n", key);
+         return false;
+      }
+   }
+   mark_end(&mark, "read", bench_count, NULL);
+   return true;
+}
+
+//! @brief Sequential large write: extend one key by a 64 KB chunk per op.
+static bool bench_seqwrite(void) {
+   BenchMark mark;
+   unsigned long chunks = bench_count / 10 != 0 ? bench_count / 10 : 1;
+
+   if (!fresh_image() || !narf_alloc("big", 0)) return false;
+   mark_begin(&mark);
+   for (unsigned long i = 0; i < chunks; i++) {
+      if (!narf_write("big", pattern, BENCH_CHUNK_BYTES, (NarfByteSize) i * BENCH_CHUNK_BYTES)) {
+         fprintf(stderr, "cannot write chunk %lu\n", i);
+         return false;
+      }
+   }
+   mark_end(&mark, "seqwrite", chunks, NULL);
+   return true;
+}
+
+//! @brief Unaligned append: add 77 bytes to one key per op.
+static bool bench_append(void) {
+   BenchMark mark;
+
+   if (!fresh_image() || !narf_alloc("log", 0)) return false;
+   mark_begin(&mark);
+   for (unsigned long i = 0; i < bench_count; i++) {
+      if (!narf_append("log", pattern, BENCH_APPEND_BYTES)) {
+         fprintf(stderr, "cannot append %lu\n", i);
+         return false;
+      }
+   }
+   mark_end(&mark, "append", bench_count, NULL);
+   return true;
+}
+
+//! @brief Rewrite in the middle: overwrite 1000 bytes inside a 1 MB key per op.
+static bool bench_rewrite(void) {
+   BenchMark mark;
+   const uint32_t span = BENCH_REWRITE_KEY_BYTES / 2 - BENCH_REWRITE_BYTES;
+
+   if (!fresh_image() || !narf_alloc("mid", 0)) return false;
+   for (NarfByteSize off = 0; off < BENCH_REWRITE_KEY_BYTES; off += BENCH_CHUNK_BYTES) {
+      if (!narf_write("mid", pattern, BENCH_CHUNK_BYTES, off)) return false;
+   }
+   mark_begin(&mark);
+   for (unsigned long i = 0; i < bench_count; i++) {
+      NarfByteSize off = BENCH_REWRITE_KEY_BYTES / 4 + rng_below(span);
+
+      if (!narf_write("mid", pattern + 1, BENCH_REWRITE_BYTES, off)) {
+         fprintf(stderr, "cannot rewrite at %lu\n", (unsigned long) off);
+         return false;
+      }
+   }
+   mark_end(&mark, "rewrite", bench_count, NULL);
+   return true;
+}
+
+//! @brief Directory listing: one narf_dirfirst() or narf_dirnext() step per op.
+static bool bench_list(void) {
+   BenchMark mark;
+   unsigned long ops = 0;
+   const char *key;
+
+   if (!fresh_image() || !create_keys("d/", bench_count) ||
+       !create_keys("x/", bench_count / 2)) {
+      return false;
+   }
+   mark_begin(&mark);
+   for (key = narf_dirfirst("/d/", "/"); key != NULL; key = narf_dirnext("/d/", "/", key)) {
+      ops++;
+   }
+   mark_end(&mark, "list", ops, NULL);
+   if (ops != bench_count) {
+      fprintf(stderr, "listed %lu of %lu keys\n", ops, bench_count);
+      return false;
+   }
+   return true;
+}
+
+//! @brief Prefix rename: move one key from d/ to e/ per op.
+static bool bench_rename(void) {
+   BenchMark mark;
+   char key[64];
+   char newkey[64];
+
+   if (!fresh_image() || !create_keys("d/", bench_count)) return false;
+   mark_begin(&mark);
+   for (unsigned long i = 0; i < bench_count; i++) {
+      bench_key(key, sizeof(key), "d/", i);
+      bench_key(newkey, sizeof(newkey), "e/", i);
+      if (!narf_rename_key(key, newkey)) {
+         fprintf(stderr, "cannot rename %s\n", key);
+         return false;
+      }
+   }
+   mark_end(&mark, "rename", bench_count, NULL);
+   return true;
+}
+
+//! @brief Free-heavy churn: allocate or free a random key per op, then defrag.
+static bool bench_churn(void) {
+   BenchMark mark;
+   unsigned long slots = bench_count / 4 != 0 ? bench_count / 4 : 1;
+   bool *live = calloc(slots, sizeof(*live));
+   unsigned long ops = 0;
+   char key[64];
+   char extra[64];
+   NarfStat stat;
+
+   if (live == NULL) {
+      perror("calloc");
+      return false;
+   }
+   if (!fresh_image()) {
+      free(live);
+      return false;
+   }
+   mark_begin(&mark);
+   for (unsigned long i = 0; i < bench_count; i++) {
+      unsigned long slot = rng_below((uint32_t) slots);
+      NarfByteSize bytes = (NarfByteSize) (1 + rng_below(64)) * NARF_SECTOR_SIZE;
+
+      bench_key(key, sizeof(key), "churn/", slot);
+      // Frees are twice as likely as allocations once a slot is taken.
+      if (live[slot] && rng_below(3) != 0) {
+         live[slot] = !narf_free(key);
+      }
+      else if (!live[slot]) {
+         live[slot] = narf_alloc(key, bytes) && narf_write(key, NULL, bytes, 0);
+      }
+      else {
+         narf_realloc(key, bytes);
+      }
+      ops++;
+   }
+   if (!narf_stat(&stat)) {
+      free(live);
+      return false;
+   }
+   snprintf(extra, sizeof(extra), " largest_free=%lu", (unsigned long) stat.largest_free);
+   mark_end(&mark, "churn", ops, extra);
+   free(live);
+
+#ifdef NARF_USE_DEFRAG
+   mark_begin(&mark);
+   if (!narf_defrag() || !narf_stat(&stat)) {
+      fprintf(stderr, "defrag failed\n");
+      return false;
+   }
+   snprintf(extra, sizeof(extra), " largest_free=%lu", (unsigned long) stat.largest_free);
+   mark_end(&mark, "defrag", 1, extra);
+#endif
+   return true;
+}
+
+//! @brief Iterator state for the mount workload's key set.
+typedef struct {
+   unsigned long index;
+   char key[64];
+} BenchBulk;
+
+//! @brief Produce the next key for the mount workload.
+static bool bench_bulk_next(void *context, NarfBulkItem *item) {
+   BenchBulk *state = context;
+
+   bench_key(state->key, sizeof(state->key), "m/", state->index++);
+   item->key = state->key;
+   item->bytes = BENCH_KEY_BYTES;
+   item->metadata = NULL;
+   return true;
+}
+
+//! @brief Mount time: ten mounts per key count, after a clean unmount and not.
+static bool bench_mount(void) {
+   const unsigned long counts[] = { bench_count / 10, bench_count, bench_count * 10 };
+
+   for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+      BenchBulk state;
+      BenchMark mark;
+      char extra[32];
+
+      memset(&state, 0, sizeof(state));
+      if (!fresh_image() || !narf_bulk_insert((NarfSector) counts[c], bench_bulk_next, &state) ||
+          !narf_unmount()) {
+         fprintf(stderr, "cannot build %lu keys\n", counts[c]);
+         return false;
+      }
+      snprintf(extra, sizeof(extra), " keys=%lu", counts[c]);
+
+      mark_begin(&mark);
+      for (unsigned i = 0; i < BENCH_MOUNTS; i++) {
+         if (!narf_init(0)) return false;
+      }
+      mark_end(&mark, "mount_clean", BENCH_MOUNTS, extra);
+
+      // A commit after the clean unmount makes every mount validate fully.
+      if (!narf_alloc("dirty", 0)) return false;
+      mark_begin(&mark);
+      for (unsigned i = 0; i < BENCH_MOUNTS; i++) {
+         if (!narf_init(0)) return false;
+      }
+      mark_end(&mark, "mount_dirty", BENCH_MOUNTS, extra);
+   }
+   return true;
+}
+
+static const Bench benches[] = {
+   { "create", bench_create },
+   { "read", bench_read },
+   { "seqwrite", bench_seqwrite },
+   { "append", bench_append },
+   { "rewrite", bench_rewrite },
+   { "list", bench_list },
+   { "rename", bench_rename },
+   { "churn", bench_churn },
+   { "mount", bench_mount },
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+//! @brief Print usage and exit.
+static void usage(const char *name) {
+   fprintf(stderr,
+         "usage: %s [-s size] [-n count] [-r seed] [-m model] [workload...]\n"
+         "\n"
+         "Run each workload, or all of them, on a fresh RAM image of size bytes\n"
+         "(K/M/G suffixes, default 64M) and print one line of key=value fields\n"
+         "per result.  count scales every workload (default 1000); seed fixes\n"
+         "the random choices (default 1); model is a narf_io_ram device model\n"
+         "such as sd or emmc,write=80 (default ram, which costs nothing).\n"
+         "\n"
+         "Workloads:", name);
+   for (size_t i = 0; i < BENCH_COUNT; i++) {
+      fprintf(stderr, " %s", benches[i].name);
+   }
+   fprintf(stderr, "\n");
+   exit(1);
+}
+
+//! @brief Parse a byte count with an optional K/M/G suffix.
+static bool parse_size(const char *text, uint64_t *bytes) {
+   char *end;
+   uint64_t value;
+   uint64_t multiplier = 1;
+
+   errno = 0;
+   value = strtoull(text, &end, 0);
+   if (end == text || errno != 0) return false;
+
+   if (*end == 'k' || *end == 'K') multiplier = 1024ull;
+   else if (*end == 'm' || *end == 'M') multiplier = 1024ull * 1024ull;
+   else if (*end == 'g' || *end == 'G') multiplier = 1024ull * 1024ull * 1024ull;
+   else if (*end != 0) return false;
+   if (multiplier != 1 && end[1] != 0) return false;
+   if (value > UINT64_MAX / multiplier) return false;
+
+   *bytes = value * multiplier;
+   return true;
+}
+
+//! @brief Parse a positive decimal count.
+static bool parse_count(const char *text, unsigned long *value) {
+   char *end;
+   unsigned long parsed;
+
+   errno = 0;
+   parsed = strtoul(text, &end, 0);
+   if (end == text || *end != 0 || errno != 0 || parsed == 0) return false;
+   *value = parsed;
+   return true;
+}
+
+int main(int argc, char *argv[]) {
+   uint64_t bytes = 64ull * 1024ull * 1024ull;
+   unsigned long seed = bench_seed;
+   const char *spec = "ram";
+   int argi = 1;
+   int status = 0;
+
+   narf_io_ram_model(NULL, &device_model);
+   while (argi < argc && argv[argi][0] == '-') {
+      if (!strcmp(argv[argi], "-s") && argi + 1 < argc) {
+         if (!parse_size(argv[argi + 1], &bytes)) usage(argv[0]);
+         argi += 2;
+      }
+      else if (!strcmp(argv[argi], "-n") && argi + 1 < argc) {
+         if (!parse_count(argv[argi + 1], &bench_count)) usage(argv[0]);
+         argi += 2;
+      }
+      else if (!strcmp(argv[argi], "-m") && argi + 1 < argc) {
+         spec = argv[argi + 1];
+         if (!narf_io_ram_model(spec, &device_model)) usage(argv[0]);
+         argi += 2;
+      }
+      else if (!strcmp(argv[argi], "-r") && argi + 1 < argc) {
+         if (!parse_count(argv[argi + 1], &seed) || seed > UINT32_MAX) usage(argv[0]);
+         argi += 2;
+      }
+      else {
+         usage(argv[0]);
+      }
+   }
+   for (int i = argi; i < argc; i++) {
+      size_t b;
+
+      for (b = 0; b < BENCH_COUNT && strcmp(benches[b].name, argv[i]); b++) {
+      }
+      if (b == BENCH_COUNT) usage(argv[0]);
+   }
+
+   if (bytes % NARF_SECTOR_SIZE != 0 || bytes / NARF_SECTOR_SIZE > UINT32_MAX ||
+       bytes / NARF_SECTOR_SIZE < 64) {
+      fprintf(stderr, "bad image size: %" PRIu64 " bytes\n", bytes);
+      return 1;
+   }
+   bench_seed = (uint32_t) seed;
+   image_sectors = (uint32_t) (bytes / NARF_SECTOR_SIZE);
+   pattern = malloc(BENCH_CHUNK_BYTES + 1);
+   if (pattern == NULL) {
+      perror("malloc");
+      return 1;
+   }
+   for (size_t i = 0; i < BENCH_CHUNK_BYTES + 1; i++) pattern[i] = (uint8_t) ('a' + i % 26);
+
+   printf("narf_bench sectors=%u count=%lu seed=%lu model=%s\n",
+          (unsigned) image_sectors, bench_count, seed, spec);
+   for (size_t b = 0; b < BENCH_COUNT; b++) {
+      bool selected = argi == argc;
+
+      for (int i = argi; i < argc && !selected; i++) {
+         selected = !strcmp(benches[b].name, argv[i]);
+      }
+      if (!selected) continue;
+      if (!benches[b].run()) {
+         fprintf(stderr, "%s: failed\n", benches[b].name);
+         status = 1;
+      }
+   }
+
+   free(pattern);
+   return status;
+}
+
+// vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
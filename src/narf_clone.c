@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "narf_conf.h"
+#include "narf_io.h"
+#include "narf.h"
+
+// narf_clone copies only the sectors a NARF filesystem still reads: the root
+// copies, live catalog nodes, and written payload, as narf_live_extents()
+// reports them, plus everything before the filesystem origin.  The output is
+// a sparse image of the same size, or a stream of the runs that narf_clone -x
+// expands back into one.  With -c the clone is defragmented and everything
+// no longer live is punched out, leaving payload packed at the bottom and
+// the catalog at the top.
+//
+// Stream layout, integers little-endian:
+//    "NARFCLN1" u64 image-sectors
+//    u64 start u64 count data...      one per run, in address order
+//    u64 0 u64 0                      end of stream
+
+extern void narf_io_configure(const char *fname);
+
+#define CLONE_MAGIC "NARFCLN1"
+
+//! @brief One run of sectors to copy.
+typedef struct {
+   uint64_t start;
+   uint64_t count;
+} CloneRun;
+
+//! @brief Runs collected from narf_live_extents(), by kind.
+typedef struct {
+   CloneRun *runs;
+   size_t count;
+   size_t capacity;
+   uint64_t sectors[3];
+   uint64_t origin;
+   bool failed;
+} CloneList;
+
+static uint8_t sector_data[NARF_SECTOR_SIZE];
+
+//! @brief Print usage and exit.
+static void usage(const char *name) {
+   fprintf(stderr,
+         "usage: %s [-p partition] [-c] <image> <output>\n"
+         "       %s [-p partition] -e <image> <stream>\n"
+         "       %s -x <stream> <output>\n"
+         "  Copy the sectors a NARF filesystem reads into a sparse image, or\n"
+         "  export them as a stream (-e) and expand one (-x).  -c compacts the\n"
+         "  copy with defrag and punches out what is no longer live.  A stream\n"
+         "  of - is standard output for -e and standard input for -x.\n",
+         name, name, name);
+   exit(2);
+}
+
+//! @brief Write an unsigned integer of the given byte width.
+static bool put_uint(FILE *out, uint64_t value, unsigned width) {
+   uint8_t bytes[8];
+
+   for (unsigned i = 0; i < width; i++) {
+      bytes[i] = (uint8_t) (value >> (8 * i));
+   }
+   return fwrite(bytes, 1, width, out) == width;
+}
+
+//! @brief Read an unsigned integer of the given byte width.
+static bool get_uint(FILE *in, uint64_t *value, unsigned width) {
+   uint8_t bytes[8];
+
+   if (fread(bytes, 1, width, in) != width) return false;
+   *value = 0;
+   for (unsigned i = 0; i < width; i++) {
+      *value |= (uint64_t) bytes[i] << (8 * i);
+   }
+   return true;
+}
+
+//! @brief Append one run to a list.
+static bool add_run(CloneList *list, uint64_t start, uint64_t count) {
+   if (list->count == list->capacity) {
+      size_t capacity = list->capacity ? 2 * list->capacity : 256;
+      CloneRun *runs = realloc(list->runs, capacity * sizeof(*runs));
+
+      if (runs == NULL) return false;
+      list->runs = runs;
+      list->capacity = capacity;
+   }
+   list->runs[list->count].start = start;
+   list->runs[list->count].count = count;
+   list->count++;
+   return true;
+}
+
+//! @brief Collect one run reported by narf_live_extents().
+static bool collect_run(void *context, NarfLiveKind kind, NarfSector start, NarfSector count) {
+   CloneList *list = context;
+
+   if (kind == NARF_LIVE_ROOT) list->origin = start;
+   list->sectors[kind] += count;
+   if (!add_run(list, start, count)) {
+      list->failed = true;
+      return false;
+   }
+   return true;
+}
+
+//! @brief Order runs by start sector.
+static int compare_runs(const void *a, const void *b) {
+   const CloneRun *x = a;
+   const CloneRun *y = b;
+
+   return (x->start > y->start) - (x->start < y->start);
+}
+
+//! @brief Sort runs and merge the ones that touch.
+static void merge_runs(CloneList *list) {
+   size_t out = 0;
+
+   qsort(list->runs, list->count, sizeof(*list->runs), compare_runs);
+   for (size_t i = 0; i < list->count; i++) {
+      CloneRun *run = &list->runs[i];
+
+      if (out != 0 && list->runs[out - 1].start + list->runs[out - 1].count >= run->start) {
+         uint64_t end = run->start + run->count;
+         CloneRun *last = &list->runs[out - 1];
+
+         if (end > last->start + last->count) last->count = end - last->start;
+      }
+      else {
+         list->runs[out++] = *run;
+      }
+   }
+   list->count = out;
+}
+
+//! @brief Open and mount an image.
+//!
+//! Mounting may write spare-list links into spare sectors, which are never
+//! part of the live set.
+static bool mount_image(const char *image, int partition) {
+   bool ok;
+
+   narf_io_configure(image);
+   if (!narf_io_open()) return false;
+#ifdef NARF_MBR_UTILS
+   ok = partition ? narf_mount(partition) : narf_init(0);
+#else
+   ok = partition == 0 && narf_init(0);
+#endif
+   if (!ok) fprintf(stderr, "cannot mount %s\n", image);
+   return ok;
+}
+
+//! @brief Collect the mounted filesystem's live runs, sorted and merged.
+static bool collect_runs(CloneList *list) {
+   memset(list, 0, sizeof(*list));
+   if (!narf_live_extents(collect_run, list) || list->failed) {
+      fprintf(stderr, "narf_live_extents() failed\n");
+      return false;
+   }
+   // Keep the partition table and anything else before the filesystem.
+   if (list->origin != 0 && !add_run(list, 0, list->origin)) return false;
+   merge_runs(list);
+   return true;
+}
+
+//! @brief Return true when the sector buffer holds only zero bytes.
+static bool sector_is_zero(void) {
+   for (size_t i = 0; i < NARF_SECTOR_SIZE; i++) {
+      if (sector_data[i] != 0) return false;
+   }
+   return true;
+}
+
+//! @brief Copy one run from the open image to a freshly truncated file
+//! descriptor, leaving all-zero sectors as holes.
+static bool copy_run_fd(int fd, const CloneRun *run) {
+   for (uint64_t s = run->start; s < run->start + run->count; s++) {
+      if (!narf_io_read((uint32_t) s, sector_data)) return false;
+      if (sector_is_zero()) continue;
+      if (pwrite(fd, sector_data, NARF_SECTOR_SIZE, (off_t) (s * NARF_SECTOR_SIZE)) !=
+          NARF_SECTOR_SIZE) {
+         return false;
+      }
+   }
+   return true;
+}
+
+//! @brief Punch out every sector of the open image outside the runs.
+static bool punch_outside(const CloneList *list, uint64_t sectors) {
+   uint64_t next = 0;
+
+   for (size_t i = 0; i <= list->count; i++) {
+      uint64_t start = i < list->count ? list->runs[i].start : sectors;
+
+      if (start > next && !narf_io_discard((uint32_t) next, (uint32_t) (start - next))) {
+         return false;
+      }
+      if (i < list->count) next = list->runs[i].start + list->runs[i].count;
+   }
+   return true;
+}
+
+//! @brief Print what a clone copied.
+static void print_summary(const char *what, const CloneList *list, uint64_t sectors) {
+   uint64_t copied = 0;
+
+   for (size_t i = 0; i < list->count; i++) copied += list->runs[i].count;
+   fprintf(stderr,
+           "%s: runs=%zu copied=%" PRIu64 "/%" PRIu64 " sectors"
+           " (root=%" PRIu64 " catalog=%" PRIu64 " payload=%" PRIu64 " prefix=%" PRIu64 ")\n",
+           what, list->count, copied, sectors, list->sectors[NARF_LIVE_ROOT],
+           list->sectors[NARF_LIVE_CATALOG], list->sectors[NARF_LIVE_PAYLOAD],
+           list->origin);
+}
+
+//! @brief Clone an image into a sparse image file, optionally compacted.
+static bool clone_image(const char *image, int partition, const char *output, bool compact) {
+   CloneList list;
+   uint64_t sectors;
+   bool ok;
+   int fd;
+
+   memset(&list, 0, sizeof(list));
+   ok = mount_image(image, partition) && collect_runs(&list);
+   sectors = narf_io_sectors();
+   fd = ok ? open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+   if (ok && fd < 0) {
+      perror(output);
+      ok = false;
+   }
+   if (ok && ftruncate(fd, (off_t) (sectors * NARF_SECTOR_SIZE)) != 0) {
+      perror("ftruncate");
+      ok = false;
+   }
+   for (size_t i = 0; ok && i < list.count; i++) {
+      ok = copy_run_fd(fd, &list.runs[i]);
+      if (!ok) fprintf(stderr, "copy failed at sector %" PRIu64 "\n", list.runs[i].start);
+   }
+   if (fd >= 0 && (fsync(fd) != 0 || close(fd) != 0)) ok = false;
+   narf_io_close();
+   if (ok) print_summary("clone", &list, sectors);
+   free(list.runs);
+   if (!ok || !compact) return ok;
+
+#ifdef NARF_USE_DEFRAG
+   // Defrag the copy, then punch out the sectors it moved away from.  Spare
+   // sectors are punched too; unmounting rewrites the ones it links.
+   memset(&list, 0, sizeof(list));
+   ok = mount_image(output, partition);
+   if (ok && !narf_defrag()) {
+      fprintf(stderr, "narf_defrag() failed; it is refused while snapshots exist\n");
+      ok = false;
+   }
+   if (ok) ok = collect_runs(&list);
+   if (ok) {
+      ok = punch_outside(&list, sectors);
+      if (!ok) fprintf(stderr, "punching holes failed\n");
+   }
+   if (!narf_unmount()) ok = false;
+   narf_io_close();
+   if (ok) print_summary("compact", &list, sectors);
+   free(list.runs);
+   return ok;
+#else
+   fprintf(stderr, "-c needs NARF_USE_DEFRAG\n");
+   return false;
+#endif
+}
+
+//! @brief Export an image's live runs as a stream.
+static bool export_image(const char *image, int partition, const char *path) {
+   CloneList list;
+   uint64_t sectors;
+   FILE *out = NULL;
+   bool ok;
+
+   memset(&list, 0, sizeof(list));
+   ok = mount_image(image, partition) && collect_runs(&list);
+   sectors = narf_io_sectors();
+   if (ok) {
+      out = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+      if (out == NULL) perror(path);
+      ok = out != NULL && fwrite(CLONE_MAGIC, 1, 8, out) == 8 && put_uint(out, sectors, 8);
+   }
+   for (size_t i = 0; ok && i < list.count; i++) {
+      const CloneRun *run = &list.runs[i];
+
+      ok = put_uint(out, run->start, 8) && put_uint(out, run->count, 8);
+      for (uint64_t s = run->start; ok && s < run->start + run->count; s++) {
+         ok = narf_io_read((uint32_t) s, sector_data) &&
+              fwrite(sector_data, 1, NARF_SECTOR_SIZE, out) == NARF_SECTOR_SIZE;
+      }
+   }
+   if (ok) ok = put_uint(out, 0, 8) && put_uint(out, 0, 8);
+   if (out == stdout && fflush(out) != 0) ok = false;
+   if (out != NULL && out != stdout && fclose(out) != 0) ok = false;
+   narf_io_close();
+   if (ok) print_summary("export", &list, sectors);
+   free(list.runs);
+   return ok;
+}
+
+//! @brief Expand a stream into a sparse image file.
+static bool expand_stream(const char *path, const char *output) {
+   FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+   char magic[8];
+   uint64_t sectors;
+   uint64_t copied = 0;
+   size_t runs = 0;
+   bool ok;
+   int fd = -1;
+
+   if (in == NULL) {
+      perror(path);
+      return false;
+   }
+   ok = fread(magic, 1, 8, in) == 8 && memcmp(magic, CLONE_MAGIC, 8) == 0 &&
+        get_uint(in, &sectors, 8);
+   if (!ok) {
+      fprintf(stderr, "not a NARF clone stream\n");
+      if (in != stdin) fclose(in);
+      return false;
+   }
+   fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      perror(output);
+      if (in != stdin) fclose(in);
+      return false;
+   }
+   ok = ftruncate(fd, (off_t) (sectors * NARF_SECTOR_SIZE)) == 0;
+   while (ok) {
+      uint64_t start;
+      uint64_t count;
+
+      ok = get_uint(in, &start, 8) && get_uint(in, &count, 8);
+      if (!ok || count == 0) break;
+      if (start > sectors || count > sectors - start) {
+         ok = false;
+         break;
+      }
+      for (uint64_t s = start; ok && s < start + count; s++) {
+         ok = fread(sector_data, 1, NARF_SECTOR_SIZE, in) == NARF_SECTOR_SIZE;
+         if (!ok || sector_is_zero()) continue;
+         ok = pwrite(fd, sector_data, NARF_SECTOR_SIZE, (off_t) (s * NARF_SECTOR_SIZE)) ==
+              NARF_SECTOR_SIZE;
+      }
+      copied += count;
+      runs++;
+   }
+   if (!ok) fprintf(stderr, "malformed or truncated clone stream\n");
+   if (fd >= 0 && (fsync(fd) != 0 || close(fd) != 0)) ok = false;
+   if (in != stdin) fclose(in);
+   if (ok) {
+      fprintf(stderr, "expand: runs=%zu copied=%" PRIu64 "/%" PRIu64 " sectors\n",
+              runs, copied, sectors);
+   }
+   return ok;
+}
+
+int main(int argc, char *argv[]) {
+   int partition = 0;
+   bool compact = false;
+   char mode = 0;
+   int argi = 1;
+   bool ok;
+
+   while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != 0) {
+      if (!strcmp(argv[argi], "-p") && argi + 1 < argc) {
+         char *end;
+
+         errno = 0;
+         partition = (int) strtol(argv[argi + 1], &end, 10);
+         if (errno != 0 || *end != 0 || partition < 1 || partition > 4) usage(argv[0]);
+         argi += 2;
+      }
+      else if (!strcmp(argv[argi], "-c")) {
+         compact = true;
+         argi++;
+      }
+      else if ((!strcmp(argv[argi], "-e") || !strcmp(argv[argi], "-x")) && mode == 0) {
+         mode = argv[argi][1];
+         argi++;
+      }
+      else {
+         usage(argv[0]);
+      }
+   }
+   if (argc - argi != 2) usage(argv[0]);
+   if (compact && mode != 0) usage(argv[0]);
+   if (mode == 'x' && partition != 0) usage(argv[0]);
+
+   if (mode == 'e') {
+      ok = export_image(argv[argi], partition, argv[argi + 1]);
+   }
+   else if (mode == 'x') {
+      ok = expand_stream(argv[argi], argv[argi + 1]);
+   }
+   else {
+      ok = clone_image(argv[argi], partition, argv[argi + 1], compact);
+   }
+   return ok ? 0 : 1;
+}
+
+// vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
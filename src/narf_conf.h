@@ -23,6 +23,103 @@
 #define NARF_METADATA_RESERVE_SECTORS 32
 #endif
 
+// Bytes of the built-in spare-rebuild bitmap.  A frame covers eight catalog
+// sectors per byte and costs one walk of each catalog tree.  Hosts can instead
+// lend a larger buffer at run time with narf_set_work_memory().
+#ifndef NARF_SPARE_WORK_BYTES
+#define NARF_SPARE_WORK_BYTES NARF_SECTOR_SIZE
+#endif
+
+// Spare-list rebuild frames scanned at the start of each transaction while a
+// deferred rebuild is pending.  Each frame walks both catalog trees once.
+// Larger values finish sooner; smaller values keep individual operations
+// cheaper after mount.
+#ifndef NARF_SPARE_REBUILD_FRAMES
+#define NARF_SPARE_REBUILD_FRAMES 1
+#endif
+
+// Uncomment this when the narf_io layer implements narf_io_discard() and
+// narf_io_write_zeroes().  Freed payload extents and catalog sectors returned
+// past m_top are then discarded after each commit, and zero fills use
+// write-zeroes.  The Makefile enables it for the host tools.
+//#define NARF_USE_DISCARD
+
+// Freed ranges remembered per transaction for discard.  Ranges beyond this
+// are simply not discarded.
+#ifndef NARF_DISCARD_RANGES
+#define NARF_DISCARD_RANGES 16
+#endif
+
+// Defrag keeps a key's narf_reserve() growth slack while at least this many
+// sectors stay open between the payload and catalog frontiers, and trims it
+// once the gap falls below.
+#ifndef NARF_SLACK_TIGHT_SECTORS
+#define NARF_SLACK_TIGHT_SECTORS 1024
+#endif
+
+// Uncomment this for narf_set_alloc_policy() and the first-fit, next-fit,
+// segregated, and frontier-first payload allocators.  Without it payloads
+// always use best fit.  The Makefile enables it for the host tools.
+//#define NARF_USE_ALLOC_POLICIES
+
+// Requests below this many sectors count as small for the segregated policy.
+#ifndef NARF_ALLOC_SMALL_SECTORS
+#define NARF_ALLOC_SMALL_SECTORS 8
+#endif
+
+// Requests of at least this many sectors go to the open gap first under the
+// frontier policy.
+#ifndef NARF_ALLOC_LARGE_SECTORS
+#define NARF_ALLOC_LARGE_SECTORS 64
+#endif
+
+// Uncomment this for narf_set_compressed() and per-key compressed payloads.
+// It costs about 8 KiB of chunk buffers plus the match table below.  The
+// Makefile enables it for the host tools.
+//#define NARF_USE_COMPRESSION
+
+// Uncomment this for narf_dedup(): keys with identical payloads can share one
+// extent, reference counted in the catalog.  It costs one sector buffer.  The
+// Makefile enables it for the host tools.
+//#define NARF_USE_DEDUP
+
+// Uncomment this for narf_snapshot_create(), read-only snapshot mounts, and
+// narf_changes_since().  Snapshots pin catalog nodes and payload extents by
+// root version, so the first change to a key after a snapshot copies its
+// payload.  It costs one sector buffer and two walk stacks of about
+// 10 * NARF_MAX_AVL_DEPTH bytes each.  The Makefile enables it for the host
+// tools.
+//#define NARF_USE_SNAPSHOTS
+
+// Uncomment this for narf_perf_stats(): sector reads and writes, commits,
+// rollbacks, and other counters per public operation, kept in RAM.  Without
+// it the counting compiles to nothing.  The Makefile enables it for the host
+// tools.
+//#define NARF_USE_PERF_STATS
+
+// Uncomment this, with NARF_USE_PERF_STATS, for narf_perf_latency() and the
+// sector trace: log2-bucketed call latencies per public operation, timed by a
+// clock the host passes to narf_perf_set_clock(), and a record of every
+// catalog, payload, and root sector transfer in a ring the host lends.  It
+// costs about 2.5 KB of RAM.  The Makefile enables it for the host tools.
+//#define NARF_USE_PERF_TRACE
+
+// Uncomment this for narf_set_recorder(): the host is told about every public
+// call that reads or changes payload, with its key, size, and offset, and can
+// log them as a trace for narf_replay.  The Makefile enables it for the host
+// tools.
+//#define NARF_USE_RECORDER
+
+#if defined(NARF_USE_PERF_TRACE) && !defined(NARF_USE_PERF_STATS)
+#error "NARF_USE_PERF_TRACE needs NARF_USE_PERF_STATS"
+#endif
+
+// log2 of the compressor's match-table entries, two bytes each.  Larger finds
+// more matches; it does not change the on-disk format.
+#ifndef NARF_LZ_HASH_BITS
+#define NARF_LZ_HASH_BITS 12
+#endif
+
 // Number of bits in a sector address
 // NB: currently only 32 is actually supported !!!
 #define NARF_SECTOR_ADDRESS_BITS 32
@@ -49,8 +146,31 @@
 // Useful for real removable media
 #define NARF_MBR_UTILS
 
+// Uncomment this on hosts with POSIX threads for a multi-threaded
+// narf_fsck_deep() that sorts extents instead of scanning a tree per extent.
+// Needs -pthread; the Makefile enables it for the host tools.
+//#define NARF_USE_THREADS
+
+// Worker threads used by the threaded narf_fsck_deep().
+#ifndef NARF_FSCK_THREADS
+#define NARF_FSCK_THREADS 4
+#endif
+#if defined(NARF_USE_THREADS) && NARF_FSCK_THREADS < 2
+#error "NARF_FSCK_THREADS must be at least 2; leave NARF_USE_THREADS off for one"
+#endif
+
 // Uncomment this for narf_defrag().
 // Commenting it out will save code space.
 #define NARF_USE_DEFRAG
 
+// Uncomment this on hosts for a narf_defrag() planning pass that sorts all
+// data extents in heap memory and slides them down in batched commits.
+// The Makefile enables it for the host tools.
+//#define NARF_USE_DEFRAG_PLAN
+
+// Payload moves the planning pass may commit together.
+#ifndef NARF_DEFRAG_PLAN_BATCH
+#define NARF_DEFRAG_PLAN_BATCH 64
+#endif
+
 #endif
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "narf_conf.h"
+#include "narf_io.h"
+#include "narf.h"
+
+// narf_delta writes the keys changed since a snapshot of one image as a
+// delta stream, and applies such a stream to another image that still holds
+// the snapshot's contents.  Only blocks whose bytes differ are sent.
+//
+// Stream layout, integers little-endian:
+//    "NARFDLT1"
+//    'D' u16 key-length key                      delete a key
+//    'K' u16 key-length key u64 bytes metadata   size a key, set metadata
+//    'W' u64 offset u32 length data              write to the last 'K' key
+//    'E'                                         end of stream
+// Every record can be applied twice, so an interrupted apply is rerun.
+
+extern void narf_io_configure(const char *fname);
+
+#define DELTA_MAGIC "NARFDLT1"
+#define DELTA_BLOCK NARF_SECTOR_SIZE
+#define DELTA_CHUNK (128u * DELTA_BLOCK)
+// A key and its NUL always fit in a catalog node sector.
+#define DELTA_KEY_BYTES NARF_SECTOR_SIZE
+
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief One key reported by narf_changes_since().
+typedef struct {
+   NarfChangeKind kind;
+   char *key;
+   NarfByteSize old_bytes;
+   NarfByteSize new_bytes;
+   NarfByteSize first;
+} DeltaChange;
+
+//! @brief Changes collected before any payload is read.
+typedef struct {
+   DeltaChange *items;
+   size_t count;
+   size_t capacity;
+   bool failed;
+} DeltaList;
+
+//! @brief Totals printed after emit or apply.
+typedef struct {
+   unsigned long deleted;
+   unsigned long sized;
+   unsigned long writes;
+   uint64_t bytes;
+} DeltaTotals;
+
+static uint8_t before[DELTA_CHUNK];
+static uint8_t after[DELTA_CHUNK];
+static uint8_t metadata[NARF_METADATA_SIZE];
+#endif
+
+//! @brief Print usage and exit.
+static void usage(const char *name) {
+   fprintf(stderr,
+         "usage: %s [-p partition] emit <image> <snapshot> [delta]\n"
+         "       %s [-p partition] apply <image> [delta]\n"
+         "  emit writes the keys changed since <snapshot> to delta or stdout.\n"
+         "  apply replays a delta from a file or stdin onto an image that holds\n"
+         "  the snapshot's contents.\n",
+         name, name);
+   exit(2);
+}
+
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief Write an unsigned integer of the given byte width.
+static bool put_uint(FILE *out, uint64_t value, unsigned width) {
+   uint8_t bytes[8];
+
+   for (unsigned i = 0; i < width; i++) {
+      bytes[i] = (uint8_t) (value >> (8 * i));
+   }
+   return fwrite(bytes, 1, width, out) == width;
+}
+
+//! @brief Read an unsigned integer of the given byte width.
+static bool get_uint(FILE *in, uint64_t *value, unsigned width) {
+   uint8_t bytes[8];
+
+   if (fread(bytes, 1, width, in) != width) return false;
+   *value = 0;
+   for (unsigned i = 0; i < width; i++) {
+      *value |= (uint64_t) bytes[i] << (8 * i);
+   }
+   return true;
+}
+
+//! @brief Write a record tag and key.
+static bool put_key(FILE *out, char tag, const char *key) {
+   size_t length = strlen(key);
+
+   return fputc(tag, out) != EOF && put_uint(out, length, 2) &&
+          fwrite(key, 1, length, out) == length;
+}
+
+//! @brief Read a key into a buffer of DELTA_KEY_BYTES bytes.
+static bool get_key(FILE *in, char *key) {
+   uint64_t length;
+
+   if (!get_uint(in, &length, 2) || length == 0 || length >= DELTA_KEY_BYTES) {
+      return false;
+   }
+   if (fread(key, 1, (size_t) length, in) != length) return false;
+   key[length] = 0;
+   return memchr(key, 0, (size_t) length) == NULL;
+}
+
+//! @brief Collect one change; the key is copied because its buffer is reused.
+static bool collect_change(void *context, const NarfChange *change) {
+   DeltaList *list = context;
+   DeltaChange *item;
+
+   if (list->count == list->capacity) {
+      size_t capacity = list->capacity ? 2 * list->capacity : 64;
+      DeltaChange *items = realloc(list->items, capacity * sizeof(*items));
+
+      if (items == NULL) {
+         list->failed = true;
+         return false;
+      }
+      list->items = items;
+      list->capacity = capacity;
+   }
+   item = &list->items[list->count];
+   item->key = strdup(change->key);
+   if (item->key == NULL) {
+      list->failed = true;
+      return false;
+   }
+   item->kind = change->kind;
+   item->old_bytes = change->old_bytes;
+   item->new_bytes = change->new_bytes;
+   item->first = change->first;
+   list->count++;
+   return true;
+}
+
+//! @brief Read up to length bytes of a key at offset, zero-filling the rest.
+static bool read_padded(const char *key, NarfByteSize bytes, NarfByteSize offset,
+                        uint8_t *data, size_t length) {
+   size_t have = 0;
+
+   if (offset < bytes) {
+      have = bytes - offset < length ? (size_t) (bytes - offset) : length;
+      if (!narf_read(key, data, (NarfByteSize) have, offset)) return false;
+   }
+   memset(data + have, 0, length - have);
+   return true;
+}
+
+//! @brief Write the blocks of one key that differ from the snapshot.
+//!
+//! Bytes past the snapshot's size compare against zeroes, because apply
+//! sizes the key first and growing a key reads back as zeroes.
+static bool emit_payload(FILE *out, const char *snapshot, const DeltaChange *change,
+                         DeltaTotals *totals) {
+   NarfByteSize offset = change->first - change->first % DELTA_BLOCK;
+
+   while (offset < change->new_bytes) {
+      size_t length = change->new_bytes - offset < DELTA_CHUNK ?
+                      (size_t) (change->new_bytes - offset) : DELTA_CHUNK;
+      NarfByteSize old_bytes = change->kind == NARF_CHANGE_CREATED ? 0 : change->old_bytes;
+      size_t run = 0;
+
+      if (!read_padded(change->key, change->new_bytes, offset, after, length)) return false;
+      if (old_bytes > offset) {
+         bool read_ok;
+
+         if (!narf_snapshot_mount(snapshot)) return false;
+         read_ok = read_padded(change->key, old_bytes, offset, before, length);
+         if (!narf_snapshot_mount(NULL) || !read_ok) return false;
+      }
+      else {
+         memset(before, 0, length);
+      }
+
+      // Coalesce neighbouring blocks that differ into one record.
+      for (size_t at = 0; at < length || run != 0; at += DELTA_BLOCK) {
+         size_t block = 0;
+
+         if (at < length) {
+            block = length - at < DELTA_BLOCK ? length - at : DELTA_BLOCK;
+            if (memcmp(before + at, after + at, block) != 0) {
+               run += block;
+               continue;
+            }
+         }
+         if (run != 0) {
+            size_t start = (at < length ? at : length) - run;
+
+            if (fputc('W', out) == EOF ||
+                !put_uint(out, (uint64_t) offset + start, 8) ||
+                !put_uint(out, run, 4) ||
+                fwrite(after + start, 1, run, out) != run) {
+               return false;
+            }
+            totals->writes++;
+            totals->bytes += run;
+            run = 0;
+         }
+      }
+      offset += (NarfByteSize) length;
+   }
+   return true;
+}
+
+//! @brief Write the delta from a snapshot to the live filesystem.
+static bool emit(FILE *out, const char *snapshot, DeltaTotals *totals) {
+   DeltaList list = { NULL, 0, 0, false };
+   bool ok;
+
+   ok = narf_changes_since(snapshot, collect_change, &list) && !list.failed;
+   if (!ok) fprintf(stderr, "narf_changes_since(%s) failed\n", snapshot);
+   if (ok) ok = fwrite(DELTA_MAGIC, 1, 8, out) == 8;
+
+   for (size_t i = 0; ok && i < list.count; i++) {
+      const DeltaChange *change = &list.items[i];
+      const uint8_t *meta;
+
+      if (change->kind == NARF_CHANGE_DELETED) {
+         ok = put_key(out, 'D', change->key);
+         totals->deleted++;
+         continue;
+      }
+      meta = narf_metadata(change->key);
+      ok = meta != NULL && put_key(out, 'K', change->key) &&
+           put_uint(out, change->new_bytes, 8) &&
+           fwrite(meta, 1, NARF_METADATA_SIZE, out) == NARF_METADATA_SIZE &&
+           emit_payload(out, snapshot, change, totals);
+      if (!ok) fprintf(stderr, "failed to emit %s\n", change->key);
+      totals->sized++;
+   }
+   if (ok) ok = fputc('E', out) != EOF;
+
+   for (size_t i = 0; i < list.count; i++) free(list.items[i].key);
+   free(list.items);
+   return ok;
+}
+
+//! @brief Apply a delta stream to the live filesystem.
+static bool apply(FILE *in, DeltaTotals *totals) {
+   char magic[8];
+   char key[DELTA_KEY_BYTES];
+   bool have_key = false;
+
+   if (fread(magic, 1, 8, in) != 8 || memcmp(magic, DELTA_MAGIC, 8) != 0) {
+      fprintf(stderr, "not a NARF delta stream\n");
+      return false;
+   }
+
+   for (;;) {
+      int tag = fgetc(in);
+      uint64_t value;
+      uint64_t length;
+
+      if (tag == 'E') return true;
+      if (tag == 'D') {
+         if (!get_key(in, key)) break;
+         have_key = false;
+         // A key already gone was deleted by an earlier, interrupted apply.
+         if (narf_find(key) && !narf_free(key)) {
+            fprintf(stderr, "narf_free(%s) failed\n", key);
+            return false;
+         }
+         totals->deleted++;
+      }
+      else if (tag == 'K') {
+         if (!get_key(in, key) || !get_uint(in, &value, 8) ||
+             fread(metadata, 1, NARF_METADATA_SIZE, in) != NARF_METADATA_SIZE) {
+            break;
+         }
+         if (value > (NarfByteSize) -1 ||
+             !narf_realloc(key, (NarfByteSize) value) ||
+             !narf_set_metadata(key, metadata)) {
+            fprintf(stderr, "failed to size %s\n", key);
+            return false;
+         }
+         have_key = true;
+         totals->sized++;
+      }
+      else if (tag == 'W') {
+         if (!have_key || !get_uint(in, &value, 8) || !get_uint(in, &length, 4)) break;
+         while (length != 0) {
+            size_t part = length < DELTA_CHUNK ? (size_t) length : DELTA_CHUNK;
+
+            if (fread(after, 1, part, in) != part) {
+               fprintf(stderr, "truncated delta stream\n");
+               return false;
+            }
+            if (value > (NarfByteSize) -1 ||
+                !narf_write(key, after, (NarfByteSize) part, (NarfByteSize) value)) {
+               fprintf(stderr, "failed to write %s\n", key);
+               return false;
+            }
+            totals->bytes += part;
+            value += part;
+            length -= part;
+         }
+         totals->writes++;
+      }
+      else {
+         break;
+      }
+   }
+   fprintf(stderr, "malformed delta stream\n");
+   return false;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+   int partition = 0;
+   int argi = 1;
+   bool emitting;
+   const char *path;
+   bool ok;
+
+   while (argi < argc && argv[argi][0] == '-') {
+      if (!strcmp(argv[argi], "-p") && argi + 1 < argc) {
+         char *end;
+
+         errno = 0;
+         partition = (int) strtol(argv[argi + 1], &end, 10);
+         if (errno != 0 || *end != 0 || partition < 1 || partition > 4) usage(argv[0]);
+         argi += 2;
+      }
+      else {
+         usage(argv[0]);
+      }
+   }
+   if (argc - argi < 2) usage(argv[0]);
+   emitting = !strcmp(argv[argi], "emit");
+   if (emitting ? argc - argi < 3 || argc - argi > 4 :
+                  strcmp(argv[argi], "apply") || argc - argi > 3) {
+      usage(argv[0]);
+   }
+   path = argv[argi + (emitting ? 3 : 2)];
+
+#ifdef NARF_USE_SNAPSHOTS
+   DeltaTotals totals = { 0, 0, 0, 0 };
+   FILE *stream;
+
+   narf_io_configure(argv[argi + 1]);
+   if (!narf_io_open()) return 1;
+#ifdef NARF_MBR_UTILS
+   ok = partition ? narf_mount(partition) : narf_init(0);
+#else
+   ok = partition == 0 && narf_init(0);
+#endif
+   if (!ok) {
+      fprintf(stderr, "cannot mount %s\n", argv[argi + 1]);
+      narf_io_close();
+      return 1;
+   }
+
+   if (path == NULL) {
+      stream = emitting ? stdout : stdin;
+   }
+   else {
+      stream = fopen(path, emitting ? "wb" : "rb");
+      if (stream == NULL) {
+         perror(path);
+         narf_unmount();
+         narf_io_close();
+         return 1;
+      }
+   }
+
+   ok = emitting ? emit(stream, argv[argi + 2], &totals) : apply(stream, &totals);
+   if (emitting && fflush(stream) != 0) ok = false;
+   if (path != NULL && fclose(stream) != 0) ok = false;
+   if (!narf_unmount()) ok = false;
+   narf_io_close();
+
+   fprintf(stderr, "%s: deleted=%lu sized=%lu writes=%lu bytes=%" PRIu64 "%s\n",
+           emitting ? "emit" : "apply", totals.deleted, totals.sized,
+           totals.writes, totals.bytes, ok ? "" : " FAILED");
+   return ok ? 0 : 1;
+#else
+   (void) partition;
+   (void) path;
+   (void) ok;
+   fprintf(stderr, "narf_delta needs NARF_USE_SNAPSHOTS\n");
+   return 1;
+#endif
+}
+
+// vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
@@ -1,4 +1,5 @@
 #define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
 
 #include <fuse3/fuse.h>
 #include <stdio.h>
@@ -13,10 +14,17 @@
 #include <inttypes.h>
 #include <time.h>
 #include <sys/xattr.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "narf_conf.h"
 #include "narf_io.h"
 #include "narf.h"
+#include "narf_record.h"
 
 // NARF core state is not thread-safe, so every FUSE callback takes
 // this mutex before touching the mounted filesystem.
@@ -28,10 +36,71 @@ static int fd = -1;
 static off_t size;
 static int partition = -1;
 static bool mounted = false;
+#ifdef NARF_USE_SNAPSHOTS
+static const char *snapshot_name = NULL;
+#endif
 static time_t mount_time;
+static uint8_t *work_memory = NULL;
 
 static char *xformpath(const char *path);
 
+#ifdef NARF_USE_PERF_STATS
+// Read-only file that shows narf_perf_stats() at the root of the mount.  It is
+// not listed by readdir and hides a key of the same name.
+#define STATS_PATH "/.narf_stats"
+#define STATS_TEXT_BYTES 12288
+
+#ifdef NARF_USE_PERF_TRACE
+//! @brief Monotonic clock in microseconds for narf_perf_set_clock().
+static uint64_t fuse_clock(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000u + (uint64_t) ts.tv_nsec / 1000u;
+}
+#endif
+
+//! @brief Format the performance counters, one line per operation called.
+static size_t format_perf_stats(char *out, size_t out_size) {
+   NarfPerfStats s;
+#ifdef NARF_USE_PERF_TRACE
+   NarfPerfLatency l;
+#endif
+   size_t used = 0;
+
+   for (unsigned op = 0; op <= NARF_PERF_OPS; op++) {
+      const char *name = op < NARF_PERF_OPS ? narf_perf_op_name((NarfPerfOp) op) : "total";
+      int n;
+
+      if (!narf_perf_stats((NarfPerfOp) op, &s) || (s.calls == 0 && op < NARF_PERF_OPS)) continue;
+      n = snprintf(out + used, out_size - used,
+            "%s calls=%" PRIu32 " node_reads=%" PRIu32 " node_writes=%" PRIu32
+            " payload_reads=%" PRIu32 " payload_writes=%" PRIu32 " root_commits=%" PRIu32
+            " rollbacks=%" PRIu32 " spare_rebuilds=%" PRIu32 " retired_overflows=%" PRIu32
+            " coalesce_walks=%" PRIu32 " spare_hits=%" PRIu32 " max_depth=%" PRIu32,
+            name, s.calls, s.node_reads, s.node_writes, s.payload_reads, s.payload_writes,
+            s.root_commits, s.rollbacks, s.spare_rebuilds, s.retired_overflows,
+            s.coalesce_walks, s.spare_hits, s.max_depth);
+      if (n < 0 || (size_t) n >= out_size - used) break;
+      used += (size_t) n;
+#ifdef NARF_USE_PERF_TRACE
+      if (narf_perf_latency((NarfPerfOp) op, &l)) {
+         n = snprintf(out + used, out_size - used,
+               " timed=%" PRIu32 " p50_us=%" PRIu64 " p99_us=%" PRIu64
+               " p999_us=%" PRIu64 " max_us=%" PRIu64,
+               l.count, l.p50, l.p99, l.p999, l.max);
+         if (n < 0 || (size_t) n >= out_size - used) break;
+         used += (size_t) n;
+      }
+#endif
+      n = snprintf(out + used, out_size - used, "\n");
+      if (n < 0 || (size_t) n >= out_size - used) break;
+      used += (size_t) n;
+   }
+   return used;
+}
+#endif
+
 #define NARF_XATTR_PREFIX "user."
 #define NARF_META_VERSION "v1"
 
@@ -694,6 +763,69 @@ bool narf_io_read(uint32_t sector, void *data) {
    return exact_pio(false, sector, data);
 }
 
+//! @brief Release or zero a sector range without transferring data.
+//!
+//! Block devices use BLKDISCARD/BLKZEROOUT; image files use fallocate()
+//! hole punching or zero ranges, keeping the file size.
+static bool range_op(bool zero, uint32_t sector, uint32_t count) {
+#ifdef __linux__
+   struct stat st;
+   uint64_t range[2];
+
+   if (count == 0) return true;
+   if (fd == -1) return false;
+   if (sector >= narf_io_sectors() || count > narf_io_sectors() - sector) {
+      return false;
+   }
+
+   range[0] = (uint64_t) sector * NARF_SECTOR_SIZE;
+   range[1] = (uint64_t) count * NARF_SECTOR_SIZE;
+
+   if (fstat(fd, &st) != 0) return false;
+
+   if (S_ISBLK(st.st_mode)) {
+      if (ioctl(fd, zero ? BLKZEROOUT : BLKDISCARD, range) != 0) return false;
+   }
+   else if (fallocate(fd, FALLOC_FL_KEEP_SIZE |
+                      (zero ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE),
+                      (off_t) range[0], (off_t) range[1]) != 0) {
+      return false;
+   }
+
+   while (fsync(fd) == -1) {
+      if (errno == EINTR) continue;
+      return false;
+   }
+
+   return true;
+#else
+   (void) zero;
+   (void) sector;
+   (void) count;
+   return false;
+#endif
+}
+
+//! @brief Discard a sector range of the backing file.
+//! @see narf_io.h
+//!
+//! @param sector First sector address.
+//! @param count Number of sectors.
+//! @return true on success.
+bool narf_io_discard(uint32_t sector, uint32_t count) {
+   return range_op(false, sector, count);
+}
+
+//! @brief Zero a sector range of the backing file without writing it.
+//! @see narf_io.h
+//!
+//! @param sector First sector address.
+//! @param count Number of sectors.
+//! @return true on success.
+bool narf_io_write_zeroes(uint32_t sector, uint32_t count) {
+   return range_op(true, sector, count);
+}
+
 // --- File & directory metadata ---
 //! @brief FUSE getattr callback.
 static int my_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
@@ -705,6 +837,23 @@ static int my_getattr(const char *path, struct stat *st, struct fuse_file_info *
 
    memset(st, 0, sizeof(*st));
 
+#ifdef NARF_USE_PERF_STATS
+   if (strcmp(path, STATS_PATH) == 0) {
+      char text[STATS_TEXT_BYTES];
+
+      st->st_mode = S_IFREG | 0444;
+      st->st_nlink = 1;
+      st->st_uid = getuid();
+      st->st_gid = getgid();
+      st->st_size = (off_t) format_perf_stats(text, sizeof(text));
+      st->st_atime = now_sec();
+      st->st_ctime = now_sec();
+      st->st_mtime = now_sec();
+      UNLOCK;
+      return 0;
+   }
+#endif
+
    // root always exists, but it does not have an on-disk NARF node.
    if (strcmp(path, "/") == 0) {
       st->st_mode = S_IFDIR | 0755;
@@ -745,7 +894,7 @@ static int my_getattr(const char *path, struct stat *st, struct fuse_file_info *
       st->st_mtime = meta.mtime;
 
       if (!is_dir) {
-         st->st_blocks = (st->st_size + 511) / 512;
+         st->st_blocks = narf_allocated(key);
       }
 
       UNLOCK;
@@ -1207,6 +1356,14 @@ static int my_open(const char *path, struct fuse_file_info *fi) {
    (void) fi;
 
    if (!mounted) return -ENODEV;
+#ifdef NARF_USE_PERF_STATS
+   if (strcmp(path, STATS_PATH) == 0) {
+      if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+      // The text changes with every call, so skip the page cache.
+      fi->direct_io = 1;
+      return 0;
+   }
+#endif
 
    // Open is optional here; lookup/getattr already proved the file exists.
    return 0;
@@ -1221,6 +1378,19 @@ static int my_read(const char *path, char *buf, size_t size, off_t offset, struc
 
    LOCK;
 
+#ifdef NARF_USE_PERF_STATS
+   if (strcmp(path, STATS_PATH) == 0) {
+      char text[STATS_TEXT_BYTES];
+      size_t len = format_perf_stats(text, sizeof(text));
+
+      UNLOCK;
+      if ((size_t) offset >= len) return 0;
+      if (size > len - (size_t) offset) size = len - (size_t) offset;
+      memcpy(buf, text + offset, size);
+      return (int) size;
+   }
+#endif
+
    // Read data from a file
 
    if (!narf_find(path + 1)) {
@@ -1229,10 +1399,9 @@ static int my_read(const char *path, char *buf, size_t size, off_t offset, struc
    }
 
    size_t len = narf_size(path + 1);
-   NarfSector sector = narf_sector(path + 1);
    size_t read_offset = (size_t) offset;
 
-   if (sector == INVALID_NAF || read_offset >= len) {
+   if (read_offset >= len) {
       UNLOCK;
       return 0;
    }
@@ -1246,33 +1415,11 @@ static int my_read(const char *path, char *buf, size_t size, off_t offset, struc
       return -EFBIG;
    }
 
-   // this would be so much easier if i cheated...
-
-   while (read_offset >= NARF_SECTOR_SIZE) {
-      read_offset -= NARF_SECTOR_SIZE;
-      sector++;
-   }
-
-   size_t remaining = size;
+   // unwritten sectors come back as zeroes without touching the device
 
-   while (remaining) {
-      char data[NARF_SECTOR_SIZE];
-      if (!narf_io_read(sector, data)) {
-         UNLOCK;
-         return -EIO;
-      }
-      if ((size_t)(NARF_SECTOR_SIZE - read_offset) >= remaining) {
-         memcpy(buf, data + read_offset, remaining);
-         buf += remaining;
-         remaining = 0;
-      }
-      else {
-         memcpy(buf, data + read_offset, NARF_SECTOR_SIZE - read_offset);
-         buf += (NARF_SECTOR_SIZE - read_offset);
-         remaining -= (NARF_SECTOR_SIZE - read_offset);
-         read_offset = 0;
-      }
-      sector++;
+   if (!narf_read(path + 1, buf, size, read_offset)) {
+      UNLOCK;
+      return -EIO;
    }
 
    UNLOCK;
@@ -1285,7 +1432,9 @@ static int my_write(const char *path, const char *buf, size_t size, off_t offset
    time_t mtime;
    int ret;
 
+#ifndef NARF_USE_DEDUP
    (void) fi;
+#endif
 
    if (!mounted) return -ENODEV;
    if (offset < 0) return -EINVAL;
@@ -1317,6 +1466,10 @@ static int my_write(const char *path, const char *buf, size_t size, off_t offset
    }
 
    UNLOCK;
+#ifdef NARF_USE_DEDUP
+   // Mark the handle so release can look for an identical payload.
+   if (fi != NULL) fi->fh = 1;
+#endif
    return (int) size;
 }
 
@@ -1362,12 +1515,22 @@ static int my_flush(const char *path, struct fuse_file_info *fi) {
 
 //! @brief FUSE release callback.
 static int my_release(const char *path, struct fuse_file_info *fi) {
+#ifndef NARF_USE_DEDUP
    (void) path;
    (void) fi;
+#endif
 
    if (!mounted) return -ENODEV;
 
-   // Release is optional here; no per-handle state is kept.
+#ifdef NARF_USE_DEDUP
+   // A handle that wrote shares its file with identical ones on close.  This
+   // is best effort; sparse files are left alone.
+   if (fi != NULL && fi->fh != 0) {
+      LOCK;
+      if (narf_find(path + 1)) (void) narf_dedup(path + 1);
+      UNLOCK;
+   }
+#endif
    return 0;
 }
 
@@ -1390,6 +1553,123 @@ static int my_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
    return 0;
 }
 
+//! @brief FUSE fallocate callback; only hole punching is supported.
+static int my_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+   (void) fi;
+
+   if (!mounted) return -ENODEV;
+   if (offset < 0 || length <= 0) return -EINVAL;
+   if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE) &&
+       mode != FALLOC_FL_KEEP_SIZE) {
+      return -EOPNOTSUPP;
+   }
+   if (mode == FALLOC_FL_KEEP_SIZE &&
+       (uint64_t) offset + (uint64_t) length > (NarfByteSize) -1) {
+      return -EFBIG;
+   }
+
+   LOCK;
+
+   if (!narf_find(path + 1)) {
+      UNLOCK;
+      return -ENOENT;
+   }
+
+   if (mode == FALLOC_FL_KEEP_SIZE) {
+      // Preallocation past EOF becomes the key's growth slack.
+      NarfByteSize end = (NarfByteSize) (offset + length);
+      NarfByteSize bytes = narf_size(path + 1);
+      NarfSector sectors = 0;
+
+      if (end > bytes) {
+         sectors = (NarfSector) ((end + NARF_SECTOR_SIZE - 1) / NARF_SECTOR_SIZE -
+                                 (bytes + NARF_SECTOR_SIZE - 1) / NARF_SECTOR_SIZE);
+      }
+      if (sectors != 0 && !narf_reserve(path + 1, sectors)) {
+         UNLOCK;
+         return -EIO;
+      }
+   }
+   else if (!narf_punch(path + 1, (NarfByteSize) offset, (NarfByteSize) length)) {
+      UNLOCK;
+      return -EIO;
+   }
+
+   UNLOCK;
+   return 0;
+}
+
+//! @brief FUSE lseek callback for SEEK_DATA and SEEK_HOLE.
+static off_t my_lseek(const char *path, off_t offset, int whence, struct fuse_file_info *fi) {
+   NarfByteSize found;
+
+   (void) fi;
+
+   if (!mounted) return -ENODEV;
+   if (whence != SEEK_DATA && whence != SEEK_HOLE) return -EINVAL;
+   if (offset < 0) return -ENXIO;
+
+   LOCK;
+
+   if (!narf_find(path + 1)) {
+      UNLOCK;
+      return -ENOENT;
+   }
+
+   if (!narf_seek(path + 1, (NarfByteSize) offset, whence == SEEK_HOLE, &found)) {
+      UNLOCK;
+      return -ENXIO;
+   }
+
+   UNLOCK;
+   return (off_t) found;
+}
+
+#ifdef NARF_USE_COMPRESSION
+//! @brief FUSE ioctl callback; exposes per-key compression as FS_COMPR_FL.
+//!
+//! This is what lsattr and chattr +c/-c use.  Setting the flag converts the
+//! key's stored payload in place; no other inode flag is kept.
+static int my_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                    unsigned int flags, void *data) {
+   unsigned int *attr = data;
+   bool result;
+
+   (void) arg;
+   (void) fi;
+
+   if (!mounted) return -ENODEV;
+   if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+   if ((unsigned int) cmd != (unsigned int) FS_IOC_GETFLAGS &&
+       (unsigned int) cmd != (unsigned int) FS_IOC_SETFLAGS) {
+      return -ENOTTY;
+   }
+
+   LOCK;
+
+   if (!narf_find(path + 1)) {
+      UNLOCK;
+      return -ENOENT;
+   }
+
+   if ((unsigned int) cmd == (unsigned int) FS_IOC_GETFLAGS) {
+      *attr = narf_compressed(path + 1) ? FS_COMPR_FL : 0;
+      UNLOCK;
+      return 0;
+   }
+
+   if (*attr & ~(unsigned int) FS_COMPR_FL) {
+      UNLOCK;
+      return -EOPNOTSUPP;
+   }
+
+   result = narf_set_compressed(path + 1, (*attr & FS_COMPR_FL) != 0);
+
+   UNLOCK;
+   return result ? 0 : -ENOSPC;
+}
+#endif
+
 // --- Directory handling ---
 
 typedef struct {
@@ -1962,6 +2242,12 @@ static void *my_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
    // Called on mount.
    mount_time = now_sec();
    LOCK;
+   // One bit per device sector covers any catalog, so spare rebuilds and
+   // deep checks walk each tree once.  Without it the core uses its own.
+   work_memory = calloc(((size_t) narf_io_sectors() + 7u) / 8u, 1);
+   if (work_memory != NULL) {
+      narf_set_work_memory(work_memory, ((size_t) narf_io_sectors() + 7u) / 8u);
+   }
    if (partition == -1) {
       mounted = narf_init(0);
    }
@@ -1971,6 +2257,13 @@ static void *my_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
       }
       mounted = narf_mount(partition);
    }
+#ifdef NARF_USE_SNAPSHOTS
+   if (mounted && snapshot_name != NULL && !narf_snapshot_mount(snapshot_name)) {
+      fprintf(stderr, "No snapshot named %s\n", snapshot_name);
+      narf_unmount();
+      mounted = false;
+   }
+#endif
    UNLOCK;
    return NULL;
 }
@@ -1979,6 +2272,17 @@ static void *my_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
 static void my_destroy(void *private_data) {
    (void) private_data;
 
+   LOCK;
+   if (mounted) {
+      // Lets the next mount skip rebuilding the spare list and walking
+      // every catalog node.
+      narf_unmount();
+   }
+   narf_set_work_memory(NULL, 0);
+   free(work_memory);
+   work_memory = NULL;
+   UNLOCK;
+
    if (fd != -1) {
       fsync(fd);
       close(fd);
@@ -2008,6 +2312,11 @@ static struct fuse_operations my_ops = {
    .flush       = my_flush,
    .release     = my_release,
    .fsync       = my_fsync,
+   .fallocate   = my_fallocate,
+   .lseek       = my_lseek,
+#ifdef NARF_USE_COMPRESSION
+   .ioctl       = my_ioctl,
+#endif
    .opendir     = my_opendir,
    .readdir     = my_readdir,
    .releasedir  = my_releasedir,
@@ -2027,11 +2336,22 @@ static struct fuse_operations my_ops = {
 //! @brief Print FUSE front-end usage help.
 static void usage(const char *progname) {
     fprintf(stderr,
+#ifdef NARF_USE_SNAPSHOTS
+        "Usage: %s <backing_file[:N][@snapshot]> [FUSE options...]\n"
+#else
         "Usage: %s <backing_file[:N]> [FUSE options...]\n"
+#endif
         "  <backing_file> : raw device or image file\n"
         "  [:N]           : optional partition number to mount\n"
-        "                  - if : is present but no number, will auto-detect 0x6E type\n",
-        progname);
+        "                  - if : is present but no number, will auto-detect 0x6E type\n"
+#ifdef NARF_USE_SNAPSHOTS
+        "  [@snapshot]    : mount the named snapshot read-only\n"
+#endif
+#ifdef NARF_USE_RECORDER
+        "Set NARF_RECORD=<trace_file> to append every NARF call to a trace for\n"
+        "narf_replay, and NARF_RECORD_HASH=1 to hash the data written.\n"
+#endif
+        , progname);
     exit(1);
 }
 
@@ -2042,6 +2362,15 @@ int main(int argc, char *argv[]) {
    }
 
    char *filename = argv[1];
+#ifdef NARF_USE_SNAPSHOTS
+   char *at = strrchr(filename, '@');
+
+   if (at) {
+      *at = 0;
+      snapshot_name = at + 1;
+      if (*snapshot_name == '\0') usage(argv[0]);
+   }
+#endif
    char *colon = strchr(filename, ':');
 
    if (colon) {
@@ -2080,6 +2409,39 @@ int main(int argc, char *argv[]) {
    argv[1] = argv[0];
    argc--;
    argv++;
+#ifdef NARF_USE_PERF_TRACE
+   narf_perf_set_clock(fuse_clock);
+#endif
+#ifdef NARF_USE_RECORDER
+   // Open the trace before fuse_main() daemonizes, so a relative path names
+   // a file in the directory narf_fuse was started from.
+   const char *record_path = getenv("NARF_RECORD");
+
+   if (record_path != NULL && *record_path != 0) {
+      const char *hash = getenv("NARF_RECORD_HASH");
+
+      if (!narf_record_start(record_path, hash != NULL && !strcmp(hash, "1"))) {
+         perror(record_path);
+         return 1;
+      }
+   }
+#endif
+#ifdef NARF_USE_SNAPSHOTS
+   if (snapshot_name != NULL) {
+      // A snapshot is never written, so let the kernel refuse writes with
+      // EROFS instead of each callback failing with EIO.
+      char **ro_argv = calloc((size_t) argc + 3, sizeof(*ro_argv));
+
+      if (ro_argv == NULL) {
+         perror("calloc");
+         return 1;
+      }
+      memcpy(ro_argv, argv, (size_t) argc * sizeof(*ro_argv));
+      ro_argv[argc++] = "-o";
+      ro_argv[argc++] = "ro";
+      argv = ro_argv;
+   }
+#endif
    return fuse_main(argc, argv, &my_ops, NULL);
 }
 
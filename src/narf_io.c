@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include <ctype.h>
@@ -14,6 +15,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
 #include "narf_conf.h"
 #include "narf_io.h"
 
@@ -265,4 +272,55 @@ bool narf_io_read(uint32_t sector, void *data) {
    return exact_pio(false, sector, data);
 }
 
+//! @brief Release or zero a sector range without transferring data.
+//!
+//! Block devices use BLKDISCARD/BLKZEROOUT; image files use fallocate()
+//! hole punching or zero ranges, keeping the file size.
+static bool range_op(bool zero, uint32_t sector, uint32_t count) {
+#ifdef __linux__
+   struct stat st;
+   uint64_t range[2];
+
+   if (count == 0) return true;
+   if (!sector_is_valid(sector)) return false;
+   if (count > narf_io_sectors() - sector) return false;
+
+   range[0] = (uint64_t) sector * SECTOR_SIZE;
+   range[1] = (uint64_t) count * SECTOR_SIZE;
+
+   if (fstat(fd, &st) != 0) return false;
+
+   if (S_ISBLK(st.st_mode)) {
+      if (ioctl(fd, zero ? BLKZEROOUT : BLKDISCARD, range) != 0) return false;
+   }
+   else if (fallocate(fd, FALLOC_FL_KEEP_SIZE |
+                      (zero ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE),
+                      (off_t) range[0], (off_t) range[1]) != 0) {
+      return false;
+   }
+
+   while (fsync(fd) == -1) {
+      if (errno == EINTR) continue;
+      return false;
+   }
+
+   return true;
+#else
+   (void) zero;
+   (void) sector;
+   (void) count;
+   return false;
+#endif
+}
+
+//! @see narf_io.h
+bool narf_io_discard(uint32_t sector, uint32_t count) {
+   return range_op(false, sector, count);
+}
+
+//! @see narf_io.h
+bool narf_io_write_zeroes(uint32_t sector, uint32_t count) {
+   return range_op(true, sector, count);
+}
+
 // vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
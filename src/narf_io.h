@@ -36,13 +36,37 @@ bool narf_io_write(uint32_t sector, void *data);
 
 //! @brief Read one sector from the underlying device.
 //!
-//! This is typically implemented by the platform-specific I/O layer.
+//! This is typically implemented by the platform-specific I/O layer.  With
+//! NARF_USE_THREADS, narf_fsck_deep() reads from several threads at once, so
+//! concurrent calls must not share state such as a file offset: use pread()
+//! or hold a lock across the transfer.  No write overlaps those reads.
 //!
 //! @param sector Sector address to read.
 //! @param data Pointer to one sector of read buffer.
 //! @return true on success.
 bool narf_io_read(uint32_t sector, void *data);
 
+//! @brief Tell the device that a range of sectors no longer holds data.
+//!
+//! Only called when the core is built with NARF_USE_DISCARD.  The contents
+//! of discarded sectors are undefined afterwards.  Returning false only means
+//! the hint was not delivered.
+//!
+//! @param sector First sector address.
+//! @param count Number of sectors.
+//! @return true on success.
+bool narf_io_discard(uint32_t sector, uint32_t count);
+
+//! @brief Make a range of sectors read back as zeroes without transferring them.
+//!
+//! Only called when the core is built with NARF_USE_DISCARD.  On false the
+//! core writes zero sectors itself.
+//!
+//! @param sector First sector address.
+//! @param count Number of sectors.
+//! @return true on success.
+bool narf_io_write_zeroes(uint32_t sector, uint32_t count);
+
 #endif
 
 // vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
@@ -0,0 +1,368 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "narf_conf.h"
+#include "narf_io.h"
+#include "narf_io_ram.h"
+
+#ifdef NARF_USE_THREADS
+#include <pthread.h>
+#endif
+
+// A RAM narf_io implementation with a cost model.  Every transfer adds its
+// modelled cost to a simulated clock instead of waiting.
+//
+// The erase model follows how SD cards and cheap eMMC handle writes: a card
+// writes a few erase blocks (allocation units) at once, each front to back.
+// Writing on past the last written sector of an open block is cheap.
+// Rewriting a sector already written in that block, or closing a block that
+// was only partly written so another can open, makes the card copy the block
+// into a fresh one, which is the merge erase_us charges.  This is where the
+// occasional multi-second write on a card comes from.
+
+#define SECTOR_SIZE NARF_SECTOR_SIZE
+#define NO_SECTOR UINT32_MAX
+
+//! @brief One erase block the model has open for writing.
+typedef struct {
+   uint32_t block;
+   uint32_t next;
+   uint64_t used;
+   bool open;
+} RamOpenBlock;
+
+//! @brief A named cost model.
+typedef struct {
+   const char *name;
+   NarfRamModel model;
+} RamPreset;
+
+static const RamPreset presets[] = {
+   { "ram", { 0, 0, 0, 0, 0, 0, 0, 0, 1 } },
+   // Managed flash with a small FTL: cheap seeks, 512 KB erase blocks.
+   { "emmc", { 30, 60, 200, 50, 200, 100, 1024, 3000, 8 } },
+   // A class 10 card: slow random writes, 4 MB allocation units, two open.
+   { "sd", { 100, 200, 500, 500, 2000, 1000, 8192, 100000, 2 } },
+   // A worn or bargain card with one open unit and slow merges.
+   { "slowsd", { 200, 400, 2000, 1000, 5000, 5000, 8192, 500000, 1 } },
+};
+
+#define PRESET_COUNT (sizeof(presets) / sizeof(presets[0]))
+
+static uint8_t *image = NULL;
+static uint32_t image_sectors = 0;
+static NarfRamModel model;
+static NarfRamCounters counters;
+static uint32_t last_sector = NO_SECTOR;
+static RamOpenBlock open_blocks[NARF_RAM_OPEN_MAX];
+static uint64_t open_stamp = 0;
+
+#ifdef NARF_USE_THREADS
+// The threaded deep fsck reads from several threads at once, so the counters,
+// the clock and the seek and erase state are updated under one lock.  The
+// device then sees a single stream of transfers in the order they take it.
+static pthread_mutex_t cost_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define cost_lock_take() pthread_mutex_lock(&cost_lock)
+#define cost_lock_give() pthread_mutex_unlock(&cost_lock)
+#else
+#define cost_lock_take() ((void) 0)
+#define cost_lock_give() ((void) 0)
+#endif
+
+//! @brief Set one named model field from text.
+static bool set_field(NarfRamModel *m, const char *name, size_t name_len, const char *value) {
+   static const struct {
+      const char *name;
+      size_t offset;
+   } fields[] = {
+      { "read", offsetof(NarfRamModel, read_us) },
+      { "write", offsetof(NarfRamModel, write_us) },
+      { "sync", offsetof(NarfRamModel, sync_us) },
+      { "read_seek", offsetof(NarfRamModel, read_seek_us) },
+      { "write_seek", offsetof(NarfRamModel, write_seek_us) },
+      { "discard", offsetof(NarfRamModel, discard_us) },
+      { "erase", offsetof(NarfRamModel, erase_sectors) },
+      { "erase_cost", offsetof(NarfRamModel, erase_us) },
+      { "open", offsetof(NarfRamModel, open_blocks) },
+   };
+   char *end;
+   unsigned long parsed;
+
+   errno = 0;
+   parsed = strtoul(value, &end, 0);
+   if (end == value || (*end != 0 && *end != ',') || errno != 0 || parsed > UINT32_MAX) {
+      return false;
+   }
+   for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+      if (strlen(fields[i].name) == name_len && !strncmp(fields[i].name, name, name_len)) {
+         uint32_t v = (uint32_t) parsed;
+
+         memcpy((uint8_t *) m + fields[i].offset, &v, sizeof(v));
+         return true;
+      }
+   }
+   return false;
+}
+
+//! @see narf_io_ram.h
+bool narf_io_ram_model(const char *spec, NarfRamModel *m) {
+   const char *p = spec;
+
+   if (m == NULL) return false;
+   *m = presets[0].model;
+   if (p == NULL) return true;
+
+   while (*p != 0) {
+      const char *comma = strchr(p, ',');
+      const char *eq = strchr(p, '=');
+      size_t len = comma != NULL ? (size_t) (comma - p) : strlen(p);
+
+      if (eq != NULL && (comma == NULL || eq < comma)) {
+         if (!set_field(m, p, (size_t) (eq - p), eq + 1)) return false;
+      }
+      else if (p == spec) {
+         size_t i;
+
+         for (i = 0; i < PRESET_COUNT; i++) {
+            if (strlen(presets[i].name) == len && !strncmp(presets[i].name, p, len)) break;
+         }
+         if (i == PRESET_COUNT) return false;
+         *m = presets[i].model;
+      }
+      else {
+         return false;
+      }
+      p += len;
+      if (*p == ',') p++;
+   }
+   return m->open_blocks >= 1 && m->open_blocks <= NARF_RAM_OPEN_MAX;
+}
+
+//! @see narf_io_ram.h
+bool narf_io_ram_setup(uint32_t sectors, const NarfRamModel *m) {
+   uint8_t *fresh;
+
+   if (sectors == 0 || (uint64_t) sectors * SECTOR_SIZE > SIZE_MAX) return false;
+   if (m != NULL && (m->open_blocks < 1 || m->open_blocks > NARF_RAM_OPEN_MAX)) return false;
+   fresh = calloc(sectors, SECTOR_SIZE);
+   if (fresh == NULL) return false;
+
+   free(image);
+   image = fresh;
+   image_sectors = sectors;
+   if (m != NULL) {
+      model = *m;
+   }
+   else {
+      narf_io_ram_model(NULL, &model);
+   }
+   narf_io_ram_reset();
+   return true;
+}
+
+//! @see narf_io_ram.h
+bool narf_io_ram_load(const char *path, const NarfRamModel *m) {
+   FILE *f;
+   long bytes;
+   bool ok;
+
+   if (path == NULL) return false;
+   f = fopen(path, "rb");
+   if (f == NULL) return false;
+   ok = fseek(f, 0, SEEK_END) == 0 && (bytes = ftell(f)) > 0 &&
+        bytes % SECTOR_SIZE == 0 && (uint64_t) bytes / SECTOR_SIZE <= UINT32_MAX &&
+        fseek(f, 0, SEEK_SET) == 0 &&
+        narf_io_ram_setup((uint32_t) (bytes / SECTOR_SIZE), m) &&
+        fread(image, SECTOR_SIZE, image_sectors, f) == image_sectors;
+   fclose(f);
+   return ok;
+}
+
+//! @see narf_io_ram.h
+bool narf_io_ram_counters(NarfRamCounters *out) {
+   if (out == NULL || image == NULL) return false;
+   cost_lock_take();
+   *out = counters;
+   cost_lock_give();
+   return true;
+}
+
+//! @see narf_io_ram.h
+void narf_io_ram_reset(void) {
+   cost_lock_take();
+   memset(&counters, 0, sizeof(counters));
+   memset(open_blocks, 0, sizeof(open_blocks));
+   last_sector = NO_SECTOR;
+   open_stamp = 0;
+   cost_lock_give();
+}
+
+//! @see narf_io_ram.h
+uint64_t narf_io_ram_clock(void) {
+   uint64_t micros;
+
+   cost_lock_take();
+   micros = counters.micros;
+   cost_lock_give();
+   return micros;
+}
+
+//! @see narf_io_ram.h
+void narf_io_configure(const char *arg) {
+   NarfRamModel m;
+   char *end;
+   uint64_t value;
+   uint64_t multiplier = 1;
+
+   if (arg == NULL || *arg != '=') {
+      fprintf(stderr, "the RAM device takes =size[,model], not a file name\n");
+      exit(-1);
+   }
+   errno = 0;
+   value = strtoull(arg + 1, &end, 0);
+   if (end == arg + 1 || errno != 0) {
+      fprintf(stderr, "bad RAM device size: %s\n", arg);
+      exit(-1);
+   }
+   if (*end == 'k' || *end == 'K') multiplier = 1024ull;
+   else if (*end == 'm' || *end == 'M') multiplier = 1024ull * 1024ull;
+   else if (*end == 'g' || *end == 'G') multiplier = 1024ull * 1024ull * 1024ull;
+   if (multiplier != 1) end++;
+   if ((*end != 0 && *end != ',') || value > UINT64_MAX / multiplier ||
+       (value * multiplier) % SECTOR_SIZE != 0 ||
+       (value * multiplier) / SECTOR_SIZE > UINT32_MAX) {
+      fprintf(stderr, "bad RAM device size: %s\n", arg);
+      exit(-1);
+   }
+   if (!narf_io_ram_model(*end == ',' ? end + 1 : NULL, &m)) {
+      fprintf(stderr, "bad RAM device model: %s\n", arg);
+      exit(-1);
+   }
+   if (!narf_io_ram_setup((uint32_t) (value * multiplier / SECTOR_SIZE), &m)) {
+      fprintf(stderr, "cannot allocate the RAM device\n");
+      exit(-1);
+   }
+   printf("total_bytes = %" PRIu64 "\n", value * multiplier);
+}
+
+//! @see narf_io.h
+bool narf_io_open(void) {
+   return image != NULL;
+}
+
+//! @see narf_io.h
+bool narf_io_close(void) {
+   return true;
+}
+
+//! @see narf_io.h
+uint32_t narf_io_sectors(void) {
+   return image_sectors;
+}
+
+//! @brief Charge the seek penalty when a transfer does not follow the last one.
+//!
+//! Called with the cost lock held, as is charge_erase().
+static void charge_seek(uint32_t sector, uint32_t cost, uint64_t *seeks) {
+   if (last_sector == NO_SECTOR || sector != last_sector + 1) {
+      counters.micros += cost;
+      (*seeks)++;
+   }
+   last_sector = sector;
+}
+
+//! @brief Charge the erase-block model for writing one sector.
+static void charge_erase(uint32_t sector) {
+   uint32_t block;
+   uint32_t offset;
+   RamOpenBlock *slot = NULL;
+
+   if (model.erase_sectors == 0) return;
+   block = sector / model.erase_sectors;
+   offset = sector % model.erase_sectors;
+
+   for (uint32_t i = 0; i < model.open_blocks; i++) {
+      if (open_blocks[i].open && open_blocks[i].block == block) slot = &open_blocks[i];
+   }
+   if (slot == NULL) {
+      // Close the least recently used block, merging it if it was not filled.
+      slot = &open_blocks[0];
+      for (uint32_t i = 1; i < model.open_blocks; i++) {
+         if (!open_blocks[i].open || (slot->open && open_blocks[i].used < slot->used)) {
+            slot = &open_blocks[i];
+         }
+      }
+      if (slot->open && slot->next < model.erase_sectors) {
+         counters.micros += model.erase_us;
+         counters.merges++;
+      }
+      slot->open = true;
+      slot->block = block;
+      slot->next = 0;
+      counters.block_opens++;
+   }
+   else if (offset < slot->next) {
+      counters.micros += model.erase_us;
+      counters.merges++;
+   }
+   slot->next = offset + 1;
+   slot->used = ++open_stamp;
+}
+
+//! @see narf_io.h
+bool narf_io_write(uint32_t sector, void *data) {
+   if (data == NULL || image == NULL || sector >= image_sectors) return false;
+   memcpy(image + (size_t) sector * SECTOR_SIZE, data, SECTOR_SIZE);
+   cost_lock_take();
+   counters.writes++;
+   counters.syncs++;
+   counters.micros += (uint64_t) model.write_us + model.sync_us;
+   charge_seek(sector, model.write_seek_us, &counters.write_seeks);
+   charge_erase(sector);
+   cost_lock_give();
+   return true;
+}
+
+//! @see narf_io.h
+bool narf_io_read(uint32_t sector, void *data) {
+   if (data == NULL || image == NULL || sector >= image_sectors) return false;
+   memcpy(data, image + (size_t) sector * SECTOR_SIZE, SECTOR_SIZE);
+   cost_lock_take();
+   counters.reads++;
+   counters.micros += model.read_us;
+   charge_seek(sector, model.read_seek_us, &counters.read_seeks);
+   cost_lock_give();
+   return true;
+}
+
+//! @brief Zero a sector range and charge one range operation to calls and sectors.
+static bool zero_range(uint32_t sector, uint32_t count, uint64_t *calls, uint64_t *sectors) {
+   if (image == NULL || sector >= image_sectors || count > image_sectors - sector) return false;
+   memset(image + (size_t) sector * SECTOR_SIZE, 0, (size_t) count * SECTOR_SIZE);
+   cost_lock_take();
+   counters.syncs++;
+   counters.micros += (uint64_t) model.discard_us + model.sync_us;
+   (*calls)++;
+   *sectors += count;
+   cost_lock_give();
+   return true;
+}
+
+//! @see narf_io.h
+bool narf_io_discard(uint32_t sector, uint32_t count) {
+   return zero_range(sector, count, &counters.discards, &counters.discarded);
+}
+
+//! @see narf_io.h
+bool narf_io_write_zeroes(uint32_t sector, uint32_t count) {
+   return zero_range(sector, count, &counters.zeroes, &counters.zeroed);
+}
+
+// vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
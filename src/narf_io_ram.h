@@ -0,0 +1,98 @@
+#ifndef _INCLUDE_NARF_IO_RAM_H_
+#define _INCLUDE_NARF_IO_RAM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// narf_io_ram.c implements narf_io.h on an image held in RAM and charges each
+// transfer to a simulated clock from a cost model, so runs are repeatable and
+// slow media can be studied without hardware.  Nothing sleeps; the costs only
+// accumulate in the counters.
+
+//! @brief Most erase blocks the model keeps open at once.
+#define NARF_RAM_OPEN_MAX 16
+
+//! @brief Device cost model, all times in microseconds.
+typedef struct {
+   uint32_t read_us;        //!< Per sector read.
+   uint32_t write_us;       //!< Per sector written.
+   uint32_t sync_us;        //!< Per barrier: after every write, discard, and zeroed range.
+   uint32_t read_seek_us;   //!< Extra for a read that does not follow the previous transfer.
+   uint32_t write_seek_us;  //!< Extra for a write that does not follow the previous transfer.
+   uint32_t discard_us;     //!< Per discard or zeroed range, before its barrier.
+   uint32_t erase_sectors;  //!< Erase-block size in sectors, or 0 for no erase model.
+   uint32_t erase_us;       //!< Cost of merging one erase block.
+   uint32_t open_blocks;    //!< Erase blocks written at once, 1 to NARF_RAM_OPEN_MAX.
+} NarfRamModel;
+
+//! @brief Everything the RAM device has done since it was set up or reset.
+typedef struct {
+   uint64_t reads;          //!< Sectors read.
+   uint64_t writes;         //!< Sectors written.
+   uint64_t syncs;          //!< Barriers.
+   uint64_t read_seeks;     //!< Reads that did not follow the previous transfer.
+   uint64_t write_seeks;    //!< Writes that did not follow the previous transfer.
+   uint64_t discards;       //!< narf_io_discard() calls.
+   uint64_t discarded;      //!< Sectors discarded.
+   uint64_t zeroes;         //!< narf_io_write_zeroes() calls.
+   uint64_t zeroed;         //!< Sectors zeroed.
+   uint64_t block_opens;    //!< Writes that opened an erase block.
+   uint64_t merges;         //!< Erase-block merges charged.
+   uint64_t micros;         //!< Simulated device time.
+} NarfRamCounters;
+
+//! @brief Parse a model specification.
+//!
+//! The specification is a comma-separated list: an optional preset first,
+//! one of ram, emmc, sd, or slowsd, then name=value overrides named after
+//! the NarfRamModel fields without their _us or _sectors suffix: read,
+//! write, sync, read_seek, write_seek, discard, erase, erase_cost, open.
+//! An empty specification is the cost-free ram preset.
+//!
+//! @param spec Specification, or NULL for ram.
+//! @param model Destination for the model.
+//! @return true on success.
+bool narf_io_ram_model(const char *spec, NarfRamModel *model);
+
+//! @brief Replace the RAM image with a zeroed one and reset the counters.
+//!
+//! @param sectors Image size in sectors.
+//! @param model Cost model, or NULL for no costs.
+//! @return true on success.
+bool narf_io_ram_setup(uint32_t sectors, const NarfRamModel *model);
+
+//! @brief Replace the RAM image with the contents of a host image file.
+//!
+//! The file must be a whole number of sectors.  Nothing is written back.
+//!
+//! @param path Host image file.
+//! @param model Cost model, or NULL for no costs.
+//! @return true on success.
+bool narf_io_ram_load(const char *path, const NarfRamModel *model);
+
+//! @brief Copy the device counters.
+//!
+//! @param counters Destination for the counters.
+//! @return true when a RAM device is set up.
+bool narf_io_ram_counters(NarfRamCounters *counters);
+
+//! @brief Zero the counters and the simulated clock, keeping the image.
+void narf_io_ram_reset(void);
+
+//! @brief Return the simulated device time in microseconds.
+//!
+//! Suitable for narf_perf_set_clock(), which then times calls by the device
+//! work they cause.
+uint64_t narf_io_ram_clock(void);
+
+//! @brief Set up a RAM device from a tester-style argument.
+//!
+//! Accepts =size[,spec], where size takes a K, M, or G suffix and spec is
+//! as for narf_io_ram_model().  Exits on a bad argument.
+//!
+//! @param arg Argument text.
+void narf_io_configure(const char *arg);
+
+#endif
+
+// vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
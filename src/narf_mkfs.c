@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -9,6 +11,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
 #include "narf_conf.h"
 #include "narf_io.h"
 #include "narf.h"
@@ -60,11 +68,7 @@ bool narf_io_write(uint32_t sector, void *data) {
 
    offset = (off_t) sector * NARF_SECTOR_SIZE;
 
-   if (lseek(fd, offset, SEEK_SET) == (off_t) -1) {
-      return false;
-   }
-
-   written = write(fd, data, NARF_SECTOR_SIZE);
+   written = pwrite(fd, data, NARF_SECTOR_SIZE, offset);
 
    if (written != NARF_SECTOR_SIZE) {
       return false;
@@ -95,19 +99,79 @@ bool narf_io_read(uint32_t sector, void *data) {
       return false;
    }
 
+   // Positional, so threaded fsck workers can read at the same time.
    offset = (off_t) sector * NARF_SECTOR_SIZE;
 
-   if (lseek(fd, offset, SEEK_SET) == (off_t) -1) {
+   bytes = pread(fd, data, NARF_SECTOR_SIZE, offset);
+
+   if (bytes != NARF_SECTOR_SIZE) {
       return false;
    }
 
-   bytes = read(fd, data, NARF_SECTOR_SIZE);
+   return true;
+}
+
+//! @brief Release or zero a sector range without transferring data.
+//!
+//! Block devices use BLKDISCARD/BLKZEROOUT; image files use fallocate()
+//! hole punching or zero ranges, keeping the file size.
+static bool range_op(bool zero, uint32_t sector, uint32_t count) {
+#ifdef __linux__
+   struct stat st;
+   uint64_t range[2];
+
+   if (count == 0) return true;
+   if (fd == -1) return false;
+   if (sector >= narf_io_sectors() || count > narf_io_sectors() - sector) {
+      return false;
+   }
 
-   if (bytes != NARF_SECTOR_SIZE) {
+   range[0] = (uint64_t) sector * NARF_SECTOR_SIZE;
+   range[1] = (uint64_t) count * NARF_SECTOR_SIZE;
+
+   if (fstat(fd, &st) != 0) return false;
+
+   if (S_ISBLK(st.st_mode)) {
+      if (ioctl(fd, zero ? BLKZEROOUT : BLKDISCARD, range) != 0) return false;
+   }
+   else if (fallocate(fd, FALLOC_FL_KEEP_SIZE |
+                      (zero ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE),
+                      (off_t) range[0], (off_t) range[1]) != 0) {
+      return false;
+   }
+
+   while (fsync(fd) == -1) {
+      if (errno == EINTR) continue;
       return false;
    }
 
    return true;
+#else
+   (void) zero;
+   (void) sector;
+   (void) count;
+   return false;
+#endif
+}
+
+//! @brief Discard a sector range of the mkfs target image.
+//! @see narf_io.h
+//!
+//! @param sector First sector address.
+//! @param count Number of sectors.
+//! @return true on success.
+bool narf_io_discard(uint32_t sector, uint32_t count) {
+   return range_op(false, sector, count);
+}
+
+//! @brief Zero a sector range of the mkfs target image without writing it.
+//! @see narf_io.h
+//!
+//! @param sector First sector address.
+//! @param count Number of sectors.
+//! @return true on success.
+bool narf_io_write_zeroes(uint32_t sector, uint32_t count) {
+   return range_op(true, sector, count);
 }
 
 //! @brief Print narf_mkfs usage help.
@@ -0,0 +1,179 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "narf_conf.h"
+#include "narf.h"
+#include "narf_record.h"
+
+// Host side of the operation recorder: the trace text format, shared by the
+// tools that write traces and narf_replay, which reads them.
+
+//! @brief Return whether a key byte must be escaped in a trace.
+static bool needs_escape(unsigned char c) {
+   return c <= ' ' || c >= 0x7f || c == '%' || c == '#';
+}
+
+//! @brief Return the value of a hex digit, or -1.
+static int hex_value(char c) {
+   if (c >= '0' && c <= '9') return c - '0';
+   if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+   if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+   return -1;
+}
+
+//! @see narf_record.h
+bool narf_record_escape(const char *text, char *out, size_t size) {
+   static const char hex[] = "0123456789ABCDEF";
+   size_t used = 0;
+
+   if (text == NULL || out == NULL || size == 0) return false;
+   for (; *text != 0; text++) {
+      unsigned char c = (unsigned char) *text;
+
+      if (needs_escape(c)) {
+         if (size - used < 4) return false;
+         out[used++] = '%';
+         out[used++] = hex[c >> 4];
+         out[used++] = hex[c & 15];
+      }
+      else {
+         if (size - used < 2) return false;
+         out[used++] = (char) c;
+      }
+   }
+   out[used] = 0;
+   return true;
+}
+
+//! @see narf_record.h
+bool narf_record_unescape(char *text) {
+   char *out = text;
+
+   if (text == NULL) return false;
+   while (*text != 0) {
+      if (*text == '%') {
+         int high = hex_value(text[1]);
+         int low = high < 0 ? -1 : hex_value(text[2]);
+
+         if (low < 0 || (high == 0 && low == 0)) return false;
+         *out++ = (char) (high * 16 + low);
+         text += 3;
+      }
+      else {
+         *out++ = *text++;
+      }
+   }
+   *out = 0;
+   return true;
+}
+
+#ifdef NARF_USE_RECORDER
+
+static FILE *record_file = NULL;
+static bool record_hash = false;
+
+//! @brief Return the 32-bit FNV-1a hash of a byte range.
+static uint32_t fnv1a(const void *data, NarfByteSize size) {
+   const uint8_t *p = data;
+   uint32_t h = 2166136261u;
+
+   for (NarfByteSize i = 0; i < size; i++) {
+      h ^= p[i];
+      h *= 16777619u;
+   }
+   return h;
+}
+
+//! @see narf_record.h
+bool narf_record_format(const NarfRecord *record, bool hash, char *line) {
+   static const char *const names[] = {
+      "alloc", "realloc", "write", "append", "punch",
+      "reserve", "rename", "free", "read",
+   };
+   char key[3 * NARF_SECTOR_SIZE];
+   char newkey[3 * NARF_SECTOR_SIZE];
+   unsigned long long offset;
+   unsigned long long size;
+   int n;
+
+   if (record == NULL || line == NULL) return false;
+   if ((size_t) record->op >= sizeof(names) / sizeof(names[0])) return false;
+   // A NULL key cannot be replayed; record it as an empty, invalid one.
+   if (!narf_record_escape(record->key != NULL ? record->key : "", key, sizeof(key))) return false;
+   offset = record->offset;
+   size = record->size;
+
+   switch (record->op) {
+   case NARF_RECORD_WRITE:
+   case NARF_RECORD_PUNCH:
+   case NARF_RECORD_READ:
+      n = snprintf(line, NARF_RECORD_LINE_BYTES, "%s %s %llu %llu",
+                   names[record->op], key, offset, size);
+      break;
+   case NARF_RECORD_RENAME:
+      if (!narf_record_escape(record->newkey != NULL ? record->newkey : "",
+                              newkey, sizeof(newkey))) {
+         return false;
+      }
+      n = snprintf(line, NARF_RECORD_LINE_BYTES, "rename %s %s", key, newkey);
+      break;
+   case NARF_RECORD_FREE:
+      n = snprintf(line, NARF_RECORD_LINE_BYTES, "free %s", key);
+      break;
+   default:
+      n = snprintf(line, NARF_RECORD_LINE_BYTES, "%s %s %llu", names[record->op], key, size);
+      break;
+   }
+   if (n < 0 || n >= NARF_RECORD_LINE_BYTES - 24) return false;
+
+   if (hash && (record->op == NARF_RECORD_WRITE || record->op == NARF_RECORD_APPEND) &&
+       record->data != NULL) {
+      n += snprintf(line + n, NARF_RECORD_LINE_BYTES - (size_t) n, " # fnv1a=%08" PRIx32,
+                    fnv1a(record->data, record->size));
+   }
+   snprintf(line + n, NARF_RECORD_LINE_BYTES - (size_t) n, "\n");
+   return true;
+}
+
+//! @brief Recorder that appends each call to the trace file.
+static void record_to_file(void *context, const NarfRecord *record) {
+   char line[NARF_RECORD_LINE_BYTES];
+
+   (void) context;
+   if (narf_record_format(record, record_hash, line)) {
+      fputs(line, record_file);
+   }
+   else {
+      fputs("# call not recorded\n", record_file);
+   }
+}
+
+//! @see narf_record.h
+bool narf_record_start(const char *path, bool hash) {
+   FILE *f;
+
+   narf_record_stop();
+   if (path == NULL) return false;
+   f = fopen(path, "a");
+   if (f == NULL) return false;
+   setvbuf(f, NULL, _IOLBF, 0);
+   record_file = f;
+   record_hash = hash;
+   narf_set_recorder(record_to_file, NULL);
+   return true;
+}
+
+//! @see narf_record.h
+void narf_record_stop(void) {
+   narf_set_recorder(NULL, NULL);
+   if (record_file != NULL) fclose(record_file);
+   record_file = NULL;
+}
+
+#endif
+
+// vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
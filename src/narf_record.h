@@ -0,0 +1,64 @@
+#ifndef _INCLUDE_NARF_RECORD_H_
+#define _INCLUDE_NARF_RECORD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "narf_conf.h"
+#include "narf.h"
+
+// narf_record.c writes the calls narf_set_recorder() reports as a text trace
+// that narf_replay runs again, one call per line:
+//
+//    write <key> <offset> <bytes> # fnv1a=<hash>
+//
+// Keys are escaped so that a trace line always splits on white space.
+
+//! @brief Longest trace line, including the newline and NUL; room for two
+//! fully escaped keys.
+#define NARF_RECORD_LINE_BYTES 4096
+
+//! @brief Copy a key with white space, control bytes, '%', and '#' escaped as %XX.
+//!
+//! @param text Key to escape.
+//! @param out Destination for the escaped text.
+//! @param size Size of out in bytes.
+//! @return true when the escaped text and its NUL fit.
+bool narf_record_escape(const char *text, char *out, size_t size);
+
+//! @brief Undo narf_record_escape() in place.
+//!
+//! @param text Escaped text.
+//! @return true unless a % is not followed by two hex digits or decodes to NUL.
+bool narf_record_unescape(char *text);
+
+#ifdef NARF_USE_RECORDER
+//! @brief Format one recorded call as a trace line ending in a newline.
+//!
+//! With hash set, writes and appends end in a comment holding the 32-bit
+//! FNV-1a hash of their source bytes, so a trace shows whether the same
+//! data was written again.  Replays ignore it.
+//!
+//! @param record Call to format.
+//! @param hash Whether to hash written data.
+//! @param line Destination of at least NARF_RECORD_LINE_BYTES bytes.
+//! @return true on success.
+bool narf_record_format(const NarfRecord *record, bool hash, char *line);
+
+//! @brief Append every later call to a host trace file.
+//!
+//! Stops any recording already running.  The file is appended to and
+//! flushed line by line, so a crash loses at most the call in progress.
+//!
+//! @param path Host trace file.
+//! @param hash Whether to hash written data.
+//! @return true on success.
+bool narf_record_start(const char *path, bool hash);
+
+//! @brief Stop recording and close the trace file.
+void narf_record_stop(void);
+#endif
+
+#endif
+
+// vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
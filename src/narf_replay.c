@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "narf_conf.h"
+#include "narf_io.h"
+#include "narf_io_ram.h"
+#include "narf.h"
+#include "narf_record.h"
+
+// narf_replay runs recorded operation traces against a simulated RAM device,
+// once per allocation policy, and reports what the replay cost, how
+// fragmented each policy leaves the payload area, and what a full defrag
+// then costs.  Traces come from narf_record.c or are written by hand.
+
+//! @brief Outcome of one trace line.
+typedef enum {
+   REPLAY_OK,
+   REPLAY_FAILED,
+   REPLAY_SKIPPED,
+   REPLAY_BAD,
+} ReplayStatus;
+
+//! @brief One allocation policy to replay under.
+typedef struct {
+   const char *name;
+#ifdef NARF_USE_ALLOC_POLICIES
+   NarfAllocPolicy policy;
+#endif
+} ReplayPolicy;
+
+static const ReplayPolicy policies[] = {
+#ifdef NARF_USE_ALLOC_POLICIES
+   { "best", NARF_ALLOC_BEST_FIT },
+   { "first", NARF_ALLOC_FIRST_FIT },
+   { "next", NARF_ALLOC_NEXT_FIT },
+   { "segregated", NARF_ALLOC_SEGREGATED },
+   { "frontier", NARF_ALLOC_FRONTIER },
+#else
+   { "best" },
+#endif
+};
+
+#define POLICY_COUNT (sizeof(policies) / sizeof(policies[0]))
+
+//! @brief Counters for one replay of one trace.
+typedef struct {
+   unsigned long ops;
+   unsigned long failed;
+   double seconds;
+   NarfRamCounters io;
+   NarfStat stat;
+   NarfFsckReport fsck;
+   NarfSector defrag_moved;
+   unsigned long defrag_commits;
+   uint64_t defrag_writes;
+   NarfSector defrag_largest;
+} ReplayResult;
+
+static const char *image_path = NULL;
+static int image_partition = -1;
+static NarfRamModel model;
+static uint8_t *pattern = NULL;
+static size_t pattern_bytes = 0;
+static uint8_t *scratch = NULL;
+static size_t scratch_bytes = 0;
+
+//! @brief Print usage and exit.
+static void usage(const char *name) {
+   fprintf(stderr,
+         "usage: %s [-s size | -i image[:partition]] [-m model] [-p policy] trace...\n"
+         "\n"
+         "Replay each trace on a fresh RAM image of size bytes (K/M/G suffixes,\n"
+         "default 64M), or on a copy of an existing image, under every allocation\n"
+         "policy, or only the -p policy, on the -m device model (default ram).\n"
+         "Report the replay's time and I/O, fragmentation before, and defrag\n"
+         "cost after.\n"
+         "\n"
+         "Policies:", name);
+   for (size_t i = 0; i < POLICY_COUNT; i++) {
+      fprintf(stderr, " %s", policies[i].name);
+   }
+   fprintf(stderr,
+         "\n\n"
+         "Trace lines, a word starting with # starts a comment, %%XX escapes a key byte:\n"
+         "  alloc <key> <bytes>          realloc <key> <bytes>\n"
+         "  write <key> <offset> <bytes> append <key> <bytes>\n"
+         "  punch <key> <offset> <bytes> reserve <key> <sectors>\n"
+         "  rename <key> <new-key>       free <key>\n"
+         "  read <key> <offset> <bytes>\n");
+   exit(1);
+}
+
+//! @brief Parse a byte count with an optional K/M/G suffix.
+static bool parse_size(const char *text, uint64_t *bytes) {
+   char *end;
+   uint64_t value;
+   uint64_t multiplier = 1;
+
+   errno = 0;
+   value = strtoull(text, &end, 0);
+   if (end == text || errno != 0) return false;
+
+   if (*end == 'k' || *end == 'K') multiplier = 1024ull;
+   else if (*end == 'm' || *end == 'M') multiplier = 1024ull * 1024ull;
+   else if (*end == 'g' || *end == 'G') multiplier = 1024ull * 1024ull * 1024ull;
+   else if (*end != 0) return false;
+   if (multiplier != 1 && end[1] != 0) return false;
+   if (value > UINT64_MAX / multiplier) return false;
+
+   *bytes = value * multiplier;
+   return true;
+}
+
+//! @brief Parse one unsigned trace field.
+static bool parse_field(const char *text, NarfByteSize *value) {
+   char *end;
+   unsigned long long parsed;
+
+   if (text == NULL) return false;
+   errno = 0;
+   parsed = strtoull(text, &end, 0);
+   if (end == text || *end != 0 || errno != 0) return false;
+   if (parsed > (NarfByteSize) -1) return false;
+   *value = (NarfByteSize) parsed;
+   return true;
+}
+
+//! @brief Return a source buffer of at least bytes for write and append ops.
+static const uint8_t *pattern_for(NarfByteSize bytes) {
+   if (bytes > pattern_bytes) {
+      uint8_t *grown = realloc(pattern, bytes);
+
+      if (grown == NULL) return NULL;
+      for (size_t i = pattern_bytes; i < bytes; i++) grown[i] = (uint8_t) ('a' + i % 26);
+      pattern = grown;
+      pattern_bytes = bytes;
+   }
+   return pattern;
+}
+
+//! @brief Return a destination buffer of at least bytes for read ops.
+static uint8_t *scratch_for(NarfByteSize bytes) {
+   if (bytes > scratch_bytes) {
+      uint8_t *grown = realloc(scratch, bytes);
+
+      if (grown == NULL) return NULL;
+      scratch = grown;
+      scratch_bytes = bytes;
+   }
+   return scratch;
+}
+
+//! @brief Run one well-formed trace operation.
+static bool replay_op(int argc, char **argv) {
+   NarfByteSize a = 0;
+   NarfByteSize b = 0;
+
+   if (argc > 2) parse_field(argv[2], &a);
+   if (argc > 3) parse_field(argv[3], &b);
+
+   if (!strcmp(argv[0], "alloc")) return narf_alloc(argv[1], a);
+   if (!strcmp(argv[0], "realloc")) return narf_realloc(argv[1], a);
+   if (!strcmp(argv[0], "write")) {
+      const uint8_t *src = pattern_for(b);
+
+      return src != NULL && narf_write(argv[1], src, b, a);
+   }
+   if (!strcmp(argv[0], "append")) {
+      const uint8_t *src = pattern_for(a);
+
+      return src != NULL && narf_append(argv[1], src, a);
+   }
+   if (!strcmp(argv[0], "punch")) return narf_punch(argv[1], a, b);
+   if (!strcmp(argv[0], "reserve")) return narf_reserve(argv[1], a);
+   if (!strcmp(argv[0], "rename")) return narf_rename_key(argv[1], argv[2]);
+   if (!strcmp(argv[0], "read")) {
+      uint8_t *dst = scratch_for(b);
+
+      return (dst != NULL || b == 0) && narf_read(argv[1], dst, b, a);
+   }
+   return narf_free(argv[1]);
+}
+
+//! @brief Return whether a trace operation is well formed.
+static bool valid_op(int argc, char **argv) {
+   static const struct {
+      const char *name;
+      int argc;
+      int numbers;
+   } ops[] = {
+      { "alloc", 3, 1 }, { "realloc", 3, 1 }, { "write", 4, 2 },
+      { "append", 3, 1 }, { "punch", 4, 2 }, { "reserve", 3, 1 },
+      { "rename", 3, 0 }, { "free", 2, 0 }, { "read", 4, 2 },
+   };
+   NarfByteSize value;
+
+   for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+      if (strcmp(argv[0], ops[i].name)) continue;
+      if (argc != ops[i].argc) return false;
+      for (int n = 0; n < ops[i].numbers; n++) {
+         if (!parse_field(argv[2 + n], &value)) return false;
+      }
+      return true;
+   }
+   return false;
+}
+
+//! @brief Split and run one trace line.
+static ReplayStatus replay_line(char *line) {
+   char *argv[5];
+   int argc = 0;
+   char *save = NULL;
+   char *word;
+
+   for (word = strtok_r(line, " \t\r\n", &save); word != NULL && word[0] != '#' && argc < 5;
+        word = strtok_r(NULL, " \t\r\n", &save)) {
+      argv[argc++] = word;
+   }
+   if (argc == 0) return REPLAY_SKIPPED;
+   if ((word != NULL && word[0] != '#') || !valid_op(argc, argv)) return REPLAY_BAD;
+   if (!narf_record_unescape(argv[1])) return REPLAY_BAD;
+   if (!strcmp(argv[0], "rename") && !narf_record_unescape(argv[2])) return REPLAY_BAD;
+   return replay_op(argc, argv) ? REPLAY_OK : REPLAY_FAILED;
+}
+
+//! @brief Give the RAM device a fresh copy of the starting image and mount it.
+static bool prepare(uint32_t sectors) {
+   int partition = image_partition;
+
+   if (image_path == NULL) {
+      return narf_io_ram_setup(sectors, &model) && narf_mkfs(0, sectors) && narf_init(0);
+   }
+   if (!narf_io_ram_load(image_path, &model)) return false;
+   if (partition < 0) return narf_init(0);
+#ifdef NARF_MBR_UTILS
+   if (partition == 0) partition = narf_findpart();
+   return partition > 0 && narf_mount(partition);
+#else
+   return false;
+#endif
+}
+
+//! @brief Return seconds since a monotonic clock reading.
+static double seconds_since(const struct timespec *start) {
+   struct timespec end;
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   return (double) (end.tv_sec - start->tv_sec) +
+          (double) (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//! @brief Replay one trace under one policy on a fresh copy of the image.
+static bool replay(const char *path, uint32_t sectors, const ReplayPolicy *policy,
+                   ReplayResult *result) {
+   char line[NARF_RECORD_LINE_BYTES];
+   unsigned long number = 0;
+   NarfDefragProgress progress;
+   NarfRamCounters io;
+   NarfStat after;
+   struct timespec start;
+   FILE *f;
+   ReplayStatus status;
+
+   memset(result, 0, sizeof(*result));
+   if (!prepare(sectors)) {
+      fprintf(stderr, "%s: cannot %s the RAM image\n", path,
+              image_path == NULL ? "format" : "load and mount");
+      return false;
+   }
+#ifdef NARF_USE_ALLOC_POLICIES
+   if (!narf_set_alloc_policy(policy->policy)) return false;
+#else
+   (void) policy;
+#endif
+
+   f = fopen(path, "r");
+   if (f == NULL) {
+      perror(path);
+      return false;
+   }
+
+   narf_io_ram_reset();
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while (fgets(line, sizeof(line), f) != NULL) {
+      number++;
+      if (strchr(line, '\n') == NULL && !feof(f)) {
+         fprintf(stderr, "%s:%lu: trace line too long\n", path, number);
+         fclose(f);
+         return false;
+      }
+      status = replay_line(line);
+      if (status == REPLAY_BAD) {
+         fprintf(stderr, "%s:%lu: bad trace line\n", path, number);
+         fclose(f);
+         return false;
+      }
+      if (status == REPLAY_SKIPPED) continue;
+      result->ops++;
+      if (status == REPLAY_FAILED) result->failed++;
+   }
+   fclose(f);
+   result->seconds = seconds_since(&start);
+   narf_io_ram_counters(&result->io);
+
+   if (!narf_stat(&result->stat) || !narf_fsck(&result->fsck)) {
+      fprintf(stderr, "%s: filesystem check failed after replay\n", path);
+      return false;
+   }
+
+#ifdef NARF_USE_DEFRAG
+   do {
+      if (!narf_defrag_step(0, 1, &progress)) {
+         fprintf(stderr, "%s: defrag failed\n", path);
+         return false;
+      }
+      result->defrag_moved += progress.sectors_moved;
+      result->defrag_commits += progress.commits;
+   } while (!progress.done);
+   narf_io_ram_counters(&io);
+   result->defrag_writes = io.writes - result->io.writes;
+#else
+   (void) progress;
+#endif
+
+   if (!narf_stat(&after)) return false;
+   result->defrag_largest = after.largest_free;
+   return true;
+}
+
+//! @brief Print one result row.
+static void print_result(const char *policy, const ReplayResult *r) {
+   NarfSector free_sectors = r->stat.free_sectors;
+   unsigned frag = 0;
+
+   // Share of free space a single allocation cannot reach without defrag.
+   if (free_sectors != 0) {
+      frag = (unsigned) (100ull * (free_sectors - r->stat.largest_free) / free_sectors);
+   }
+
+   printf("%-10s %7lu %6lu %8.3f %9" PRIu64 " %9" PRIu64 " %6" PRIu64 " %9" PRIu64
+          " %8u %8u %7u %4u%% %8u %7lu %9" PRIu64 " %8u\n",
+          policy, r->ops, r->failed, r->seconds, r->io.reads, r->io.writes, r->io.merges,
+          r->io.micros / 1000,
+          (unsigned) free_sectors, (unsigned) r->stat.largest_free,
+          (unsigned) r->fsck.free_extents, frag,
+          (unsigned) r->defrag_moved, r->defrag_commits, r->defrag_writes,
+          (unsigned) r->defrag_largest);
+}
+
+//! @brief Split image[:partition] into image_path and image_partition.
+static bool parse_image(char *arg) {
+   char *colon = strrchr(arg, ':');
+
+   image_path = arg;
+   image_partition = -1;
+   if (colon == NULL) return true;
+   *colon = 0;
+   if (colon[1] == 0) {
+      image_partition = 0;
+      return true;
+   }
+   if (colon[1] < '1' || colon[1] > '4' || colon[2] != 0) return false;
+   image_partition = colon[1] - '0';
+   return true;
+}
+
+int main(int argc, char *argv[]) {
+   uint64_t bytes = 64ull * 1024ull * 1024ull;
+   const char *only = NULL;
+   const char *spec = NULL;
+   ReplayResult result;
+   uint32_t sectors;
+   int argi = 1;
+   int status = 0;
+
+   while (argi < argc && argv[argi][0] == '-') {
+      if (!strcmp(argv[argi], "-s") && argi + 1 < argc) {
+         if (!parse_size(argv[argi + 1], &bytes)) usage(argv[0]);
+         argi += 2;
+      }
+      else if (!strcmp(argv[argi], "-i") && argi + 1 < argc) {
+         if (!parse_image(argv[argi + 1])) usage(argv[0]);
+         argi += 2;
+      }
+      else if (!strcmp(argv[argi], "-m") && argi + 1 < argc) {
+         spec = argv[argi + 1];
+         argi += 2;
+      }
+      else if (!strcmp(argv[argi], "-p") && argi + 1 < argc) {
+         only = argv[argi + 1];
+         argi += 2;
+      }
+      else {
+         usage(argv[0]);
+      }
+   }
+   if (argi == argc) usage(argv[0]);
+
+   if (!narf_io_ram_model(spec, &model)) {
+      fprintf(stderr, "bad device model: %s\n", spec);
+      return 1;
+   }
+   if (image_path == NULL && (bytes % NARF_SECTOR_SIZE != 0 ||
+       bytes / NARF_SECTOR_SIZE > UINT32_MAX || bytes / NARF_SECTOR_SIZE < 64)) {
+      fprintf(stderr, "bad image size: %" PRIu64 " bytes\n", bytes);
+      return 1;
+   }
+   if (only != NULL) {
+      size_t i;
+
+      for (i = 0; i < POLICY_COUNT && strcmp(policies[i].name, only); i++) {
+      }
+      if (i == POLICY_COUNT) usage(argv[0]);
+   }
+
+   sectors = (uint32_t) (bytes / NARF_SECTOR_SIZE);
+   if (image_path != NULL) {
+      if (!narf_io_ram_load(image_path, NULL)) {
+         fprintf(stderr, "%s: cannot load the image\n", image_path);
+         return 1;
+      }
+      sectors = narf_io_sectors();
+   }
+
+   for (; argi < argc; argi++) {
+      printf("%s (%u sectors)\n", argv[argi], (unsigned) sectors);
+      printf("%-10s %7s %6s %8s %9s %9s %6s %9s %8s %8s %7s %5s %8s %7s %9s %8s\n",
+             "policy", "ops", "failed", "seconds", "reads", "writes", "merges", "device_ms",
+             "free", "largest", "extents", "frag", "moved", "commits", "dwrites", "dlargest");
+      for (size_t i = 0; i < POLICY_COUNT; i++) {
+         if (only != NULL && strcmp(policies[i].name, only)) continue;
+         if (!replay(argv[argi], sectors, &policies[i], &result)) {
+            status = 1;
+            break;
+         }
+         print_result(policies[i].name, &result);
+      }
+   }
+
+   free(pattern);
+   free(scratch);
+   return status;
+}
+
+// vim:set ai softtabstop=3 shiftwidth=3 tabstop=3 expandtab: ff=unix
@@ -6,6 +6,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined(__has_include)
@@ -25,11 +26,11 @@ void add_history(const char *line);
 
 #include "narf.h"
 #include "narf_io.h"
+#include "narf_io_ram.h"
+#include "narf_record.h"
 
 #define ASSIGN =
 
-extern void narf_io_configure(const char *fname);
-
 __attribute__((weak)) 
 //! @brief Weak fallback used when debug support is not linked.
 void narf_debug(void) {
@@ -43,6 +44,29 @@ bool narf_defrag(void) {
    return false;
 }
 
+__attribute__((weak)) 
+//! @brief Weak fallback used when defrag support is not linked.
+bool narf_defrag_step(NarfSector max_sectors_moved, unsigned max_commits,
+                      NarfDefragProgress *progress) {
+   (void) max_sectors_moved;
+   (void) max_commits;
+   (void) progress;
+   printf("defrag not supported\n");
+   return false;
+}
+
+__attribute__((weak)) 
+//! @brief Weak fallback used when the RAM device is not linked.
+bool narf_io_ram_counters(NarfRamCounters *counters) {
+   (void) counters;
+   return false;
+}
+
+__attribute__((weak)) 
+//! @brief Weak fallback used when the RAM device is not linked.
+void narf_io_ram_reset(void) {
+}
+
 const char *tf[] = { "false", "true" };
 
 static void gremlins(int s, int n);
@@ -59,12 +83,17 @@ typedef struct {
 #define TESTER_MAX_ARGS 32
 
 static bool g_quit_requested = false;
+static uint8_t *g_work_memory = NULL;
 
 static void cmd_alloc(int argc, char **argv);
 static void cmd_append(int argc, char **argv);
+static void cmd_bulk(int argc, char **argv);
 static void cmd_cat(int argc, char **argv);
+static void cmd_checkpoint(int argc, char **argv);
+static void cmd_compress(int argc, char **argv);
 static void cmd_create(int argc, char **argv);
 static void cmd_debug(int argc, char **argv);
+static void cmd_dedup(int argc, char **argv);
 static void cmd_defrag(int argc, char **argv);
 static void cmd_exit(int argc, char **argv);
 static void cmd_findpart(int argc, char **argv);
@@ -74,19 +103,34 @@ static void cmd_fsck(int argc, char **argv);
 static void cmd_gremlins(int argc, char **argv);
 static void cmd_help(int argc, char **argv);
 static void cmd_init(int argc, char **argv);
+static void cmd_iostat(int argc, char **argv);
 static void cmd_ls(int argc, char **argv);
+static void cmd_maintenance(int argc, char **argv);
 static void cmd_mbr(int argc, char **argv);
 static void cmd_mkfs(int argc, char **argv);
 static void cmd_mount(int argc, char **argv);
 static void cmd_pack(int argc, char **argv);
 static void cmd_partition(int argc, char **argv);
+static void cmd_policy(int argc, char **argv);
+static void cmd_punch(int argc, char **argv);
 static void cmd_quit(int argc, char **argv);
 static void cmd_realloc(int argc, char **argv);
+static void cmd_record(int argc, char **argv);
 static void cmd_rename(int argc, char **argv);
+static void cmd_reserve(int argc, char **argv);
 static void cmd_scan(int argc, char **argv);
+static void cmd_seek(int argc, char **argv);
+static void cmd_selftest(int argc, char **argv);
 static void cmd_slurp(int argc, char **argv);
+static void cmd_snapshot(int argc, char **argv);
+static void cmd_stat(int argc, char **argv);
+static void cmd_stats(int argc, char **argv);
 static void cmd_tag(int argc, char **argv);
 static void cmd_touch(int argc, char **argv);
+static void cmd_trace(int argc, char **argv);
+static void cmd_unmount(int argc, char **argv);
+static void cmd_workmem(int argc, char **argv);
+static void cmd_write(int argc, char **argv);
 
 static void do_pack(const char *dirname);
 static bool path_join(char *out, size_t out_size, const char *left, const char *right);
@@ -107,18 +151,30 @@ static const TesterCommand commands[] = {
    { "append", cmd_append,
       "append <key> <string>\n"
       "Append string data to an existing key. Quote strings that contain spaces." },
+   { "bulk", cmd_bulk,
+      "bulk <prefix> <count> [bytes]\n"
+      "Create count keys named <prefix>00000000 upward with narf_bulk_insert(). Each key gets bytes of zero-filled payload, default 0." },
    { "cat", cmd_cat,
       "cat <key>\n"
       "Print a hex/ASCII dump of a key's payload." },
+   { "checkpoint", cmd_checkpoint,
+      "checkpoint\n"
+      "Call narf_checkpoint() so the next mount can adopt the spare list without rebuilding it." },
+   { "compress", cmd_compress,
+      "compress <key> [on|off]\n"
+      "Show whether a key is stored compressed, or convert it with narf_set_compressed(), when compression is built in." },
    { "create", cmd_create,
       "create <key> <string>\n"
       "Create a new key and initialize it with string data. Quote strings that contain spaces." },
    { "debug", cmd_debug,
       "debug\n"
       "Print internal root/data-tree/free-tree information." },
+   { "dedup", cmd_dedup,
+      "dedup <key>\n"
+      "Share a key's payload with keys holding identical bytes using narf_dedup(), when deduplication is built in." },
    { "defrag", cmd_defrag,
-      "defrag\n"
-      "Call narf_defrag() when defrag support is linked into the tester." },
+      "defrag [step [sectors [commits]]]\n"
+      "Call narf_defrag() when defrag support is linked into the tester; 'step' calls narf_defrag_step() once with a sector budget (default 0, unlimited) and a commit budget (default 1)." },
    { "exit", cmd_exit,
       "exit\n"
       "Leave the tester prompt." },
@@ -132,8 +188,8 @@ static const TesterCommand commands[] = {
       "free <key>\n"
       "Delete a key and return its storage to the filesystem." },
    { "fsck", cmd_fsck,
-      "fsck [deep]\n"
-      "Validate NARF structure. Default is linear; 'deep' also checks overlaps, duplicate references, and full allocation coverage." },
+      "fsck [deep | online [budget] | begin | step [budget] | end]\n"
+      "Validate NARF structure. Default is linear; 'deep' also checks overlaps, duplicate references, and full allocation coverage; 'online' runs the incremental fsck to completion with budget sector reads per step, default 64; begin/step/end drive it one call at a time." },
    { "gremlins", cmd_gremlins,
       "gremlins <seed> <count>\n"
       "Run randomized tester operations. The seed makes a run reproducible." },
@@ -143,9 +199,15 @@ static const TesterCommand commands[] = {
    { "init", cmd_init,
       "init\n"
       "Mount/initialize a whole-image filesystem starting at sector 0." },
+   { "iostat", cmd_iostat,
+      "iostat [reset]\n"
+      "Print what the simulated RAM device has done and its simulated time, or zero the counters and clock, in narf_tester_ram." },
    { "ls", cmd_ls,
       "ls <dirname>\n"
       "List keys directly under dirname using / as the separator. Root may be listed as /." },
+   { "maintenance", cmd_maintenance,
+      "maintenance [steps]\n"
+      "Call narf_maintenance_step() until no deferred work remains, or at most steps times." },
    { "mbr", cmd_mbr,
       "mbr [message]\n"
       "Write a classic MBR to sector 0. With a message, embed the text in the boot-code area." },
@@ -161,27 +223,66 @@ static const TesterCommand commands[] = {
    { "partition", cmd_partition,
       "partition <n>\n"
       "Create a NARF partition entry. Valid partition numbers are 1 through 4." },
+   { "policy", cmd_policy,
+      "policy [best|first|next|segregated|frontier]\n"
+      "Show or select the payload allocation policy with narf_set_alloc_policy(), when allocation policies are built in." },
+   { "punch", cmd_punch,
+      "punch <key> <offset> <bytes>\n"
+      "Zero a byte range of a key, releasing whole sectors at the ends of its extent." },
    { "quit", cmd_quit,
       "quit\n"
       "Leave the tester prompt." },
    { "realloc", cmd_realloc,
       "realloc <key> <bytes>\n"
       "Resize a key, creating it if absent." },
+   { "record", cmd_record,
+      "record <host-file> [hash] | record off\n"
+      "Append every later call that reads or changes payload to a host trace file that narf_replay can run, when the recorder is built in. 'hash' adds the FNV-1a hash of written data to each write and append." },
    { "rename", cmd_rename,
       "rename <old-key> <new-key>\n"
       "Rename a key." },
+   { "reserve", cmd_reserve,
+      "reserve <key> <sectors>\n"
+      "Set a key's growth slack with narf_reserve() so appends keep landing in place." },
    { "scan", cmd_scan,
       "scan <key>\n"
       "Read and print the key's metadata area as a string." },
+   { "seek", cmd_seek,
+      "seek <key> <offset> data|hole\n"
+      "Find the next data or hole offset in a key and show its allocated sectors." },
+   { "selftest", cmd_selftest,
+      "selftest [case]\n"
+      "Run the targeted test cases, or one of them, and print ok or FAILED for each. Every case formats the device from sector 0, so run it on a scratch image." },
    { "slurp", cmd_slurp,
       "slurp <host-file>\n"
       "Read line-oriented keys from a host text file and allocate each with 1024 bytes." },
+   { "snapshot", cmd_snapshot,
+      "snapshot [list | create <name> | delete <name> | mount [name] | changes <name>]\n"
+      "List, create, or delete snapshots, when snapshots are built in. 'mount <name>' shows a snapshot read-only with narf_snapshot_mount(); 'mount' alone returns to the live filesystem. 'changes <name>' lists the keys changed since the snapshot." },
+   { "stat", cmd_stat,
+      "stat\n"
+      "Print narf_stat() capacity counters and the narf_usage() counters, including sectors held as growth slack." },
+   { "stats", cmd_stats,
+      "stats [reset | latency]\n"
+      "Print the narf_perf_stats() counters of each operation called so far and their total, or zero them with narf_perf_reset(), when performance counters are built in. 'latency' prints each operation's p50, p99, p999, and longest call in microseconds from narf_perf_latency(), when the trace is built in." },
    { "tag", cmd_tag,
       "tag <key> <metadata>\n"
       "Store a metadata string in the key's metadata area. Quote metadata that contains spaces." },
    { "touch", cmd_touch,
       "touch <key>\n"
       "Create a new key with no data." },
+   { "trace", cmd_trace,
+      "trace [on [entries] | off | show [count] | heat [rows] | save <host-file>]\n"
+      "Lend the core a sector-trace ring of entries records, default 65536, or stop tracing, when the trace is built in. 'show' prints the newest records, 'heat' a sector-access heatmap of the device in rows bands, default 32, and 'save' writes the kept records oldest first to a binary host file. Without arguments, print how many records were traced." },
+   { "unmount", cmd_unmount,
+      "unmount\n"
+      "Call narf_unmount() so the next mount can skip full tree validation." },
+   { "workmem", cmd_workmem,
+      "workmem <bytes>\n"
+      "Lend narf_set_work_memory() a heap bitmap of bytes for spare rebuilds and fsck deep; 0 restores the built-in bitmap." },
+   { "write", cmd_write,
+      "write <key> <offset> <string>\n"
+      "Write string data into an existing key at a byte offset with narf_write(), growing the key when it ends past the end. Quote strings that contain spaces." },
    { NULL, NULL, NULL }
 };
 
@@ -487,6 +588,10 @@ static bool pack_file(const char *host_path, const char *narf_key) {
    }
 
    fclose(f);
+#ifdef NARF_USE_DEDUP
+   // Identical assets packed under several keys end up sharing one extent.
+   if (ok && narf_size(narf_key) != 0) (void) narf_dedup(narf_key);
+#endif
    return ok;
 }
 
@@ -612,12 +717,54 @@ static void cmd_append(int argc, char **argv) {
          argv[1], data, (unsigned long) size, tf[result]);
 }
 
+//! @brief Iterator state for the bulk tester command.
+typedef struct {
+   const char *prefix;
+   NarfByteSize bytes;
+   int index;
+   char key[512];
+} BulkTestState;
+
+//! @brief Produce the next generated key for the bulk tester command.
+static bool bulk_test_next(void *context, NarfBulkItem *item) {
+   BulkTestState *state = context;
+
+   snprintf(state->key, sizeof(state->key), "%s%08d",
+         state->prefix, state->index++);
+   item->key = state->key;
+   item->bytes = state->bytes;
+   item->metadata = NULL;
+   return true;
+}
+
+static void cmd_bulk(int argc, char **argv) {
+   BulkTestState state;
+   int count;
+   bool result;
+
+   memset(&state, 0, sizeof(state));
+   if ((argc != 3 && argc != 4) ||
+       !parse_int_arg(argv[2], &count) || count < 0 ||
+       (argc == 4 && !parse_size_arg(argv[3], &state.bytes))) {
+      print_usage(argv[0]);
+      return;
+   }
+
+   state.prefix = argv[1];
+   result = narf_bulk_insert((NarfSector) count, bulk_test_next, &state);
+
+   printf("narf_bulk_insert(%s,%d,%lu)=%s\n",
+         argv[1], count, (unsigned long) state.bytes, tf[result]);
+}
+
 static void cmd_cat(int argc, char **argv) {
    char key[512];
+   char data[512];
    char line[17];
    bool found;
    NarfByteSize len;
-   NarfSector start;
+   NarfByteSize offset = 0;
+   NarfByteSize chunk;
    int addr = 0;
    int tail;
 
@@ -630,27 +777,31 @@ static void cmd_cat(int argc, char **argv) {
    printf("narf_find(%s)=%s\n", key, tf[found ASSIGN narf_find(key)]);
    if (!found) return;
 
-   start = narf_sector(key);
    len = narf_size(key);
    tail = (int)(len % 16);
 
    while (len > 0) {
-      narf_io_read(start, key);
-      for (NarfByteSize i = 0; i < len && i < 512; i++) {
+      chunk = (len > 512) ? 512 : len;
+      if (!narf_read(key, data, chunk, offset)) {
+         printf("narf_read(%s,%lu,%lu)=false\n", key,
+               (unsigned long) chunk, (unsigned long) offset);
+         return;
+      }
+      for (NarfByteSize i = 0; i < chunk; i++) {
          if ((i % 16) == 0) {
             printf("%04x: ", addr);
             addr += 16;
          }
-         printf("%02x ", (uint8_t) key[i]);
-         line[i % 16] = (key[i] >= ' ' && key[i] <= '~') ? key[i] : '.';
+         printf("%02x ", (uint8_t) data[i]);
+         line[i % 16] = (data[i] >= ' ' && data[i] <= '~') ? data[i] : '.';
          line[(i % 16) + 1] = 0;
          if ((i % 16) == 15) {
             printf(" %s\n", line);
             line[0] = 0;
          }
       }
-      start++;
-      len -= (len > 512) ? 512 : len;
+      offset += chunk;
+      len -= chunk;
    }
    if (tail) {
       printf("%*s %s\n", 3 * (16 - tail), " ", line);
@@ -658,6 +809,43 @@ static void cmd_cat(int argc, char **argv) {
    printf("\n");
 }
 
+static void cmd_checkpoint(int argc, char **argv) {
+   bool result;
+   (void) argv;
+
+   if (argc != 1) {
+      print_usage("checkpoint");
+      return;
+   }
+
+   printf("narf_checkpoint()=%s\n",
+         tf[result ASSIGN narf_checkpoint()]);
+}
+
+static void cmd_compress(int argc, char **argv) {
+#ifdef NARF_USE_COMPRESSION
+   bool result;
+
+   if (argc == 2) {
+      printf("narf_compressed(%s)=%s\n", argv[1], tf[narf_compressed(argv[1])]);
+      return;
+   }
+
+   if (argc != 3 || (strcmp(argv[2], "on") && strcmp(argv[2], "off"))) {
+      print_usage("compress");
+      return;
+   }
+
+   result = narf_set_compressed(argv[1], !strcmp(argv[2], "on"));
+   printf("narf_set_compressed(%s,%s)=%s allocated=%lu\n", argv[1], argv[2],
+         tf[result], (unsigned long) narf_allocated(argv[1]));
+#else
+   (void) argc;
+   (void) argv;
+   printf("compression is not built in\n");
+#endif
+}
+
 static void cmd_create(int argc, char **argv) {
    char data[512];
    bool result;
@@ -690,17 +878,55 @@ static void cmd_debug(int argc, char **argv) {
    narf_debug();
 }
 
-static void cmd_defrag(int argc, char **argv) {
+static void cmd_dedup(int argc, char **argv) {
+#ifdef NARF_USE_DEDUP
    bool result;
+
+   if (argc != 2) {
+      print_usage("dedup");
+      return;
+   }
+
+   result = narf_dedup(argv[1]);
+   printf("narf_dedup(%s)=%s allocated=%lu\n", argv[1], tf[result],
+         (unsigned long) narf_allocated(argv[1]));
+#else
+   (void) argc;
    (void) argv;
+   printf("deduplication is not built in\n");
+#endif
+}
 
-   if (argc != 1) {
+static void cmd_defrag(int argc, char **argv) {
+   static const char *phases[] = {
+      "carve", "plan", "squish", "widen", "reclaim", "relax", "squeeze", "done"
+   };
+   NarfDefragProgress progress;
+   int sectors = 0;
+   int commits = 1;
+   bool result;
+
+   if (argc == 1) {
+      printf("narf_defrag()=%s\n",
+            tf[result ASSIGN narf_defrag()]);
+      return;
+   }
+
+   if (argc > 4 || strcmp(argv[1], "step") != 0 ||
+       (argc >= 3 && (!parse_int_arg(argv[2], &sectors) || sectors < 0)) ||
+       (argc == 4 && (!parse_int_arg(argv[3], &commits) || commits < 0))) {
       print_usage("defrag");
       return;
    }
 
-   printf("narf_defrag()=%s\n",
-         tf[result ASSIGN narf_defrag()]);
+   result = narf_defrag_step((NarfSector) sectors, (unsigned) commits, &progress);
+   printf("narf_defrag_step(%d, %d)=%s phase=%s moved=%u commits=%u "
+          "bottom=%u top=%u done=%s\n",
+         sectors, commits, tf[result],
+         progress.phase <= NARF_DEFRAG_DONE ? phases[progress.phase] : "?",
+         (unsigned) progress.sectors_moved, progress.commits,
+         (unsigned) progress.bottom, (unsigned) progress.top,
+         tf[progress.done]);
 }
 
 static void cmd_exit(int argc, char **argv) {
@@ -749,29 +975,79 @@ static void cmd_free(int argc, char **argv) {
 }
 
 
+//! @brief Print the counters of one fsck report.
+static void print_fsck_report(const NarfFsckReport *report) {
+   printf("  errors          = %u\n", (unsigned) report->errors);
+   printf("  files           = %u\n", (unsigned) report->file_count);
+   printf("  data_nodes      = %u\n", (unsigned) report->data_nodes);
+   printf("  free_nodes      = %u\n", (unsigned) report->free_nodes);
+   printf("  shared_nodes    = %u\n", (unsigned) report->shared_nodes);
+   printf("  pinned_nodes    = %u\n", (unsigned) report->pinned_nodes);
+   printf("  snapshot_nodes  = %u\n", (unsigned) report->snapshot_nodes);
+   printf("  spare_nodes     = %u\n", (unsigned) report->spare_nodes);
+   printf("  free_extents    = %u\n", (unsigned) report->free_extents);
+   printf("  payload_sectors = %u\n", (unsigned) report->payload_sectors);
+   printf("  free_sectors    = %u\n", (unsigned) report->free_sectors);
+}
+
+//! @brief Run narf_fsck_begin/step/end to completion with a per-step read budget.
+static bool online_fsck(int budget, NarfFsckReport *report) {
+   bool done = false;
+   int steps = 0;
+
+   if (!narf_fsck_begin()) return narf_fsck_end(report);
+   while (!done && narf_fsck_step((unsigned) budget, &done)) {
+      steps++;
+   }
+   printf("narf_fsck_step(%d) x%d done=%s\n", budget, steps, tf[done]);
+   return narf_fsck_end(report);
+}
+
 static void cmd_fsck(int argc, char **argv) {
    NarfFsckReport report;
    bool result;
    bool deep = false;
+   bool online = false;
+   int budget = 64;
+
+   if (argc == 2 && strcmp(argv[1], "begin") == 0) {
+      printf("narf_fsck_begin()=%s\n", tf[narf_fsck_begin()]);
+      return;
+   }
+   if ((argc == 2 || argc == 3) && strcmp(argv[1], "step") == 0 &&
+       (argc == 2 || (parse_int_arg(argv[2], &budget) && budget > 0))) {
+      result = narf_fsck_step((unsigned) budget, &online);
+      printf("narf_fsck_step(%d)=%s done=%s\n", budget, tf[result], tf[online]);
+      return;
+   }
 
    if (argc == 2 && strcmp(argv[1], "deep") == 0) {
       deep = true;
    }
+   else if (argc == 2 && strcmp(argv[1], "end") == 0) {
+      result = narf_fsck_end(&report);
+      printf("narf_fsck_end()=%s\n", tf[result]);
+      print_fsck_report(&report);
+      return;
+   }
+   else if ((argc == 2 || argc == 3) && strcmp(argv[1], "online") == 0 &&
+            (argc == 2 || (parse_int_arg(argv[2], &budget) && budget > 0))) {
+      online = true;
+   }
    else if (argc != 1) {
       print_usage("fsck");
       return;
    }
 
-   result = deep ? narf_fsck_deep(&report) : narf_fsck(&report);
-   printf("%s()=%s\n", deep ? "narf_fsck_deep" : "narf_fsck", tf[result]);
-   printf("  errors          = %u\n", (unsigned) report.errors);
-   printf("  files           = %u\n", (unsigned) report.file_count);
-   printf("  data_nodes      = %u\n", (unsigned) report.data_nodes);
-   printf("  free_nodes      = %u\n", (unsigned) report.free_nodes);
-   printf("  spare_nodes     = %u\n", (unsigned) report.spare_nodes);
-   printf("  free_extents    = %u\n", (unsigned) report.free_extents);
-   printf("  payload_sectors = %u\n", (unsigned) report.payload_sectors);
-   printf("  free_sectors    = %u\n", (unsigned) report.free_sectors);
+   if (online) {
+      result = online_fsck(budget, &report);
+      printf("narf_fsck_end()=%s\n", tf[result]);
+   }
+   else {
+      result = deep ? narf_fsck_deep(&report) : narf_fsck(&report);
+      printf("%s()=%s\n", deep ? "narf_fsck_deep" : "narf_fsck", tf[result]);
+   }
+   print_fsck_report(&report);
 }
 
 static void cmd_gremlins(int argc, char **argv) {
@@ -786,6 +1062,181 @@ static void cmd_gremlins(int argc, char **argv) {
    gremlins(s, n);
 }
 
+//! @brief A targeted tester case that formats the device and checks its own results.
+typedef struct {
+   const char *name;
+   bool (*run)(void);
+} SelfTest;
+
+//! @brief Report a failed selftest check and return false.
+static bool selftest_fail(const char *what) {
+   printf("  check failed: %s\n", what);
+   return false;
+}
+
+//! @brief Format a fresh filesystem of the given size at sector 0 and mount it.
+static bool selftest_fresh(NarfSector sectors) {
+   if (narf_io_sectors() < sectors) return selftest_fail("device too small");
+   if (!narf_mkfs(0, sectors) || !narf_init(0)) return selftest_fail("mkfs");
+   return true;
+}
+
+//! @brief Fill a buffer with a pattern that differs per tag.
+static void selftest_fill(uint8_t *data, size_t bytes, unsigned tag) {
+   for (size_t i = 0; i < bytes; i++) data[i] = (uint8_t) (tag * 37u + i * 7u + 1u);
+}
+
+//! @brief Check that a key holds exactly the expected bytes.
+static bool selftest_same(const char *key, const uint8_t *expected, size_t bytes) {
+   uint8_t data[4096];
+
+   if (bytes > sizeof(data)) return selftest_fail("buffer");
+   if (!narf_find(key)) return selftest_fail(key);
+   if (bytes != 0 && (!narf_read(key, data, bytes, 0) || memcmp(data, expected, bytes) != 0)) {
+      return selftest_fail(key);
+   }
+   return true;
+}
+
+//! @brief Check the whole filesystem with the deep fsck.
+static bool selftest_fsck(void) {
+   NarfFsckReport report;
+
+   if (!narf_fsck_deep(&report)) return selftest_fail("fsck deep");
+   return true;
+}
+
+//! @brief Defrag trims growth slack on a nearly full volume without losing keys.
+//!
+//! The slack of every key but the last ends below the payload frontier, so
+//! trimming it inserts a free extent that does not touch m_bottom.
+static bool selftest_slack_carve(void) {
+   static const char *const keys[] = { "carve/a", "carve/b", "carve/c" };
+   uint8_t data[3][90];
+   NarfDefragProgress progress;
+   unsigned count;
+   unsigned steps = 0;
+
+   if (!selftest_fresh(160)) return false;
+   for (count = 0; count < 3; count++) {
+      selftest_fill(data[count], sizeof(data[count]), count);
+      if (!narf_alloc(keys[count], sizeof(data[count])) ||
+          !narf_write(keys[count], data[count], sizeof(data[count]), 0) ||
+          !narf_reserve(keys[count], 35)) {
+         break;
+      }
+   }
+   if (count < 2) return selftest_fail("reserve");
+
+   // One commit per step, so a bad trim is caught before later phases run.
+   do {
+      if (steps++ == 64 || !narf_defrag_step(0, 1, &progress)) {
+         return selftest_fail("defrag");
+      }
+      for (unsigned i = 0; i < count; i++) {
+         if (!selftest_same(keys[i], data[i], sizeof(data[i]))) return false;
+      }
+   } while (!progress.done);
+
+   for (unsigned i = 0; i < count; i++) {
+      if (narf_allocated(keys[i]) != 1) return selftest_fail("slack kept");
+   }
+   return selftest_fsck();
+}
+
+//! @brief Count the payload runs reported by narf_live_extents().
+static bool selftest_count_payload(void *context, NarfLiveKind kind,
+                                   NarfSector start, NarfSector count) {
+   (void) start;
+   (void) count;
+   if (kind == NARF_LIVE_PAYLOAD) (*(unsigned *) context)++;
+   return true;
+}
+
+//! @brief Check a key's contents and how many payload runs the volume holds.
+//!
+//! With one key, a second run is its tail copy.
+static bool selftest_tail_state(const char *key, const uint8_t *expected,
+                                size_t bytes, unsigned runs, const char *what) {
+   unsigned found = 0;
+
+   if (!selftest_same(key, expected, bytes)) return false;
+   if (!narf_live_extents(selftest_count_payload, &found)) {
+      return selftest_fail("live extents");
+   }
+   if (found != runs) return selftest_fail(what);
+   return true;
+}
+
+//! @brief Appends go through a tail copy that later appends and defrag fold.
+static bool selftest_tail_fold(void) {
+   static const char *const key = "tail/log";
+   uint8_t data[2048];
+   NarfDefragProgress progress;
+   unsigned steps = 0;
+
+   if (!selftest_fresh(320)) return false;
+   selftest_fill(data, sizeof(data), 5);
+
+   if (!narf_alloc(key, 700) || !narf_write(key, data, 700, 0)) {
+      return selftest_fail("write");
+   }
+   if (!selftest_tail_state(key, data, 700, 1, "unaligned write")) return false;
+
+   if (!narf_append(key, data + 700, 100)) return selftest_fail("append");
+   if (!selftest_tail_state(key, data, 800, 2, "tail copy")) return false;
+
+   if (!narf_append(key, data + 800, 100)) return selftest_fail("append");
+   // Ending in the same sector writes the slot and frees the copy.
+   if (!selftest_tail_state(key, data, 900, 1, "same sector")) return false;
+
+   if (!narf_append(key, data + 900, 300)) return selftest_fail("append");
+   if (!selftest_tail_state(key, data, 1200, 2, "next sector")) return false;
+
+   if (!narf_init(0)) return selftest_fail("remount");
+   if (!selftest_tail_state(key, data, 1200, 2, "remount")) return false;
+
+   selftest_fill(data + 1000, 50, 6);
+   if (!narf_write(key, data + 1000, 50, 1000)) return selftest_fail("offset write");
+   // A write into written sectors copies the extent and drops the tail copy.
+   if (!selftest_tail_state(key, data, 1200, 1, "offset write")) return false;
+
+   if (!narf_append(key, data + 1200, 30)) return selftest_fail("append");
+   if (!selftest_tail_state(key, data, 1230, 2, "append")) return false;
+
+   do {
+      if (steps++ == 64 || !narf_defrag_step(0, 1, &progress)) {
+         return selftest_fail("defrag");
+      }
+      if (!selftest_same(key, data, 1230)) return false;
+   } while (!progress.done);
+   if (!selftest_tail_state(key, data, 1230, 1, "defrag fold")) return false;
+   return selftest_fsck();
+}
+
+static const SelfTest selftests[] = {
+   { "slack-carve", selftest_slack_carve },
+   { "tail-fold", selftest_tail_fold },
+   { NULL, NULL }
+};
+
+static void cmd_selftest(int argc, char **argv) {
+   const SelfTest *t;
+   bool found = false;
+
+   if (argc > 2) {
+      print_usage(argv[0]);
+      return;
+   }
+
+   for (t = selftests; t->name != NULL; t++) {
+      if (argc == 2 && strcmp(argv[1], t->name) != 0) continue;
+      found = true;
+      printf("selftest %s: %s\n", t->name, t->run() ? "ok" : "FAILED");
+   }
+   if (!found) print_usage(argv[0]);
+}
+
 static void cmd_help(int argc, char **argv) {
    const TesterCommand *cmd;
 
@@ -822,6 +1273,38 @@ static void cmd_init(int argc, char **argv) {
          start, tf[narf_init(start)]);
 }
 
+static void cmd_iostat(int argc, char **argv) {
+   NarfRamCounters c;
+
+   (void) argv;
+   if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+      print_usage("iostat");
+      return;
+   }
+   if (!narf_io_ram_counters(&c)) {
+      printf("iostat: not a RAM device; use narf_tester_ram\n");
+      return;
+   }
+   if (argc == 2) {
+      narf_io_ram_reset();
+      printf("narf_io_ram_reset()\n");
+      return;
+   }
+
+   printf("  reads        = %llu (%llu seeks)\n", (unsigned long long) c.reads,
+         (unsigned long long) c.read_seeks);
+   printf("  writes       = %llu (%llu seeks)\n", (unsigned long long) c.writes,
+         (unsigned long long) c.write_seeks);
+   printf("  syncs        = %llu\n", (unsigned long long) c.syncs);
+   printf("  discards     = %llu (%llu sectors)\n", (unsigned long long) c.discards,
+         (unsigned long long) c.discarded);
+   printf("  zeroes       = %llu (%llu sectors)\n", (unsigned long long) c.zeroes,
+         (unsigned long long) c.zeroed);
+   printf("  block_opens  = %llu\n", (unsigned long long) c.block_opens);
+   printf("  merges       = %llu\n", (unsigned long long) c.merges);
+   printf("  device_us    = %llu\n", (unsigned long long) c.micros);
+}
+
 static void cmd_ls(int argc, char **argv) {
    const char *entry;
 
@@ -841,6 +1324,26 @@ static void cmd_ls(int argc, char **argv) {
    printf("\n");
 }
 
+static void cmd_maintenance(int argc, char **argv) {
+   int limit = -1;
+   int steps = 0;
+   bool pending = true;
+   bool result = true;
+
+   if (argc > 2 || (argc == 2 && (!parse_int_arg(argv[1], &limit) || limit < 0))) {
+      print_usage("maintenance");
+      return;
+   }
+
+   while (pending && (limit < 0 || steps < limit)) {
+      if (!(result = narf_maintenance_step(&pending))) break;
+      steps++;
+   }
+
+   printf("narf_maintenance_step() x%d=%s pending=%s\n",
+         steps, tf[result], tf[pending]);
+}
+
 static void cmd_mbr(int argc, char **argv) {
    char message[512];
 
@@ -930,6 +1433,56 @@ static void cmd_realloc(int argc, char **argv) {
          tf[result ASSIGN narf_realloc(argv[1], size)]);
 }
 
+static void cmd_policy(int argc, char **argv) {
+#ifdef NARF_USE_ALLOC_POLICIES
+   static const char *policies[] = {
+      "best", "first", "next", "segregated", "frontier"
+   };
+   unsigned i;
+   bool result;
+
+   if (argc == 1) {
+      printf("narf_alloc_policy()=%s\n", policies[narf_alloc_policy()]);
+      return;
+   }
+
+   if (argc != 2) {
+      print_usage("policy");
+      return;
+   }
+
+   for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+      if (!strcmp(argv[1], policies[i])) {
+         printf("narf_set_alloc_policy(%s)=%s\n", policies[i],
+               tf[result ASSIGN narf_set_alloc_policy((NarfAllocPolicy) i)]);
+         return;
+      }
+   }
+   print_usage("policy");
+#else
+   (void) argc;
+   (void) argv;
+   printf("allocation policies are not built in\n");
+#endif
+}
+
+static void cmd_punch(int argc, char **argv) {
+   NarfByteSize offset;
+   NarfByteSize size;
+   bool result;
+
+   if (argc != 4 || !parse_size_arg(argv[2], &offset) ||
+       !parse_size_arg(argv[3], &size)) {
+      print_usage(argv[0]);
+      return;
+   }
+
+   printf("narf_punch(%s,%lu,%lu)=%s allocated=%lu\n",
+         argv[1], (unsigned long) offset, (unsigned long) size,
+         tf[result ASSIGN narf_punch(argv[1], offset, size)],
+         (unsigned long) narf_allocated(argv[1]));
+}
+
 static void cmd_rename(int argc, char **argv) {
    bool result;
 
@@ -942,6 +1495,21 @@ static void cmd_rename(int argc, char **argv) {
          argv[1], argv[2], result ASSIGN narf_rename_key(argv[1], argv[2]));
 }
 
+static void cmd_reserve(int argc, char **argv) {
+   NarfByteSize sectors;
+   bool result;
+
+   if (argc != 3 || !parse_size_arg(argv[2], &sectors)) {
+      print_usage(argv[0]);
+      return;
+   }
+
+   printf("narf_reserve(%s,%lu)=%s allocated=%lu\n",
+         argv[1], (unsigned long) sectors,
+         tf[result ASSIGN narf_reserve(argv[1], sectors)],
+         (unsigned long) narf_allocated(argv[1]));
+}
+
 static void cmd_scan(int argc, char **argv) {
    char *result;
 
@@ -955,6 +1523,25 @@ static void cmd_scan(int argc, char **argv) {
          argv[1], result ? result : "(null)");
 }
 
+static void cmd_seek(int argc, char **argv) {
+   NarfByteSize offset;
+   NarfByteSize found = 0;
+   bool hole;
+   bool result;
+
+   if (argc != 4 || !parse_size_arg(argv[2], &offset) ||
+       (strcmp(argv[3], "data") && strcmp(argv[3], "hole"))) {
+      print_usage(argv[0]);
+      return;
+   }
+
+   hole = !strcmp(argv[3], "hole");
+   result = narf_seek(argv[1], offset, hole, &found);
+   printf("narf_seek(%s,%lu,%s)=%s offset=%lu allocated=%lu\n",
+         argv[1], (unsigned long) offset, argv[3], tf[result],
+         (unsigned long) found, (unsigned long) narf_allocated(argv[1]));
+}
+
 static void cmd_slurp(int argc, char **argv) {
    char p[512];
    FILE *f;
@@ -986,6 +1573,187 @@ static void cmd_slurp(int argc, char **argv) {
    }
 }
 
+#ifdef NARF_USE_SNAPSHOTS
+//! @brief Print one change reported by narf_changes_since().
+static bool print_change(void *context, const NarfChange *change) {
+   static const char *kinds[] = { "created", "modified", "deleted" };
+
+   (*(unsigned long *) context)++;
+   printf("  %-8s %s bytes %lu -> %lu from %lu%s\n",
+         kinds[change->kind], change->key,
+         (unsigned long) change->old_bytes, (unsigned long) change->new_bytes,
+         (unsigned long) change->first, change->metadata ? " metadata" : "");
+   return true;
+}
+#endif
+
+static void cmd_snapshot(int argc, char **argv) {
+#ifdef NARF_USE_SNAPSHOTS
+   if (argc == 1 || (argc == 2 && strcmp(argv[1], "list") == 0)) {
+      for (unsigned i = 0; i < NARF_SNAPSHOT_SLOTS; i++) {
+         const char *name = narf_snapshot_name(i);
+
+         if (name != NULL) printf("  %u %s\n", i, name);
+      }
+   }
+   else if (argc == 3 && strcmp(argv[1], "create") == 0) {
+      printf("narf_snapshot_create(%s)=%s\n",
+            argv[2], tf[narf_snapshot_create(argv[2])]);
+   }
+   else if (argc == 3 && strcmp(argv[1], "delete") == 0) {
+      printf("narf_snapshot_delete(%s)=%s\n",
+            argv[2], tf[narf_snapshot_delete(argv[2])]);
+   }
+   else if (argc == 2 && strcmp(argv[1], "mount") == 0) {
+      printf("narf_snapshot_mount(NULL)=%s\n", tf[narf_snapshot_mount(NULL)]);
+   }
+   else if (argc == 3 && strcmp(argv[1], "mount") == 0) {
+      printf("narf_snapshot_mount(%s)=%s\n",
+            argv[2], tf[narf_snapshot_mount(argv[2])]);
+   }
+   else if (argc == 3 && strcmp(argv[1], "changes") == 0) {
+      unsigned long count = 0;
+      bool result = narf_changes_since(argv[2], print_change, &count);
+
+      printf("narf_changes_since(%s)=%s changes=%lu\n",
+            argv[2], tf[result], count);
+   }
+   else {
+      print_usage("snapshot");
+   }
+#else
+   (void) argc;
+   (void) argv;
+   printf("snapshots are not built in\n");
+#endif
+}
+
+static void cmd_stat(int argc, char **argv) {
+   NarfStat stats;
+   NarfUsage usage;
+   bool result;
+   (void) argv;
+
+   if (argc != 1) {
+      print_usage("stat");
+      return;
+   }
+
+   printf("narf_stat()=%s\n", tf[result ASSIGN narf_stat(&stats)]);
+   if (result) {
+      printf("  total_sectors   = %u\n", (unsigned) stats.total_sectors);
+      printf("  free_sectors    = %u\n", (unsigned) stats.free_sectors);
+      printf("  used_sectors    = %u\n", (unsigned) stats.used_sectors);
+      printf("  largest_free    = %u\n", (unsigned) stats.largest_free);
+      printf("  file_count      = %u\n", (unsigned) stats.file_count);
+   }
+
+   printf("narf_usage()=%s\n", tf[result ASSIGN narf_usage(&usage)]);
+   if (result) {
+      printf("  slack_sectors   = %u\n", (unsigned) usage.slack_sectors);
+      printf("  payload_sectors = %u\n", (unsigned) usage.payload_sectors);
+      printf("  logical_sectors = %u\n", (unsigned) usage.logical_sectors);
+      printf("  shared_sectors  = %u\n", (unsigned) usage.shared_sectors);
+      printf("  snapshot_sectors= %u\n", (unsigned) usage.snapshot_sectors);
+   }
+}
+
+#ifdef NARF_USE_PERF_STATS
+//! @brief Print one row of performance counters.
+static void print_perf_row(const char *name, const NarfPerfStats *s) {
+   printf("  %-11s %7lu %7lu %7lu %7lu %7lu %6lu %4lu %4lu %4lu %7lu %6lu %3lu\n", name,
+         (unsigned long) s->calls, (unsigned long) s->node_reads,
+         (unsigned long) s->node_writes, (unsigned long) s->payload_reads,
+         (unsigned long) s->payload_writes, (unsigned long) s->root_commits,
+         (unsigned long) s->rollbacks, (unsigned long) s->spare_rebuilds,
+         (unsigned long) s->retired_overflows, (unsigned long) s->coalesce_walks,
+         (unsigned long) s->spare_hits, (unsigned long) s->max_depth);
+}
+#endif
+
+#ifdef NARF_USE_PERF_TRACE
+static NarfTraceRecord *g_trace = NULL;
+static size_t g_trace_entries = 0;
+
+static const char *const trace_kind_names[] = {
+   "n-read", "n-write", "p-read", "p-write", "root",
+};
+
+//! @brief Clock in microseconds for narf_perf_set_clock().
+//!
+//! On the RAM device this is its simulated time, so latencies are the
+//! modelled device work and repeat exactly.
+static uint64_t tester_clock(void) {
+   NarfRamCounters c;
+   struct timespec ts;
+
+   if (narf_io_ram_counters(&c)) return c.micros;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000u + (uint64_t) ts.tv_nsec / 1000u;
+}
+
+//! @brief Print one row of call latencies.
+static void print_latency_row(const char *name, const NarfPerfLatency *l) {
+   printf("  %-11s %7lu %10llu %10llu %10llu %10llu\n", name, (unsigned long) l->count,
+         (unsigned long long) l->p50, (unsigned long long) l->p99,
+         (unsigned long long) l->p999, (unsigned long long) l->max);
+}
+#endif
+
+#ifdef NARF_USE_PERF_STATS
+//! @brief Print each operation's latency percentiles.
+static void print_latency(void) {
+#ifdef NARF_USE_PERF_TRACE
+   NarfPerfLatency latency;
+
+   printf("  %-11s %7s %10s %10s %10s %10s\n", "op", "timed", "p50-us", "p99-us",
+         "p999-us", "max-us");
+   for (unsigned op = 0; op < NARF_PERF_OPS; op++) {
+      if (narf_perf_latency((NarfPerfOp) op, &latency) && latency.count != 0) {
+         print_latency_row(narf_perf_op_name((NarfPerfOp) op), &latency);
+      }
+   }
+   if (narf_perf_latency(NARF_PERF_OPS, &latency)) print_latency_row("total", &latency);
+#else
+   printf("the trace is not built in\n");
+#endif
+}
+#endif
+
+static void cmd_stats(int argc, char **argv) {
+#ifdef NARF_USE_PERF_STATS
+   NarfPerfStats stats;
+
+   if (argc == 2 && !strcmp(argv[1], "reset")) {
+      narf_perf_reset();
+      printf("narf_perf_reset()\n");
+      return;
+   }
+   if (argc == 2 && !strcmp(argv[1], "latency")) {
+      print_latency();
+      return;
+   }
+   if (argc != 1) {
+      print_usage("stats");
+      return;
+   }
+
+   printf("  %-11s %7s %7s %7s %7s %7s %6s %4s %4s %4s %7s %6s %3s\n", "op",
+         "calls", "n-read", "n-write", "p-read", "p-write", "commit", "roll",
+         "rbld", "ovfl", "coalesc", "spare", "dep");
+   for (unsigned op = 0; op < NARF_PERF_OPS; op++) {
+      if (narf_perf_stats((NarfPerfOp) op, &stats) && stats.calls != 0) {
+         print_perf_row(narf_perf_op_name((NarfPerfOp) op), &stats);
+      }
+   }
+   if (narf_perf_stats(NARF_PERF_OPS, &stats)) print_perf_row("total", &stats);
+#else
+   (void) argc;
+   (void) argv;
+   printf("performance counters are not built in\n");
+#endif
+}
+
 static void cmd_tag(int argc, char **argv) {
    char data[NARF_METADATA_SIZE] = { 0 };
    bool result;
@@ -1013,6 +1781,250 @@ static void cmd_touch(int argc, char **argv) {
          argv[1], tf[result]);
 }
 
+#ifdef NARF_USE_PERF_TRACE
+//! @brief Return the number of traced records still kept in the ring.
+static size_t trace_kept(uint64_t *first) {
+   uint64_t count = narf_perf_trace_count();
+   size_t kept = count < g_trace_entries ? (size_t) count : g_trace_entries;
+
+   *first = count - kept;
+   return kept;
+}
+
+//! @brief Print the newest trace records.
+static void trace_show(size_t count) {
+   uint64_t first;
+   size_t kept = trace_kept(&first);
+
+   if (count < kept) {
+      first += kept - count;
+      kept = count;
+   }
+   printf("  %12s %12s %8s %-7s %s\n", "start-us", "sector", "us", "kind", "op");
+   for (size_t i = 0; i < kept; i++) {
+      const NarfTraceRecord *r = &g_trace[(first + i) % g_trace_entries];
+      const char *kind = r->kind < sizeof(trace_kind_names) / sizeof(trace_kind_names[0]) ?
+            trace_kind_names[r->kind] : "?";
+      const char *op = narf_perf_op_name((NarfPerfOp) r->op);
+
+      printf("  %12llu %12lu %8lu %-7s %s\n", (unsigned long long) r->start,
+            (unsigned long) r->sector, (unsigned long) r->micros, kind,
+            op != NULL ? op : "?");
+   }
+}
+
+//! @brief Print reads and writes per band of device sectors.
+static void trace_heat(unsigned rows) {
+   NarfSector sectors = narf_io_sectors();
+   unsigned long *reads = calloc(rows, sizeof(*reads));
+   unsigned long *writes = calloc(rows, sizeof(*writes));
+   unsigned long most = 1;
+   uint64_t first;
+   size_t kept = trace_kept(&first);
+   uint64_t band = ((uint64_t) sectors + rows - 1) / rows;
+
+   if (reads == NULL || writes == NULL || band == 0) {
+      printf("trace: nothing to map\n");
+      free(reads);
+      free(writes);
+      return;
+   }
+   for (size_t i = 0; i < kept; i++) {
+      const NarfTraceRecord *r = &g_trace[(first + i) % g_trace_entries];
+      unsigned row = (unsigned) (r->sector / band);
+
+      if (row >= rows) row = rows - 1;
+      if (r->kind == NARF_TRACE_NODE_READ || r->kind == NARF_TRACE_PAYLOAD_READ) {
+         reads[row]++;
+      }
+      else {
+         writes[row]++;
+      }
+      if (reads[row] + writes[row] > most) most = reads[row] + writes[row];
+   }
+
+   printf("  %10s %10s %8s %8s\n", "from", "to", "reads", "writes");
+   for (unsigned row = 0; row < rows; row++) {
+      uint64_t from = band * row;
+      uint64_t to = from + band < sectors ? from + band : sectors;
+      unsigned r = (unsigned) ((reads[row] * 40 + most - 1) / most);
+      unsigned w = (unsigned) ((writes[row] * 40 + most - 1) / most);
+
+      if (from >= sectors) break;
+      printf("  %10llu %10llu %8lu %8lu |", (unsigned long long) from,
+            (unsigned long long) to - 1, reads[row], writes[row]);
+      for (unsigned i = 0; i < r; i++) putchar('r');
+      for (unsigned i = 0; i < w; i++) putchar('w');
+      putchar('\n');
+   }
+   free(reads);
+   free(writes);
+}
+
+//! @brief Write a little-endian value of bytes bytes to a trace file.
+static bool trace_put(FILE *f, uint64_t value, unsigned bytes) {
+   uint8_t buffer[8];
+
+   for (unsigned i = 0; i < bytes; i++) buffer[i] = (uint8_t) (value >> (8 * i));
+   return fwrite(buffer, 1, bytes, f) == bytes;
+}
+
+//! @brief Save the kept trace records, oldest first, to a host file.
+static void trace_save(const char *path) {
+   uint64_t first;
+   size_t kept = trace_kept(&first);
+   FILE *f = fopen(path, "wb");
+   bool ok = f != NULL && fwrite("NARFTRC1", 1, 8, f) == 8 && trace_put(f, kept, 8);
+
+   for (size_t i = 0; ok && i < kept; i++) {
+      const NarfTraceRecord *r = &g_trace[(first + i) % g_trace_entries];
+
+      ok = trace_put(f, r->start, 8) && trace_put(f, r->micros, 4) &&
+           trace_put(f, r->sector, 4) && trace_put(f, r->kind, 1) &&
+           trace_put(f, r->op, 1);
+   }
+   if (f != NULL && fclose(f) != 0) ok = false;
+   if (ok) {
+      printf("trace: saved %lu records to %s\n", (unsigned long) kept, path);
+   }
+   else {
+      printf("trace: unable to write %s\n", path);
+   }
+}
+#endif
+
+static void cmd_trace(int argc, char **argv) {
+#ifdef NARF_USE_PERF_TRACE
+   int value = 0;
+
+   if (argc == 1) {
+      printf("trace: %llu records, ring of %lu\n",
+            (unsigned long long) narf_perf_trace_count(), (unsigned long) g_trace_entries);
+   }
+   else if (!strcmp(argv[1], "on") && argc <= 3 &&
+            (argc == 2 || (parse_int_arg(argv[2], &value) && value > 0))) {
+      size_t entries = argc == 3 ? (size_t) value : 65536;
+      NarfTraceRecord *ring = malloc(entries * sizeof(*ring));
+
+      if (ring == NULL) {
+         printf("trace: unable to allocate %lu records\n", (unsigned long) entries);
+         return;
+      }
+      narf_perf_set_trace(ring, entries);
+      free(g_trace);
+      g_trace = ring;
+      g_trace_entries = entries;
+      printf("narf_perf_set_trace(%lu)\n", (unsigned long) entries);
+   }
+   else if (!strcmp(argv[1], "off") && argc == 2) {
+      narf_perf_set_trace(NULL, 0);
+      free(g_trace);
+      g_trace = NULL;
+      g_trace_entries = 0;
+      printf("narf_perf_set_trace(0)\n");
+   }
+   else if (!strcmp(argv[1], "show") && argc <= 3 &&
+            (argc == 2 || (parse_int_arg(argv[2], &value) && value > 0))) {
+      trace_show(argc == 3 ? (size_t) value : 20);
+   }
+   else if (!strcmp(argv[1], "heat") && argc <= 3 &&
+            (argc == 2 || (parse_int_arg(argv[2], &value) && value > 0))) {
+      trace_heat(argc == 3 ? (unsigned) value : 32);
+   }
+   else if (!strcmp(argv[1], "save") && argc == 3) {
+      trace_save(argv[2]);
+   }
+   else {
+      print_usage("trace");
+   }
+#else
+   (void) argc;
+   (void) argv;
+   printf("the trace is not built in\n");
+#endif
+}
+
+static void cmd_record(int argc, char **argv) {
+#ifdef NARF_USE_RECORDER
+   if (argc == 2 && !strcmp(argv[1], "off")) {
+      narf_record_stop();
+      printf("narf_set_recorder(NULL)\n");
+   }
+   else if (argc == 2 || (argc == 3 && !strcmp(argv[2], "hash"))) {
+      if (narf_record_start(argv[1], argc == 3)) {
+         printf("record: appending to %s\n", argv[1]);
+      }
+      else {
+         printf("record: unable to open %s\n", argv[1]);
+      }
+   }
+   else {
+      print_usage("record");
+   }
+#else
+   (void) argc;
+   (void) argv;
+   printf("the recorder is not built in\n");
+#endif
+}
+
+static void cmd_unmount(int argc, char **argv) {
+   bool result;
+   (void) argv;
+
+   if (argc != 1) {
+      print_usage("unmount");
+      return;
+   }
+
+   printf("narf_unmount()=%s\n",
+         tf[result ASSIGN narf_unmount()]);
+}
+
+static void cmd_workmem(int argc, char **argv) {
+   NarfByteSize bytes;
+   uint8_t *memory = NULL;
+   bool result;
+
+   if (argc != 2 || !parse_size_arg(argv[1], &bytes)) {
+      print_usage("workmem");
+      return;
+   }
+
+   if (bytes != 0) {
+      memory = malloc((size_t) bytes);
+      if (memory == NULL) {
+         printf("workmem: unable to allocate %lu bytes\n", (unsigned long) bytes);
+         return;
+      }
+   }
+
+   result = narf_set_work_memory(memory, (size_t) bytes);
+   free(g_work_memory);
+   g_work_memory = memory;
+
+   printf("narf_set_work_memory(%lu)=%s\n", (unsigned long) bytes, tf[result]);
+}
+
+static void cmd_write(int argc, char **argv) {
+   char data[512];
+   NarfByteSize offset;
+   NarfByteSize size;
+   bool result;
+
+   if (argc < 4 || !parse_size_arg(argv[2], &offset) ||
+       !join_args(argc, argv, 3, data, sizeof(data))) {
+      print_usage(argv[0]);
+      return;
+   }
+
+   size = (NarfByteSize) strlen(data);
+   result = narf_write(argv[1], data, size, offset);
+
+   printf("narf_write(%s,\"%s\",%lu,%lu)=%s\n",
+         argv[1], data, (unsigned long) size, (unsigned long) offset, tf[result]);
+}
+
 //! @brief Parse and execute one tester command line.
 static void process_cmd(const char *buffer) {
    char line[1024];
@@ -1069,6 +2081,7 @@ static char *rname(int l) {
 //! @brief Run randomized tester operations for stress testing.
 static void gremlins(int s, int n) {
    char buf[1024];
+   char recent[16] = "";
    int m;
    int l;
 
@@ -1086,13 +2099,15 @@ static void gremlins(int s, int n) {
    for(m = 0; m < n; m++) {
       switch(lrand48() % 6) {
          case 0:
-            sprintf(buf, "alloc %s %d", rname(l), (int)(lrand48() % 65536));
+            strcpy(recent, rname(l));
+            sprintf(buf, "alloc %s %d", recent, (int)(lrand48() % 65536));
             break;
          case 1:
             sprintf(buf, "free %s", rname(l));
             break;
          case 2:
-            sprintf(buf, "realloc %s %d", rname(l), (int)(lrand48() % 65536));
+            strcpy(recent, rname(l));
+            sprintf(buf, "realloc %s %d", recent, (int)(lrand48() % 65536));
             break;
          case 3:
             {
@@ -1107,6 +2122,43 @@ static void gremlins(int s, int n) {
                   case 0:
                      sprintf(buf, "defrag");
                      break;
+                  case 1:
+                     sprintf(buf, "defrag step %d 1", (int)(lrand48() % 64));
+                     break;
+                  case 2:
+                     sprintf(buf, "punch %s %d %d", rname(l),
+                           (int)(lrand48() % 65536), (int)(lrand48() % 65536));
+                     break;
+                  case 3:
+                     sprintf(buf, "reserve %s %d", rname(l), (int)(lrand48() % 64));
+                     break;
+                  case 4:
+                     sprintf(buf, "compress %s %s", rname(l), lrand48() % 2 ? "on" : "off");
+                     break;
+                  case 5:
+                     sprintf(buf, "dedup %s", rname(l));
+                     break;
+                  case 6:
+                  case 7:
+                     sprintf(buf, "snapshot create g%d", (int)(lrand48() % 6));
+                     break;
+                  case 8:
+                     sprintf(buf, "snapshot delete g%d", (int)(lrand48() % 6));
+                     break;
+                  case 9:
+                  case 10:
+                  case 11:
+                  case 12:
+                     // Random names rarely exist, so grow the key last
+                     // allocated.  Odd lengths leave a partial last sector
+                     // for the next append to copy.
+                     sprintf(buf, "append %s %s", recent, rname(lrand48() % 15 + 1));
+                     break;
+                  case 13:
+                  case 14:
+                     sprintf(buf, "write %s %d %s", recent, (int)(lrand48() % 65536),
+                           rname(lrand48() % 15 + 1));
+                     break;
                   default:
                      sprintf(buf, "cat %s", rname(l));
                }
@@ -1201,6 +2253,9 @@ int main(int argc, char **argv) {
       exit(0);
    }
    narf_io_configure(argv[1]);
+#ifdef NARF_USE_PERF_TRACE
+   narf_perf_set_clock(tester_clock);
+#endif
 
    printf("narf_io_open()=%d\n", result ASSIGN narf_io_open());
 